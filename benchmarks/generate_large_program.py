@@ -0,0 +1,104 @@
+from __future__ import print_function
+
+import argparse
+import os
+import random
+
+
+def lookup_table(out, count):
+    """Emit one global per entry, each with its own name and string value"""
+
+    for i in range(count):
+        out.append('var entry_{0} = "value number {0} of the table";'
+                   .format(i))
+
+
+def state_machine(out, groups, states_per_group, steps):
+    """Emit a function whose loop body is a large if/else-if dispatch over
+    the machine's states, grouped so compile-time recursion stays shallow"""
+
+    rng = random.Random(1234)
+    total = groups * states_per_group
+
+    out.append("fun run(steps) {")
+    out.append("  var state = 0;")
+    out.append("  var sum = 0;")
+    out.append("  var i = 0;")
+    out.append("  while (i < steps) {")
+
+    for g in range(groups):
+        low = g * states_per_group
+        keyword = "if" if g == 0 else "} else if"
+        out.append("    {} (state < {}) {{".format(
+            keyword, low + states_per_group))
+
+        for s in range(low, low + states_per_group):
+            keyword = "if" if s == low else "else if"
+            out.append("      {} (state == {}) {{ sum = sum + {}; "
+                       "state = {}; }}".format(
+                           keyword, s, rng.randint(1, 1000),
+                           rng.randrange(total)))
+
+    out.append("    }")
+    out.append("    i = i + 1;")
+    out.append("  }")
+    out.append("  return sum;")
+    out.append("}")
+
+
+def library(out, count):
+    """Emit helper functions of about ten lines each, of which the program
+    only calls the first, the way a script pulls in a large library"""
+
+    for i in range(count):
+        out.append("fun helper_{}(a, b) {{".format(i))
+        out.append("  var total = 0;")
+        out.append("  for (var i = 0; i < a; i = i + 1) {")
+        out.append("    if (i < b) total = total + i * {};".format(i % 7 + 1))
+        out.append("    else total = total - {};".format(i % 5 + 1))
+        out.append("  }")
+        out.append("  fun scale(x) { return x * a + b; }")
+        out.append("  var label = \"helper {} done\";".format(i))
+        out.append("  return scale(total);")
+        out.append("}")
+
+
+def generate(target_size, steps, functions):
+    out = ["// Generated by generate_large_program.py, do not edit."]
+    library(out, functions)
+
+    # roughly half of the source is the table, half the state machine
+    lookup_table(out, target_size // 2 // 45)
+    state_machine(out, 10, target_size // 2 // 10 // 75, steps)
+
+    out.append("var start = clock();")
+    out.append("print run({});".format(steps))
+    if functions > 0:
+        out.append("print helper_0(10, 5);")
+    out.append("print entry_0;")
+    out.append("print clock() - start;")
+    return "\n".join(out) + "\n"
+
+
+if __name__ == "__main__":
+    directory = os.path.dirname(os.path.abspath(__file__))
+
+    parser = argparse.ArgumentParser(
+        description="Generate a large Lox program for compiler benchmarks.")
+    parser.add_argument("-o", "--output",
+                        default=os.path.join(directory, "large_program.lox"),
+                        help="Path of the generated program.")
+    parser.add_argument("-s", "--size", type=int, default=1024 * 1024,
+                        help="Approximate size of the program in bytes.")
+    parser.add_argument("-n", "--steps", type=int, default=500,
+                        help="Number of state machine steps to run.")
+    parser.add_argument("-f", "--functions", type=int, default=0,
+                        help="Number of library functions, all but one "
+                             "of which are never called.")
+    args = parser.parse_args()
+
+    source = generate(args.size, args.steps, args.functions)
+    with open(args.output, "w") as f:
+        f.write(source)
+
+    print("Wrote {} bytes to '{}'.".format(len(source), args.output))
@@ -0,0 +1,111 @@
+// Microbenchmark for string hashing and interning.
+//
+// For every key length from 8 bytes to 64KB it reports the throughput of
+// hash_string, of a byte at a time FNV-1a reference, of string_equals and of
+// an interning lookup (copy_string on an already interned string).
+
+#include "Object.h"
+#include "VM.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BYTES_PER_RUN (64u * 1024u * 1024u)
+#define MIN_LENGTH 8
+#define MAX_LENGTH (64 * 1024)
+
+static volatile uint32_t sink;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t fnv1a(const char *key, size_t length)
+{
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < length; i++)
+  {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+
+  return hash;
+}
+
+static double mb_per_sec(size_t bytes, double seconds)
+{
+  return bytes / seconds / (1024.0 * 1024.0);
+}
+
+int main(void)
+{
+  char *a = malloc(MAX_LENGTH);
+  char *b = malloc(MAX_LENGTH);
+  srand(42);
+  for (size_t i = 0; i < MAX_LENGTH; ++i)
+  {
+    a[i] = b[i] = (char)('a' + rand() % 26);
+  }
+
+  VM vm;
+  init_VM(&vm);
+
+  printf("%8s %12s %12s %12s %12s   (MB/s)\n", "length", "hash_string",
+         "fnv1a", "equals", "intern");
+
+  for (size_t length = MIN_LENGTH; length <= MAX_LENGTH; length *= 2)
+  {
+    size_t iters = BYTES_PER_RUN / length;
+    size_t bytes = iters * length;
+    uint32_t acc = 0;
+
+    double start = now();
+    for (size_t i = 0; i < iters; ++i)
+    {
+      a[i % length] ^= 1;
+      acc += hash_string(a, length);
+    }
+    double hash_time = now() - start;
+
+    start = now();
+    for (size_t i = 0; i < iters; ++i)
+    {
+      a[i % length] ^= 1;
+      acc += fnv1a(a, length);
+    }
+    double fnv_time = now() - start;
+
+    start = now();
+    for (size_t i = 0; i < iters; ++i)
+    {
+      acc += string_equals(a, b, length);
+    }
+    double equals_time = now() - start;
+
+    // the interned copy stays reachable from the stack across collections
+    push(&vm, object_val((Obj *)copy_string(&vm, a, length)));
+    start = now();
+    for (size_t i = 0; i < iters; ++i)
+    {
+      acc += copy_string(&vm, a, length)->hash;
+    }
+    double intern_time = now() - start;
+    pop(&vm);
+
+    sink = acc;
+    printf("%8zu %12.1f %12.1f %12.1f %12.1f\n", length,
+           mb_per_sec(bytes, hash_time), mb_per_sec(bytes, fnv_time),
+           mb_per_sec(bytes, equals_time), mb_per_sec(bytes, intern_time));
+  }
+
+  free_VM(&vm);
+  free(a);
+  free(b);
+  return 0;
+}
@@ -0,0 +1,89 @@
+// Reports how much the peephole pass shrinks compiled code.
+//
+// Every file given on the command line is compiled, not run, and the number
+// of instructions and bytes before and after the pass is printed per file and
+// in total. Files that fail to compile are skipped.
+//
+//   peephole_report benchmarks/*.lox tests/*/*.lox
+
+#include "Compiler.h"
+#include "Optimizer.h"
+#include "VM.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char *read_file(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    return NULL;
+  }
+
+  fseek(file, 0L, SEEK_END);
+  size_t file_size = ftell(file);
+  rewind(file);
+
+  char *buffer = malloc(file_size + 1);
+  size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+  buffer[bytes_read] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+static double percent(size_t before, size_t after)
+{
+  return before == 0 ? 0.0 : 100.0 * (double)(before - after) / before;
+}
+
+int main(int argc, const char *argv[])
+{
+  VM vm;
+  init_VM(&vm);
+
+  PeepholeStats total;
+  init_peephole_stats(&total);
+
+  printf("%-48s %8s %8s %7s %8s %8s %7s\n", "file", "insts", "after", "saved",
+         "bytes", "after", "saved");
+
+  for (int i = 1; i < argc; ++i)
+  {
+    char *src = read_file(argv[i]);
+    if (src == NULL)
+    {
+      fprintf(stderr, "Could not read file \"%s\".\n", argv[i]);
+      continue;
+    }
+
+    init_peephole_stats(&vm.peephole_stats);
+    ObjFunction *fn = compile(&vm, src, strlen(src));
+    vm.compiler = NULL;
+    free(src);
+
+    if (fn == NULL)
+      continue;
+
+    PeepholeStats *stats = &vm.peephole_stats;
+    printf("%-48s %8zu %8zu %6.1f%% %8zu %8zu %6.1f%%\n", argv[i],
+           stats->instructions_before, stats->instructions_after,
+           percent(stats->instructions_before, stats->instructions_after),
+           stats->bytes_before, stats->bytes_after,
+           percent(stats->bytes_before, stats->bytes_after));
+
+    total.instructions_before += stats->instructions_before;
+    total.instructions_after += stats->instructions_after;
+    total.bytes_before += stats->bytes_before;
+    total.bytes_after += stats->bytes_after;
+  }
+
+  printf("%-48s %8zu %8zu %6.1f%% %8zu %8zu %6.1f%%\n", "total",
+         total.instructions_before, total.instructions_after,
+         percent(total.instructions_before, total.instructions_after),
+         total.bytes_before, total.bytes_after,
+         percent(total.bytes_before, total.bytes_after));
+
+  free_VM(&vm);
+  return 0;
+}
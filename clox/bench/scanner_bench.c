@@ -0,0 +1,174 @@
+// Microbenchmark for the scanner.
+//
+// Scans every file given on the command line, or a generated source of about
+// 16MB without one, and reports the scanning throughput in MB/s and tokens
+// per second. The number literals seen are then parsed with parse_number and
+// with strtod to compare the two.
+//
+//   scanner_bench benchmarks/large_program.lox
+
+#include "Scanner.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define GENERATED_SIZE (16u * 1024u * 1024u)
+#define BYTES_PER_RUN (256u * 1024u * 1024u)
+
+static volatile double sink;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double mb_per_sec(size_t bytes, double seconds)
+{
+  return bytes / seconds / (1024.0 * 1024.0);
+}
+
+static char *read_file(const char *path, size_t *length)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    return NULL;
+  }
+
+  fseek(file, 0L, SEEK_END);
+  size_t file_size = ftell(file);
+  rewind(file);
+
+  char *buffer = malloc(file_size + 1);
+  if (buffer == NULL || fread(buffer, 1, file_size, file) < file_size)
+  {
+    free(buffer);
+    fclose(file);
+    return NULL;
+  }
+
+  buffer[file_size] = '\0';
+  fclose(file);
+  *length = file_size;
+  return buffer;
+}
+
+// Indented functions with comments, strings and number literals, roughly
+// what generated programs look like.
+static char *generate_source(size_t *length)
+{
+  char *buffer = malloc(GENERATED_SIZE + 512);
+  size_t size = 0;
+  for (int i = 0; size < GENERATED_SIZE; ++i)
+  {
+    size += sprintf(buffer + size,
+                    "// helper number %d, generated\n"
+                    "fun helper_%d(argument, other_argument) {\n"
+                    "    var total_so_far = %d.%d;\n"
+                    "    while (total_so_far < argument) {\n"
+                    "        total_so_far = total_so_far * 1.5 + "
+                    "other_argument;\n"
+                    "    }\n"
+                    "    print \"helper %d is done with its work\";\n"
+                    "    return total_so_far;\n"
+                    "}\n",
+                    i, i, i, i % 1000, i);
+  }
+
+  *length = size;
+  return buffer;
+}
+
+static void bench(const char *name, const char *src, size_t length)
+{
+  int runs = (int)(BYTES_PER_RUN / length) + 1;
+  size_t tokens = 0;
+  size_t number_count = 0;
+  size_t number_capacity = 0;
+  Token *numbers = NULL;
+
+  double start = now();
+  for (int run = 0; run < runs; ++run)
+  {
+    Scanner scanner;
+    init_scanner(&scanner, src, src + length);
+    for (;;)
+    {
+      Token token = scan_token(&scanner);
+      ++tokens;
+      if (token.type == TOKEN_EOF)
+        break;
+
+      if (run == 0 && token.type == TOKEN_NUMBER)
+      {
+        if (number_count == number_capacity)
+        {
+          number_capacity = number_capacity < 64 ? 64 : number_capacity * 2;
+          numbers = realloc(numbers, sizeof(Token) * number_capacity);
+        }
+        numbers[number_count++] = token;
+      }
+    }
+  }
+  double scan_time = now() - start;
+
+  double acc = 0;
+  start = now();
+  for (int run = 0; run < runs; ++run)
+  {
+    for (size_t i = 0; i < number_count; ++i)
+    {
+      acc += parse_number(numbers[i].start, numbers[i].length);
+    }
+  }
+  double parse_time = now() - start;
+
+  start = now();
+  for (int run = 0; run < runs; ++run)
+  {
+    for (size_t i = 0; i < number_count; ++i)
+    {
+      acc += strtod(numbers[i].start, NULL);
+    }
+  }
+  double strtod_time = now() - start;
+  sink = acc;
+
+  double parsed = (double)number_count * runs;
+  printf("%-32s %10.1f MB/s %8.1f Mtokens/s   numbers: %8.1f M/s parse_number"
+         " %8.1f M/s strtod\n",
+         name, mb_per_sec(length * (size_t)runs, scan_time),
+         tokens / scan_time / 1e6, parsed / parse_time / 1e6,
+         parsed / strtod_time / 1e6);
+  free(numbers);
+}
+
+int main(int argc, const char *argv[])
+{
+  if (argc == 1)
+  {
+    size_t length;
+    char *src = generate_source(&length);
+    bench("generated", src, length);
+    free(src);
+    return 0;
+  }
+
+  for (int i = 1; i < argc; ++i)
+  {
+    size_t length;
+    char *src = read_file(argv[i], &length);
+    if (src == NULL)
+    {
+      fprintf(stderr, "Could not read \"%s\".\n", argv[i]);
+      continue;
+    }
+
+    bench(argv[i], src, length);
+    free(src);
+  }
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+// Bump allocator for data that lives no longer than one compilation. It is
+// invisible to the GC and is released back to a mark or freed as a whole.
+// Only a large allocation, which gets a block to itself, can be freed or
+// resized on its own.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_LARGE_SIZE (ARENA_BLOCK_SIZE / 4)
+
+struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+};
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct Arena {
+  ArenaBlock *blocks;
+  int block_count;
+  // the most recent allocation, the only one that can grow in place
+  void *last;
+};
+
+typedef struct Arena Arena;
+
+// Where the arena was at some point, releasing it drops everything allocated
+// since. Blocks are counted rather than pointed to, a large block may move
+// when it grows.
+struct ArenaMark {
+  int block_count;
+  size_t used;
+};
+
+typedef struct ArenaMark ArenaMark;
+
+void init_arena(Arena *arena);
+void free_arena(Arena *arena);
+ArenaMark arena_mark(Arena *arena);
+void arena_release(Arena *arena, ArenaMark mark);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *array, size_t old_size, size_t new_size);
+void arena_free(Arena *arena, void *array, size_t size);
+
+#endif
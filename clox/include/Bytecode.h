@@ -0,0 +1,36 @@
+#ifndef _BYTECODE_H_
+#define _BYTECODE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Compiled scripts saved to disk. A file starts with the magic, the format
+// version and the stamp of the source it was compiled from, followed by the
+// top-level function. A function is its arity, upvalue count, name, code,
+// its line runs and its constants, functions among them written
+// out in place. Integers are little endian.
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_VERSION 2
+
+typedef struct ObjFunction ObjFunction;
+typedef struct VM VM;
+
+// Identifies the source a file was compiled from, a cached file is only used
+// while all of it still matches.
+struct SourceStamp {
+  uint32_t hash;
+  uint64_t size;
+  int64_t mtime;
+};
+
+typedef struct SourceStamp SourceStamp;
+
+bool stamp_source(const char *path, const char *src, size_t length,
+                  SourceStamp *stamp);
+bool write_bytecode(ObjFunction *fn, const SourceStamp *stamp,
+                    const char *path);
+ObjFunction *read_bytecode(VM *vm, const char *path,
+                           const SourceStamp *stamp);
+
+#endif
@@ -5,11 +5,22 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Lines are run-length encoded: a run starts at the first byte compiled from
+// its line and covers every byte up to the start of the next run.
+struct LineRun {
+  int offset;
+  int line;
+};
+
+typedef struct LineRun LineRun;
+
 struct Chunk {
   size_t size;
   size_t capacity;
   uint8_t *code;
-  int *lines;
+  LineRun *lines;
+  int line_count;
+  int line_capacity;
   ValueArray constants;
 };
 
@@ -19,6 +30,11 @@ typedef struct VM VM;
 void init_chunk(Chunk *chunk);
 void free_chunk(VM *vm, Chunk *chunk);
 void write_chunk(VM *vm, Chunk *chunk, uint8_t byte, int line);
+void add_line(VM *vm, Chunk *chunk, size_t offset, int line);
+int get_line(Chunk *chunk, size_t offset);
+void shrink_chunk(VM *vm, Chunk *chunk);
 size_t add_constant(VM *vm, Chunk *chunk, Value value);
+size_t read_index(Chunk *chunk, size_t offset, bool wide);
+size_t instruction_length(Chunk *chunk, size_t offset);
 
 #endif
@@ -1,9 +1,11 @@
 #ifndef _COMPILER_H_
 #define _COMPILER_H_
 
+#include "Arena.h"
 #include "Scanner.h"
 #include "Value.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct Chunk Chunk;
@@ -12,11 +14,18 @@ typedef struct ObjFunction ObjFunction;
 typedef struct VM VM;
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define NUMBER_DEPS_MAX 8
 
 struct Local {
   Token name;
   int depth;
   bool is_captured;
+  // declared with a method access, the local holds the receiver and the slot
+  // after it the unbound method until the local is read as a value
+  bool unbound;
+  // index into the compiler's number_locals, unique per declaration while
+  // slots get reused by later scopes
+  int id;
 };
 
 typedef struct Local Local;
@@ -37,6 +46,18 @@ struct Upvalue {
 
 typedef struct Upvalue Upvalue;
 
+// A local of the function captured by one of its closures. The flags byte at
+// offset is made flat once the local turns out to never be assigned, and so
+// are the reads of upvalue index in fn.
+struct Capture {
+  size_t offset;
+  int local;
+  ObjFunction *fn;
+  int index;
+};
+
+typedef struct Capture Capture;
+
 struct ClassCompiler {
   Token name;
   bool has_superclass;
@@ -45,13 +66,133 @@ struct ClassCompiler {
 
 typedef struct ClassCompiler ClassCompiler;
 
+// Maps a constant to its index in the chunk's constant pool so that repeated
+// identifiers and literals share one slot. index is -1 for an empty slot.
+struct ConstantEntry {
+  Value value;
+  int index;
+};
+
+typedef struct ConstantEntry ConstantEntry;
+
+// The locals a value depends on, it is a number as long as each of them
+// only ever holds numbers.
+struct NumberDeps {
+  int count;
+  int locals[NUMBER_DEPS_MAX];
+};
+
+typedef struct NumberDeps NumberDeps;
+
+// A local only holds numbers if deps do.
+struct NumberConstraint {
+  int local;
+  NumberDeps deps;
+};
+
+typedef struct NumberConstraint NumberConstraint;
+
+// The checked instruction at offset becomes op if deps only hold numbers.
+struct NumberCheck {
+  size_t offset;
+  uint8_t op;
+  NumberDeps deps;
+};
+
+typedef struct NumberCheck NumberCheck;
+
+// What a brace opened in the body of a lazy function belongs to.
+enum PreparseKind {
+  PREPARSE_BLOCK,
+  PREPARSE_FUNCTION,
+  PREPARSE_INITIALIZER,
+  PREPARSE_CLASS,
+  PREPARSE_SUBCLASS,
+};
+
+typedef enum PreparseKind PreparseKind;
+
+struct PreparseBlock {
+  PreparseKind kind;
+  int first_local;
+};
+
+typedef struct PreparseBlock PreparseBlock;
+
+// The pre-parse of a lazy function keeps just enough of its body to report
+// the errors that compiling it would. That is the locals each open block
+// declares, from its first_local on, and the functions and classes the
+// blocks belong to, which decide what 'return', 'this' and 'super' may do.
+struct Preparse {
+  PreparseBlock *blocks;
+  int depth;
+  int block_capacity;
+  Token *locals;
+  int local_count;
+  int local_capacity;
+};
+
+typedef struct Preparse Preparse;
+
 struct Compiler {
   struct Compiler *enclosing;
   ClassCompiler *current_class;
-  Local locals[UINT8_COUNT];
-  Upvalue upvalues[UINT8_COUNT];
+  // both grow on the parser's arena up to UINT8_COUNT entries
+  Local *locals;
   int local_count;
+  int local_capacity;
+  Upvalue *upvalues;
+  int upvalue_capacity;
   int scope_depth;
+  ConstantEntry *constants;
+  int constant_count;
+  int constant_capacity;
+  // opcode offset of the last OP_CALL, OP_INVOKE or OP_SUPER_INVOKE, which
+  // ends at last_call_end. A return whose expression ends with it is a tail
+  // call.
+  int last_call;
+  size_t last_call_end;
+  // opcode offset of an OP_GET_PROPERTY or OP_GET_SUPER ending at
+  // last_property_end, a call right after it needs no bound method
+  int last_property;
+  size_t last_property_end;
+  // offset of an OP_BIND_LOCAL ending at last_bind_end, a call right after it
+  // takes the receiver and the method as they are
+  int last_bind;
+  size_t last_bind_end;
+  // the intrinsic named by a global read ending at last_intrinsic_end, a
+  // call right after it becomes OP_CALL_INTRINSIC
+  int last_intrinsic;
+  size_t last_intrinsic_end;
+  // the code from last_constant_start to last_constant_end only pushes
+  // last_constant, -1 when no such constant ends the chunk
+  int last_constant_start;
+  size_t last_constant_end;
+  Value last_constant;
+  // the code ending at last_number_end pushes a number when last_number
+  // holds, -1 when no such expression ends the chunk
+  int last_number_end;
+  NumberDeps last_number;
+  // locals declared with a number that are not yet known to ever hold
+  // anything else, checked once the whole function has been seen
+  bool *number_locals;
+  int number_local_count;
+  int number_local_capacity;
+  NumberConstraint *number_constraints;
+  int number_constraint_count;
+  int number_constraint_capacity;
+  NumberCheck *number_checks;
+  int number_check_count;
+  int number_check_capacity;
+  // whether a local is ever assigned, indexed like number_locals
+  bool *assigned_locals;
+  Capture *captures;
+  int capture_count;
+  int capture_capacity;
+  // the arena is released back to mark once the function is emitted, unless
+  // an enclosing compiler grew its own arrays past it meanwhile
+  ArenaMark mark;
+  bool keep_temporaries;
   ObjFunction *fn;
   FunctionType fn_type;
   Parser *parser;
@@ -62,8 +203,9 @@ typedef struct Compiler Compiler;
 
 void init_compiler(Compiler *compiler, Compiler *enclosing, Parser *parser,
                    VM *vm, FunctionType type);
-ObjFunction *compile(VM *vm, const char *src);
-void define_variable(Compiler *compiler, uint8_t global);
+ObjFunction *compile(VM *vm, const char *src, size_t length);
+bool compile_lazy(VM *vm, ObjFunction *fn);
+void define_variable(Compiler *compiler, int global);
 void declare_variable(Compiler *compiler);
 void mark_initialized(Compiler *compiler);
 void add_local(Compiler *compiler, Token name);
@@ -79,9 +221,10 @@ void emit_bytes(Compiler *compiler, uint8_t byte1, uint8_t byte2);
 void emit_loop(Compiler *compiler, int loop_start);
 void emit_return(Compiler *compiler);
 void emit_constant(Compiler *compiler, Value value);
+void emit_constant_op(Compiler *compiler, uint8_t op, int index);
 int emit_jump(Compiler *compiler, uint8_t inst);
 void patch_jump(Compiler *compiler, int offset);
-uint8_t make_constant(Compiler *compiler, Value value);
+int make_constant(Compiler *compiler, Value value);
 ObjFunction *end_compiler(Compiler *compiler);
 Token synthetic_token(const char *text);
 
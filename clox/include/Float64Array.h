@@ -0,0 +1,26 @@
+#ifndef _FLOAT64_ARRAY_H_
+#define _FLOAT64_ARRAY_H_
+
+#include <stdint.h>
+
+// Kernels over count unboxed numbers. Sums are added up in vector lanes, so
+// they may round differently from a loop adding one element at a time.
+// Arrays given to the same kernel may be the same array.
+
+double float64_sum(const double *a, int count);
+double float64_dot(const double *a, const double *b, int count);
+void float64_scale(double *a, double k, int count);
+void float64_axpy(double alpha, const double *x, double *y, int count);
+void float64_add(const double *a, const double *b, double *out, int count);
+void float64_mul(const double *a, const double *b, double *out, int count);
+
+// Like a loop keeping the first element and every one that is smaller or
+// larger: a NaN is only ever the result when it comes first. count > 0.
+double float64_min(const double *a, int count);
+double float64_max(const double *a, int count);
+
+// Sorts ascending, -0 before 0 and NaNs at the ends by sign. scratch holds
+// 2 * count keys.
+void float64_sort(double *a, uint64_t *scratch, int count);
+
+#endif
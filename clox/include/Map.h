@@ -0,0 +1,16 @@
+#ifndef _MAP_H_
+#define _MAP_H_
+
+#include "Object.h"
+#include "Value.h"
+#include <stdint.h>
+
+// the index is rebuilt at half full, and never smaller than this
+#define MAP_MIN_CAPACITY 8
+
+uint32_t hash_value(Value value);
+bool map_get(ObjMap *map, Value key, Value *value);
+bool map_set(VM *vm, ObjMap *map, Value key, Value value);
+bool map_remove(ObjMap *map, Value key, Value *value);
+
+#endif
@@ -6,6 +6,8 @@
 #include <stddef.h>
 
 #define GC_HEAP_GROW_FACTOR 2
+// freed bound methods kept around for the next bindings
+#define FREE_BOUND_METHODS_MAX 256
 
 typedef struct Value Value;
 typedef struct VM VM;
@@ -17,8 +19,11 @@ void *grow_array(VM *vm, void *array, size_t element_size, size_t old_capacity,
 void free_array(VM *vm, size_t element_size, void *array, size_t capacity);
 void *reallocate(VM *vm, void *array, size_t old_size, size_t new_size);
 void *allocate(VM *vm, size_t element_size, size_t capacity);
+void *allocate_aligned(VM *vm, size_t alignment, size_t size);
+void free_aligned(VM *vm, void *array, size_t alignment, size_t size);
 Obj *allocate_object(VM *vm, size_t object_size, ObjType type);
 void free_object(VM *vm, Obj *obj);
+void free_lazy_function(VM *vm, LazyFunction *lazy);
 
 void collect_garbage(VM *vm);
 void mark_roots(VM *vm);
@@ -29,7 +34,8 @@ void mark_value(VM *vm, Value value);
 void mark_object(VM *vm, Obj *object);
 void trace_references(VM *vm);
 void blacken_object(VM *vm, Obj *object);
-void table_remove_white(VM *vm, Table *table);
+void table_remove_white(Table *table);
+void forget_white_intrinsics(VM *vm);
 void sweep(VM *vm);
 
 #endif
@@ -0,0 +1,48 @@
+#ifndef _NATIVES_H_
+#define _NATIVES_H_
+
+#include "Object.h"
+#include "Value.h"
+#include <stdbool.h>
+
+typedef struct VM VM;
+
+// Defines the natives every VM starts with as globals.
+void define_natives(VM *vm);
+// The intrinsic a native of this name is, -1 if none.
+int find_intrinsic(const char *name, size_t length);
+// The native registered under this name, NULL if none is.
+ObjNative *find_native(VM *vm, const char *name, size_t length);
+
+// Allocate a native's result into args[-1], where the collector finds it.
+// return_float64_array reports a runtime error and returns NULL when the
+// array cannot be allocated.
+ObjList *return_list(VM *vm, Value *args, int capacity);
+ObjFloat64Array *return_float64_array(VM *vm, Value *args, int count);
+
+bool clock_native(VM *vm, int arg_count, Value *args);
+bool len_native(VM *vm, int arg_count, Value *args);
+bool sqrt_native(VM *vm, int arg_count, Value *args);
+bool abs_native(VM *vm, int arg_count, Value *args);
+bool floor_native(VM *vm, int arg_count, Value *args);
+bool push_native(VM *vm, int arg_count, Value *args);
+bool pop_native(VM *vm, int arg_count, Value *args);
+bool slice_native(VM *vm, int arg_count, Value *args);
+bool map_native(VM *vm, int arg_count, Value *args);
+bool keys_native(VM *vm, int arg_count, Value *args);
+bool values_native(VM *vm, int arg_count, Value *args);
+bool has_native(VM *vm, int arg_count, Value *args);
+bool remove_native(VM *vm, int arg_count, Value *args);
+bool size_native(VM *vm, int arg_count, Value *args);
+bool float64_array_native(VM *vm, int arg_count, Value *args);
+bool sum_native(VM *vm, int arg_count, Value *args);
+bool dot_native(VM *vm, int arg_count, Value *args);
+bool scale_native(VM *vm, int arg_count, Value *args);
+bool axpy_native(VM *vm, int arg_count, Value *args);
+bool min_native(VM *vm, int arg_count, Value *args);
+bool max_native(VM *vm, int arg_count, Value *args);
+bool add_native(VM *vm, int arg_count, Value *args);
+bool mul_native(VM *vm, int arg_count, Value *args);
+bool sort_native(VM *vm, int arg_count, Value *args);
+
+#endif
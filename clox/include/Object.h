@@ -4,6 +4,7 @@
 #include "Chunk.h"
 #include "Table.h"
 #include "Value.h"
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -19,6 +20,9 @@ enum ObjType {
   OBJ_INSTANCE,
   OBJ_METHOD,
   OBJ_BOUND_METHOD,
+  OBJ_LIST,
+  OBJ_MAP,
+  OBJ_FLOAT64_ARRAY,
 };
 
 typedef enum ObjType ObjType;
@@ -36,25 +40,75 @@ struct ObjString {
   size_t length;
   char *chars;
   uint32_t hash;
+  // the slot the name was last looked up at and the layout numbering it,
+  // a layout of 0 until then
+  int slot;
+  int slot_layout;
 };
 
 typedef struct ObjString ObjString;
 
+// A name an upvalue of a lazily compiled function was resolved to, flat once
+// the variable turned out to never be assigned.
+struct LazyName {
+  const char *start;
+  int length;
+  bool flat;
+};
+
+typedef struct LazyName LazyName;
+
+// A function whose body is only compiled on its first call. The source from
+// its parameter list on is kept by the VM. The body is compiled as what the
+// declaration was pre-parsed as: the kind of function, whether it sits in a
+// class and the names of its upvalues, one per upvalue.
+struct LazyFunction {
+  const char *start;
+  // end of the source the body is in
+  const char *end;
+  int line;
+  int type;
+  bool in_class;
+  bool has_superclass;
+  LazyName *names;
+  int name_capacity;
+};
+
+typedef struct LazyFunction LazyFunction;
+
 struct ObjFunction {
   Obj obj;
   int arity;
   int upvalue_count;
   Chunk chunk;
   ObjString *name;
+  // calls so far, the optimizing tier runs once this gets hot
+  int calls;
+  bool optimized;
+  // code replaced by the optimizing tier, frames that were already running
+  // it keep executing it
+  Chunk retired;
+  // NULL once the body is compiled
+  LazyFunction *lazy;
 };
 
 typedef struct ObjFunction ObjFunction;
 
-typedef Value (*NativeFn)(int arg_count, Value *args);
+// A native finds its arguments at args and leaves its result in args[-1],
+// the callee's slot, which is also a safe place to keep an object it has
+// just allocated. It returns false once it has reported a runtime error.
+// The caller has checked arg_count against the native's arity, unless that
+// is NATIVE_VARIADIC.
+typedef bool (*NativeFn)(VM *vm, int arg_count, Value *args);
+
+#define NATIVE_VARIADIC -1
 
 struct ObjNative {
   Obj obj;
   NativeFn fn;
+  int arity;
+  // the name it was registered under, which images write it as
+  const char *name;
 };
 
 typedef struct ObjNative ObjNative;
@@ -68,19 +122,38 @@ struct ObjUpvalue {
 
 typedef struct ObjUpvalue ObjUpvalue;
 
+// An upvalue captured flat is the variable's value, any other one is an
+// ObjUpvalue shared with the closures capturing the same variable.
 struct ObjClosure {
   Obj obj;
   ObjFunction *fn;
-  ObjUpvalue **upvalues;
+  Value *upvalues;
   int upvalue_count;
 };
 
 typedef struct ObjClosure ObjClosure;
 
+// Methods live in a vtable indexed by the slot of their name. Slots are
+// numbered per class hierarchy: a subclass starts from a copy of its
+// superclass' vtable and shares its layout, so inherited methods keep their
+// slots and overriding one replaces a single entry. The first name the
+// superclass lacks gives the subclass a layout of its own, numbering new
+// names from the superclass' count on.
 struct ObjClass {
   Obj obj;
   ObjString *name;
-  Table methods;
+  ObjClosure **methods;
+  int method_count;
+  // the class whose slots number this class' methods, itself or an ancestor
+  struct ObjClass *layout;
+  int layout_id;
+  // name to slot, empty unless the class is its own layout
+  Table slots;
+  // the 'init' method, also in methods, so construction skips the lookup
+  ObjClosure *initializer;
+  // fields of the instance that last gained one, new instances start with
+  // room for as many
+  int field_count;
 };
 
 typedef struct ObjClass ObjClass;
@@ -101,20 +174,79 @@ struct ObjBoundMethod {
 
 typedef struct ObjBoundMethod ObjBoundMethod;
 
+// A growable array of values stored contiguously.
+struct ObjList {
+  Obj obj;
+  Value *items;
+  int count;
+  int capacity;
+};
+
+typedef struct ObjList ObjList;
+
+// A key and its value in a map, removed entries keep their place until the
+// map's index is next rebuilt.
+struct MapEntry {
+  Value key;
+  Value value;
+  uint32_t hash;
+  bool removed;
+};
+
+typedef struct MapEntry MapEntry;
+
+// A hash map from any value to any value. The entries are kept in insertion
+// order and found through an open addressing index of their positions, so
+// growing rebuilds the index without moving an entry ahead of another.
+// index_capacity is zero or a power of two.
+struct ObjMap {
+  Obj obj;
+  MapEntry *entries;
+  int entry_count;
+  int entry_capacity;
+  int32_t *index;
+  int index_capacity;
+  int count;
+};
+
+typedef struct ObjMap ObjMap;
+
+// the storage of a Float64Array starts on a cache line
+#define FLOAT64_ARRAY_ALIGNMENT 64
+// the most elements a Float64Array holds, its size in bytes fits in an int
+#define FLOAT64_ARRAY_MAX (int)(INT_MAX / sizeof(double))
+
+// A fixed length array of unboxed numbers, zeroed when created.
+struct ObjFloat64Array {
+  Obj obj;
+  double *items;
+  int count;
+};
+
+typedef struct ObjFloat64Array ObjFloat64Array;
+
 ObjType object_type(Value value);
 ObjFunction *new_function(VM *vm);
-ObjNative *new_native(VM *vm, NativeFn fn);
+ObjNative *new_native(VM *vm, const char *name, NativeFn fn, int arity);
 ObjClosure *new_closure(VM *vm, ObjFunction *fn);
 ObjUpvalue *new_upvalue(VM *vm, Value *slot);
 ObjClass *new_class(VM *vm, ObjString *name);
 ObjInstance *new_instance(VM *vm, ObjClass *klass);
 ObjBoundMethod *new_bound_method(VM *vm, Value receiver, ObjClosure *method);
+ObjList *new_list(VM *vm, Value *items, int count);
+void list_append(VM *vm, ObjList *list, Value value);
+ObjMap *new_map(VM *vm);
+ObjFloat64Array *new_float64_array(VM *vm, int count);
+int method_slot(ObjClass *klass, ObjString *name);
+ObjClosure *find_method(ObjClass *klass, ObjString *name);
+void set_method(VM *vm, ObjClass *klass, ObjString *name, ObjClosure *method);
+void inherit_methods(VM *vm, ObjClass *klass, ObjClass *superclass);
 ObjString *copy_string(VM *vm, const char *chars, size_t length);
 void concatenate(VM *vm);
-ObjString *take_string(VM *vm, char *chars, int length);
+ObjString *take_string(VM *vm, char *chars, size_t length);
 ObjString *allocate_string(VM *vm, char *chars, size_t length, uint32_t hash);
-void print_object(FILE *out, Value value);
-void print_function(FILE *out, ObjFunction *fn);
+void write_object(Output *out, Value value);
+void write_function(Output *out, ObjFunction *fn);
 
 bool is_object_type(Value value, ObjType type);
 bool is_string(Value value);
@@ -124,16 +256,24 @@ bool is_closure(Value value);
 bool is_class(Value value);
 bool is_instance(Value value);
 bool is_bound_method(Value value);
+bool is_list(Value value);
+bool is_map(Value value);
+bool is_float64_array(Value value);
 
 ObjString *as_string(Value value);
 ObjFunction *as_function(Value value);
 NativeFn as_native(Value value);
 ObjClosure *as_closure(Value value);
+ObjUpvalue *as_upvalue(Value value);
 char *as_cstring(Value value);
 ObjClass *as_class(Value value);
 ObjInstance *as_instance(Value value);
 ObjBoundMethod *as_bound_method(Value value);
+ObjList *as_list(Value value);
+ObjMap *as_map(Value value);
+ObjFloat64Array *as_float64_array(Value value);
 
-uint32_t hash_string(const char *key, int length);
+uint32_t hash_string(const char *key, size_t length);
+bool string_equals(const char *a, const char *b, size_t length);
 
 #endif
@@ -1,6 +1,17 @@
 #ifndef _OPCODE_H_
 #define _OPCODE_H_
 
+// Constant pool operands are one byte, or three bytes (big endian) when the
+// instruction is prefixed by OP_WIDE. Jump operands are always three bytes.
+#define UINT24_MAX 0xffffff
+
+// OP_CLOSURE is followed by a flags byte and an index for every variable the
+// closure captures. The index is a slot of the frame for a local, otherwise
+// one of the enclosing closure's upvalues. A flat capture copies the value,
+// which the compiler only asks for when the variable is never assigned.
+#define CAPTURE_LOCAL 0x1
+#define CAPTURE_FLAT 0x2
+
 enum Opcode {
   OP_RETURN,
   OP_CONSTANT,
@@ -26,6 +37,7 @@ enum Opcode {
   OP_LOOP,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
+  OP_JUMP_IF_TRUE,
   OP_CALL,
   OP_CLOSURE,
   OP_GET_UPVALUE,
@@ -39,8 +51,60 @@ enum Opcode {
   OP_INHERIT,
   OP_GET_SUPER,
   OP_SUPER_INVOKE,
+  OP_WIDE,
+  OP_TAIL_CALL,
+  // arithmetic and comparisons on operands already known to be numbers
+  OP_ADD_NUM,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_NEGATE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  // the two ends of a call site with the callee's body spliced in: a jump
+  // into the body taken while the callee is still the inlined function, and
+  // the body's return, which leaves the result in the callee's slot
+  OP_JUMP_IF_CALLEE,
+  OP_INLINE_RETURN,
+  // a method looked up for a call right away, it stays unbound as the
+  // receiver and the method until OP_CALL_METHOD
+  OP_GET_METHOD,
+  OP_GET_SUPER_METHOD,
+  OP_CALL_METHOD,
+  // reads an upvalue captured flat, which holds the value itself
+  OP_GET_FLAT_UPVALUE,
+  // a list of the values its operand counts, and reads and stores of an
+  // element: the list and the index, then the value for a store, which is
+  // left on the stack
+  OP_BUILD_LIST,
+  OP_INDEX_GET,
+  OP_INDEX_SET,
+  // a call whose callee was read from the global of an intrinsic's name,
+  // followed by the argument count and the intrinsic. While the callee is
+  // still that native and the arguments suit it, the VM computes the result
+  // in place of the call.
+  OP_CALL_INTRINSIC,
+  // OP_INVOKE and OP_SUPER_INVOKE ending a return's expression, which take
+  // over the caller's frame like OP_TAIL_CALL
+  OP_TAIL_INVOKE,
+  OP_TAIL_SUPER_INVOKE,
+  // reads a local holding a receiver whose method, in the next slot, is
+  // still unbound. The first read binds it and leaves the bound method in
+  // the local and nil in the next slot.
+  OP_BIND_LOCAL,
 };
 
 typedef enum Opcode Opcode;
 
+enum Intrinsic {
+  INTRINSIC_CLOCK,
+  INTRINSIC_LEN,
+  INTRINSIC_SQRT,
+  INTRINSIC_ABS,
+  INTRINSIC_FLOOR,
+  INTRINSIC_COUNT,
+};
+
+typedef enum Intrinsic Intrinsic;
+
 #endif
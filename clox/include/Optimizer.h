@@ -0,0 +1,39 @@
+#ifndef _OPTIMIZER_H_
+#define _OPTIMIZER_H_
+
+#include "Chunk.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// One decoded instruction of the chunk being optimized. Jumps refer to the
+// index of their target instead of an offset, so the code can shrink freely
+// and the operands are recomputed when the chunk is written back.
+struct Instruction {
+  size_t offset;
+  size_t new_offset;
+  size_t length;
+  uint8_t op;
+  bool wide;
+  int line;
+  int target;
+  bool is_target;
+  bool removed;
+};
+
+typedef struct Instruction Instruction;
+
+struct PeepholeStats {
+  size_t instructions_before;
+  size_t instructions_after;
+  size_t bytes_before;
+  size_t bytes_after;
+};
+
+typedef struct PeepholeStats PeepholeStats;
+
+int decode_chunk(Chunk *chunk, Instruction **out);
+void init_peephole_stats(PeepholeStats *stats);
+void peephole_optimize(Chunk *chunk, PeepholeStats *stats);
+
+#endif
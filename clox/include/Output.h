@@ -0,0 +1,26 @@
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+// What the program prints, collected and written to the stream in large
+// pieces. The VM flushes it whenever something else might be shown in
+// between: before an error, a REPL prompt, and on exit.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+struct Output {
+  FILE *stream;
+  char *chars;
+  size_t size;
+  size_t capacity;
+};
+
+typedef struct Output Output;
+
+void init_output(Output *output, FILE *stream, char *chars, size_t capacity);
+void flush_output(Output *output);
+void write_output(Output *output, const char *chars, size_t length);
+void write_output_char(Output *output, char c);
+
+#endif
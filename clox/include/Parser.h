@@ -1,6 +1,7 @@
 #ifndef _PARSER_H_
 #define _PARSER_H_
 
+#include "Arena.h"
 #include "Compiler.h"
 #include "Scanner.h"
 #include <stdbool.h>
@@ -15,6 +16,8 @@ struct Parser {
   Token previous;
   bool had_error;
   bool panic_mode;
+  // the compilers' own data, freed once the source is compiled
+  Arena arena;
 };
 
 typedef struct Parser Parser;
@@ -69,6 +72,8 @@ void this_(Compiler *compiler, bool can_assign);
 void super_(Compiler *compiler, bool can_assign);
 void call(Compiler *compiler, bool can_assign);
 void dot(Compiler *compiler, bool can_assign);
+void list(Compiler *compiler, bool can_assign);
+void subscript(Compiler *compiler, bool can_assign);
 uint8_t argument_list(Compiler *compiler);
 void grouping(Compiler *compiler, bool can_assign);
 void logical_and(Compiler *compiler, bool can_assign);
@@ -78,8 +83,8 @@ void number(Compiler *compiler, bool can_assign);
 void string(Compiler *compiler, bool can_assign);
 void literal(Compiler *compiler, bool can_assign);
 void variable(Compiler *compiler, bool can_assign);
-uint8_t parse_variable(Compiler *compiler, const char *msg);
-uint8_t identifier_constant(Compiler *compiler, Token *name);
+int parse_variable(Compiler *compiler, const char *msg);
+int identifier_constant(Compiler *compiler, Token *name);
 void advance(Compiler *compiler);
 bool check(Compiler *compiler, TokenType type);
 bool match(Compiler *compiler, TokenType type);
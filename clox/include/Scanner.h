@@ -1,9 +1,11 @@
 #ifndef _SCANNER_H_
 #define _SCANNER_H_
 
+// Scans the source up to end, which need not be the end of a string.
 struct Scanner {
   const char *start;
   const char *current;
+  const char *end;
   int line;
 };
 
@@ -15,6 +17,8 @@ enum TokenType {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA,
   TOKEN_DOT,
   TOKEN_MINUS,
@@ -71,7 +75,8 @@ struct Token {
 
 typedef struct Token Token;
 
-void init_scanner(Scanner *scanner, const char *src);
+void init_scanner(Scanner *scanner, const char *src, const char *end);
 Token scan_token(Scanner *scanner);
+double parse_number(const char *start, int length);
 
 #endif
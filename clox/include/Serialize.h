@@ -0,0 +1,52 @@
+#ifndef _SERIALIZE_H_
+#define _SERIALIZE_H_
+
+#include "Chunk.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Byte level helpers shared by the bytecode and heap image formats. Integers
+// are little endian, numbers are the bits of the double.
+
+// Grows in memory, the file is written in one go once it is complete.
+struct Writer {
+  uint8_t *bytes;
+  size_t size;
+  size_t capacity;
+  bool ok;
+};
+
+typedef struct Writer Writer;
+
+// Bounds checked view of a mapped file, ok turns false on the first read
+// past its end and every later read yields zeroes.
+struct Reader {
+  const uint8_t *start;
+  const uint8_t *at;
+  const uint8_t *end;
+  bool ok;
+};
+
+typedef struct Reader Reader;
+
+void init_writer(Writer *writer);
+void free_writer(Writer *writer);
+bool write_file(Writer *writer, const char *path);
+void put_bytes(Writer *writer, const void *bytes, size_t size);
+void put_u8(Writer *writer, uint8_t value);
+void put_u32(Writer *writer, uint32_t value);
+void put_u64(Writer *writer, uint64_t value);
+void put_number(Writer *writer, double number);
+void put_lines(Writer *writer, Chunk *chunk);
+
+bool map_file(const char *path, Reader *reader);
+void unmap_file(Reader *reader);
+const uint8_t *get_bytes(Reader *reader, size_t size);
+uint8_t get_u8(Reader *reader);
+uint32_t get_u32(Reader *reader);
+uint64_t get_u64(Reader *reader);
+double get_number(Reader *reader);
+void get_lines(VM *vm, Reader *reader, Chunk *chunk);
+
+#endif
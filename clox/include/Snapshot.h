@@ -0,0 +1,21 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdbool.h>
+
+// Heap images. Once a prelude has run, every live object is written out,
+// globals included. A later process maps the image and rebuilds the heap
+// from it instead of running the prelude again. An image is the magic, the
+// format version and the object count. Then comes one shape record per
+// object, enough to allocate it, and one record of each object's references
+// in the same order. The globals close the file. References are indices
+// into the objects, integers are little endian.
+#define IMAGE_MAGIC "LOXI"
+#define IMAGE_VERSION 3
+
+typedef struct VM VM;
+
+bool write_image(VM *vm, const char *path);
+bool read_image(VM *vm, const char *path);
+
+#endif
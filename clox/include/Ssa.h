@@ -0,0 +1,183 @@
+#ifndef _SSA_H_
+#define _SSA_H_
+
+#include "Chunk.h"
+#include "Value.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Optimizing tier. A function's bytecode is lifted into SSA form, where every
+// stack slot and temporary holds a value defined exactly once and merges get
+// phis. The analyses on that form drive rewrites of the bytecode, which is
+// then encoded back into the function's chunk.
+
+typedef struct ObjFunction ObjFunction;
+typedef struct VM VM;
+
+// Calls after which a function is handed to the optimizing tier.
+#ifndef HOT_CALLS
+#define HOT_CALLS 1000
+#endif
+
+enum SsaType {
+  SSA_UNDEFINED,
+  SSA_NIL,
+  SSA_BOOL,
+  SSA_NUMBER,
+  SSA_STRING,
+  SSA_ANY,
+};
+
+typedef enum SsaType SsaType;
+
+enum SsaKind {
+  SSA_PARAM,
+  SSA_CONST,
+  SSA_PHI,
+  SSA_RESULT,
+  SSA_COPY,
+};
+
+typedef enum SsaKind SsaKind;
+
+struct SsaValue {
+  SsaKind kind;
+  SsaType type;
+  bool is_constant;
+  Value constant;
+  // instruction defining the value, -1 for parameters and phis
+  int inst;
+  int block;
+  // the stored value of an SSA_COPY made by OP_SET_LOCAL
+  int source;
+  // phi inputs, one per predecessor of block
+  int *inputs;
+  // value a trivial phi stands for, -1 otherwise
+  int replacement;
+  bool live;
+  // first instruction whose success proves this value is a number
+  int proof;
+};
+
+typedef struct SsaValue SsaValue;
+
+// An entry of the abstract stack, producer is the instruction of the current
+// block that pushed it or -1.
+struct SsaSlot {
+  int value;
+  int producer;
+};
+
+typedef struct SsaSlot SsaSlot;
+
+struct SsaInst {
+  int block;
+  uint8_t op;
+  // operands of the instructions the analyses look at, in push order
+  int args[2];
+  int producers[2];
+  int arg_count;
+  int result;
+  // first instruction of the contiguous expression computing result, -1
+  // when it is not contiguous
+  int first;
+  // next instruction proving the same value is a number
+  int proof_next[2];
+  // set once a pass removed, replaced or hoisted the instruction
+  bool edited;
+  bool removed;
+  // a constant load is at most OP_WIDE, OP_CONSTANT and three operand bytes
+  uint8_t replacement[5];
+  int replacement_length;
+  int hoist;
+  // stack slot and value of a call's callee, the function inlined at the
+  // call and where its own constant and the callee's constants start in the
+  // caller's constant table
+  int callee_slot;
+  int callee_value;
+  ObjFunction *inlined;
+  size_t inlined_function;
+  size_t inlined_constants;
+};
+
+typedef struct SsaInst SsaInst;
+
+struct SsaBlock {
+  int start;
+  int end;
+  int *preds;
+  int pred_count;
+  int pred_capacity;
+  int succs[2];
+  int succ_count;
+  // stack depth on entry, -1 while the block is unreachable
+  int depth;
+  int exit_depth;
+  bool has_phis;
+  SsaSlot *entry;
+  SsaSlot *exit;
+  int rpo;
+  int idom;
+  // children in the dominator tree and the interval its walk spends below
+  // the block, a dominates b exactly when a's interval encloses b's
+  int first_child;
+  int next_sibling;
+  int enter;
+  int leave;
+};
+
+typedef struct SsaBlock SsaBlock;
+
+// A loop invariant expression moved in front of its loop header and kept in
+// a hidden local slot.
+struct SsaHoist {
+  int header;
+  int first;
+  int last;
+  int slot;
+};
+
+typedef struct SsaHoist SsaHoist;
+
+typedef struct Instruction Instruction;
+
+struct SsaFunction {
+  VM *vm;
+  ObjFunction *fn;
+  Chunk *chunk;
+  Instruction *code;
+  SsaInst *insts;
+  int count;
+  SsaBlock *blocks;
+  int block_count;
+  // reachable blocks in reverse postorder
+  int *order;
+  int order_count;
+  SsaValue *values;
+  int value_count;
+  int value_capacity;
+  // abstract stack of the block being lifted
+  SsaSlot *stack;
+  int depth;
+  int stack_capacity;
+  // values read by instructions, the roots of liveness
+  int *uses;
+  int use_count;
+  int use_capacity;
+  SsaHoist *hoists;
+  int hoist_count;
+  int hoist_capacity;
+  // hidden slots this round adds after the parameters
+  int hidden;
+  // highest local slot operand in the code
+  int max_slot;
+  // splice small global functions into their call sites this round
+  bool inlining;
+  bool changed;
+};
+
+typedef struct SsaFunction SsaFunction;
+
+void optimize_function(VM *vm, ObjFunction *fn, bool retire);
+
+#endif
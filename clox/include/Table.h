@@ -4,21 +4,25 @@
 #include "Value.h"
 #include <stdint.h>
 
+#define TABLE_MAX_LOAD 0.75
+
 typedef struct ObjString ObjString;
 
+// An empty bucket has a NULL key and a nil value, a tombstone left behind by
+// table_delete has a NULL key and a true value.
 struct Entry {
   ObjString *key;
   Value value;
-  struct Entry *next;
 };
 
 typedef struct Entry Entry;
 
+// Open addressing hash table with linear probing. size counts live entries
+// and tombstones, capacity is always a power of two.
 struct Table {
-  Entry *front;
-  Entry *rear;
   int size;
   int capacity;
+  Entry *entries;
 };
 
 typedef struct Table Table;
@@ -30,7 +34,8 @@ bool table_set_no_search(VM *vm, Table *table, ObjString *key, Value value);
 bool table_get(Table *table, ObjString *key, Value *value);
 ObjString *table_find_string(Table *table, const char *key, size_t length,
                              uint32_t hash);
-bool table_delete(VM *vm, Table *table, ObjString *key);
+bool table_delete(Table *table, ObjString *key);
 void table_add_all(VM *vm, Table *from, Table *to);
+void table_reserve(VM *vm, Table *table, int count);
 
 #endif
@@ -4,10 +4,18 @@
 #include "Chunk.h"
 #include "InterpretResult.h"
 #include "Object.h"
+#include "Opcode.h"
+#include "Optimizer.h"
+#include "Output.h"
 #include "Table.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * 256)
+// Both stacks start small and grow on demand, FRAMES_MAX bounds the call
+// depth and can be overridden at build time.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX (64 * 1024)
+#endif
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 256
 
 typedef struct Compiler Compiler;
 
@@ -22,34 +30,63 @@ typedef struct CallFrame CallFrame;
 struct VM {
   // for GC
   Compiler *compiler;
-  CallFrame frames[FRAMES_MAX];
+  CallFrame *frames;
   int frame_count;
-  Value stack[STACK_MAX];
+  int frame_capacity;
+  Value *stack;
   Value *stack_top;
+  int stack_capacity;
   Obj *objects;
   Table strings;
   Table globals;
+  // the natives OP_CALL_INTRINSIC stands in for, held weakly: a native no
+  // longer reachable otherwise is forgotten and its calls take the slow path
+  ObjNative *intrinsics[INTRINSIC_COUNT];
   ObjString *init_string;
+  // the last id given a class layout
+  int layout_count;
   int gray_size;
   int gray_capacity;
   Obj **gray_stack;
   size_t bytes_allocated;
   size_t next_gc;
+  // open upvalues sorted by slot, highest first, and the one of each slot
+  // of the stack or NULL
   ObjUpvalue *open_upvalues;
+  ObjUpvalue **open_slots;
+  // bound methods the collector freed, linked through their next fields
+  Obj *free_bound_methods;
+  int free_bound_method_count;
+  // run the peephole pass over every compiled function
+  bool peephole;
+  PeepholeStats peephole_stats;
+  // hand functions to the optimizing tier once they get hot, or optimize
+  // every function as soon as it is compiled
+  bool hot_tier;
+  bool optimize_all;
+  // compile function bodies on their first call, keeping the sources
+  bool lazy;
+  char **sources;
+  int source_count;
+  int source_capacity;
+  // what print statements write, flushed before anything goes to stderr
+  Output output;
 };
 
 typedef struct VM VM;
 
 void init_VM(VM *vm);
 void free_VM(VM *vm);
-InterpretResult interpret(VM *vm, const char *src);
+InterpretResult interpret(VM *vm, const char *src, size_t length);
+InterpretResult interpret_function(VM *vm, ObjFunction *fn);
 void push(VM *vm, Value value);
 Value pop(VM *vm);
 Value peek(VM *vm, size_t index);
 bool call_value(VM *vm, Value callee, int arg_count);
 
-void define_native(VM *vm, const char *name, NativeFn fn);
-Value clock_native(int arg_count, Value *args);
+void runtime_error(VM *vm, const char *format, ...);
+// The native keeps the name, which must outlive it.
+ObjNative *define_native(VM *vm, const char *name, NativeFn fn, int arity);
 
 ObjUpvalue *capture_upvalue(VM *vm, Value *slot);
 void close_upvalues(VM *vm, Value *last);
@@ -57,8 +94,8 @@ void close_upvalues(VM *vm, Value *last);
 void define_method(VM *vm, ObjString *name);
 bool bind_method(VM *vm, ObjClass *klass, ObjString *name);
 
-bool invoke(VM *vm, ObjString *name, uint8_t arg_count);
+bool invoke(VM *vm, ObjString *name, uint8_t arg_count, bool tail);
 bool invoke_from_class(VM *vm, ObjClass *klass, ObjString *name,
-                       uint8_t arg_count);
+                       uint8_t arg_count, bool tail);
 
 #endif
@@ -1,10 +1,14 @@
 #ifndef _VALUE_H_
 #define _VALUE_H_
 
+#include "Output.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 
+// room for any number print_value writes
+#define NUMBER_BUFFER_SIZE 32
+
 enum ValueType {
   VAL_BOOL,
   VAL_NIL,
@@ -41,6 +45,8 @@ void init_value_array(ValueArray *array);
 void write_value_array(VM *vm, ValueArray *array, Value value);
 void free_value_array(VM *vm, ValueArray *array);
 void print_value(FILE *out, Value value);
+void write_value(Output *out, Value value);
+size_t format_number(double number, char *buffer);
 
 Value add(Value, Value);
 Value subtract(Value, Value);
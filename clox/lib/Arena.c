@@ -0,0 +1,152 @@
+#include "Arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t align_size(size_t size);
+static ArenaBlock *new_block(Arena *arena, size_t size);
+static ArenaBlock **find_large_block(Arena *arena, void *array);
+static void out_of_memory(void);
+
+void init_arena(Arena *arena) {
+  arena->blocks = NULL;
+  arena->block_count = 0;
+  arena->last = NULL;
+}
+
+void free_arena(Arena *arena) {
+  ArenaBlock *block = arena->blocks;
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+
+  init_arena(arena);
+}
+
+ArenaMark arena_mark(Arena *arena) {
+  ArenaMark mark;
+  mark.block_count = arena->block_count;
+  mark.used = arena->blocks == NULL ? 0 : arena->blocks->used;
+  return mark;
+}
+
+void arena_release(Arena *arena, ArenaMark mark) {
+  while (arena->block_count > mark.block_count) {
+    ArenaBlock *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+    --arena->block_count;
+  }
+
+  if (arena->blocks != NULL) {
+    arena->blocks->used = mark.used;
+  }
+  arena->last = NULL;
+}
+
+size_t align_size(size_t size) {
+  size_t align = sizeof(max_align_t);
+  return (size + align - 1) & ~(align - 1);
+}
+
+void out_of_memory(void) {
+  fprintf(stderr, "Out of memory compiling.\n");
+  exit(74);
+}
+
+// A large request gets a block of its own, exactly its size.
+ArenaBlock *new_block(Arena *arena, size_t size) {
+  size_t capacity = size >= ARENA_LARGE_SIZE ? size : ARENA_BLOCK_SIZE;
+  ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+  if (block == NULL) {
+    out_of_memory();
+  }
+
+  block->next = arena->blocks;
+  block->size = capacity;
+  block->used = 0;
+  arena->blocks = block;
+  ++arena->block_count;
+  return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size = align_size(size);
+  ArenaBlock *block = arena->blocks;
+  if (block == NULL || size >= ARENA_LARGE_SIZE ||
+      block->size - block->used < size) {
+    block = new_block(arena, size);
+  }
+
+  void *result = (char *)block->data + block->used;
+  block->used += size;
+  arena->last = result;
+  return result;
+}
+
+// Arrays appended to one at a time are usually the last thing allocated, they
+// grow where they are, and a large one moves with its block. Any other array
+// is copied, its old space is given back if it was large and left behind
+// until the arena goes otherwise.
+void *arena_grow(Arena *arena, void *array, size_t old_size, size_t new_size) {
+  ArenaBlock *block = arena->blocks;
+  if (array != NULL && array == arena->last) {
+    size_t start = (size_t)((char *)array - (char *)block->data);
+    if (align_size(new_size) <= block->size - start) {
+      block->used = start + align_size(new_size);
+      return array;
+    }
+
+    if (start == 0 && old_size >= ARENA_LARGE_SIZE) {
+      size_t capacity = align_size(new_size);
+      ArenaBlock *grown = realloc(block, sizeof(ArenaBlock) + capacity);
+      if (grown == NULL) {
+        out_of_memory();
+      }
+
+      grown->size = capacity;
+      grown->used = capacity;
+      arena->blocks = grown;
+      arena->last = grown->data;
+      return grown->data;
+    }
+  }
+
+  void *result = arena_alloc(arena, new_size);
+  if (old_size > 0) {
+    memcpy(result, array, old_size);
+    arena_free(arena, array, old_size);
+  }
+  return result;
+}
+
+// Frees a large allocation's block, anything smaller stays until the arena is
+// released. Only valid for an array allocated after every live mark.
+void arena_free(Arena *arena, void *array, size_t size) {
+  if (array == NULL || align_size(size) < ARENA_LARGE_SIZE)
+    return;
+
+  ArenaBlock **link = find_large_block(arena, array);
+  if (link == NULL)
+    return;
+
+  ArenaBlock *block = *link;
+  *link = block->next;
+  --arena->block_count;
+  if (arena->last == array) {
+    arena->last = NULL;
+  }
+  free(block);
+}
+
+ArenaBlock **find_large_block(Arena *arena, void *array) {
+  for (ArenaBlock **link = &arena->blocks; *link != NULL;
+       link = &(*link)->next) {
+    if ((void *)(*link)->data == array)
+      return link;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,634 @@
+#include "Bytecode.h"
+#include "Compiler.h"
+#include "Memory.h"
+#include "Object.h"
+#include "Opcode.h"
+#include "Serialize.h"
+#include "VM.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+enum ConstantTag {
+  TAG_NIL,
+  TAG_FALSE,
+  TAG_TRUE,
+  TAG_NUMBER,
+  TAG_STRING,
+  TAG_FUNCTION,
+};
+
+// An instruction as the verifier sees it: how far it reaches, its effect on
+// the stack, the highest local slot it touches and where it jumps, -1 when
+// it does not.
+struct Decoded {
+  uint8_t op;
+  size_t length;
+  int pops;
+  int pushes;
+  int slot;
+  int target;
+};
+
+typedef struct Decoded Decoded;
+
+static void put_string(Writer *writer, ObjString *string);
+static void put_function(Writer *writer, ObjFunction *fn);
+static ObjString *get_string(VM *vm, Reader *reader);
+static ObjFunction *get_function(VM *vm, Reader *reader, int depth);
+static bool verify_function(ObjFunction *fn);
+static bool verify_captures(ObjFunction *fn, const bool *flat);
+static bool decode(ObjFunction *fn, size_t offset, Decoded *inst);
+static bool constant_operand(uint8_t op);
+static bool is_string_constant(Chunk *chunk, size_t index);
+
+bool stamp_source(const char *path, const char *src, size_t length,
+                  SourceStamp *stamp) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return false;
+
+  stamp->hash = hash_string(src, length);
+  stamp->size = length;
+  stamp->mtime = (int64_t)st.st_mtime;
+  return true;
+}
+
+bool write_bytecode(ObjFunction *fn, const SourceStamp *stamp,
+                    const char *path) {
+  Writer writer;
+  init_writer(&writer);
+  put_bytes(&writer, BYTECODE_MAGIC, 4);
+  put_u32(&writer, BYTECODE_VERSION);
+  put_u32(&writer, stamp->hash);
+  put_u64(&writer, stamp->size);
+  put_u64(&writer, (uint64_t)stamp->mtime);
+  put_function(&writer, fn);
+
+  bool ok = write_file(&writer, path);
+  free_writer(&writer);
+  return ok;
+}
+
+// Maps the file and rebuilds its functions. Returns NULL when the file cannot
+// be read, fails verification or was compiled from a source other than the
+// one stamp describes, a NULL stamp accepts any source.
+ObjFunction *read_bytecode(VM *vm, const char *path,
+                           const SourceStamp *stamp) {
+  Reader reader;
+  if (!map_file(path, &reader))
+    return NULL;
+
+  const uint8_t *magic = get_bytes(&reader, 4);
+  uint32_t version = get_u32(&reader);
+  SourceStamp source;
+  source.hash = get_u32(&reader);
+  source.size = get_u64(&reader);
+  source.mtime = (int64_t)get_u64(&reader);
+
+  ObjFunction *fn = NULL;
+  if (reader.ok && memcmp(magic, BYTECODE_MAGIC, 4) == 0 &&
+      version == BYTECODE_VERSION &&
+      (stamp == NULL ||
+       (source.hash == stamp->hash && source.size == stamp->size &&
+        source.mtime == stamp->mtime))) {
+    fn = get_function(vm, &reader, 0);
+    if (fn != NULL &&
+        (reader.at != reader.end || fn->arity != 0 ||
+         fn->upvalue_count != 0 || !verify_captures(fn, NULL))) {
+      fn = NULL;
+    }
+  }
+
+  unmap_file(&reader);
+  return fn;
+}
+
+void put_string(Writer *writer, ObjString *string) {
+  put_u32(writer, (uint32_t)string->length);
+  put_bytes(writer, string->chars, string->length);
+}
+
+// Only eagerly compiled, unoptimized code is written: a lazy body needs its
+// source and the optimizing tier refers to functions by identity.
+void put_function(Writer *writer, ObjFunction *fn) {
+  if (fn->lazy != NULL || fn->optimized) {
+    writer->ok = false;
+    return;
+  }
+
+  Chunk *chunk = &fn->chunk;
+  put_u32(writer, (uint32_t)fn->arity);
+  put_u32(writer, (uint32_t)fn->upvalue_count);
+  put_string(writer, fn->name);
+
+  put_u32(writer, (uint32_t)chunk->size);
+  put_bytes(writer, chunk->code, chunk->size);
+  put_lines(writer, chunk);
+
+  put_u32(writer, (uint32_t)chunk->constants.size);
+  for (size_t i = 0; i < chunk->constants.size; ++i) {
+    Value value = chunk->constants.values[i];
+    if (is_nil(value)) {
+      put_u8(writer, TAG_NIL);
+    } else if (is_bool(value)) {
+      put_u8(writer, as_bool(value) ? TAG_TRUE : TAG_FALSE);
+    } else if (is_number(value)) {
+      put_u8(writer, TAG_NUMBER);
+      put_number(writer, as_number(value));
+    } else if (is_string(value)) {
+      put_u8(writer, TAG_STRING);
+      put_string(writer, as_string(value));
+    } else if (is_function(value)) {
+      put_u8(writer, TAG_FUNCTION);
+      put_function(writer, as_function(value));
+    } else {
+      writer->ok = false;
+    }
+  }
+}
+
+ObjString *get_string(VM *vm, Reader *reader) {
+  uint32_t length = get_u32(reader);
+  if (!reader->ok || length > (size_t)(reader->end - reader->at)) {
+    reader->ok = false;
+    return NULL;
+  }
+
+  return copy_string(vm, (const char *)get_bytes(reader, length), length);
+}
+
+// The function under construction stays on the stack, everything it is
+// built from may trigger a collection.
+ObjFunction *get_function(VM *vm, Reader *reader, int depth) {
+  if (depth > UINT8_COUNT)
+    return NULL;
+
+  ObjFunction *fn = new_function(vm);
+  push(vm, object_val((Obj *)fn));
+
+  uint32_t arity = get_u32(reader);
+  uint32_t upvalue_count = get_u32(reader);
+  fn->name = get_string(vm, reader);
+  uint32_t size = get_u32(reader);
+  bool ok = reader->ok && arity <= 255 && upvalue_count <= UINT8_COUNT &&
+            size > 0 && size <= (size_t)(reader->end - reader->at);
+
+  if (ok) {
+    fn->arity = (int)arity;
+    fn->upvalue_count = (int)upvalue_count;
+
+    Chunk *chunk = &fn->chunk;
+    chunk->code = allocate(vm, sizeof(uint8_t), size);
+    chunk->capacity = size;
+    chunk->size = size;
+    memcpy(chunk->code, get_bytes(reader, size), size);
+    get_lines(vm, reader, chunk);
+
+    uint32_t count = get_u32(reader);
+    for (uint32_t i = 0; i < count && reader->ok; ++i) {
+      Value value = nil_val();
+      switch (get_u8(reader)) {
+      case TAG_NIL:
+        break;
+      case TAG_FALSE:
+        value = bool_val(false);
+        break;
+      case TAG_TRUE:
+        value = bool_val(true);
+        break;
+      case TAG_NUMBER:
+        value = number_val(get_number(reader));
+        break;
+      case TAG_STRING: {
+        ObjString *string = get_string(vm, reader);
+        value = string == NULL ? nil_val() : object_val((Obj *)string);
+        break;
+      }
+      case TAG_FUNCTION: {
+        ObjFunction *inner = get_function(vm, reader, depth + 1);
+        if (inner == NULL) {
+          reader->ok = false;
+        }
+        value = object_val((Obj *)inner);
+        break;
+      }
+      default:
+        reader->ok = false;
+        break;
+      }
+
+      if (reader->ok) {
+        add_constant(vm, chunk, value);
+      }
+    }
+
+    ok = reader->ok && verify_function(fn);
+  }
+
+  pop(vm);
+  return ok ? fn : NULL;
+}
+
+// Checks everything the interpreter takes for granted about compiled code:
+// known opcodes, operands within the code, constants of the kind each
+// instruction expects, upvalues and stack slots that exist, and jumps landing
+// on an instruction with the stack as deep as every other way there. No
+// instruction may pop the frame's own slot. How upvalues were captured is left
+// to verify_captures, the types of the values on the stack are checked by the
+// instructions that depend on them.
+bool verify_function(ObjFunction *fn) {
+  Chunk *chunk = &fn->chunk;
+  // stack depth on entry to every offset reached so far, -1 elsewhere
+  int *depths = malloc(sizeof(int) * (chunk->size + 1));
+  bool *starts = calloc(chunk->size + 1, sizeof(bool));
+  bool ok = depths != NULL && starts != NULL;
+
+  Decoded inst = {OP_RETURN, 0, 0, 0, 0, -1};
+  size_t offset = 0;
+  while (ok && offset < chunk->size) {
+    starts[offset] = true;
+    depths[offset] = -1;
+    ok = decode(fn, offset, &inst);
+    offset += inst.length;
+  }
+
+  // running off the end of the code is never fine
+  ok = ok && offset == chunk->size &&
+       (inst.op == OP_RETURN || inst.op == OP_JUMP || inst.op == OP_LOOP);
+
+  for (offset = 0; ok && offset < chunk->size; offset += inst.length) {
+    decode(fn, offset, &inst);
+    ok = inst.target == -1 || starts[inst.target];
+  }
+
+  // depths flow forward along the code and its jumps until every reachable
+  // instruction has one, a loop only adds its body once its header is known
+  bool changed = ok;
+  if (ok) {
+    // the callee and its arguments
+    depths[0] = fn->arity + 1;
+  }
+  while (ok && changed) {
+    changed = false;
+    for (offset = 0; ok && offset < chunk->size; offset += inst.length) {
+      decode(fn, offset, &inst);
+      int depth = depths[offset];
+      if (depth == -1)
+        continue;
+
+      int after = depth - inst.pops + inst.pushes;
+      ok = inst.pops < depth &&
+           inst.slot < (inst.op == OP_CLOSURE ? after : depth);
+
+      size_t successors[2];
+      int count = 0;
+      if (inst.op != OP_RETURN && inst.op != OP_JUMP && inst.op != OP_LOOP) {
+        successors[count++] = offset + inst.length;
+      }
+      if (inst.target != -1) {
+        successors[count++] = (size_t)inst.target;
+      }
+
+      for (int i = 0; ok && i < count; ++i) {
+        if (depths[successors[i]] == -1) {
+          depths[successors[i]] = after;
+          changed = true;
+        } else {
+          ok = depths[successors[i]] == after;
+        }
+      }
+    }
+  }
+
+  free(depths);
+  free(starts);
+  return ok;
+}
+
+// Walks the closures fn makes from the top down and checks that each upvalue
+// is read the way it was captured, boxed or flat, flat has an entry for each
+// of fn's upvalues. A function is closed over by a single OP_CLOSURE, as the
+// compiler writes them, so it has one way of capturing. fn has been verified.
+bool verify_captures(ObjFunction *fn, const bool *flat) {
+  Chunk *chunk = &fn->chunk;
+  bool *closed = calloc(chunk->constants.size + 1, sizeof(bool));
+  bool ok = closed != NULL;
+
+  Decoded inst;
+  for (size_t offset = 0; ok && offset < chunk->size; offset += inst.length) {
+    decode(fn, offset, &inst);
+    switch (inst.op) {
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      ok = !flat[chunk->code[offset + 1]];
+      break;
+
+    case OP_GET_FLAT_UPVALUE:
+      ok = flat[chunk->code[offset + 1]];
+      break;
+
+    case OP_CLOSURE: {
+      bool wide = chunk->code[offset] == OP_WIDE;
+      size_t index = read_index(chunk, offset + (wide ? 2 : 1), wide);
+      ObjFunction *inner = as_function(chunk->constants.values[index]);
+      ok = !closed[index];
+      closed[index] = true;
+
+      // a local captured flat holds the value itself, any other local a box,
+      // an enclosing upvalue stays what it was
+      bool inner_flat[UINT8_COUNT];
+      size_t captures = offset + inst.length - 2 * inner->upvalue_count;
+      for (int i = 0; i < inner->upvalue_count; ++i) {
+        uint8_t flags = chunk->code[captures + 2 * i];
+        uint8_t slot = chunk->code[captures + 2 * i + 1];
+        inner_flat[i] = (flags & CAPTURE_LOCAL)
+                            ? flags == (CAPTURE_LOCAL | CAPTURE_FLAT)
+                            : flat[slot];
+      }
+      ok = ok && verify_captures(inner, inner_flat);
+      break;
+    }
+
+    default:
+      break;
+    }
+  }
+
+  free(closed);
+  return ok;
+}
+
+// Fills in the instruction at offset, false when it is not one the
+// interpreter could run.
+bool decode(ObjFunction *fn, size_t offset, Decoded *inst) {
+  Chunk *chunk = &fn->chunk;
+  bool wide = chunk->code[offset] == OP_WIDE;
+  size_t operand = offset + (wide ? 2 : 1);
+  size_t width = wide ? 3 : 1;
+
+  inst->op = operand <= chunk->size ? chunk->code[operand - 1] : OP_WIDE;
+  inst->length = 1;
+  inst->pops = 0;
+  inst->pushes = 0;
+  inst->slot = 0;
+  inst->target = -1;
+  if (operand > chunk->size || (wide && !constant_operand(inst->op)))
+    return false;
+
+  bool ok = true;
+  switch (inst->op) {
+  case OP_CONSTANT:
+    inst->length = operand - offset + width;
+    ok = inst->length <= chunk->size - offset &&
+         read_index(chunk, operand, wide) < chunk->constants.size;
+    inst->pushes = 1;
+    break;
+
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_CLASS:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_METHOD:
+  case OP_GET_SUPER:
+  case OP_GET_METHOD:
+  case OP_GET_SUPER_METHOD:
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_TAIL_SUPER_INVOKE: {
+    bool invoke = inst->op == OP_INVOKE || inst->op == OP_SUPER_INVOKE ||
+                  inst->op == OP_TAIL_INVOKE ||
+                  inst->op == OP_TAIL_SUPER_INVOKE;
+    inst->length = operand - offset + width + (invoke ? 1 : 0);
+    ok = inst->length <= chunk->size - offset &&
+         is_string_constant(chunk, read_index(chunk, operand, wide));
+    if (!ok)
+      break;
+
+    int arg_count = invoke ? chunk->code[offset + inst->length - 1] : 0;
+    switch (inst->op) {
+    case OP_DEFINE_GLOBAL:
+      inst->pops = 1;
+      break;
+    case OP_GET_GLOBAL:
+    case OP_CLASS:
+      inst->pushes = 1;
+      break;
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+      inst->pops = inst->pushes = 1;
+      break;
+    case OP_GET_METHOD:
+      inst->pops = 1;
+      inst->pushes = 2;
+      break;
+    case OP_GET_SUPER_METHOD:
+      inst->pops = inst->pushes = 2;
+      break;
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+      inst->pops = arg_count + 1;
+      inst->pushes = 1;
+      break;
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+      inst->pops = arg_count + 2;
+      inst->pushes = 1;
+      break;
+    default:
+      inst->pops = 2;
+      inst->pushes = 1;
+      break;
+    }
+    break;
+  }
+
+  case OP_CLOSURE: {
+    ok = operand - offset + width <= chunk->size - offset;
+    size_t index = ok ? read_index(chunk, operand, wide) : 0;
+    ok = ok && index < chunk->constants.size &&
+         is_function(chunk->constants.values[index]);
+    if (!ok)
+      break;
+
+    // a local function may capture its own slot, the one pushed here
+    ObjFunction *inner = as_function(chunk->constants.values[index]);
+    inst->length = operand - offset + width + 2 * inner->upvalue_count;
+    inst->pushes = 1;
+    ok = inst->length <= chunk->size - offset;
+    size_t captures = offset + inst->length - 2 * inner->upvalue_count;
+    for (int i = 0; ok && i < inner->upvalue_count; ++i) {
+      uint8_t flags = chunk->code[captures + 2 * i];
+      uint8_t slot = chunk->code[captures + 2 * i + 1];
+      ok = (flags & ~(CAPTURE_LOCAL | CAPTURE_FLAT)) == 0;
+      if (flags & CAPTURE_LOCAL) {
+        inst->slot = slot > inst->slot ? slot : inst->slot;
+      } else {
+        ok = ok && slot < fn->upvalue_count;
+      }
+    }
+    break;
+  }
+
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_FLAT_UPVALUE:
+    inst->length = 2;
+    ok = inst->length <= chunk->size - offset &&
+         chunk->code[offset + 1] < fn->upvalue_count;
+    inst->pops = inst->op == OP_SET_UPVALUE ? 1 : 0;
+    inst->pushes = 1;
+    break;
+
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+    inst->length = 2;
+    ok = inst->length <= chunk->size - offset;
+    inst->slot = ok ? chunk->code[offset + 1] : 0;
+    inst->pops = inst->op == OP_SET_LOCAL ? 1 : 0;
+    inst->pushes = 1;
+    break;
+
+  // the local and the method in the slot after it
+  case OP_BIND_LOCAL:
+    inst->length = 2;
+    ok = inst->length <= chunk->size - offset;
+    inst->slot = ok ? chunk->code[offset + 1] + 1 : 0;
+    inst->pushes = 1;
+    break;
+
+  case OP_BUILD_LIST:
+    inst->length = 2;
+    ok = inst->length <= chunk->size - offset;
+    inst->pops = ok ? chunk->code[offset + 1] : 0;
+    inst->pushes = 1;
+    break;
+
+  case OP_CALL_INTRINSIC:
+    inst->length = 3;
+    ok = inst->length <= chunk->size - offset &&
+         chunk->code[offset + 2] < INTRINSIC_COUNT;
+    inst->pops = ok ? chunk->code[offset + 1] + 1 : 0;
+    inst->pushes = 1;
+    break;
+
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_CALL_METHOD:
+    inst->length = 2;
+    ok = inst->length <= chunk->size - offset;
+    if (ok) {
+      inst->pops =
+          chunk->code[offset + 1] + (inst->op == OP_CALL_METHOD ? 2 : 1);
+    }
+    inst->pushes = 1;
+    break;
+
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+  case OP_LOOP:
+  case OP_JUMP: {
+    inst->length = 4;
+    ok = inst->length <= chunk->size - offset;
+    if (!ok)
+      break;
+
+    // a jump lands on an instruction, never on the end of the code
+    size_t jump = read_index(chunk, offset + 1, true);
+    size_t next = offset + inst->length;
+    if (inst->op == OP_LOOP) {
+      ok = jump <= next;
+      inst->target = ok ? (int)(next - jump) : -1;
+    } else {
+      ok = jump < chunk->size - next;
+      inst->target = ok ? (int)(next + jump) : -1;
+    }
+    if (inst->op != OP_LOOP && inst->op != OP_JUMP) {
+      inst->pops = inst->pushes = 1;
+    }
+    break;
+  }
+
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+    inst->pushes = 1;
+    break;
+
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+  case OP_INHERIT:
+  case OP_INDEX_GET:
+    inst->pops = 2;
+    inst->pushes = 1;
+    break;
+
+  case OP_INDEX_SET:
+    inst->pops = 3;
+    inst->pushes = 1;
+    break;
+
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_NEGATE_NUM:
+    inst->pops = inst->pushes = 1;
+    break;
+
+  case OP_RETURN:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_CLOSE_UPVALUE:
+    inst->pops = 1;
+    break;
+
+  // the optimizing tier's instructions never reach a file
+  default:
+    ok = false;
+    break;
+  }
+
+  return ok;
+}
+
+bool constant_operand(uint8_t op) {
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_CLASS:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_METHOD:
+  case OP_GET_SUPER:
+  case OP_GET_METHOD:
+  case OP_GET_SUPER_METHOD:
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+  case OP_CLOSURE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool is_string_constant(Chunk *chunk, size_t index) {
+  return index < chunk->constants.size &&
+         is_string(chunk->constants.values[index]);
+}
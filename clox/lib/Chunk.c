@@ -1,5 +1,7 @@
 #include "Chunk.h"
 #include "Memory.h"
+#include "Object.h"
+#include "Opcode.h"
 #include "VM.h"
 #include <stdlib.h>
 
@@ -9,13 +11,15 @@ void init_chunk(Chunk *chunk)
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
   init_value_array(&chunk->constants);
 }
 
 void free_chunk(VM *vm, Chunk *chunk)
 {
   free_array(vm, sizeof(uint8_t), chunk->code, chunk->capacity);
-  free_array(vm, sizeof(int), chunk->lines, chunk->capacity);
+  free_array(vm, sizeof(LineRun), chunk->lines, chunk->line_capacity);
   free_value_array(vm, &chunk->constants);
   init_chunk(chunk);
 }
@@ -28,15 +32,74 @@ void write_chunk(VM *vm, Chunk *chunk, uint8_t byte, int line)
     chunk->capacity = grow_capacity(old_capacity);
     chunk->code =
         grow_array(vm, chunk->code, sizeof(uint8_t), old_capacity, chunk->capacity);
-    chunk->lines =
-        grow_array(vm, chunk->lines, sizeof(int), old_capacity, chunk->capacity);
   }
 
+  add_line(vm, chunk, chunk->size, line);
   chunk->code[chunk->size] = byte;
-  chunk->lines[chunk->size] = line;
   ++chunk->size;
 }
 
+// Offsets must come in increasing order, a byte on the line of the last run
+// just extends it.
+void add_line(VM *vm, Chunk *chunk, size_t offset, int line)
+{
+  if (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].line == line)
+  {
+    return;
+  }
+
+  if (chunk->line_capacity <= chunk->line_count)
+  {
+    int old_capacity = chunk->line_capacity;
+    chunk->line_capacity = grow_capacity(old_capacity);
+    chunk->lines = grow_array(vm, chunk->lines, sizeof(LineRun), old_capacity,
+                              chunk->line_capacity);
+  }
+
+  chunk->lines[chunk->line_count].offset = (int)offset;
+  chunk->lines[chunk->line_count].line = line;
+  ++chunk->line_count;
+}
+
+// Only runtime errors and the disassembler ask, so a binary search over the
+// runs is fast enough.
+int get_line(Chunk *chunk, size_t offset)
+{
+  int low = 0;
+  int high = chunk->line_count - 1;
+  while (low < high)
+  {
+    int middle = low + (high - low + 1) / 2;
+    if ((size_t)chunk->lines[middle].offset <= offset)
+    {
+      low = middle;
+    }
+    else
+    {
+      high = middle - 1;
+    }
+  }
+
+  return chunk->line_count > 0 ? chunk->lines[low].line : 0;
+}
+
+// Gives back the room left by doubling once a chunk is done growing.
+void shrink_chunk(VM *vm, Chunk *chunk)
+{
+  chunk->code = grow_array(vm, chunk->code, sizeof(uint8_t), chunk->capacity,
+                           chunk->size);
+  chunk->capacity = chunk->size;
+
+  chunk->lines = grow_array(vm, chunk->lines, sizeof(LineRun),
+                            chunk->line_capacity, chunk->line_count);
+  chunk->line_capacity = chunk->line_count;
+
+  ValueArray *constants = &chunk->constants;
+  constants->values = grow_array(vm, constants->values, sizeof(Value),
+                                 constants->capacity, constants->size);
+  constants->capacity = constants->size;
+}
+
 size_t add_constant(VM *vm, Chunk *chunk, Value value)
 {
   push(vm, value);
@@ -44,3 +107,87 @@ size_t add_constant(VM *vm, Chunk *chunk, Value value)
   pop(vm);
   return chunk->constants.size - 1;
 }
+
+size_t read_index(Chunk *chunk, size_t offset, bool wide)
+{
+  if (!wide)
+  {
+    return chunk->code[offset];
+  }
+
+  return ((size_t)chunk->code[offset] << 16) |
+         ((size_t)chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+size_t instruction_length(Chunk *chunk, size_t offset)
+{
+  uint8_t inst = chunk->code[offset];
+  size_t prefix = 0;
+  size_t index = 1;
+
+  if (inst == OP_WIDE)
+  {
+    prefix = 1;
+    index = 3;
+    inst = chunk->code[offset + 1];
+  }
+
+  switch (inst)
+  {
+  case OP_CONSTANT:
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_CLASS:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_METHOD:
+  case OP_GET_SUPER:
+  case OP_GET_METHOD:
+  case OP_GET_SUPER_METHOD:
+    return prefix + 1 + index;
+
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return prefix + 2 + index;
+
+  case OP_CLOSURE:
+  {
+    size_t constant = read_index(chunk, offset + prefix + 1, prefix != 0);
+    ObjFunction *fn = as_function(chunk->constants.values[constant]);
+    return prefix + 1 + index + 2 * fn->upvalue_count;
+  }
+
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_FLAT_UPVALUE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_INLINE_RETURN:
+  case OP_CALL_METHOD:
+  case OP_BUILD_LIST:
+  case OP_BIND_LOCAL:
+    return 2;
+
+  case OP_LOOP:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+    return 4;
+
+  // argument count and intrinsic
+  case OP_CALL_INTRINSIC:
+    return 3;
+
+  // jump, argument count and the inlined function's constant
+  case OP_JUMP_IF_CALLEE:
+    return 6;
+
+  default:
+    return 1;
+  }
+}
@@ -1,9 +1,11 @@
 #include "Compiler.h"
 #include "Memory.h"
+#include "Natives.h"
 #include "Object.h"
 #include "Opcode.h"
 #include "Parser.h"
 #include "Scanner.h"
+#include "Ssa.h"
 #include "VM.h"
 #include <stdlib.h>
 #include <string.h>
@@ -14,25 +16,114 @@
 
 static Chunk *current_chunk(Compiler *compiler) { return &compiler->fn->chunk; }
 
+static uint32_t hash_constant(Value value);
+static bool constants_equal(Value a, Value b);
+static ConstantEntry *find_constant(ConstantEntry *entries, int capacity,
+                                    Value value);
+static void cache_constant(Compiler *compiler, Value value, int index);
+static void note_constant(Compiler *compiler, size_t start, Value value);
+static bool ends_with_constant(Compiler *compiler, size_t *start,
+                               Value *value);
+static void replace_with_constant(Compiler *compiler, size_t start,
+                                  Value value);
+static bool fold_unary(TokenType op, Value a, Value *res);
+static bool fold_binary(TokenType op, Value a, Value b, Value *res);
+static int new_number_local(Compiler *compiler);
+static void note_number(Compiler *compiler, NumberDeps *deps);
+static bool ends_with_number(Compiler *compiler, NumberDeps *deps);
+static bool merge_deps(NumberDeps *into, NumberDeps *from);
+static bool deps_hold(Compiler *compiler, NumberDeps *deps);
+static void add_number_constraint(Compiler *compiler, int local,
+                                  NumberDeps *deps);
+static void add_number_check(Compiler *compiler, size_t offset, uint8_t op,
+                             NumberDeps *deps);
+static void resolve_number_checks(Compiler *compiler);
+static void note_property(Compiler *compiler, size_t start, int name);
+static void keep_unbound(Compiler *compiler);
+static void emit_invoke(Compiler *compiler, uint8_t op, int name,
+                        uint8_t arg_count);
+static void note_assigned_upvalue(Compiler *compiler, int index);
+static void add_capture(Compiler *compiler, int local, ObjFunction *fn,
+                        int index);
+static void resolve_captures(Compiler *compiler);
+static void flatten_upvalue(ObjFunction *fn, int index);
+static void *grow_temporary(Compiler *compiler, void *array,
+                            size_t element_size, int old_capacity,
+                            int new_capacity);
+static void reserve_local(Compiler *compiler);
+static void free_temporaries(Compiler *compiler);
+static void emit_closure(Compiler *compiler, Compiler *inner,
+                         ObjFunction *fn);
+static void setup_compiler(Compiler *compiler, Compiler *enclosing,
+                           Parser *parser, VM *vm, FunctionType type,
+                           ObjFunction *fn);
+static const char *keep_source(VM *vm, const char *src, size_t length);
+static void function_body(Compiler *compiler);
+static ObjFunction *preparse_function(Compiler *compiler);
+static void preparse_token(Compiler *compiler, Preparse *pre);
+static int preparse_header(Compiler *compiler, Preparse *pre,
+                           PreparseKind kind);
+static void preparse_block(Compiler *compiler, Preparse *pre,
+                           PreparseKind kind);
+static void preparse_local(Compiler *compiler, Preparse *pre);
+static PreparseKind preparse_class(Compiler *compiler, Preparse *pre);
+static void preparse_this(Compiler *compiler);
+static void preparse_name(Compiler *compiler, Token name);
+static int resolve_lazy_name(Compiler *compiler, Token *name);
+
 void init_compiler(Compiler *compiler, Compiler *enclosing, Parser *parser,
                    VM *vm, FunctionType type) {
+  setup_compiler(compiler, enclosing, parser, vm, type, new_function(vm));
+
+  if (type != TYPE_SCRIPT) {
+    compiler->fn->name =
+        copy_string(vm, parser->previous.start, parser->previous.length);
+  }
+}
+
+void setup_compiler(Compiler *compiler, Compiler *enclosing, Parser *parser,
+                    VM *vm, FunctionType type, ObjFunction *fn) {
   compiler->enclosing = enclosing;
   compiler->current_class =
       (enclosing == NULL) ? NULL : enclosing->current_class;
+  compiler->locals = NULL;
   compiler->local_count = 0;
+  compiler->local_capacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalue_capacity = 0;
   compiler->scope_depth = 0;
+  compiler->constants = NULL;
+  compiler->constant_count = 0;
+  compiler->constant_capacity = 0;
+  compiler->last_call = -1;
+  compiler->last_property = -1;
+  compiler->last_bind = -1;
+  compiler->last_intrinsic = -1;
+  compiler->last_constant_start = -1;
+  compiler->last_number_end = -1;
+  compiler->number_locals = NULL;
+  compiler->number_local_count = 0;
+  compiler->number_local_capacity = 0;
+  compiler->number_constraints = NULL;
+  compiler->number_constraint_count = 0;
+  compiler->number_constraint_capacity = 0;
+  compiler->number_checks = NULL;
+  compiler->number_check_count = 0;
+  compiler->number_check_capacity = 0;
+  compiler->assigned_locals = NULL;
+  compiler->captures = NULL;
+  compiler->capture_count = 0;
+  compiler->capture_capacity = 0;
+  compiler->mark = arena_mark(&parser->arena);
+  compiler->keep_temporaries = false;
   compiler->parser = parser;
   compiler->vm = vm;
-  compiler->fn = new_function(vm);
+  compiler->fn = fn;
   compiler->fn_type = type;
   // for GC
   compiler->vm->compiler = compiler;
 
-  if (type != TYPE_SCRIPT) {
-    compiler->fn->name =
-        copy_string(vm, parser->previous.start, parser->previous.length);
-  }
-
+  reserve_local(compiler);
   Local *local = &compiler->locals[compiler->local_count++];
   local->depth = 0;
   if (type != TYPE_FUNCTION) {
@@ -43,11 +134,17 @@ void init_compiler(Compiler *compiler, Compiler *enclosing, Parser *parser,
     local->name.length = 0;
   }
   local->is_captured = false;
+  local->unbound = false;
+  local->id = new_number_local(compiler);
 }
 
-ObjFunction *compile(VM *vm, const char *src) {
+ObjFunction *compile(VM *vm, const char *src, size_t length) {
+  if (vm->lazy) {
+    src = keep_source(vm, src, length);
+  }
+
   Scanner scanner;
-  init_scanner(&scanner, src);
+  init_scanner(&scanner, src, src + length);
 
   Parser parser;
   init_parser(&parser, &scanner);
@@ -63,9 +160,124 @@ ObjFunction *compile(VM *vm, const char *src) {
   }
 
   ObjFunction *fn = end_compiler(&compiler);
+  free_arena(&parser.arena);
   return parser.had_error ? NULL : fn;
 }
 
+// Compiles the body of a function pre-parsed in lazy mode where the
+// declaration left off, returns false once a syntax error in it is reported.
+bool compile_lazy(VM *vm, ObjFunction *fn) {
+  LazyFunction *lazy = fn->lazy;
+
+  Scanner scanner;
+  init_scanner(&scanner, lazy->start, lazy->end);
+  scanner.line = lazy->line;
+
+  Parser parser;
+  init_parser(&parser, &scanner);
+
+  // only whether there is a class and a superclass matters to the body
+  ClassCompiler class_compiler;
+  class_compiler.name = synthetic_token("");
+  class_compiler.has_superclass = lazy->has_superclass;
+  class_compiler.enclosing = NULL;
+
+  Compiler compiler;
+  setup_compiler(&compiler, NULL, &parser, vm, (FunctionType)lazy->type, fn);
+  compiler.current_class = lazy->in_class ? &class_compiler : NULL;
+
+  fn->arity = 0;
+  advance(&compiler);
+  function_body(&compiler);
+  end_compiler(&compiler);
+  free_arena(&parser.arena);
+  vm->compiler = NULL;
+
+  if (parser.had_error)
+    return false;
+
+  fn->lazy = NULL;
+  for (int i = 0; i < fn->upvalue_count; ++i) {
+    if (lazy->names[i].flat) {
+      flatten_upvalue(fn, i);
+    }
+  }
+  free_lazy_function(vm, lazy);
+  return true;
+}
+
+// Lazy bodies are compiled long after the caller is done with the source, the
+// VM keeps a copy of it.
+const char *keep_source(VM *vm, const char *src, size_t length) {
+  char *copy = malloc(length + 1);
+  if (vm->source_count == vm->source_capacity) {
+    vm->source_capacity = vm->source_capacity < 8 ? 8 : vm->source_capacity * 2;
+    vm->sources = realloc(vm->sources, sizeof(char *) * vm->source_capacity);
+  }
+
+  if (copy == NULL || vm->sources == NULL) {
+    fprintf(stderr, "Out of memory keeping the source.\n");
+    exit(74);
+  }
+
+  memcpy(copy, src, length);
+  copy[length] = '\0';
+  vm->sources[vm->source_count++] = copy;
+  return copy;
+}
+
+// Compiler temporaries live on the parser's arena, they are not counted
+// towards the next collection. A function's go once it is emitted, so the
+// arena only ever holds those of the functions being compiled.
+void *grow_temporary(Compiler *compiler, void *array, size_t element_size,
+                     int old_capacity, int new_capacity) {
+  // an enclosing function resolving an upvalue for a nested one
+  for (Compiler *inner = compiler->vm->compiler; inner != compiler;
+       inner = inner->enclosing) {
+    inner->keep_temporaries = true;
+  }
+
+  return arena_grow(&compiler->parser->arena, array,
+                    element_size * old_capacity, element_size * new_capacity);
+}
+
+// Most functions have a handful of locals, the arrays start small.
+void reserve_local(Compiler *compiler) {
+  if (compiler->local_count < compiler->local_capacity)
+    return;
+
+  int capacity = compiler->local_capacity < 8 ? 8 : compiler->local_capacity * 2;
+  compiler->locals = grow_temporary(compiler, compiler->locals, sizeof(Local),
+                                    compiler->local_capacity, capacity);
+  compiler->local_capacity = capacity;
+}
+
+// The arrays only needed while the body is compiled, the large ones are given
+// back before the optimizer allocates its own.
+void free_temporaries(Compiler *compiler) {
+  Arena *arena = &compiler->parser->arena;
+  arena_free(arena, compiler->constants,
+             sizeof(ConstantEntry) * compiler->constant_capacity);
+  arena_free(arena, compiler->number_locals,
+             sizeof(bool) * compiler->number_local_capacity);
+  arena_free(arena, compiler->assigned_locals,
+             sizeof(bool) * compiler->number_local_capacity);
+  arena_free(arena, compiler->number_constraints,
+             sizeof(NumberConstraint) * compiler->number_constraint_capacity);
+  arena_free(arena, compiler->number_checks,
+             sizeof(NumberCheck) * compiler->number_check_capacity);
+  arena_free(arena, compiler->captures,
+             sizeof(Capture) * compiler->capture_capacity);
+  compiler->constants = NULL;
+  compiler->constant_count = 0;
+  compiler->constant_capacity = 0;
+  compiler->number_locals = NULL;
+  compiler->assigned_locals = NULL;
+  compiler->number_constraints = NULL;
+  compiler->number_checks = NULL;
+  compiler->captures = NULL;
+}
+
 void mark_compiler_roots(Compiler *compiler) {
   while (compiler != NULL) {
     mark_object(compiler->vm, (Obj *)compiler->fn);
@@ -73,13 +285,13 @@ void mark_compiler_roots(Compiler *compiler) {
   }
 }
 
-void define_variable(Compiler *compiler, uint8_t global) {
+void define_variable(Compiler *compiler, int global) {
   if (compiler->scope_depth > 0) {
     mark_initialized(compiler);
     return;
   }
 
-  emit_bytes(compiler, OP_DEFINE_GLOBAL, global);
+  emit_constant_op(compiler, OP_DEFINE_GLOBAL, global);
 }
 
 void declare_variable(Compiler *compiler) {
@@ -119,10 +331,13 @@ void add_local(Compiler *compiler, Token name) {
   if (compiler->local_count == UINT8_COUNT) {
     error(compiler, "Too many local variables in function.");
   } else {
+    reserve_local(compiler);
     Local *local = &compiler->locals[compiler->local_count++];
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
+    local->unbound = false;
+    local->id = new_number_local(compiler);
   }
 }
 
@@ -134,7 +349,10 @@ void end_scope(Compiler *compiler) {
   while (compiler->local_count > 0 &&
          compiler->locals[compiler->local_count - 1].depth >
              compiler->scope_depth) {
-    if (compiler->locals[compiler->local_count - 1].is_captured) {
+    // every assignment to the local is behind it, without one its closures
+    // hold copies of the value
+    Local *local = &compiler->locals[compiler->local_count - 1];
+    if (local->is_captured && compiler->assigned_locals[local->id]) {
       emit_byte(compiler, OP_CLOSE_UPVALUE);
     } else {
       emit_byte(compiler, OP_POP);
@@ -145,10 +363,11 @@ void end_scope(Compiler *compiler) {
 
 void emit_loop(Compiler *compiler, int loop_start) {
   emit_byte(compiler, OP_LOOP);
-  int offset = current_chunk(compiler)->size - loop_start + 2;
-  if (offset > UINT16_MAX)
+  int offset = current_chunk(compiler)->size - loop_start + 3;
+  if (offset > UINT24_MAX)
     error(compiler, "Loop body too large.");
 
+  emit_byte(compiler, (offset >> 16) & 0xff);
   emit_byte(compiler, (offset >> 8) & 0xff);
   emit_byte(compiler, offset & 0xff);
 }
@@ -164,26 +383,333 @@ void emit_bytes(Compiler *compiler, uint8_t byte1, uint8_t byte2) {
 }
 
 void emit_constant(Compiler *compiler, Value value) {
-  emit_bytes(compiler, OP_CONSTANT, make_constant(compiler, value));
+  size_t start = current_chunk(compiler)->size;
+  emit_constant_op(compiler, OP_CONSTANT, make_constant(compiler, value));
+  note_constant(compiler, start, value);
+}
+
+void note_constant(Compiler *compiler, size_t start, Value value) {
+  compiler->last_constant_start = (int)start;
+  compiler->last_constant_end = current_chunk(compiler)->size;
+  compiler->last_constant = value;
+
+  if (is_number(value)) {
+    NumberDeps deps = {0};
+    note_number(compiler, &deps);
+  }
+}
+
+bool ends_with_constant(Compiler *compiler, size_t *start, Value *value) {
+  if (compiler->last_constant_start == -1 ||
+      compiler->last_constant_end != current_chunk(compiler)->size)
+    return false;
+
+  *start = compiler->last_constant_start;
+  *value = compiler->last_constant;
+  return true;
+}
+
+// Drops the operand loads from start onwards and pushes the folded value in
+// their place. The operands stay in the constant pool.
+void replace_with_constant(Compiler *compiler, size_t start, Value value) {
+  current_chunk(compiler)->size = start;
+  compiler->last_number_end = -1;
+
+  if (is_nil(value)) {
+    emit_byte(compiler, OP_NIL);
+    note_constant(compiler, start, value);
+  } else if (is_bool(value)) {
+    emit_byte(compiler, as_bool(value) ? OP_TRUE : OP_FALSE);
+    note_constant(compiler, start, value);
+  } else {
+    emit_constant(compiler, value);
+  }
+}
+
+// Folding only happens when the operation cannot fail, anything that would
+// be a runtime error is left for the VM to report.
+bool fold_unary(TokenType op, Value a, Value *res) {
+  switch (op) {
+  case TOKEN_MINUS:
+    if (!is_number(a))
+      return false;
+    *res = number_val(-as_number(a));
+    return true;
+  case TOKEN_BANG:
+    *res = bool_val(is_falsey(a));
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool fold_binary(TokenType op, Value a, Value b, Value *res) {
+  switch (op) {
+  case TOKEN_EQUAL_EQUAL:
+    *res = bool_val(is_equal(a, b));
+    return true;
+  case TOKEN_BANG_EQUAL:
+    *res = bool_val(!is_equal(a, b));
+    return true;
+  default:
+    break;
+  }
+
+  if (!is_number(a) || !is_number(b))
+    return false;
+
+  switch (op) {
+  case TOKEN_PLUS:
+    *res = add(a, b);
+    return true;
+  case TOKEN_MINUS:
+    *res = subtract(a, b);
+    return true;
+  case TOKEN_STAR:
+    *res = multiply(a, b);
+    return true;
+  case TOKEN_SLASH:
+    *res = divide(a, b);
+    return true;
+  case TOKEN_GREATER:
+    *res = greater(a, b);
+    return true;
+  case TOKEN_GREATER_EQUAL:
+    *res = bool_val(!as_bool(less(a, b)));
+    return true;
+  case TOKEN_LESS:
+    *res = less(a, b);
+    return true;
+  case TOKEN_LESS_EQUAL:
+    *res = bool_val(!as_bool(greater(a, b)));
+    return true;
+  default:
+    return false;
+  }
+}
+
+int new_number_local(Compiler *compiler) {
+  if (compiler->number_local_count == compiler->number_local_capacity) {
+    int old_capacity = compiler->number_local_capacity;
+    compiler->number_local_capacity = grow_capacity(old_capacity);
+    compiler->number_locals =
+        grow_temporary(compiler, compiler->number_locals, sizeof(bool),
+                       old_capacity, compiler->number_local_capacity);
+    compiler->assigned_locals =
+        grow_temporary(compiler, compiler->assigned_locals, sizeof(bool),
+                       old_capacity, compiler->number_local_capacity);
+  }
+
+  compiler->number_locals[compiler->number_local_count] = false;
+  compiler->assigned_locals[compiler->number_local_count] = false;
+  return compiler->number_local_count++;
+}
+
+void note_number(Compiler *compiler, NumberDeps *deps) {
+  compiler->last_number_end = current_chunk(compiler)->size;
+  compiler->last_number = *deps;
+}
+
+bool ends_with_number(Compiler *compiler, NumberDeps *deps) {
+  if (compiler->last_number_end == -1 ||
+      (size_t)compiler->last_number_end != current_chunk(compiler)->size)
+    return false;
+
+  *deps = compiler->last_number;
+  return true;
+}
+
+// Fails when the union no longer fits, the value is then treated as
+// possibly not a number.
+bool merge_deps(NumberDeps *into, NumberDeps *from) {
+  for (int i = 0; i < from->count; ++i) {
+    bool found = false;
+    for (int j = 0; j < into->count && !found; ++j) {
+      found = into->locals[j] == from->locals[i];
+    }
+
+    if (!found) {
+      if (into->count == NUMBER_DEPS_MAX)
+        return false;
+      into->locals[into->count++] = from->locals[i];
+    }
+  }
+  return true;
+}
+
+bool deps_hold(Compiler *compiler, NumberDeps *deps) {
+  for (int i = 0; i < deps->count; ++i) {
+    if (!compiler->number_locals[deps->locals[i]])
+      return false;
+  }
+  return true;
+}
+
+void add_number_constraint(Compiler *compiler, int local, NumberDeps *deps) {
+  if (deps->count == 0)
+    return;
+
+  if (compiler->number_constraint_count ==
+      compiler->number_constraint_capacity) {
+    int old_capacity = compiler->number_constraint_capacity;
+    compiler->number_constraint_capacity = grow_capacity(old_capacity);
+    compiler->number_constraints = grow_temporary(
+        compiler, compiler->number_constraints, sizeof(NumberConstraint),
+        old_capacity, compiler->number_constraint_capacity);
+  }
+
+  NumberConstraint *constraint =
+      &compiler->number_constraints[compiler->number_constraint_count++];
+  constraint->local = local;
+  constraint->deps = *deps;
+}
+
+void add_number_check(Compiler *compiler, size_t offset, uint8_t op,
+                      NumberDeps *deps) {
+  if (compiler->number_check_count == compiler->number_check_capacity) {
+    int old_capacity = compiler->number_check_capacity;
+    compiler->number_check_capacity = grow_capacity(old_capacity);
+    compiler->number_checks =
+        grow_temporary(compiler, compiler->number_checks, sizeof(NumberCheck),
+                       old_capacity, compiler->number_check_capacity);
+  }
+
+  NumberCheck *check = &compiler->number_checks[compiler->number_check_count++];
+  check->offset = offset;
+  check->op = op;
+  check->deps = *deps;
+}
+
+// Every local starts out trusted if it was declared with a number and loses
+// that as soon as one of the values stored into it might not be one. What
+// is left once nothing changes only ever holds numbers, so the checks on
+// them can go. The unchecked opcodes have the same size as the checked
+// ones, they are patched in place.
+void resolve_number_checks(Compiler *compiler) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < compiler->number_constraint_count; ++i) {
+      NumberConstraint *constraint = &compiler->number_constraints[i];
+      if (compiler->number_locals[constraint->local] &&
+          !deps_hold(compiler, &constraint->deps)) {
+        compiler->number_locals[constraint->local] = false;
+        changed = true;
+      }
+    }
+  }
+
+  Chunk *chunk = current_chunk(compiler);
+  for (int i = 0; i < compiler->number_check_count; ++i) {
+    NumberCheck *check = &compiler->number_checks[i];
+    if (check->offset < chunk->size && deps_hold(compiler, &check->deps)) {
+      chunk->code[check->offset] = check->op;
+    }
+  }
+}
+
+void add_capture(Compiler *compiler, int local, ObjFunction *fn, int index) {
+  if (compiler->capture_count == compiler->capture_capacity) {
+    int old_capacity = compiler->capture_capacity;
+    compiler->capture_capacity = grow_capacity(old_capacity);
+    compiler->captures =
+        grow_temporary(compiler, compiler->captures, sizeof(Capture),
+                       old_capacity, compiler->capture_capacity);
+  }
+
+  Capture *capture = &compiler->captures[compiler->capture_count++];
+  capture->offset = current_chunk(compiler)->size;
+  capture->local = local;
+  capture->fn = fn;
+  capture->index = index;
+}
+
+// A local that is never assigned holds the same value from the moment it is
+// captured on, closures can keep that value instead of sharing a box. The
+// flags have been emitted long before this is known, they are patched in
+// place together with the reads in the closures' functions.
+void resolve_captures(Compiler *compiler) {
+  Chunk *chunk = current_chunk(compiler);
+  for (int i = 0; i < compiler->capture_count; ++i) {
+    Capture *capture = &compiler->captures[i];
+    if (!compiler->assigned_locals[capture->local]) {
+      chunk->code[capture->offset] |= CAPTURE_FLAT;
+      flatten_upvalue(capture->fn, capture->index);
+    }
+  }
+}
+
+// Reads of upvalue index in fn become flat reads, and the closures fn makes
+// copy it flat in turn. A body not compiled yet gets them once it is.
+void flatten_upvalue(ObjFunction *fn, int index) {
+  if (fn->lazy != NULL) {
+    fn->lazy->names[index].flat = true;
+    return;
+  }
+
+  Chunk *chunk = &fn->chunk;
+  for (size_t offset = 0; offset < chunk->size;
+       offset += instruction_length(chunk, offset)) {
+    bool wide = chunk->code[offset] == OP_WIDE;
+    uint8_t op = chunk->code[offset + (wide ? 1 : 0)];
+
+    if (op == OP_GET_UPVALUE && chunk->code[offset + 1] == index) {
+      chunk->code[offset] = OP_GET_FLAT_UPVALUE;
+    } else if (op == OP_CLOSURE) {
+      size_t constant = read_index(chunk, offset + (wide ? 2 : 1), wide);
+      ObjFunction *inner = as_function(chunk->constants.values[constant]);
+      size_t captures = offset + instruction_length(chunk, offset) -
+                        2 * inner->upvalue_count;
+
+      for (int k = 0; k < inner->upvalue_count; ++k) {
+        uint8_t *flags = &chunk->code[captures + 2 * k];
+        if (!(*flags & CAPTURE_LOCAL) &&
+            chunk->code[captures + 2 * k + 1] == index) {
+          *flags |= CAPTURE_FLAT;
+          flatten_upvalue(inner, k);
+        }
+      }
+    }
+  }
+}
+
+void emit_constant_op(Compiler *compiler, uint8_t op, int index) {
+  if (index <= UINT8_MAX) {
+    emit_bytes(compiler, op, (uint8_t)index);
+  } else {
+    emit_bytes(compiler, OP_WIDE, op);
+    emit_byte(compiler, (index >> 16) & 0xff);
+    emit_byte(compiler, (index >> 8) & 0xff);
+    emit_byte(compiler, index & 0xff);
+  }
 }
 
 void patch_jump(Compiler *compiler, int offset) {
-  // -2 for bytecode for jump offset
-  int jmp = current_chunk(compiler)->size - offset - 2;
+  // -3 for bytecode for jump offset
+  int jmp = current_chunk(compiler)->size - offset - 3;
 
-  if (jmp > UINT8_MAX) {
+  if (jmp > UINT24_MAX) {
     error(compiler, "Too much code to jump over.");
   }
 
-  current_chunk(compiler)->code[offset] = (jmp >> 8) & 0xff;
-  current_chunk(compiler)->code[offset + 1] = jmp & 0xff;
+  // the jump lands after the last constant, so it no longer is the only
+  // thing pushing the value on top of the stack
+  compiler->last_constant_start = -1;
+  compiler->last_number_end = -1;
+  compiler->last_property = -1;
+  compiler->last_bind = -1;
+
+  current_chunk(compiler)->code[offset] = (jmp >> 16) & 0xff;
+  current_chunk(compiler)->code[offset + 1] = (jmp >> 8) & 0xff;
+  current_chunk(compiler)->code[offset + 2] = jmp & 0xff;
 }
 
 int emit_jump(Compiler *compiler, uint8_t inst) {
   emit_byte(compiler, inst);
   emit_byte(compiler, 0xff);
   emit_byte(compiler, 0xff);
-  return current_chunk(compiler)->size - 2;
+  emit_byte(compiler, 0xff);
+  return current_chunk(compiler)->size - 3;
 }
 
 void emit_return(Compiler *compiler) {
@@ -195,21 +721,140 @@ void emit_return(Compiler *compiler) {
   }
 }
 
-uint8_t make_constant(Compiler *compiler, Value value) {
+int make_constant(Compiler *compiler, Value value) {
+  // functions are unique per OP_CLOSURE, everything else may repeat
+  bool shareable = !is_function(value);
+
+  if (shareable && compiler->constant_count > 0) {
+    ConstantEntry *entry = find_constant(compiler->constants,
+                                         compiler->constant_capacity, value);
+    if (entry->index != -1) {
+      return entry->index;
+    }
+  }
+
   size_t index = add_constant(compiler->vm, current_chunk(compiler), value);
 
-  if (index > UINT8_MAX) {
+  if (index > UINT24_MAX) {
     error(compiler, "Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)index;
+  // the value is reachable from the chunk now, so growing the cache may
+  // safely trigger a collection
+  if (shareable) {
+    cache_constant(compiler, value, (int)index);
+  }
+
+  return (int)index;
+}
+
+uint32_t hash_constant(Value value) {
+  uint64_t bits = 0;
+
+  switch (value.type) {
+  case VAL_BOOL:
+    bits = as_bool(value) ? 1 : 2;
+    break;
+  case VAL_NIL:
+    bits = 3;
+    break;
+  case VAL_NUMBER: {
+    double number = as_number(value);
+    memcpy(&bits, &number, sizeof(bits));
+    break;
+  }
+  case VAL_OBJ:
+    bits = (uint64_t)(uintptr_t)as_object(value);
+    break;
+  }
+
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+bool constants_equal(Value a, Value b) {
+  if (a.type != b.type)
+    return false;
+
+  // compare numbers bitwise so that 0 and -0 stay distinct constants
+  if (is_number(a)) {
+    double x = as_number(a), y = as_number(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+
+  return is_equal(a, b);
+}
+
+ConstantEntry *find_constant(ConstantEntry *entries, int capacity,
+                             Value value) {
+  uint32_t mask = capacity - 1;
+  uint32_t index = hash_constant(value) & mask;
+
+  for (;;) {
+    ConstantEntry *entry = &entries[index];
+    if (entry->index == -1 || constants_equal(entry->value, value)) {
+      return entry;
+    }
+
+    index = (index + 1) & mask;
+  }
+}
+
+void cache_constant(Compiler *compiler, Value value, int index) {
+  if (compiler->constant_count + 1 >
+      compiler->constant_capacity * TABLE_MAX_LOAD) {
+    int capacity =
+        compiler->constant_capacity < 8 ? 8 : compiler->constant_capacity * 2;
+    ConstantEntry *entries =
+        grow_temporary(compiler, NULL, sizeof(ConstantEntry), 0, capacity);
+    for (int i = 0; i < capacity; ++i) {
+      entries[i].index = -1;
+    }
+
+    for (int i = 0; i < compiler->constant_capacity; ++i) {
+      ConstantEntry *entry = &compiler->constants[i];
+      if (entry->index != -1) {
+        *find_constant(entries, capacity, entry->value) = *entry;
+      }
+    }
+
+    arena_free(&compiler->parser->arena, compiler->constants,
+               sizeof(ConstantEntry) * compiler->constant_capacity);
+    compiler->constants = entries;
+    compiler->constant_capacity = capacity;
+  }
+
+  ConstantEntry *entry =
+      find_constant(compiler->constants, compiler->constant_capacity, value);
+  entry->value = value;
+  entry->index = index;
+  ++compiler->constant_count;
 }
 
 ObjFunction *end_compiler(Compiler *compiler) {
   emit_return(compiler);
   ObjFunction *fn = compiler->fn;
 
+  if (!compiler->parser->had_error) {
+    resolve_number_checks(compiler);
+    resolve_captures(compiler);
+  }
+  free_temporaries(compiler);
+
+  if (compiler->vm->peephole && !compiler->parser->had_error) {
+    peephole_optimize(current_chunk(compiler), &compiler->vm->peephole_stats);
+  }
+
+  if (compiler->vm->optimize_all && !compiler->parser->had_error) {
+    optimize_function(compiler->vm, fn, false);
+  }
+
+  // the chunk is done growing until the optimizing tier rewrites it
+  shrink_chunk(compiler->vm, current_chunk(compiler));
+
 #ifdef DEBUG_PRINT_CODE
   if (!compiler->parser->had_error) {
     disassemble_chunk(current_chunk(compiler), fn->name->chars, stderr);
@@ -249,10 +894,10 @@ void declaration(Compiler *compiler) {
 void class_declaration(Compiler *compiler) {
   consume(compiler, TOKEN_IDENTIFIER, "Expected class name.");
   Token name = compiler->parser->previous;
-  uint8_t name_constant = identifier_constant(compiler, &name);
+  int name_constant = identifier_constant(compiler, &name);
   declare_variable(compiler);
 
-  emit_bytes(compiler, OP_CLASS, name_constant);
+  emit_constant_op(compiler, OP_CLASS, name_constant);
   define_variable(compiler, name_constant);
 
   ClassCompiler class_compiler;
@@ -297,7 +942,7 @@ void class_declaration(Compiler *compiler) {
 
 void method(Compiler *compiler) {
   consume(compiler, TOKEN_IDENTIFIER, "Expected method name.");
-  uint8_t constant = identifier_constant(compiler, &compiler->parser->previous);
+  int constant = identifier_constant(compiler, &compiler->parser->previous);
   FunctionType type = TYPE_METHOD;
 
   if (compiler->parser->previous.length == 4 &&
@@ -306,11 +951,11 @@ void method(Compiler *compiler) {
   }
 
   function(compiler, type);
-  emit_bytes(compiler, OP_METHOD, constant);
+  emit_constant_op(compiler, OP_METHOD, constant);
 }
 
 void fun_declaration(Compiler *compiler) {
-  uint8_t global = parse_variable(compiler, "Expected function name.");
+  int global = parse_variable(compiler, "Expected function name.");
   mark_initialized(compiler);
   function(compiler, TYPE_FUNCTION);
   define_variable(compiler, global);
@@ -321,6 +966,58 @@ void function(Compiler *compiler, FunctionType type) {
   init_compiler(&ncompiler, compiler, compiler->parser, compiler->vm, type);
   compiler = &ncompiler;
 
+  ObjFunction *fn;
+  if (compiler->vm->lazy) {
+    fn = preparse_function(compiler);
+  } else {
+    function_body(compiler);
+    // get function created by compiler
+    fn = end_compiler(compiler);
+  }
+
+  // move back to the upper function
+  // as we may need to write upvalues
+  compiler = compiler->enclosing;
+  // for GC, set compiler as enclosing compiler
+  compiler->vm->compiler = compiler;
+  emit_closure(compiler, &ncompiler, fn);
+}
+
+// The upvalues of the finished inner function are copied off the arena before
+// its temporaries are released, the closure's operands then grow the
+// enclosing function's arrays.
+void emit_closure(Compiler *compiler, Compiler *inner, ObjFunction *fn) {
+  Upvalue upvalues[UINT8_COUNT];
+  if (fn->upvalue_count > 0) {
+    memcpy(upvalues, inner->upvalues, sizeof(Upvalue) * fn->upvalue_count);
+  }
+  if (!inner->keep_temporaries) {
+    arena_release(&compiler->parser->arena, inner->mark);
+  }
+
+  // a closure keeps the bound method, not the receiver
+  for (int i = 0; i < fn->upvalue_count; ++i) {
+    if (upvalues[i].is_local && compiler->locals[upvalues[i].index].unbound) {
+      emit_bytes(compiler, OP_BIND_LOCAL, upvalues[i].index);
+      emit_byte(compiler, OP_POP);
+    }
+  }
+
+  emit_constant_op(compiler, OP_CLOSURE,
+                   make_constant(compiler, object_val((Obj *)fn)));
+
+  for (int i = 0; i < fn->upvalue_count; ++i) {
+    if (upvalues[i].is_local) {
+      add_capture(compiler, compiler->locals[upvalues[i].index].id, fn, i);
+      emit_byte(compiler, CAPTURE_LOCAL);
+    } else {
+      emit_byte(compiler, 0);
+    }
+    emit_byte(compiler, upvalues[i].index);
+  }
+}
+
+void function_body(Compiler *compiler) {
   // a function starts a new scope
   begin_scope(compiler);
 
@@ -333,7 +1030,7 @@ void function(Compiler *compiler, FunctionType type) {
         error_at_current(compiler, "Cannot have more than 255 parameters.");
       }
 
-      uint8_t param = parse_variable(compiler, "Expected parameter name.");
+      int param = parse_variable(compiler, "Expected parameter name.");
       define_variable(compiler, param);
     } while (match(compiler, TOKEN_COMMA));
   }
@@ -342,41 +1039,309 @@ void function(Compiler *compiler, FunctionType type) {
   // body
   consume(compiler, TOKEN_LEFT_BRACE, "Expected '{' before function body.");
   block(compiler);
+}
 
-  // get function created by compiler
-  ObjFunction *fn = end_compiler(compiler);
+// Skips the parameters and body of a function, leaving them to compile_lazy.
+// Any name in the body an enclosing function declares is captured, which may
+// capture variables the body shadows but never misses one, and counts as
+// assigned when an assignment follows it. Errors that need no more than the
+// tokens and the scopes they open are reported right away, other syntax
+// errors only once the body is compiled.
+ObjFunction *preparse_function(Compiler *compiler) {
+  ObjFunction *fn = compiler->fn;
+  LazyFunction *lazy = allocate(compiler->vm, sizeof(LazyFunction), 1);
+  lazy->start = compiler->parser->current.start;
+  lazy->end = compiler->parser->scanner->end;
+  lazy->line = compiler->parser->current.line;
+  lazy->type = compiler->fn_type;
+  lazy->in_class = compiler->current_class != NULL;
+  lazy->has_superclass =
+      lazy->in_class && compiler->current_class->has_superclass;
+  lazy->names = NULL;
+  lazy->name_capacity = 0;
+  fn->lazy = lazy;
+
+  Preparse pre = {NULL, 0, 0, NULL, 0, 0};
+  fn->arity = preparse_header(compiler, &pre,
+                              compiler->fn_type == TYPE_INITIALIZER
+                                  ? PREPARSE_INITIALIZER
+                                  : PREPARSE_FUNCTION);
+  while (pre.depth > 0 && !check(compiler, TOKEN_EOF)) {
+    preparse_token(compiler, &pre);
+  }
 
-  // move back to the upper function
-  // as we may need to write upvalues
-  compiler = compiler->enclosing;
-  // for GC, set compiler as enclosing compiler
-  compiler->vm->compiler = compiler;
+  if (pre.depth > 0) {
+    consume(compiler, TOKEN_RIGHT_BRACE, "Expected '}' after block.");
+  }
 
-  emit_bytes(compiler, OP_CLOSURE,
-             make_constant(compiler, object_val((Obj *)fn)));
+  Arena *arena = &compiler->parser->arena;
+  arena_free(arena, pre.locals, sizeof(Token) * pre.local_capacity);
+  arena_free(arena, pre.blocks, sizeof(PreparseBlock) * pre.block_capacity);
+  free_temporaries(compiler);
+  return fn;
+}
 
-  for (int i = 0; i < fn->upvalue_count; ++i) {
-    // NOTE: compiler is the enclosing function for this function
-    // and we stored the upvalues inside this compiler
-    // write them out
-    emit_byte(compiler, ncompiler.upvalues[i].is_local ? 1 : 0);
-    emit_byte(compiler, ncompiler.upvalues[i].index);
+void preparse_token(Compiler *compiler, Preparse *pre) {
+  TokenType before = compiler->parser->previous.type;
+  advance(compiler);
+  Token *token = &compiler->parser->previous;
+
+  // a class body only holds methods
+  if (pre->blocks[pre->depth - 1].kind >= PREPARSE_CLASS) {
+    if (token->type == TOKEN_IDENTIFIER) {
+      bool init = token->length == 4 && memcmp(token->start, "init", 4) == 0;
+      preparse_header(compiler, pre,
+                      init ? PREPARSE_INITIALIZER : PREPARSE_FUNCTION);
+    } else if (token->type == TOKEN_RIGHT_BRACE) {
+      --pre->depth;
+    }
+    return;
+  }
+
+  switch (token->type) {
+  case TOKEN_LEFT_BRACE:
+    preparse_block(compiler, pre, PREPARSE_BLOCK);
+    break;
+
+  case TOKEN_RIGHT_BRACE:
+    pre->local_count = pre->blocks[--pre->depth].first_local;
+    break;
+
+  case TOKEN_VAR:
+    consume(compiler, TOKEN_IDENTIFIER, "Expected variable name.");
+    preparse_local(compiler, pre);
+    break;
+
+  // the loop variable has a scope to itself
+  case TOKEN_FOR:
+    if (match(compiler, TOKEN_LEFT_PAREN) && match(compiler, TOKEN_VAR)) {
+      consume(compiler, TOKEN_IDENTIFIER, "Expected variable name.");
+    }
+    break;
+
+  case TOKEN_FUN:
+    consume(compiler, TOKEN_IDENTIFIER, "Expected function name.");
+    preparse_local(compiler, pre);
+    preparse_header(compiler, pre, PREPARSE_FUNCTION);
+    break;
+
+  case TOKEN_CLASS: {
+    consume(compiler, TOKEN_IDENTIFIER, "Expected class name.");
+    preparse_local(compiler, pre);
+    PreparseKind kind = PREPARSE_CLASS;
+    if (match(compiler, TOKEN_LESS)) {
+      consume(compiler, TOKEN_IDENTIFIER, "Expected superclass name.");
+      preparse_name(compiler, compiler->parser->previous);
+      kind = PREPARSE_SUBCLASS;
+    }
+    consume(compiler, TOKEN_LEFT_BRACE, "Expected '{' before class body.");
+    preparse_block(compiler, pre, kind);
+    break;
+  }
+
+  case TOKEN_RETURN: {
+    int i = pre->depth - 1;
+    while (pre->blocks[i].kind == PREPARSE_BLOCK) {
+      --i;
+    }
+    if (pre->blocks[i].kind == PREPARSE_INITIALIZER &&
+        !check(compiler, TOKEN_SEMICOLON)) {
+      error(compiler, "Cannot return a value from an initialiser.");
+    }
+    break;
+  }
+
+  // only a variable, a property or an element can be assigned
+  case TOKEN_EQUAL:
+    if (before != TOKEN_IDENTIFIER && before != TOKEN_RIGHT_BRACKET) {
+      error(compiler, "Invalid assignment target.");
+    }
+    break;
+
+  case TOKEN_IDENTIFIER:
+    // a property name follows a dot
+    if (before != TOKEN_DOT) {
+      preparse_name(compiler, *token);
+    }
+    break;
+
+  case TOKEN_SUPER: {
+    PreparseKind kind = preparse_class(compiler, pre);
+    if (kind == PREPARSE_BLOCK) {
+      error(compiler, "Cannot use 'super' outside of a class.");
+    } else if (kind == PREPARSE_CLASS) {
+      error(compiler, "Cannot use 'super' in a class without a superclass.");
+    }
+
+    if (compiler->current_class != NULL) {
+      preparse_name(compiler, synthetic_token("super"));
+      preparse_this(compiler);
+    }
+    consume(compiler, TOKEN_DOT, "Expected '.' after 'super'.");
+    consume(compiler, TOKEN_IDENTIFIER, "Expected superclass method name.");
+    break;
+  }
+
+  case TOKEN_THIS:
+    if (preparse_class(compiler, pre) == PREPARSE_BLOCK) {
+      error(compiler, "Cannot use 'this' outside of a class.");
+    }
+    preparse_this(compiler);
+    break;
+
+  default:
+    break;
+  }
+}
+
+// Parses a function's parameters up to the brace that opens its body, and
+// returns how many there are.
+int preparse_header(Compiler *compiler, Preparse *pre, PreparseKind kind) {
+  preparse_block(compiler, pre, kind);
+
+  int arity = 0;
+  consume(compiler, TOKEN_LEFT_PAREN, "Expected '(' after function name.");
+  if (!check(compiler, TOKEN_RIGHT_PAREN)) {
+    do {
+      ++arity;
+      if (arity > 255) {
+        error_at_current(compiler, "Cannot have more than 255 parameters.");
+      }
+
+      consume(compiler, TOKEN_IDENTIFIER, "Expected parameter name.");
+      preparse_local(compiler, pre);
+    } while (match(compiler, TOKEN_COMMA));
+  }
+  consume(compiler, TOKEN_RIGHT_PAREN, "Expected ')' after parameters.");
+  consume(compiler, TOKEN_LEFT_BRACE, "Expected '{' before function body.");
+  return arity;
+}
+
+void preparse_block(Compiler *compiler, Preparse *pre, PreparseKind kind) {
+  if (pre->depth == pre->block_capacity) {
+    int capacity = pre->block_capacity < 8 ? 8 : pre->block_capacity * 2;
+    pre->blocks = grow_temporary(compiler, pre->blocks, sizeof(PreparseBlock),
+                                 pre->block_capacity, capacity);
+    pre->block_capacity = capacity;
+  }
+
+  pre->blocks[pre->depth].kind = kind;
+  pre->blocks[pre->depth].first_local = pre->local_count;
+  ++pre->depth;
+}
+
+// Declares the name just parsed in the innermost block.
+void preparse_local(Compiler *compiler, Preparse *pre) {
+  Token *name = &compiler->parser->previous;
+  if (name->type != TOKEN_IDENTIFIER)
+    return;
+
+  for (int i = pre->blocks[pre->depth - 1].first_local; i < pre->local_count;
+       ++i) {
+    if (identifiers_equal(name, &pre->locals[i])) {
+      error(compiler,
+            "Variable with this name already declared in this scope.");
+    }
+  }
+
+  if (pre->local_count == pre->local_capacity) {
+    int capacity = pre->local_capacity < 8 ? 8 : pre->local_capacity * 2;
+    pre->locals = grow_temporary(compiler, pre->locals, sizeof(Token),
+                                 pre->local_capacity, capacity);
+    pre->local_capacity = capacity;
+  }
+  pre->locals[pre->local_count++] = *name;
+}
+
+// A method's own slot zero is 'this', a function in one captures it.
+void preparse_this(Compiler *compiler) {
+  if (compiler->current_class != NULL && compiler->fn_type == TYPE_FUNCTION) {
+    preparse_name(compiler, synthetic_token("this"));
+  }
+}
+
+// The innermost class, PREPARSE_BLOCK outside of any.
+PreparseKind preparse_class(Compiler *compiler, Preparse *pre) {
+  for (int i = pre->depth - 1; i >= 0; --i) {
+    if (pre->blocks[i].kind >= PREPARSE_CLASS)
+      return pre->blocks[i].kind;
+  }
+
+  if (compiler->current_class == NULL)
+    return PREPARSE_BLOCK;
+  return compiler->current_class->has_superclass ? PREPARSE_SUBCLASS
+                                                 : PREPARSE_CLASS;
+}
+
+void preparse_name(Compiler *compiler, Token name) {
+  int index = resolve_upvalue(compiler, &name);
+  if (index == -1)
+    return;
+
+  LazyFunction *lazy = compiler->fn->lazy;
+  if (index == lazy->name_capacity) {
+    int capacity = lazy->name_capacity < 8 ? 8 : lazy->name_capacity * 2;
+    lazy->names = grow_array(compiler->vm, lazy->names, sizeof(LazyName),
+                             lazy->name_capacity, capacity);
+    lazy->name_capacity = capacity;
+  }
+
+  LazyName *entry = &lazy->names[index];
+  if (index == compiler->fn->upvalue_count - 1) {
+    entry->start = name.start;
+    entry->length = name.length;
+    entry->flat = false;
+  }
+
+  if (check(compiler, TOKEN_EQUAL)) {
+    note_assigned_upvalue(compiler, index);
   }
 }
 
 // 'var' ID ('=' expr)? ';'
 void var_declaration(Compiler *compiler) {
-  uint8_t global = parse_variable(compiler, "Expected variable name.");
+  int global = parse_variable(compiler, "Expected variable name.");
 
+  NumberDeps deps;
+  bool is_number = false;
+  bool unbound = false;
   if (match(compiler, TOKEN_EQUAL)) {
     expression(compiler);
+    is_number = ends_with_number(compiler, &deps);
+    unbound = compiler->scope_depth > 0 && compiler->last_property != -1 &&
+              compiler->last_property_end == current_chunk(compiler)->size &&
+              compiler->local_count < UINT8_COUNT;
   } else {
     emit_byte(compiler, OP_NIL);
   }
 
   consume(compiler, TOKEN_SEMICOLON,
           "Expected ';' after variable declaration.");
+
+  if (compiler->scope_depth > 0 && is_number) {
+    int id = compiler->locals[compiler->local_count - 1].id;
+    compiler->number_locals[id] = true;
+    add_number_constraint(compiler, id, &deps);
+  }
+
   define_variable(compiler, global);
+  if (unbound) {
+    keep_unbound(compiler);
+  }
+}
+
+// A local initialized with a method access, as in 'var f = object.method;',
+// holds on to the receiver and the method without binding them. The method
+// goes in a hidden local right after it. Calls through the local need no
+// bound method, any other read binds it once and leaves it bound.
+void keep_unbound(Compiler *compiler) {
+  uint8_t *op = &current_chunk(compiler)->code[compiler->last_property];
+  *op = *op == OP_GET_PROPERTY ? OP_GET_METHOD : OP_GET_SUPER_METHOD;
+  compiler->last_property = -1;
+
+  compiler->locals[compiler->local_count - 1].unbound = true;
+  add_local(compiler, synthetic_token(""));
+  mark_initialized(compiler);
 }
 
 void statement(Compiler *compiler) {
@@ -525,6 +1490,18 @@ void return_statement(Compiler *compiler) {
 
     expression(compiler);
     consume(compiler, TOKEN_SEMICOLON, "Expected ';' after return value.");
+
+    // a call that produces the return value reuses the caller's frame, the
+    // OP_RETURN stays for callees that do not push a frame and for jumps
+    // that land past the call
+    Chunk *chunk = current_chunk(compiler);
+    if (compiler->last_call != -1 && compiler->last_call_end == chunk->size) {
+      uint8_t *op = &chunk->code[compiler->last_call];
+      *op = *op == OP_CALL     ? OP_TAIL_CALL
+            : *op == OP_INVOKE ? OP_TAIL_INVOKE
+                               : OP_TAIL_SUPER_INVOKE;
+    }
+
     emit_byte(compiler, OP_RETURN);
   }
 }
@@ -570,10 +1547,30 @@ void unary(Compiler *compiler, bool can_assign) {
   // operand
   parse_precedence(compiler, PREC_UNARY);
 
+  size_t start;
+  Value operand, res;
+  if (ends_with_constant(compiler, &start, &operand) &&
+      fold_unary(op, operand, &res)) {
+    replace_with_constant(compiler, start, res);
+    return;
+  }
+
+  NumberDeps deps;
+  bool is_number = ends_with_number(compiler, &deps);
+
   switch (op) {
-  case TOKEN_MINUS:
+  case TOKEN_MINUS: {
+    if (is_number) {
+      add_number_check(compiler, current_chunk(compiler)->size,
+                       OP_NEGATE_NUM, &deps);
+    }
     emit_byte(compiler, OP_NEGATE);
+
+    // the result is a number, or the negation failed
+    NumberDeps result = {0};
+    note_number(compiler, &result);
     break;
+  }
   case TOKEN_BANG:
     emit_byte(compiler, OP_NOT);
     break;
@@ -585,10 +1582,42 @@ void unary(Compiler *compiler, bool can_assign) {
 void binary(Compiler *compiler, bool can_assign) {
   TokenType op = compiler->parser->previous.type;
 
+  size_t left_start, left_end = current_chunk(compiler)->size;
+  Value left;
+  bool left_constant = ends_with_constant(compiler, &left_start, &left);
+  NumberDeps deps, right_deps;
+  bool is_number = ends_with_number(compiler, &deps);
+
   // compile right operand
   ParseRule *rule = get_rule(op);
   parse_precedence(compiler, (Precedence)(rule->precedence + 1));
 
+  size_t right_start;
+  Value right, res;
+  if (left_constant && ends_with_constant(compiler, &right_start, &right) &&
+      right_start == left_end) {
+    if (op == TOKEN_PLUS && is_string(left) && is_string(right)) {
+      // operands are reachable from the constant pool while this allocates
+      push(compiler->vm, left);
+      push(compiler->vm, right);
+      concatenate(compiler->vm);
+      replace_with_constant(compiler, left_start, peek(compiler->vm, 0));
+      pop(compiler->vm);
+      return;
+    }
+
+    if (fold_binary(op, left, right, &res)) {
+      replace_with_constant(compiler, left_start, res);
+      return;
+    }
+  }
+
+  // both operands are numbers when everything either depends on is
+  is_number = is_number && ends_with_number(compiler, &right_deps) &&
+              merge_deps(&deps, &right_deps);
+  size_t offset = current_chunk(compiler)->size;
+  uint8_t unchecked;
+
   // emit op instruction
   switch (op) {
   case TOKEN_PLUS:
@@ -624,6 +1653,44 @@ void binary(Compiler *compiler, bool can_assign) {
   default:
     break;
   }
+
+  switch (op) {
+  case TOKEN_PLUS:
+    unchecked = OP_ADD_NUM;
+    break;
+  case TOKEN_MINUS:
+    unchecked = OP_SUBTRACT_NUM;
+    break;
+  case TOKEN_SLASH:
+    unchecked = OP_DIVIDE_NUM;
+    break;
+  case TOKEN_STAR:
+    unchecked = OP_MULTIPLY_NUM;
+    break;
+  case TOKEN_GREATER:
+  case TOKEN_LESS_EQUAL:
+    unchecked = OP_GREATER_NUM;
+    break;
+  case TOKEN_LESS:
+  case TOKEN_GREATER_EQUAL:
+    unchecked = OP_LESS_NUM;
+    break;
+  default:
+    return;
+  }
+
+  if (is_number) {
+    add_number_check(compiler, offset, unchecked, &deps);
+  }
+
+  // '+' yields a number from two numbers, the other arithmetic operators
+  // yield one or fail
+  if (op == TOKEN_PLUS && is_number) {
+    note_number(compiler, &deps);
+  } else if (op == TOKEN_MINUS || op == TOKEN_SLASH || op == TOKEN_STAR) {
+    NumberDeps result = {0};
+    note_number(compiler, &result);
+  }
 }
 
 void this_(Compiler *compiler, bool can_assign) {
@@ -643,41 +1710,126 @@ void super_(Compiler *compiler, bool can_assign) {
 
   consume(compiler, TOKEN_DOT, "Expected '.' after 'super'.");
   consume(compiler, TOKEN_IDENTIFIER, "Expected superclass method name.");
-  uint8_t name = identifier_constant(compiler, &compiler->parser->previous);
+  int name = identifier_constant(compiler, &compiler->parser->previous);
   named_variable(compiler, synthetic_token("this"), false);
 
   if (match(compiler, TOKEN_LEFT_PAREN)) {
     uint8_t arg_count = argument_list(compiler);
     named_variable(compiler, synthetic_token("super"), false);
-    emit_bytes(compiler, OP_SUPER_INVOKE, name);
-    emit_byte(compiler, arg_count);
+    emit_invoke(compiler, OP_SUPER_INVOKE, name, arg_count);
   } else {
     named_variable(compiler, synthetic_token("super"), false);
-    emit_bytes(compiler, OP_GET_SUPER, name);
+    size_t start = current_chunk(compiler)->size;
+    emit_constant_op(compiler, OP_GET_SUPER, name);
+    note_property(compiler, start, name);
   }
 }
 
+// Only a property right before the call can be its callee, as in
+// '(object.method)()', which then never binds the method.
 void call(Compiler *compiler, bool can_assign) {
+  Chunk *chunk = current_chunk(compiler);
+  if (compiler->last_bind != -1 && compiler->last_bind_end == chunk->size) {
+    uint8_t slot = chunk->code[compiler->last_bind + 1];
+    chunk->size = compiler->last_bind;
+    compiler->last_bind = -1;
+    emit_bytes(compiler, OP_GET_LOCAL, slot);
+    emit_bytes(compiler, OP_GET_LOCAL, slot + 1);
+    emit_bytes(compiler, OP_CALL_METHOD, argument_list(compiler));
+    return;
+  }
+
+  if (compiler->last_property != -1 &&
+      compiler->last_property_end == chunk->size) {
+    uint8_t *op = &chunk->code[compiler->last_property];
+    *op = *op == OP_GET_PROPERTY ? OP_GET_METHOD : OP_GET_SUPER_METHOD;
+    compiler->last_property = -1;
+    emit_bytes(compiler, OP_CALL_METHOD, argument_list(compiler));
+    return;
+  }
+
+  // the VM checks the callee is still the native before taking its place
+  int intrinsic = compiler->last_intrinsic_end == chunk->size
+                      ? compiler->last_intrinsic
+                      : -1;
   uint8_t arg_count = argument_list(compiler);
+  if (intrinsic != -1) {
+    emit_bytes(compiler, OP_CALL_INTRINSIC, arg_count);
+    emit_byte(compiler, (uint8_t)intrinsic);
+    return;
+  }
+
+  compiler->last_call = current_chunk(compiler)->size;
   emit_bytes(compiler, OP_CALL, arg_count);
+  compiler->last_call_end = current_chunk(compiler)->size;
+}
+
+// Notes an invoke about to be emitted as the last call, its opcode comes
+// after OP_WIDE when the name's constant needs one.
+void emit_invoke(Compiler *compiler, uint8_t op, int name,
+                 uint8_t arg_count) {
+  Chunk *chunk = current_chunk(compiler);
+  compiler->last_call = (int)chunk->size + (name > UINT8_MAX ? 1 : 0);
+  emit_constant_op(compiler, op, name);
+  emit_byte(compiler, arg_count);
+  compiler->last_call_end = chunk->size;
 }
 
 void dot(Compiler *compiler, bool can_assign) {
   consume(compiler, TOKEN_IDENTIFIER, "Expected property name after '.'.");
-  uint8_t name = identifier_constant(compiler, &compiler->parser->previous);
+  int name = identifier_constant(compiler, &compiler->parser->previous);
 
   if (can_assign && match(compiler, TOKEN_EQUAL)) {
     expression(compiler);
-    emit_bytes(compiler, OP_SET_PROPERTY, name);
+    emit_constant_op(compiler, OP_SET_PROPERTY, name);
   } else if (match(compiler, TOKEN_LEFT_PAREN)) {
     uint8_t arg_count = argument_list(compiler);
-    emit_bytes(compiler, OP_INVOKE, name);
-    emit_byte(compiler, arg_count);
+    emit_invoke(compiler, OP_INVOKE, name, arg_count);
+  } else {
+    size_t start = current_chunk(compiler)->size;
+    emit_constant_op(compiler, OP_GET_PROPERTY, name);
+    note_property(compiler, start, name);
+  }
+}
+
+void list(Compiler *compiler, bool can_assign) {
+  int count = 0;
+
+  if (!check(compiler, TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression(compiler);
+
+      if (count == 255) {
+        error(compiler, "Cannot have more than 255 elements in a list.");
+      }
+
+      ++count;
+    } while (match(compiler, TOKEN_COMMA));
+  }
+
+  consume(compiler, TOKEN_RIGHT_BRACKET, "Expected ']' after list elements.");
+  emit_bytes(compiler, OP_BUILD_LIST, (uint8_t)count);
+}
+
+void subscript(Compiler *compiler, bool can_assign) {
+  expression(compiler);
+  consume(compiler, TOKEN_RIGHT_BRACKET, "Expected ']' after index.");
+
+  if (can_assign && match(compiler, TOKEN_EQUAL)) {
+    expression(compiler);
+    emit_byte(compiler, OP_INDEX_SET);
   } else {
-    emit_bytes(compiler, OP_GET_PROPERTY, name);
+    emit_byte(compiler, OP_INDEX_GET);
   }
 }
 
+// Remembers the property access emitted from start on, its opcode follows
+// the OP_WIDE prefix of a wide name.
+void note_property(Compiler *compiler, size_t start, int name) {
+  compiler->last_property = (int)start + (name > UINT8_MAX ? 1 : 0);
+  compiler->last_property_end = current_chunk(compiler)->size;
+}
+
 uint8_t argument_list(Compiler *compiler) {
   uint8_t arg_count = 0;
 
@@ -698,7 +1850,8 @@ uint8_t argument_list(Compiler *compiler) {
 }
 
 void number(Compiler *compiler, bool can_assign) {
-  double value = strtod(compiler->parser->previous.start, NULL);
+  double value = parse_number(compiler->parser->previous.start,
+                              compiler->parser->previous.length);
   emit_constant(compiler, number_val(value));
 }
 
@@ -710,15 +1863,20 @@ void string(Compiler *compiler, bool can_assign) {
 }
 
 void literal(Compiler *compiler, bool can_assign) {
+  size_t start = current_chunk(compiler)->size;
+
   switch (compiler->parser->previous.type) {
   case TOKEN_NIL:
     emit_byte(compiler, OP_NIL);
+    note_constant(compiler, start, nil_val());
     break;
   case TOKEN_TRUE:
     emit_byte(compiler, OP_TRUE);
+    note_constant(compiler, start, bool_val(true));
     break;
   case TOKEN_FALSE:
     emit_byte(compiler, OP_FALSE);
+    note_constant(compiler, start, bool_val(false));
     break;
   default:
     break;
@@ -745,11 +1903,61 @@ void named_variable(Compiler *compiler, Token name, bool can_assign) {
     set_op = OP_SET_GLOBAL;
   }
 
+  // locals and upvalues are slot numbers, globals index the constant pool
+  bool is_global = get_op == OP_GET_GLOBAL;
+
+  // only locals are tracked, upvalues and globals may be changed by code the
+  // compiler cannot see from here
+  bool is_local = get_op == OP_GET_LOCAL;
+  int id = is_local ? compiler->locals[arg].id : -1;
+
   if (can_assign && match(compiler, TOKEN_EQUAL)) {
     expression(compiler);
-    emit_bytes(compiler, set_op, (uint8_t)arg);
+    NumberDeps deps;
+    bool is_number = ends_with_number(compiler, &deps);
+
+    if (is_global) {
+      emit_constant_op(compiler, set_op, arg);
+    } else {
+      emit_bytes(compiler, set_op, (uint8_t)arg);
+    }
+
+    // whatever the local holds now is called as it is
+    if (is_local && compiler->locals[arg].unbound) {
+      emit_byte(compiler, OP_NIL);
+      emit_bytes(compiler, OP_SET_LOCAL, (uint8_t)(arg + 1));
+      emit_byte(compiler, OP_POP);
+    }
+
+    if (is_local) {
+      compiler->assigned_locals[id] = true;
+    } else if (!is_global) {
+      note_assigned_upvalue(compiler, arg);
+    }
+
+    if (is_local && !is_number) {
+      compiler->number_locals[id] = false;
+    } else if (is_local) {
+      add_number_constraint(compiler, id, &deps);
+    }
+    if (is_number) {
+      note_number(compiler, &deps);
+    }
+  } else if (is_global) {
+    emit_constant_op(compiler, get_op, arg);
+    compiler->last_intrinsic = find_intrinsic(name.start, (size_t)name.length);
+    compiler->last_intrinsic_end = current_chunk(compiler)->size;
+  } else if (is_local && compiler->locals[arg].unbound) {
+    compiler->last_bind = (int)current_chunk(compiler)->size;
+    emit_bytes(compiler, OP_BIND_LOCAL, (uint8_t)arg);
+    compiler->last_bind_end = current_chunk(compiler)->size;
   } else {
     emit_bytes(compiler, get_op, (uint8_t)arg);
+
+    if (is_local && compiler->number_locals[id]) {
+      NumberDeps deps = {1, {id}};
+      note_number(compiler, &deps);
+    }
   }
 }
 
@@ -770,11 +1978,13 @@ int resolve_local(Compiler *compiler, Token *name) {
 
 int resolve_upvalue(Compiler *compiler, Token *name) {
   if (compiler->enclosing == NULL)
-    return -1;
+    return resolve_lazy_name(compiler, name);
 
   int local = resolve_local(compiler->enclosing, name);
   if (local != -1) {
-    compiler->enclosing->locals[local].is_captured = true;
+    Local *captured = &compiler->enclosing->locals[local];
+    captured->is_captured = true;
+    compiler->enclosing->number_locals[captured->id] = false;
     return add_upvalue(compiler, (uint8_t)local, true);
   }
 
@@ -786,6 +1996,39 @@ int resolve_upvalue(Compiler *compiler, Token *name) {
   return -1;
 }
 
+// Marks the local an upvalue ends up at, in whichever function declared it.
+void note_assigned_upvalue(Compiler *compiler, int index) {
+  // the pre-parse of a lazy body has seen its assignments
+  if (compiler->enclosing == NULL)
+    return;
+
+  Upvalue *upvalue = &compiler->upvalues[index];
+  Compiler *enclosing = compiler->enclosing;
+  if (upvalue->is_local) {
+    enclosing->assigned_locals[enclosing->locals[upvalue->index].id] = true;
+  } else {
+    note_assigned_upvalue(enclosing, upvalue->index);
+  }
+}
+
+// A lazily compiled body has no enclosing compiler, its upvalues are the
+// names the pre-parse resolved.
+int resolve_lazy_name(Compiler *compiler, Token *name) {
+  LazyFunction *lazy = compiler->fn->lazy;
+  if (lazy == NULL)
+    return -1;
+
+  for (int i = 0; i < compiler->fn->upvalue_count; ++i) {
+    LazyName *entry = &lazy->names[i];
+    if (entry->length == name->length &&
+        memcmp(entry->start, name->start, name->length) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
 int add_upvalue(Compiler *compiler, uint8_t index, bool is_local) {
   int upvalue_count = compiler->fn->upvalue_count;
 
@@ -801,12 +2044,21 @@ int add_upvalue(Compiler *compiler, uint8_t index, bool is_local) {
     return 0;
   }
 
+  if (upvalue_count == compiler->upvalue_capacity) {
+    int capacity =
+        compiler->upvalue_capacity < 8 ? 8 : compiler->upvalue_capacity * 2;
+    compiler->upvalues =
+        grow_temporary(compiler, compiler->upvalues, sizeof(Upvalue),
+                       compiler->upvalue_capacity, capacity);
+    compiler->upvalue_capacity = capacity;
+  }
+
   compiler->upvalues[upvalue_count].is_local = is_local;
   compiler->upvalues[upvalue_count].index = index;
   return compiler->fn->upvalue_count++;
 }
 
-uint8_t parse_variable(Compiler *compiler, const char *msg) {
+int parse_variable(Compiler *compiler, const char *msg) {
   consume(compiler, TOKEN_IDENTIFIER, msg);
   declare_variable(compiler);
   if (compiler->scope_depth > 0)
@@ -814,7 +2066,7 @@ uint8_t parse_variable(Compiler *compiler, const char *msg) {
   return identifier_constant(compiler, &compiler->parser->previous);
 }
 
-uint8_t identifier_constant(Compiler *compiler, Token *name) {
+int identifier_constant(Compiler *compiler, Token *name) {
   return make_constant(compiler, object_val((Obj *)copy_string(
                                      compiler->vm, name->start, name->length)));
 }
@@ -15,44 +15,60 @@ void disassemble_chunk(Chunk *chunk, const char *name, FILE *out) {
 size_t disassemble_instruction(Chunk *chunk, size_t offset, FILE *out) {
   fprintf(out, "%04ld ", offset);
 
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = get_line(chunk, offset);
+  if (offset > 0 && line == get_line(chunk, offset - 1)) {
     fprintf(out, "   | ");
   } else {
-    fprintf(out, "%4d ", chunk->lines[offset]);
+    fprintf(out, "%4d ", line);
   }
 
   uint8_t inst = chunk->code[offset];
+  bool wide = false;
+  if (inst == OP_WIDE) {
+    // the prefix widens the constant operand of the next instruction
+    fprintf(out, "OP_WIDE ");
+    wide = true;
+    inst = chunk->code[++offset];
+  }
+
   switch (inst) {
   case OP_CLASS:
-    return constant_instruction("OP_CLASS", chunk, offset, out);
+    return constant_instruction("OP_CLASS", chunk, offset, wide, out);
   case OP_GET_PROPERTY:
-    return constant_instruction("OP_GET_PROPERTY", chunk, offset, out);
+    return constant_instruction("OP_GET_PROPERTY", chunk, offset, wide, out);
   case OP_SET_PROPERTY:
-    return constant_instruction("OP_SET_PROPERTY", chunk, offset, out);
+    return constant_instruction("OP_SET_PROPERTY", chunk, offset, wide, out);
   case OP_METHOD:
-    return constant_instruction("OP_METHOD", chunk, offset, out);
+    return constant_instruction("OP_METHOD", chunk, offset, wide, out);
   case OP_CLOSURE: {
     ++offset;
-    uint8_t constant = chunk->code[offset++];
-    fprintf(out, "%-16s %4d ", "OP_CLOSURE", constant);
+    size_t constant = read_index(chunk, offset, wide);
+    offset += wide ? 3 : 1;
+    fprintf(out, "%-16s %4zu ", "OP_CLOSURE", constant);
     print_value(out, chunk->constants.values[constant]);
     fputc('\n', out);
 
     ObjFunction *function = as_function(chunk->constants.values[constant]);
     for (int j = 0; j < function->upvalue_count; ++j) {
-      int is_local = chunk->code[offset++];
+      int capture = chunk->code[offset++];
       int index = chunk->code[offset++];
-      fprintf(out, "%04ld      |                     %s %d\n", offset - 2,
-              is_local ? "local" : "upvalue", index);
+      fprintf(out, "%04ld      |                     %s%s %d\n", offset - 2,
+              capture & CAPTURE_FLAT ? "flat " : "",
+              capture & CAPTURE_LOCAL ? "local" : "upvalue", index);
     }
     return offset;
   }
   case OP_INVOKE:
-    return invoke_instruction("OP_INVOKE", chunk, offset, out);
+    return invoke_instruction("OP_INVOKE", chunk, offset, wide, out);
   case OP_GET_SUPER:
-    return constant_instruction("OP_GET_SUPER", chunk, offset, out);
+    return constant_instruction("OP_GET_SUPER", chunk, offset, wide, out);
   case OP_SUPER_INVOKE:
-    return invoke_instruction("OP_SUPER_INVOKE", chunk, offset, out);
+    return invoke_instruction("OP_SUPER_INVOKE", chunk, offset, wide, out);
+  case OP_TAIL_INVOKE:
+    return invoke_instruction("OP_TAIL_INVOKE", chunk, offset, wide, out);
+  case OP_TAIL_SUPER_INVOKE:
+    return invoke_instruction("OP_TAIL_SUPER_INVOKE", chunk, offset, wide,
+                              out);
   case OP_INHERIT:
     return simple_instruction("OP_INHERIT", offset, out);
   case OP_GET_UPVALUE:
@@ -62,11 +78,11 @@ size_t disassemble_instruction(Chunk *chunk, size_t offset, FILE *out) {
   case OP_CLOSE_UPVALUE:
     return simple_instruction("OP_CLOSE_UPVALUE", offset, out);
   case OP_DEFINE_GLOBAL:
-    return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset, out);
+    return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset, wide, out);
   case OP_GET_GLOBAL:
-    return constant_instruction("OP_GET_GLOBAL", chunk, offset, out);
+    return constant_instruction("OP_GET_GLOBAL", chunk, offset, wide, out);
   case OP_SET_GLOBAL:
-    return constant_instruction("OP_SET_GLOBAL", chunk, offset, out);
+    return constant_instruction("OP_SET_GLOBAL", chunk, offset, wide, out);
   case OP_GET_LOCAL:
     return byte_instruction("OP_GET_LOCAL", chunk, offset, out);
   case OP_SET_LOCAL:
@@ -79,12 +95,16 @@ size_t disassemble_instruction(Chunk *chunk, size_t offset, FILE *out) {
     return jump_instruction("OP_JUMP", 1, chunk, offset, out);
   case OP_JUMP_IF_FALSE:
     return jump_instruction("OP_JUMP_IF_ELSE", 1, chunk, offset, out);
+  case OP_JUMP_IF_TRUE:
+    return jump_instruction("OP_JUMP_IF_TRUE", 1, chunk, offset, out);
   case OP_CALL:
     return byte_instruction("OP_CALL", chunk, offset, out);
+  case OP_TAIL_CALL:
+    return byte_instruction("OP_TAIL_CALL", chunk, offset, out);
   case OP_RETURN:
     return simple_instruction("OP_RETURN", offset, out);
   case OP_CONSTANT:
-    return constant_instruction("OP_CONSTANT", chunk, offset, out);
+    return constant_instruction("OP_CONSTANT", chunk, offset, wide, out);
   case OP_NEGATE:
     return simple_instruction("OP_NEGATE", offset, out);
   case OP_ADD:
@@ -111,6 +131,53 @@ size_t disassemble_instruction(Chunk *chunk, size_t offset, FILE *out) {
     return simple_instruction("OP_GREATER", offset, out);
   case OP_LESS:
     return simple_instruction("OP_LESS", offset, out);
+  case OP_ADD_NUM:
+    return simple_instruction("OP_ADD_NUM", offset, out);
+  case OP_SUBTRACT_NUM:
+    return simple_instruction("OP_SUBTRACT_NUM", offset, out);
+  case OP_MULTIPLY_NUM:
+    return simple_instruction("OP_MULTIPLY_NUM", offset, out);
+  case OP_DIVIDE_NUM:
+    return simple_instruction("OP_DIVIDE_NUM", offset, out);
+  case OP_NEGATE_NUM:
+    return simple_instruction("OP_NEGATE_NUM", offset, out);
+  case OP_GREATER_NUM:
+    return simple_instruction("OP_GREATER_NUM", offset, out);
+  case OP_LESS_NUM:
+    return simple_instruction("OP_LESS_NUM", offset, out);
+  case OP_JUMP_IF_CALLEE: {
+    int jump = (int)read_index(chunk, offset + 1, true);
+    uint8_t arg_count = chunk->code[offset + 4];
+    uint8_t constant = chunk->code[offset + 5];
+    fprintf(out, "%-16s (%d args) %4zu -> %zu '", "OP_JUMP_IF_CALLEE",
+            arg_count, offset, offset + 6 + jump);
+    print_value(out, chunk->constants.values[constant]);
+    fprintf(out, "'\n");
+    return offset + 6;
+  }
+  case OP_INLINE_RETURN:
+    return byte_instruction("OP_INLINE_RETURN", chunk, offset, out);
+  case OP_GET_METHOD:
+    return constant_instruction("OP_GET_METHOD", chunk, offset, wide, out);
+  case OP_GET_SUPER_METHOD:
+    return constant_instruction("OP_GET_SUPER_METHOD", chunk, offset, wide,
+                                out);
+  case OP_CALL_METHOD:
+    return byte_instruction("OP_CALL_METHOD", chunk, offset, out);
+  case OP_GET_FLAT_UPVALUE:
+    return byte_instruction("OP_GET_FLAT_UPVALUE", chunk, offset, out);
+  case OP_BIND_LOCAL:
+    return byte_instruction("OP_BIND_LOCAL", chunk, offset, out);
+  case OP_BUILD_LIST:
+    return byte_instruction("OP_BUILD_LIST", chunk, offset, out);
+  case OP_INDEX_GET:
+    return simple_instruction("OP_INDEX_GET", offset, out);
+  case OP_INDEX_SET:
+    return simple_instruction("OP_INDEX_SET", offset, out);
+  case OP_CALL_INTRINSIC:
+    fprintf(out, "%-16s (%d args) %4d\n", "OP_CALL_INTRINSIC",
+            chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
   default:
     fprintf(stderr, "Unknown opcode %d\n", inst);
     return offset + 1;
@@ -123,12 +190,12 @@ size_t simple_instruction(const char *name, size_t offset, FILE *out) {
 }
 
 size_t constant_instruction(const char *name, Chunk *chunk, size_t offset,
-                            FILE *out) {
-  uint8_t constant = chunk->code[offset + 1];
-  fprintf(out, "%-16s %4d '", name, constant);
+                            bool wide, FILE *out) {
+  size_t constant = read_index(chunk, offset + 1, wide);
+  fprintf(out, "%-16s %4zu '", name, constant);
   print_value(out, chunk->constants.values[constant]);
   fprintf(out, "'\n");
-  return offset + 2;
+  return offset + (wide ? 4 : 2);
 }
 
 size_t byte_instruction(const char *name, Chunk *chunk, size_t offset,
@@ -140,18 +207,18 @@ size_t byte_instruction(const char *name, Chunk *chunk, size_t offset,
 
 size_t jump_instruction(const char *name, int sign, Chunk *chunk, int offset,
                         FILE *out) {
-  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-  jump |= chunk->code[offset + 2];
-  fprintf(out, "%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
-  return offset + 3;
+  int jump = (int)read_index(chunk, offset + 1, true);
+  fprintf(out, "%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+  return offset + 4;
 }
 
 size_t invoke_instruction(const char *name, Chunk *chunk, int offset,
-                          FILE *out) {
-  uint8_t constant = chunk->code[offset + 1];
-  uint8_t arg_count = chunk->code[offset + 2];
-  fprintf(out, "%-16s (%d args) %4d '", name, arg_count, constant);
+                          bool wide, FILE *out) {
+  size_t constant = read_index(chunk, offset + 1, wide);
+  int length = wide ? 3 : 1;
+  uint8_t arg_count = chunk->code[offset + 1 + length];
+  fprintf(out, "%-16s (%d args) %4zu '", name, arg_count, constant);
   print_value(out, chunk->constants.values[constant]);
   fprintf(out, "'\n");
-  return offset + 3;
+  return offset + 2 + length;
 }
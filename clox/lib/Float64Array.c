@@ -0,0 +1,311 @@
+#include "Float64Array.h"
+#include <string.h>
+
+#if !defined(LOX_NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
+// radix sort digits
+#define SORT_BITS 8
+#define SORT_BUCKETS (1 << SORT_BITS)
+#define SORT_PASSES (64 / SORT_BITS)
+
+static uint64_t sort_key(double number);
+static double sort_number(uint64_t key);
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+static double sum_lanes256(__m256d v) {
+  __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+static double sum_lanes128(__m128d v) {
+  return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+#endif
+
+double float64_sum(const double *a, int count) {
+  double sum = 0;
+  int i = 0;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  __m256d sum4 = _mm256_setzero_pd();
+  for (; i + 4 <= count; i += 4) {
+    sum4 = _mm256_add_pd(sum4, _mm256_loadu_pd(a + i));
+  }
+  sum += sum_lanes256(sum4);
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  __m128d sum2 = _mm_setzero_pd();
+  for (; i + 2 <= count; i += 2) {
+    sum2 = _mm_add_pd(sum2, _mm_loadu_pd(a + i));
+  }
+  sum += sum_lanes128(sum2);
+#endif
+
+  for (; i < count; ++i) {
+    sum += a[i];
+  }
+  return sum;
+}
+
+double float64_dot(const double *a, const double *b, int count) {
+  double sum = 0;
+  int i = 0;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  __m256d sum4 = _mm256_setzero_pd();
+  for (; i + 4 <= count; i += 4) {
+    sum4 = _mm256_add_pd(
+        sum4, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+  }
+  sum += sum_lanes256(sum4);
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  __m128d sum2 = _mm_setzero_pd();
+  for (; i + 2 <= count; i += 2) {
+    sum2 = _mm_add_pd(sum2,
+                      _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+  sum += sum_lanes128(sum2);
+#endif
+
+  for (; i < count; ++i) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+void float64_scale(double *a, double k, int count) {
+  int i = 0;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  __m256d k4 = _mm256_set1_pd(k);
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), k4));
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  __m128d k2 = _mm_set1_pd(k);
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), k2));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    a[i] *= k;
+  }
+}
+
+// y = alpha * x + y, multiplied and added apart as the scalar loop does
+void float64_axpy(double alpha, const double *x, double *y, int count) {
+  int i = 0;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  __m256d alpha4 = _mm256_set1_pd(alpha);
+  for (; i + 4 <= count; i += 4) {
+    __m256d product = _mm256_mul_pd(alpha4, _mm256_loadu_pd(x + i));
+    _mm256_storeu_pd(y + i, _mm256_add_pd(product, _mm256_loadu_pd(y + i)));
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  __m128d alpha2 = _mm_set1_pd(alpha);
+  for (; i + 2 <= count; i += 2) {
+    __m128d product = _mm_mul_pd(alpha2, _mm_loadu_pd(x + i));
+    _mm_storeu_pd(y + i, _mm_add_pd(product, _mm_loadu_pd(y + i)));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    y[i] = alpha * x[i] + y[i];
+  }
+}
+
+void float64_add(const double *a, const double *b, double *out, int count) {
+  int i = 0;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                            _mm256_loadu_pd(b + i)));
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(out + i,
+                  _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    out[i] = a[i] + b[i];
+  }
+}
+
+void float64_mul(const double *a, const double *b, double *out, int count) {
+  int i = 0;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                            _mm256_loadu_pd(b + i)));
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(out + i,
+                  _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+#endif
+
+  for (; i < count; ++i) {
+    out[i] = a[i] * b[i];
+  }
+}
+
+// minpd(x, m) is x < m ? x : m, the scalar step, in every lane. Each lane
+// starts from the first element, so the lanes all agree on a NaN there.
+double float64_min(const double *a, int count) {
+  double min = a[0];
+  int i = 0;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  if (count >= 4) {
+    __m256d min4 = _mm256_set1_pd(a[0]);
+    for (; i + 4 <= count; i += 4) {
+      min4 = _mm256_min_pd(_mm256_loadu_pd(a + i), min4);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, min4);
+    for (int lane = 0; lane < 4; ++lane) {
+      min = lanes[lane] < min ? lanes[lane] : min;
+    }
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  if (count - i >= 2) {
+    __m128d min2 = _mm_set1_pd(min);
+    for (; i + 2 <= count; i += 2) {
+      min2 = _mm_min_pd(_mm_loadu_pd(a + i), min2);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, min2);
+    for (int lane = 0; lane < 2; ++lane) {
+      min = lanes[lane] < min ? lanes[lane] : min;
+    }
+  }
+#endif
+
+  for (; i < count; ++i) {
+    min = a[i] < min ? a[i] : min;
+  }
+  return min;
+}
+
+double float64_max(const double *a, int count) {
+  double max = a[0];
+  int i = 0;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  if (count >= 4) {
+    __m256d max4 = _mm256_set1_pd(a[0]);
+    for (; i + 4 <= count; i += 4) {
+      max4 = _mm256_max_pd(_mm256_loadu_pd(a + i), max4);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, max4);
+    for (int lane = 0; lane < 4; ++lane) {
+      max = lanes[lane] > max ? lanes[lane] : max;
+    }
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  if (count - i >= 2) {
+    __m128d max2 = _mm_set1_pd(max);
+    for (; i + 2 <= count; i += 2) {
+      max2 = _mm_max_pd(_mm_loadu_pd(a + i), max2);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, max2);
+    for (int lane = 0; lane < 2; ++lane) {
+      max = lanes[lane] > max ? lanes[lane] : max;
+    }
+  }
+#endif
+
+  for (; i < count; ++i) {
+    max = a[i] > max ? a[i] : max;
+  }
+  return max;
+}
+
+// Flipping every bit of a negative number and the sign bit of any other
+// makes the bits compare as unsigned integers the way the numbers compare.
+uint64_t sort_key(double number) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  return bits >> 63 ? ~bits : bits | 0x8000000000000000ULL;
+}
+
+double sort_number(uint64_t key) {
+  uint64_t bits = key >> 63 ? key & ~0x8000000000000000ULL : ~key;
+  double number;
+  memcpy(&number, &bits, sizeof(number));
+  return number;
+}
+
+// A least significant digit first radix sort of the keys. All the digit
+// counts come from one pass, and a digit every key shares, as the low
+// mantissa bits of whole numbers do, is not moved on at all.
+void float64_sort(double *a, uint64_t *scratch, int count) {
+  uint32_t counts[SORT_PASSES][SORT_BUCKETS];
+  memset(counts, 0, sizeof(counts));
+
+  uint64_t *keys = scratch;
+  uint64_t *sorted = scratch + count;
+  for (int i = 0; i < count; ++i) {
+    keys[i] = sort_key(a[i]);
+    for (int pass = 0; pass < SORT_PASSES; ++pass) {
+      ++counts[pass][(keys[i] >> (pass * SORT_BITS)) & (SORT_BUCKETS - 1)];
+    }
+  }
+
+  for (int pass = 0; pass < SORT_PASSES; ++pass) {
+    uint32_t *digit_counts = counts[pass];
+    int shift = pass * SORT_BITS;
+    if (count == 0 ||
+        digit_counts[(keys[0] >> shift) & (SORT_BUCKETS - 1)] ==
+            (uint32_t)count)
+      continue;
+
+    uint32_t start = 0;
+    for (int digit = 0; digit < SORT_BUCKETS; ++digit) {
+      uint32_t digit_count = digit_counts[digit];
+      digit_counts[digit] = start;
+      start += digit_count;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      sorted[digit_counts[(keys[i] >> shift) & (SORT_BUCKETS - 1)]++] = keys[i];
+    }
+
+    uint64_t *swap = keys;
+    keys = sorted;
+    sorted = swap;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    a[i] = sort_number(keys[i]);
+  }
+}
@@ -16,7 +16,8 @@ void collect_garbage(VM *vm)
 
   mark_roots(vm);
   trace_references(vm);
-  table_remove_white(vm, &vm->strings);
+  table_remove_white(&vm->strings);
+  forget_white_intrinsics(vm);
   sweep(vm);
 
   vm->next_gc = vm->bytes_allocated * GC_HEAP_GROW_FACTOR;
@@ -55,10 +56,11 @@ void mark_roots(VM *vm)
 
 void mark_table(VM *vm, Table *table)
 {
-  for (Entry *cur = table->front; cur != NULL; cur = cur->next)
+  for (int i = 0; i < table->capacity; ++i)
   {
-    mark_object(vm, (Obj *)cur->key);
-    mark_value(vm, cur->value);
+    Entry *entry = &table->entries[i];
+    mark_object(vm, (Obj *)entry->key);
+    mark_value(vm, entry->value);
   }
 }
 
@@ -141,7 +143,7 @@ void blacken_object(VM *vm, Obj *object)
     mark_object(vm, (Obj *)closure->fn);
     for (int i = 0; i < closure->upvalue_count; ++i)
     {
-      mark_object(vm, (Obj *)closure->upvalues[i]);
+      mark_value(vm, closure->upvalues[i]);
     }
 
     break;
@@ -151,7 +153,12 @@ void blacken_object(VM *vm, Obj *object)
   {
     ObjClass *klass = (ObjClass *)object;
     mark_object(vm, (Obj *)klass->name);
-    mark_table(vm, &klass->methods);
+    mark_object(vm, (Obj *)klass->layout);
+    mark_table(vm, &klass->slots);
+    for (int i = 0; i < klass->method_count; ++i)
+    {
+      mark_object(vm, (Obj *)klass->methods[i]);
+    }
     break;
   }
 
@@ -171,23 +178,57 @@ void blacken_object(VM *vm, Obj *object)
     break;
   }
 
+  case OBJ_LIST:
+  {
+    ObjList *list = (ObjList *)object;
+    for (int i = 0; i < list->count; ++i)
+    {
+      mark_value(vm, list->items[i]);
+    }
+    break;
+  }
+
+  case OBJ_MAP:
+  {
+    // removed entries hold nil
+    ObjMap *map = (ObjMap *)object;
+    for (int i = 0; i < map->entry_count; ++i)
+    {
+      mark_value(vm, map->entries[i].key);
+      mark_value(vm, map->entries[i].value);
+    }
+    break;
+  }
+
   default:
     break;
   }
 }
 
-void table_remove_white(VM *vm, Table *table)
+void forget_white_intrinsics(VM *vm)
+{
+  for (int i = 0; i < INTRINSIC_COUNT; ++i)
+  {
+    if (vm->intrinsics[i] != NULL && !vm->intrinsics[i]->obj.is_marked)
+    {
+      vm->intrinsics[i] = NULL;
+    }
+  }
+}
+
+void table_remove_white(Table *table)
 {
-  for (Entry *cur = table->front; cur != NULL; cur = cur->next)
+  for (int i = 0; i < table->capacity; ++i)
   {
-    if (cur->key != NULL && !cur->key->obj.is_marked)
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL && !entry->key->obj.is_marked)
     {
 #ifdef DEBUG_LOG_GC
-      fprintf(stderr, "%p table_remove_white ", (void *)cur->key);
-      print_value(stderr, object_val((Obj *)cur->key));
+      fprintf(stderr, "%p table_remove_white ", (void *)entry->key);
+      print_value(stderr, object_val((Obj *)entry->key));
       fputc('\n', stderr);
 #endif
-      table_delete(vm, table, cur->key);
+      table_delete(table, entry->key);
     }
   }
 }
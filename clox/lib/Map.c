@@ -0,0 +1,181 @@
+#include "Map.h"
+#include "Memory.h"
+#include <string.h>
+
+// index slots hold an entry's position or one of these
+#define SLOT_EMPTY -1
+#define SLOT_REMOVED -2
+
+static uint32_t hash_bits(uint64_t bits);
+static int32_t *find_slot(ObjMap *map, Value key, uint32_t hash);
+static void rebuild_index(VM *vm, ObjMap *map);
+
+// Numbers that compare equal hash the same, 0 and -0 included. Strings are
+// interned, every other object hashes by its identity.
+uint32_t hash_value(Value value) {
+  switch (value.type) {
+  case VAL_BOOL:
+    return as_bool(value) ? 3 : 2;
+
+  case VAL_NIL:
+    return 1;
+
+  case VAL_NUMBER: {
+    double number = as_number(value);
+    if (number == 0) {
+      number = 0;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return hash_bits(bits);
+  }
+
+  case VAL_OBJ:
+    if (is_string(value))
+      return as_string(value)->hash;
+    return hash_bits((uint64_t)(uintptr_t)as_object(value));
+  }
+
+  return 0;
+}
+
+// Small integers and aligned pointers differ in only a few bits, the
+// murmur3 finalizer spreads them over the whole hash.
+uint32_t hash_bits(uint64_t bits) {
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  bits *= 0xc4ceb9fe1a85ec53ULL;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// The slot holding key's position, or the slot a new key would take: the
+// first removed one passed or else the empty one that ended the probe.
+int32_t *find_slot(ObjMap *map, Value key, uint32_t hash) {
+  uint32_t mask = (uint32_t)map->index_capacity - 1;
+  uint32_t i = hash & mask;
+  int32_t *removed = NULL;
+
+  for (;;) {
+    int32_t *slot = &map->index[i];
+    if (*slot == SLOT_EMPTY)
+      return removed != NULL ? removed : slot;
+
+    if (*slot == SLOT_REMOVED) {
+      if (removed == NULL) {
+        removed = slot;
+      }
+    } else {
+      MapEntry *entry = &map->entries[*slot];
+      if (entry->hash == hash && is_equal(entry->key, key))
+        return slot;
+    }
+
+    i = (i + 1) & mask;
+  }
+}
+
+bool map_get(ObjMap *map, Value key, Value *value) {
+  if (map->count == 0)
+    return false;
+
+  int32_t *slot = find_slot(map, key, hash_value(key));
+  if (*slot < 0)
+    return false;
+
+  *value = map->entries[*slot].value;
+  return true;
+}
+
+// The map, key and value must be reachable, growing may collect. Returns
+// whether the key is new.
+bool map_set(VM *vm, ObjMap *map, Value key, Value value) {
+  uint32_t hash = hash_value(key);
+  int32_t *slot = NULL;
+  if (map->index_capacity > 0) {
+    slot = find_slot(map, key, hash);
+    if (*slot >= 0) {
+      map->entries[*slot].value = value;
+      return false;
+    }
+  }
+
+  // every entry, removed ones too, has a slot in the index
+  if ((map->entry_count + 1) * 4 > map->index_capacity * 3) {
+    rebuild_index(vm, map);
+    slot = find_slot(map, key, hash);
+  }
+
+  if (map->entry_count == map->entry_capacity) {
+    int old_capacity = map->entry_capacity;
+    map->entry_capacity = old_capacity < MAP_MIN_CAPACITY ? MAP_MIN_CAPACITY
+                                                          : old_capacity * 2;
+    map->entries = grow_array(vm, map->entries, sizeof(MapEntry),
+                              old_capacity, map->entry_capacity);
+  }
+
+  MapEntry *entry = &map->entries[map->entry_count];
+  entry->key = key;
+  entry->value = value;
+  entry->hash = hash;
+  entry->removed = false;
+  *slot = map->entry_count++;
+  ++map->count;
+  return true;
+}
+
+// The entry stays in place, emptied so it keeps nothing alive, and is
+// dropped when the index is next rebuilt.
+bool map_remove(ObjMap *map, Value key, Value *value) {
+  if (map->count == 0)
+    return false;
+
+  int32_t *slot = find_slot(map, key, hash_value(key));
+  if (*slot < 0)
+    return false;
+
+  MapEntry *entry = &map->entries[*slot];
+  *value = entry->value;
+  entry->key = nil_val();
+  entry->value = nil_val();
+  entry->removed = true;
+  *slot = SLOT_REMOVED;
+  --map->count;
+  return true;
+}
+
+// Sized for the live entries to fill at most half of it, so a map that only
+// grows doubles and one that mostly removes keeps its size or shrinks.
+// Removed entries are squeezed out, the rest keep their order.
+void rebuild_index(VM *vm, ObjMap *map) {
+  int capacity = MAP_MIN_CAPACITY;
+  while ((map->count + 1) * 2 > capacity) {
+    capacity *= 2;
+  }
+
+  // allocate before touching the map, a collection may trace it meanwhile
+  int32_t *index = allocate(vm, sizeof(int32_t), capacity);
+  free_array(vm, sizeof(int32_t), map->index, map->index_capacity);
+  memset(index, 0xff, sizeof(int32_t) * capacity);
+
+  int count = 0;
+  uint32_t mask = (uint32_t)capacity - 1;
+  for (int i = 0; i < map->entry_count; ++i) {
+    MapEntry *entry = &map->entries[i];
+    if (entry->removed)
+      continue;
+
+    map->entries[count] = *entry;
+    uint32_t j = entry->hash & mask;
+    while (index[j] != SLOT_EMPTY) {
+      j = (j + 1) & mask;
+    }
+    index[j] = count++;
+  }
+
+  map->index = index;
+  map->index_capacity = capacity;
+  map->entry_count = count;
+}
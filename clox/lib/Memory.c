@@ -16,6 +16,15 @@ void *grow_array(VM *vm, void *array, size_t element_size, size_t old_capacity,
                     element_size * new_capacity);
 }
 
+void free_lazy_function(VM *vm, LazyFunction *lazy)
+{
+  if (lazy == NULL)
+    return;
+
+  free_array(vm, sizeof(LazyName), lazy->names, lazy->name_capacity);
+  reallocate(vm, lazy, sizeof(LazyFunction), 0);
+}
+
 void free_object(VM *vm, Obj *obj)
 {
 #ifdef DEBUG_LOG_GC
@@ -27,14 +36,27 @@ void free_object(VM *vm, Obj *obj)
   case OBJ_CLASS:
   {
     ObjClass *klass = (ObjClass *)obj;
-    free_table(vm, &klass->methods);
+    free_array(vm, sizeof(ObjClosure *), klass->methods, klass->method_count);
+    free_table(vm, &klass->slots);
     reallocate(vm, obj, sizeof(ObjClass), 0);
     break;
   }
 
   case OBJ_BOUND_METHOD:
   {
-    reallocate(vm, obj, sizeof(ObjBoundMethod), 0);
+    // a method bound in a loop is garbage right after its call, so the next
+    // binding likely reuses it
+    if (vm->free_bound_method_count < FREE_BOUND_METHODS_MAX)
+    {
+      vm->bytes_allocated -= sizeof(ObjBoundMethod);
+      obj->next = vm->free_bound_methods;
+      vm->free_bound_methods = obj;
+      ++vm->free_bound_method_count;
+    }
+    else
+    {
+      reallocate(vm, obj, sizeof(ObjBoundMethod), 0);
+    }
     break;
   }
 
@@ -50,6 +72,8 @@ void free_object(VM *vm, Obj *obj)
   {
     ObjFunction *fn = (ObjFunction *)obj;
     free_chunk(vm, &fn->chunk);
+    free_chunk(vm, &fn->retired);
+    free_lazy_function(vm, fn->lazy);
     reallocate(vm, obj, sizeof(ObjFunction), 0);
     break;
   }
@@ -63,7 +87,7 @@ void free_object(VM *vm, Obj *obj)
   case OBJ_CLOSURE:
   {
     ObjClosure *closure = (ObjClosure *)obj;
-    free_array(vm, sizeof(ObjUpvalue *), closure->upvalues,
+    free_array(vm, sizeof(Value), closure->upvalues,
                closure->upvalue_count);
     reallocate(vm, obj, sizeof(ObjClosure), 0);
     break;
@@ -75,6 +99,32 @@ void free_object(VM *vm, Obj *obj)
     break;
   }
 
+  case OBJ_LIST:
+  {
+    ObjList *list = (ObjList *)obj;
+    free_array(vm, sizeof(Value), list->items, list->capacity);
+    reallocate(vm, obj, sizeof(ObjList), 0);
+    break;
+  }
+
+  case OBJ_MAP:
+  {
+    ObjMap *map = (ObjMap *)obj;
+    free_array(vm, sizeof(MapEntry), map->entries, map->entry_capacity);
+    free_array(vm, sizeof(int32_t), map->index, map->index_capacity);
+    reallocate(vm, obj, sizeof(ObjMap), 0);
+    break;
+  }
+
+  case OBJ_FLOAT64_ARRAY:
+  {
+    ObjFloat64Array *array = (ObjFloat64Array *)obj;
+    free_aligned(vm, array->items, FLOAT64_ARRAY_ALIGNMENT,
+                 sizeof(double) * array->count);
+    reallocate(vm, obj, sizeof(ObjFloat64Array), 0);
+    break;
+  }
+
   case OBJ_STRING:
   {
     ObjString *string = (ObjString *)obj;
@@ -99,16 +149,18 @@ void *reallocate(VM *vm, void *array, size_t old_size, size_t new_size)
 {
   vm->bytes_allocated += new_size - old_size;
 
+  // only collect when growing, freeing memory from inside sweep must not
+  // start another collection
   if (new_size > old_size)
   {
 #ifdef DEBUG_STRESS_GC
     collect_garbage(vm);
 #endif
-  }
 
-  if (vm->bytes_allocated > vm->next_gc)
-  {
-    collect_garbage(vm);
+    if (vm->bytes_allocated > vm->next_gc)
+    {
+      collect_garbage(vm);
+    }
   }
 
   if (new_size == 0)
@@ -125,9 +177,57 @@ void *allocate(VM *vm, size_t element_size, size_t capacity)
   return reallocate(vm, NULL, 0, element_size * capacity);
 }
 
+// aligned_alloc takes whole multiples of the alignment, at least one
+static size_t aligned_size(size_t alignment, size_t size)
+{
+  return size == 0 ? alignment : (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Counted and collected for like a growing reallocate, alignment must be a
+// power of two. Returns NULL when the memory cannot be had.
+void *allocate_aligned(VM *vm, size_t alignment, size_t size)
+{
+  size = aligned_size(alignment, size);
+  vm->bytes_allocated += size;
+
+#ifdef DEBUG_STRESS_GC
+  collect_garbage(vm);
+#endif
+
+  if (vm->bytes_allocated > vm->next_gc)
+  {
+    collect_garbage(vm);
+  }
+
+  void *array = aligned_alloc(alignment, size);
+  if (array == NULL)
+  {
+    vm->bytes_allocated -= size;
+  }
+  return array;
+}
+
+void free_aligned(VM *vm, void *array, size_t alignment, size_t size)
+{
+  vm->bytes_allocated -= aligned_size(alignment, size);
+  free(array);
+}
+
 Obj *allocate_object(VM *vm, size_t object_size, ObjType type)
 {
-  Obj *obj = reallocate(vm, NULL, 0, object_size);
+  Obj *obj;
+  if (type == OBJ_BOUND_METHOD && vm->free_bound_methods != NULL)
+  {
+    obj = vm->free_bound_methods;
+    vm->free_bound_methods = obj->next;
+    --vm->free_bound_method_count;
+    vm->bytes_allocated += object_size;
+  }
+  else
+  {
+    obj = reallocate(vm, NULL, 0, object_size);
+  }
+
   obj->type = type;
   obj->is_marked = false;
   obj->next = vm->objects;
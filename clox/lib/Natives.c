@@ -0,0 +1,569 @@
+#include "Natives.h"
+#include "Float64Array.h"
+#include "Map.h"
+#include "Memory.h"
+#include "VM.h"
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+static ObjList *list_arg(VM *vm, const char *name, Value value);
+static bool bound_arg(VM *vm, Value value, int count, int *bound);
+static ObjMap *map_arg(VM *vm, const char *name, Value value);
+static bool map_entries(VM *vm, Value *args, const char *name, bool keys);
+static ObjFloat64Array *array_arg(VM *vm, const char *name, Value value);
+static bool array_pair(VM *vm, Value *args, const char *name,
+                       ObjFloat64Array **a, ObjFloat64Array **b);
+static bool number_extreme(VM *vm, int arg_count, Value *args,
+                           const char *name, bool min);
+static bool number_arg(VM *vm, const char *name, Value value, double *number);
+
+// A native is defined as a global of its name. One that is an intrinsic
+// is also compiled to OP_CALL_INTRINSIC where a call names it.
+struct NativeDef {
+  const char *name;
+  NativeFn fn;
+  int arity;
+  int intrinsic;
+};
+
+typedef struct NativeDef NativeDef;
+
+static const NativeDef natives[] = {
+    {"clock", clock_native, 0, INTRINSIC_CLOCK},
+    {"len", len_native, 1, INTRINSIC_LEN},
+    {"sqrt", sqrt_native, 1, INTRINSIC_SQRT},
+    {"abs", abs_native, 1, INTRINSIC_ABS},
+    {"floor", floor_native, 1, INTRINSIC_FLOOR},
+    {"push", push_native, 2, -1},
+    {"pop", pop_native, 1, -1},
+    {"slice", slice_native, 3, -1},
+    {"Map", map_native, 0, -1},
+    {"keys", keys_native, 1, -1},
+    {"values", values_native, 1, -1},
+    {"has", has_native, 2, -1},
+    {"remove", remove_native, 2, -1},
+    {"size", size_native, 1, -1},
+    {"Float64Array", float64_array_native, 1, -1},
+    {"sum", sum_native, 1, -1},
+    {"dot", dot_native, 2, -1},
+    {"scale", scale_native, 2, -1},
+    {"axpy", axpy_native, 3, -1},
+    {"min", min_native, NATIVE_VARIADIC, -1},
+    {"max", max_native, NATIVE_VARIADIC, -1},
+    {"add", add_native, 2, -1},
+    {"mul", mul_native, 2, -1},
+    {"sort", sort_native, 1, -1},
+};
+
+#define NATIVE_COUNT (int)(sizeof(natives) / sizeof(natives[0]))
+
+void define_natives(VM *vm) {
+  for (int i = 0; i < NATIVE_COUNT; ++i) {
+    const NativeDef *def = &natives[i];
+    ObjNative *native = define_native(vm, def->name, def->fn, def->arity);
+    if (def->intrinsic != -1) {
+      vm->intrinsics[def->intrinsic] = native;
+    }
+  }
+}
+
+int find_intrinsic(const char *name, size_t length) {
+  for (int i = 0; i < NATIVE_COUNT; ++i) {
+    if (natives[i].intrinsic != -1 && strlen(natives[i].name) == length &&
+        memcmp(natives[i].name, name, length) == 0)
+      return natives[i].intrinsic;
+  }
+
+  return -1;
+}
+
+// define_natives left the native in the global of its name, unless the
+// global was assigned since. A native found nowhere else is made anew.
+ObjNative *find_native(VM *vm, const char *name, size_t length) {
+  for (int i = 0; i < NATIVE_COUNT; ++i) {
+    const NativeDef *def = &natives[i];
+    if (strlen(def->name) != length || memcmp(def->name, name, length) != 0)
+      continue;
+
+    Value value;
+    if (table_get(&vm->globals, copy_string(vm, name, length), &value) &&
+        is_native(value) && ((ObjNative *)as_object(value))->fn == def->fn)
+      return (ObjNative *)as_object(value);
+    return new_native(vm, def->name, def->fn, def->arity);
+  }
+
+  return NULL;
+}
+
+// The callee's slot becomes the result, so an object stored there stays
+// reachable however much the native allocates after.
+ObjList *return_list(VM *vm, Value *args, int capacity) {
+  ObjList *list = new_list(vm, NULL, 0);
+  args[-1] = object_val((Obj *)list);
+  if (capacity > list->capacity) {
+    list->items = grow_array(vm, list->items, sizeof(Value), list->capacity,
+                             capacity);
+    list->capacity = capacity;
+  }
+  return list;
+}
+
+ObjFloat64Array *return_float64_array(VM *vm, Value *args, int count) {
+  ObjFloat64Array *array =
+      count <= FLOAT64_ARRAY_MAX ? new_float64_array(vm, count) : NULL;
+  if (array == NULL) {
+    runtime_error(vm, "Not enough memory for a Float64Array of %d elements.",
+                  count);
+    return NULL;
+  }
+
+  args[-1] = object_val((Obj *)array);
+  return array;
+}
+
+ObjList *list_arg(VM *vm, const char *name, Value value) {
+  if (!is_list(value)) {
+    runtime_error(vm, "%s() expects a list.", name);
+    return NULL;
+  }
+
+  return as_list(value);
+}
+
+ObjMap *map_arg(VM *vm, const char *name, Value value) {
+  if (!is_map(value)) {
+    runtime_error(vm, "%s() expects a map.", name);
+    return NULL;
+  }
+
+  return as_map(value);
+}
+
+ObjFloat64Array *array_arg(VM *vm, const char *name, Value value) {
+  if (!is_float64_array(value)) {
+    runtime_error(vm, "%s() expects a Float64Array.", name);
+    return NULL;
+  }
+
+  return as_float64_array(value);
+}
+
+// The two arrays of an elementwise native, which must be as long.
+bool array_pair(VM *vm, Value *args, const char *name, ObjFloat64Array **a,
+                ObjFloat64Array **b) {
+  *a = array_arg(vm, name, args[0]);
+  *b = *a == NULL ? NULL : array_arg(vm, name, args[1]);
+  if (*b == NULL)
+    return false;
+
+  if ((*a)->count != (*b)->count) {
+    runtime_error(vm, "%s() expects arrays of the same length.", name);
+    return false;
+  }
+
+  return true;
+}
+
+bool number_arg(VM *vm, const char *name, Value value, double *number) {
+  if (!is_number(value)) {
+    runtime_error(vm, "%s() expects a number.", name);
+    return false;
+  }
+
+  *number = as_number(value);
+  return true;
+}
+
+// A bound of a slice, an integer from 0 to count.
+bool bound_arg(VM *vm, Value value, int count, int *bound) {
+  if (!is_number(value)) {
+    runtime_error(vm, "Slice bounds must be integers.");
+    return false;
+  }
+
+  double number = as_number(value);
+  if (!(number >= 0 && number <= count)) {
+    runtime_error(vm, "Slice bounds out of range.");
+    return false;
+  }
+
+  *bound = (int)number;
+  if (*bound != number) {
+    runtime_error(vm, "Slice bounds must be integers.");
+    return false;
+  }
+
+  return true;
+}
+
+bool clock_native(VM *vm, int arg_count, Value *args) {
+  (void)vm;
+  (void)arg_count;
+  args[-1] = number_val((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+bool sqrt_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  double number;
+  if (!number_arg(vm, "sqrt", args[0], &number))
+    return false;
+
+  args[-1] = number_val(sqrt(number));
+  return true;
+}
+
+bool abs_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  double number;
+  if (!number_arg(vm, "abs", args[0], &number))
+    return false;
+
+  args[-1] = number_val(fabs(number));
+  return true;
+}
+
+bool floor_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  double number;
+  if (!number_arg(vm, "floor", args[0], &number))
+    return false;
+
+  args[-1] = number_val(floor(number));
+  return true;
+}
+
+// The number of elements of a list or a Float64Array, entries of a map or
+// characters of a string.
+bool len_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  if (is_string(args[0])) {
+    args[-1] = number_val((double)as_string(args[0])->length);
+    return true;
+  }
+
+  if (is_map(args[0])) {
+    args[-1] = number_val(as_map(args[0])->count);
+    return true;
+  }
+
+  if (is_float64_array(args[0])) {
+    args[-1] = number_val(as_float64_array(args[0])->count);
+    return true;
+  }
+
+  if (!is_list(args[0])) {
+    runtime_error(vm, "len() expects a list, map, string or Float64Array.");
+    return false;
+  }
+
+  args[-1] = number_val(as_list(args[0])->count);
+  return true;
+}
+
+// Appends the value and returns the new length.
+bool push_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjList *list = list_arg(vm, "push", args[0]);
+  if (list == NULL)
+    return false;
+
+  list_append(vm, list, args[1]);
+  args[-1] = number_val(list->count);
+  return true;
+}
+
+// Removes the last element and returns it.
+bool pop_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjList *list = list_arg(vm, "pop", args[0]);
+  if (list == NULL)
+    return false;
+
+  if (list->count == 0) {
+    runtime_error(vm, "Cannot pop from an empty list.");
+    return false;
+  }
+
+  args[-1] = list->items[--list->count];
+  return true;
+}
+
+// A new list of the elements from start up to but not including end.
+bool slice_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjList *list = list_arg(vm, "slice", args[0]);
+  int start, end;
+  if (list == NULL || !bound_arg(vm, args[1], list->count, &start) ||
+      !bound_arg(vm, args[2], list->count, &end))
+    return false;
+
+  if (end < start) {
+    end = start;
+  }
+  args[-1] = object_val((Obj *)new_list(vm, list->items + start, end - start));
+  return true;
+}
+
+bool map_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  args[-1] = object_val((Obj *)new_map(vm));
+  return true;
+}
+
+// A new list of the keys or the values of a map in insertion order. The
+// list is a copy, so the map may change while a script walks it.
+bool map_entries(VM *vm, Value *args, const char *name, bool keys) {
+  ObjMap *map = map_arg(vm, name, args[0]);
+  if (map == NULL)
+    return false;
+
+  ObjList *list = return_list(vm, args, map->count);
+  for (int i = 0; i < map->entry_count; ++i) {
+    MapEntry *entry = &map->entries[i];
+    if (!entry->removed) {
+      list_append(vm, list, keys ? entry->key : entry->value);
+    }
+  }
+  return true;
+}
+
+bool keys_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  return map_entries(vm, args, "keys", true);
+}
+
+bool values_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  return map_entries(vm, args, "values", false);
+}
+
+// Whether the map has the key, even one whose value is nil.
+bool has_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjMap *map = map_arg(vm, "has", args[0]);
+  if (map == NULL)
+    return false;
+
+  Value value;
+  args[-1] = bool_val(map_get(map, args[1], &value));
+  return true;
+}
+
+// Removes the key and returns its value, nil if it was missing.
+bool remove_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjMap *map = map_arg(vm, "remove", args[0]);
+  if (map == NULL)
+    return false;
+
+  Value value;
+  args[-1] = map_remove(map, args[1], &value) ? value : nil_val();
+  return true;
+}
+
+bool size_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjMap *map = map_arg(vm, "size", args[0]);
+  if (map == NULL)
+    return false;
+
+  args[-1] = number_val(map->count);
+  return true;
+}
+
+// Float64Array(count) is count zeros, Float64Array(list) a copy of a list of
+// numbers.
+bool float64_array_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  if (is_list(args[0])) {
+    ObjList *list = as_list(args[0]);
+    for (int i = 0; i < list->count; ++i) {
+      if (!is_number(list->items[i])) {
+        runtime_error(vm, "Float64Array elements must be numbers.");
+        return false;
+      }
+    }
+
+    ObjFloat64Array *array = return_float64_array(vm, args, list->count);
+    if (array == NULL)
+      return false;
+
+    for (int i = 0; i < list->count; ++i) {
+      array->items[i] = as_number(list->items[i]);
+    }
+    return true;
+  }
+
+  double count = is_number(args[0]) ? as_number(args[0]) : -1;
+  if (!(count >= 0) || count != floor(count)) {
+    runtime_error(vm, "Float64Array size must be a non-negative integer.");
+    return false;
+  }
+
+  if (count > FLOAT64_ARRAY_MAX) {
+    runtime_error(vm, "Float64Array size must be at most %d.",
+                  FLOAT64_ARRAY_MAX);
+    return false;
+  }
+
+  return return_float64_array(vm, args, (int)count) != NULL;
+}
+
+bool sum_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjFloat64Array *array = array_arg(vm, "sum", args[0]);
+  if (array == NULL)
+    return false;
+
+  args[-1] = number_val(float64_sum(array->items, array->count));
+  return true;
+}
+
+bool dot_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjFloat64Array *a, *b;
+  if (!array_pair(vm, args, "dot", &a, &b))
+    return false;
+
+  args[-1] = number_val(float64_dot(a->items, b->items, a->count));
+  return true;
+}
+
+// Multiplies every element by k in place and returns the array.
+bool scale_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjFloat64Array *array = array_arg(vm, "scale", args[0]);
+  double k;
+  if (array == NULL || !number_arg(vm, "scale", args[1], &k))
+    return false;
+
+  float64_scale(array->items, k, array->count);
+  args[-1] = args[0];
+  return true;
+}
+
+// axpy(alpha, x, y) adds alpha * x to y in place and returns y.
+bool axpy_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  double alpha;
+  if (!number_arg(vm, "axpy", args[0], &alpha))
+    return false;
+
+  ObjFloat64Array *x, *y;
+  if (!array_pair(vm, args + 1, "axpy", &x, &y))
+    return false;
+
+  float64_axpy(alpha, x->items, y->items, x->count);
+  args[-1] = args[2];
+  return true;
+}
+
+// min(array) is the least element of a Float64Array, min(a, b, ...) the
+// least of its numbers.
+bool min_native(VM *vm, int arg_count, Value *args) {
+  if (arg_count != 1 || !is_float64_array(args[0]))
+    return number_extreme(vm, arg_count, args, "min", true);
+
+  ObjFloat64Array *array = as_float64_array(args[0]);
+  if (array->count == 0) {
+    runtime_error(vm, "Cannot take the min of an empty array.");
+    return false;
+  }
+
+  args[-1] = number_val(float64_min(array->items, array->count));
+  return true;
+}
+
+bool max_native(VM *vm, int arg_count, Value *args) {
+  if (arg_count != 1 || !is_float64_array(args[0]))
+    return number_extreme(vm, arg_count, args, "max", false);
+
+  ObjFloat64Array *array = as_float64_array(args[0]);
+  if (array->count == 0) {
+    runtime_error(vm, "Cannot take the max of an empty array.");
+    return false;
+  }
+
+  args[-1] = number_val(float64_max(array->items, array->count));
+  return true;
+}
+
+// The least or greatest of one or more numbers, by the same rule as the
+// Float64Array kernels.
+bool number_extreme(VM *vm, int arg_count, Value *args, const char *name,
+                    bool min) {
+  if (arg_count == 0) {
+    runtime_error(vm, "%s() expects a Float64Array or numbers.", name);
+    return false;
+  }
+
+  double result = 0;
+  for (int i = 0; i < arg_count; ++i) {
+    if (!is_number(args[i])) {
+      runtime_error(vm, "%s() expects a Float64Array or numbers.", name);
+      return false;
+    }
+
+    double number = as_number(args[i]);
+    if (i == 0 || (min ? number < result : number > result)) {
+      result = number;
+    }
+  }
+
+  args[-1] = number_val(result);
+  return true;
+}
+
+// A new array of the elementwise sums.
+bool add_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjFloat64Array *a, *b;
+  if (!array_pair(vm, args, "add", &a, &b))
+    return false;
+
+  ObjFloat64Array *result = return_float64_array(vm, args, a->count);
+  if (result == NULL)
+    return false;
+
+  float64_add(a->items, b->items, result->items, a->count);
+  return true;
+}
+
+// A new array of the elementwise products.
+bool mul_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjFloat64Array *a, *b;
+  if (!array_pair(vm, args, "mul", &a, &b))
+    return false;
+
+  ObjFloat64Array *result = return_float64_array(vm, args, a->count);
+  if (result == NULL)
+    return false;
+
+  float64_mul(a->items, b->items, result->items, a->count);
+  return true;
+}
+
+// Sorts the array ascending in place and returns it.
+bool sort_native(VM *vm, int arg_count, Value *args) {
+  (void)arg_count;
+  ObjFloat64Array *array = array_arg(vm, "sort", args[0]);
+  if (array == NULL)
+    return false;
+
+  uint64_t *scratch = allocate(vm, sizeof(uint64_t), 2 * (size_t)array->count);
+  if (scratch == NULL && array->count > 0) {
+    free_array(vm, sizeof(uint64_t), scratch, 2 * (size_t)array->count);
+    runtime_error(vm, "Not enough memory to sort a Float64Array of %d elements.",
+                  array->count);
+    return false;
+  }
+
+  float64_sort(array->items, scratch, array->count);
+  free_array(vm, sizeof(uint64_t), scratch, 2 * (size_t)array->count);
+  args[-1] = args[0];
+  return true;
+}
@@ -5,6 +5,21 @@
 #include <stdio.h>
 #include <string.h>
 
+// lists start with room for this many values and then double
+#define LIST_MIN_CAPACITY 8
+// lists and maps nested deeper are printed as [...] and {...}, a list or a
+// map may contain itself
+#define PRINT_DEPTH 8
+
+static void write_element(Output *out, Value value, int depth);
+static void write_list(Output *out, ObjList *list, int depth);
+static void write_map(Output *out, ObjMap *map, int depth);
+static void write_float64_array(Output *out, ObjFloat64Array *array);
+
+#if !defined(LOX_NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
 ObjType object_type(Value value) { return as_object(value)->type; }
 
 ObjFunction *new_function(VM *vm)
@@ -14,24 +29,30 @@ ObjFunction *new_function(VM *vm)
   fn->arity = 0;
   fn->upvalue_count = 0;
   fn->name = NULL;
+  fn->calls = 0;
+  fn->optimized = false;
+  fn->lazy = NULL;
   init_chunk(&fn->chunk);
+  init_chunk(&fn->retired);
   return fn;
 }
 
-ObjNative *new_native(VM *vm, NativeFn fn)
+ObjNative *new_native(VM *vm, const char *name, NativeFn fn, int arity)
 {
   ObjNative *native_fn =
       (ObjNative *)allocate_object(vm, sizeof(ObjNative), OBJ_NATIVE);
   native_fn->fn = fn;
+  native_fn->arity = arity;
+  native_fn->name = name;
   return native_fn;
 }
 
 ObjClosure *new_closure(VM *vm, ObjFunction *fn)
 {
-  ObjUpvalue **upvalues = allocate(vm, sizeof(ObjUpvalue *), fn->upvalue_count);
+  Value *upvalues = allocate(vm, sizeof(Value), fn->upvalue_count);
   for (int i = 0; i < fn->upvalue_count; ++i)
   {
-    upvalues[i] = NULL;
+    upvalues[i] = nil_val();
   }
 
   ObjClosure *closure =
@@ -57,7 +78,13 @@ ObjClass *new_class(VM *vm, ObjString *name)
   ObjClass *klass =
       (ObjClass *)allocate_object(vm, sizeof(ObjClass), OBJ_CLASS);
   klass->name = name;
-  init_table(&klass->methods);
+  klass->methods = NULL;
+  klass->method_count = 0;
+  klass->layout = klass;
+  klass->layout_id = ++vm->layout_count;
+  init_table(&klass->slots);
+  klass->initializer = NULL;
+  klass->field_count = 0;
   return klass;
 }
 
@@ -67,6 +94,13 @@ ObjInstance *new_instance(VM *vm, ObjClass *klass)
       (ObjInstance *)allocate_object(vm, sizeof(ObjInstance), OBJ_INSTANCE);
   instance->klass = klass;
   init_table(&instance->fields);
+
+  if (klass->field_count > 0)
+  {
+    push(vm, object_val((Obj *)instance));
+    table_reserve(vm, &instance->fields, klass->field_count);
+    pop(vm);
+  }
   return instance;
 }
 
@@ -79,6 +113,156 @@ ObjBoundMethod *new_bound_method(VM *vm, Value receiver, ObjClosure *method)
   return bound_method;
 }
 
+// A new list holding a copy of count values from items, which the caller
+// keeps reachable meanwhile, usually on the stack.
+ObjList *new_list(VM *vm, Value *items, int count)
+{
+  int capacity = count < LIST_MIN_CAPACITY ? LIST_MIN_CAPACITY : count;
+  Value *copy = allocate(vm, sizeof(Value), capacity);
+  if (count > 0)
+  {
+    memcpy(copy, items, sizeof(Value) * count);
+  }
+
+  ObjList *list = (ObjList *)allocate_object(vm, sizeof(ObjList), OBJ_LIST);
+  list->items = copy;
+  list->count = count;
+  list->capacity = capacity;
+  return list;
+}
+
+// Both the list and the value must be reachable, growing may collect.
+void list_append(VM *vm, ObjList *list, Value value)
+{
+  if (list->count == list->capacity)
+  {
+    int old_capacity = list->capacity;
+    list->capacity = old_capacity < LIST_MIN_CAPACITY ? LIST_MIN_CAPACITY
+                                                      : old_capacity * 2;
+    list->items = grow_array(vm, list->items, sizeof(Value), old_capacity,
+                             list->capacity);
+  }
+
+  list->items[list->count++] = value;
+}
+
+// An empty map allocates its entries and index on the first insertion.
+ObjMap *new_map(VM *vm)
+{
+  ObjMap *map = (ObjMap *)allocate_object(vm, sizeof(ObjMap), OBJ_MAP);
+  map->entries = NULL;
+  map->entry_count = 0;
+  map->entry_capacity = 0;
+  map->index = NULL;
+  map->index_capacity = 0;
+  map->count = 0;
+  return map;
+}
+
+// NULL when there is not enough memory for the elements.
+ObjFloat64Array *new_float64_array(VM *vm, int count)
+{
+  double *items = allocate_aligned(vm, FLOAT64_ARRAY_ALIGNMENT,
+                                   sizeof(double) * count);
+  if (items == NULL)
+    return NULL;
+
+  memset(items, 0, sizeof(double) * count);
+
+  ObjFloat64Array *array = (ObjFloat64Array *)allocate_object(
+      vm, sizeof(ObjFloat64Array), OBJ_FLOAT64_ARRAY);
+  array->items = items;
+  array->count = count;
+  return array;
+}
+
+// -1 when the class' layout has no slot for the name. The name remembers
+// its last slot, a lookup in the same hierarchy as the one before skips the
+// table. Layouts only ever gain names, so the slot stays right.
+int method_slot(ObjClass *klass, ObjString *name)
+{
+  if (name->slot_layout == klass->layout_id)
+  {
+    return name->slot;
+  }
+
+  Value slot;
+  if (!table_get(&klass->layout->slots, name, &slot))
+  {
+    return -1;
+  }
+
+  name->slot = (int)as_number(slot);
+  name->slot_layout = klass->layout_id;
+  return name->slot;
+}
+
+ObjClosure *find_method(ObjClass *klass, ObjString *name)
+{
+  int slot = method_slot(klass, name);
+  if ((unsigned)slot >= (unsigned)klass->method_count)
+  {
+    return NULL;
+  }
+
+  return klass->methods[slot];
+}
+
+void set_method(VM *vm, ObjClass *klass, ObjString *name, ObjClosure *method)
+{
+  int slot = method_slot(klass, name);
+  if (slot == -1)
+  {
+    // a shared layout is copied before it gets a name of the subclass'
+    if (klass->layout != klass)
+    {
+      table_add_all(vm, &klass->layout->slots, &klass->slots);
+      klass->layout = klass;
+      klass->layout_id = ++vm->layout_count;
+    }
+
+    slot = klass->slots.size;
+    table_set(vm, &klass->slots, name, number_val(slot));
+  }
+
+  if (slot >= klass->method_count)
+  {
+    klass->methods = grow_array(vm, klass->methods, sizeof(ObjClosure *),
+                                klass->method_count, slot + 1);
+    for (int i = klass->method_count; i <= slot; ++i)
+    {
+      klass->methods[i] = NULL;
+    }
+    klass->method_count = slot + 1;
+  }
+
+  klass->methods[slot] = method;
+  if (name == vm->init_string)
+  {
+    klass->initializer = method;
+  }
+}
+
+void inherit_methods(VM *vm, ObjClass *klass, ObjClass *superclass)
+{
+  ObjClosure **methods = NULL;
+  if (superclass->method_count > 0)
+  {
+    methods = allocate(vm, sizeof(ObjClosure *), superclass->method_count);
+    memcpy(methods, superclass->methods,
+           sizeof(ObjClosure *) * superclass->method_count);
+  }
+
+  free_array(vm, sizeof(ObjClosure *), klass->methods, klass->method_count);
+  klass->methods = methods;
+  klass->method_count = superclass->method_count;
+  klass->initializer = superclass->initializer;
+
+  free_table(vm, &klass->slots);
+  klass->layout = superclass->layout;
+  klass->layout_id = superclass->layout_id;
+}
+
 ObjString *copy_string(VM *vm, const char *chars, size_t length)
 {
   uint32_t hash = hash_string(chars, length);
@@ -98,6 +282,8 @@ ObjString *allocate_string(VM *vm, char *chars, size_t length, uint32_t hash)
   string->chars = chars;
   string->length = length;
   string->hash = hash;
+  string->slot = -1;
+  string->slot_layout = 0;
   push(vm, object_val((Obj *)string));
   table_set(vm, &vm->strings, string, nil_val());
   pop(vm);
@@ -108,8 +294,8 @@ void concatenate(VM *vm)
 {
   ObjString *sa = as_string(peek(vm, 1));
   ObjString *sb = as_string(peek(vm, 0));
-  int length = sa->length + sb->length;
-  char *chars = allocate(vm, sizeof(char), length);
+  size_t length = sa->length + sb->length;
+  char *chars = allocate(vm, sizeof(char), length + 1);
 
   memcpy(chars, sa->chars, sa->length);
   memcpy(chars + sa->length, sb->chars, sb->length);
@@ -121,53 +307,74 @@ void concatenate(VM *vm)
   push(vm, object_val((Obj *)sobj));
 }
 
-ObjString *take_string(VM *vm, char *chars, int length)
+ObjString *take_string(VM *vm, char *chars, size_t length)
 {
   uint32_t hash = hash_string(chars, length);
   ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
   if (interned != NULL)
   {
-    free_array(vm, sizeof(char), chars, length);
+    free_array(vm, sizeof(char), chars, length + 1);
     return interned;
   }
 
   return allocate_string(vm, chars, length, hash);
 }
 
-void print_object(FILE *out, Value value)
+void write_object(Output *out, Value value)
 {
   switch (object_type(value))
   {
   case OBJ_CLASS:
-    fprintf(out, "<class %s>", as_class(value)->name->chars);
+  {
+    ObjString *name = as_class(value)->name;
+    write_output(out, "<class ", 7);
+    write_output(out, name->chars, name->length);
+    write_output_char(out, '>');
     break;
+  }
 
   case OBJ_BOUND_METHOD:
-    print_function(out, as_bound_method(value)->method->fn);
+    write_function(out, as_bound_method(value)->method->fn);
     break;
 
   case OBJ_INSTANCE:
-    fprintf(out, "%s instance", as_instance(value)->klass->name->chars);
+  {
+    ObjString *name = as_instance(value)->klass->name;
+    write_output(out, name->chars, name->length);
+    write_output(out, " instance", 9);
     break;
+  }
 
   case OBJ_FUNCTION:
-    print_function(out, as_function(value));
+    write_function(out, as_function(value));
     break;
 
   case OBJ_NATIVE:
-    fprintf(out, "<native fn>");
+    write_output(out, "<native fn>", 11);
     break;
 
   case OBJ_CLOSURE:
-    print_function(out, as_closure(value)->fn);
+    write_function(out, as_closure(value)->fn);
     break;
 
   case OBJ_UPVALUE:
-    fprintf(out, "upvalue");
+    write_output(out, "upvalue", 7);
     break;
 
   case OBJ_STRING:
-    fprintf(out, "%s", as_cstring(value));
+    write_output(out, as_cstring(value), as_string(value)->length);
+    break;
+
+  case OBJ_LIST:
+    write_list(out, as_list(value), 0);
+    break;
+
+  case OBJ_MAP:
+    write_map(out, as_map(value), 0);
+    break;
+
+  case OBJ_FLOAT64_ARRAY:
+    write_float64_array(out, as_float64_array(value));
     break;
 
   default:
@@ -175,15 +382,98 @@ void print_object(FILE *out, Value value)
   }
 }
 
-void print_function(FILE *out, ObjFunction *fn)
+void write_element(Output *out, Value value, int depth)
+{
+  if (is_list(value))
+  {
+    write_list(out, as_list(value), depth);
+  }
+  else if (is_map(value))
+  {
+    write_map(out, as_map(value), depth);
+  }
+  else
+  {
+    write_value(out, value);
+  }
+}
+
+void write_list(Output *out, ObjList *list, int depth)
+{
+  if (depth == PRINT_DEPTH)
+  {
+    write_output(out, "[...]", 5);
+    return;
+  }
+
+  write_output_char(out, '[');
+  for (int i = 0; i < list->count; ++i)
+  {
+    if (i > 0)
+    {
+      write_output(out, ", ", 2);
+    }
+
+    write_element(out, list->items[i], depth + 1);
+  }
+  write_output_char(out, ']');
+}
+
+void write_map(Output *out, ObjMap *map, int depth)
+{
+  if (depth == PRINT_DEPTH)
+  {
+    write_output(out, "{...}", 5);
+    return;
+  }
+
+  write_output_char(out, '{');
+  bool first = true;
+  for (int i = 0; i < map->entry_count; ++i)
+  {
+    MapEntry *entry = &map->entries[i];
+    if (entry->removed)
+      continue;
+
+    if (!first)
+    {
+      write_output(out, ", ", 2);
+    }
+    first = false;
+
+    write_element(out, entry->key, depth + 1);
+    write_output(out, ": ", 2);
+    write_element(out, entry->value, depth + 1);
+  }
+  write_output_char(out, '}');
+}
+
+void write_float64_array(Output *out, ObjFloat64Array *array)
+{
+  write_output(out, "Float64Array[", 13);
+  for (int i = 0; i < array->count; ++i)
+  {
+    if (i > 0)
+    {
+      write_output(out, ", ", 2);
+    }
+
+    write_value(out, number_val(array->items[i]));
+  }
+  write_output_char(out, ']');
+}
+
+void write_function(Output *out, ObjFunction *fn)
 {
   if (fn->name != NULL)
   {
-    fprintf(out, "<fn %s>", fn->name->chars);
+    write_output(out, "<fn ", 4);
+    write_output(out, fn->name->chars, fn->name->length);
+    write_output_char(out, '>');
   }
   else
   {
-    fprintf(out, "<fn ||between-allocation||>");
+    write_output(out, "<fn ||between-allocation||>", 27);
   }
 }
 
@@ -227,6 +517,21 @@ bool is_bound_method(Value value)
   return is_object(value) && is_object_type(value, OBJ_BOUND_METHOD);
 }
 
+bool is_list(Value value)
+{
+  return is_object(value) && is_object_type(value, OBJ_LIST);
+}
+
+bool is_map(Value value)
+{
+  return is_object(value) && is_object_type(value, OBJ_MAP);
+}
+
+bool is_float64_array(Value value)
+{
+  return is_object(value) && is_object_type(value, OBJ_FLOAT64_ARRAY);
+}
+
 ObjString *as_string(Value value) { return (ObjString *)as_object(value); }
 
 ObjFunction *as_function(Value value)
@@ -238,6 +543,8 @@ NativeFn as_native(Value value) { return ((ObjNative *)as_object(value))->fn; }
 
 ObjClosure *as_closure(Value value) { return (ObjClosure *)as_object(value); }
 
+ObjUpvalue *as_upvalue(Value value) { return (ObjUpvalue *)as_object(value); }
+
 char *as_cstring(Value value) { return ((ObjString *)as_object(value))->chars; }
 
 ObjClass *as_class(Value value) { return ((ObjClass *)as_object(value)); }
@@ -246,15 +553,173 @@ ObjInstance *as_instance(Value value) { return ((ObjInstance *)as_object(value))
 
 ObjBoundMethod *as_bound_method(Value value) { return (ObjBoundMethod *)as_object(value); }
 
-uint32_t hash_string(const char *key, int length)
+ObjList *as_list(Value value) { return (ObjList *)as_object(value); }
+
+ObjMap *as_map(Value value) { return (ObjMap *)as_object(value); }
+
+ObjFloat64Array *as_float64_array(Value value)
+{
+  return (ObjFloat64Array *)as_object(value);
+}
+
+// unaligned loads, memcpy compiles down to a single mov
+static uint64_t read_u64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+#ifdef LOX_HASH_FNV1A
+uint32_t hash_string(const char *key, size_t length)
 {
   uint32_t hash = 2166136261u;
 
-  for (int i = 0; i < length; i++)
+  for (size_t i = 0; i < length; i++)
   {
-    hash ^= key[i];
+    hash ^= (uint8_t)key[i];
     hash *= 16777619;
   }
 
   return hash;
 }
+#else
+static uint64_t read_u32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// wyhash style: consume 8 bytes per load and fold each pair of words through
+// a 64x64->128 bit multiply. Keys up to 16 bytes take a branch light path,
+// longer keys are processed 48 bytes per iteration in three lanes.
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+static void hash_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+  __extension__ unsigned __int128 r = (unsigned __int128)*a * *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+  hash_mum(&a, &b);
+  return a ^ b;
+}
+
+uint32_t hash_string(const char *key, size_t length)
+{
+  const uint8_t *p = (const uint8_t *)key;
+  uint64_t seed = hash_mix(HASH_P0, HASH_P1);
+  uint64_t a, b;
+
+  if (length <= 16)
+  {
+    if (length >= 4)
+    {
+      // two overlapping 4 byte reads from each end cover 4..16 bytes
+      size_t mid = (length >> 3) << 2;
+      a = (read_u32(p) << 32) | read_u32(p + mid);
+      b = (read_u32(p + length - 4) << 32) |
+          read_u32(p + length - 4 - mid);
+    }
+    else if (length > 0)
+    {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+          p[length - 1];
+      b = 0;
+    }
+    else
+    {
+      a = b = 0;
+    }
+  }
+  else
+  {
+    size_t i = length;
+    if (i > 48)
+    {
+      uint64_t see1 = seed, see2 = seed;
+      do
+      {
+        seed = hash_mix(read_u64(p) ^ HASH_P1, read_u64(p + 8) ^ seed);
+        see1 = hash_mix(read_u64(p + 16) ^ HASH_P2,
+                        read_u64(p + 24) ^ see1);
+        see2 = hash_mix(read_u64(p + 32) ^ HASH_P3,
+                        read_u64(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+
+    while (i > 16)
+    {
+      seed = hash_mix(read_u64(p) ^ HASH_P1, read_u64(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+
+    // the last 16 bytes, overlapping what was already consumed
+    a = read_u64(p + i - 16);
+    b = read_u64(p + i - 8);
+  }
+
+  a ^= HASH_P1;
+  b ^= seed;
+  hash_mum(&a, &b);
+  uint64_t hash = hash_mix(a ^ HASH_P0 ^ length, b ^ HASH_P1);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+#endif
+
+bool string_equals(const char *a, const char *b, size_t length)
+{
+  size_t i = 0;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  for (; i + 32 <= length; i += 32)
+  {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) !=
+        0xffffffffu)
+      return false;
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  for (; i + 16 <= length; i += 16)
+  {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff)
+      return false;
+  }
+#endif
+
+  for (; i + 8 <= length; i += 8)
+  {
+    if (read_u64((const uint8_t *)a + i) !=
+        read_u64((const uint8_t *)b + i))
+      return false;
+  }
+
+  return memcmp(a + i, b + i, length - i) == 0;
+}
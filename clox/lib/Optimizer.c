@@ -0,0 +1,357 @@
+#include "Optimizer.h"
+#include "Opcode.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Upper bound on the number of jumps followed when threading a jump chain,
+// it guards against cycles of unconditional jumps.
+#define MAX_THREAD_HOPS 16
+
+static void encode(Chunk *chunk, Instruction *code, int count);
+static bool is_jump(uint8_t op);
+static bool is_conditional_jump(uint8_t op);
+static bool is_branch(uint8_t op);
+static bool is_pure_push(uint8_t op);
+static int next_live(Instruction *code, int count, int index);
+static void mark_targets(Instruction *code, int count);
+static bool thread_jumps(Instruction *code, int count);
+static bool remove_dead_code(Instruction *code, int count);
+static bool rewrite_sequences(Instruction *code, int count);
+
+void init_peephole_stats(PeepholeStats *stats) {
+  stats->instructions_before = 0;
+  stats->instructions_after = 0;
+  stats->bytes_before = 0;
+  stats->bytes_after = 0;
+}
+
+// Rewrites the chunk in place. Every pass only removes instructions or
+// replaces them with shorter ones, so the result never outgrows the chunk.
+void peephole_optimize(Chunk *chunk, PeepholeStats *stats) {
+  Instruction *code = NULL;
+  int count = decode_chunk(chunk, &code);
+
+  if (stats != NULL) {
+    stats->instructions_before += count;
+    stats->bytes_before += chunk->size;
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = thread_jumps(code, count);
+    mark_targets(code, count);
+    changed |= remove_dead_code(code, count);
+    changed |= rewrite_sequences(code, count);
+  }
+
+  encode(chunk, code, count);
+
+  if (stats != NULL) {
+    for (int i = 0; i < count; ++i) {
+      if (!code[i].removed) {
+        ++stats->instructions_after;
+      }
+    }
+    stats->bytes_after += chunk->size;
+  }
+
+  free(code);
+}
+
+int decode_chunk(Chunk *chunk, Instruction **out) {
+  int count = 0;
+  for (size_t offset = 0; offset < chunk->size;) {
+    offset += instruction_length(chunk, offset);
+    ++count;
+  }
+
+  Instruction *code = malloc(sizeof(Instruction) * (count + 1));
+  int *index_of = malloc(sizeof(int) * (chunk->size + 1));
+
+  size_t offset = 0;
+  int run = 0;
+  for (int i = 0; i < count; ++i) {
+    Instruction *inst = &code[i];
+    while (run + 1 < chunk->line_count &&
+           (size_t)chunk->lines[run + 1].offset <= offset) {
+      ++run;
+    }
+
+    inst->offset = offset;
+    inst->line = chunk->line_count > 0 ? chunk->lines[run].line : 0;
+    inst->new_offset = 0;
+    inst->length = instruction_length(chunk, offset);
+    inst->wide = chunk->code[offset] == OP_WIDE;
+    inst->op = chunk->code[offset + (inst->wide ? 1 : 0)];
+    inst->target = -1;
+    inst->is_target = false;
+    inst->removed = false;
+
+    index_of[offset] = i;
+    offset += inst->length;
+  }
+  index_of[chunk->size] = count;
+
+  for (int i = 0; i < count; ++i) {
+    Instruction *inst = &code[i];
+    if (!is_jump(inst->op))
+      continue;
+
+    size_t jump = read_index(chunk, inst->offset + 1, true);
+    size_t next = inst->offset + inst->length;
+    inst->target = index_of[inst->op == OP_LOOP ? next - jump : next + jump];
+  }
+
+  free(index_of);
+  *out = code;
+  return count;
+}
+
+// Compacts the live instructions towards the start of the chunk and patches
+// every jump. Each instruction moves to an offset at or below its original
+// one, so moving them in order never overwrites code that is still unread.
+// The lines of the live instructions are a subsequence of the old ones, so
+// their runs never outnumber the old runs either.
+void encode(Chunk *chunk, Instruction *code, int count) {
+  size_t size = 0;
+  for (int i = 0; i < count; ++i) {
+    if (code[i].removed)
+      continue;
+
+    code[i].new_offset = size;
+    size += code[i].length;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    Instruction *inst = &code[i];
+    if (inst->removed)
+      continue;
+
+    memmove(&chunk->code[inst->new_offset], &chunk->code[inst->offset],
+            inst->length);
+    chunk->code[inst->new_offset + (inst->wide ? 1 : 0)] = inst->op;
+  }
+
+  chunk->line_count = 0;
+  for (int i = 0; i < count; ++i) {
+    Instruction *inst = &code[i];
+    if (inst->removed || (chunk->line_count > 0 &&
+                          chunk->lines[chunk->line_count - 1].line == inst->line))
+      continue;
+
+    chunk->lines[chunk->line_count].offset = (int)inst->new_offset;
+    chunk->lines[chunk->line_count].line = inst->line;
+    ++chunk->line_count;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    Instruction *inst = &code[i];
+    if (inst->removed || !is_jump(inst->op))
+      continue;
+
+    int target = next_live(code, count, inst->target);
+    size_t to = target < count ? code[target].new_offset : size;
+    size_t from = inst->new_offset + inst->length;
+
+    // unconditional jumps may have been threaded in either direction
+    size_t jump;
+    if (to >= from) {
+      jump = to - from;
+      if (inst->op == OP_LOOP) {
+        inst->op = OP_JUMP;
+      }
+    } else {
+      jump = from - to;
+      inst->op = OP_LOOP;
+    }
+
+    chunk->code[inst->new_offset] = inst->op;
+    chunk->code[inst->new_offset + 1] = (jump >> 16) & 0xff;
+    chunk->code[inst->new_offset + 2] = (jump >> 8) & 0xff;
+    chunk->code[inst->new_offset + 3] = jump & 0xff;
+  }
+
+  chunk->size = size;
+}
+
+bool is_jump(uint8_t op) {
+  return op == OP_JUMP || op == OP_LOOP || is_branch(op);
+}
+
+bool is_conditional_jump(uint8_t op) {
+  return op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+}
+
+// Jumps that may fall through, unlike conditional jumps OP_JUMP_IF_CALLEE
+// tests the callee and has no inverse.
+bool is_branch(uint8_t op) {
+  return is_conditional_jump(op) || op == OP_JUMP_IF_CALLEE;
+}
+
+// Pushes that cannot fail and have no side effect, so a push immediately
+// discarded by OP_POP can be dropped together with the pop.
+bool is_pure_push(uint8_t op) {
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_GET_FLAT_UPVALUE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+int next_live(Instruction *code, int count, int index) {
+  while (index < count && code[index].removed) {
+    ++index;
+  }
+  return index;
+}
+
+void mark_targets(Instruction *code, int count) {
+  for (int i = 0; i < count; ++i) {
+    code[i].is_target = false;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    if (code[i].removed || !is_jump(code[i].op))
+      continue;
+
+    int target = next_live(code, count, code[i].target);
+    if (target < count) {
+      code[target].is_target = true;
+    }
+  }
+}
+
+// Points jumps that land on an unconditional jump at its destination. A
+// conditional jump must keep going forward, an unconditional jump landing on
+// a return becomes that return, and a jump to the next instruction goes away.
+bool thread_jumps(Instruction *code, int count) {
+  bool changed = false;
+
+  for (int i = 0; i < count; ++i) {
+    Instruction *inst = &code[i];
+    if (inst->removed || !is_jump(inst->op))
+      continue;
+
+    int target = next_live(code, count, inst->target);
+    for (int hops = 0; hops < MAX_THREAD_HOPS && target < count; ++hops) {
+      Instruction *next = &code[target];
+      if (next->op != OP_JUMP && next->op != OP_LOOP)
+        break;
+
+      int destination = next_live(code, count, next->target);
+      if (destination == target || (is_branch(inst->op) && destination <= i))
+        break;
+
+      target = destination;
+    }
+
+    if (target != next_live(code, count, inst->target)) {
+      inst->target = target;
+      changed = true;
+    }
+
+    if (target == next_live(code, count, i + 1)) {
+      inst->removed = true;
+      changed = true;
+    } else if (!is_branch(inst->op) && target < count &&
+               code[target].op == OP_RETURN) {
+      inst->op = OP_RETURN;
+      inst->length = 1;
+      inst->target = -1;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+// Nothing falls through an unconditional transfer, so the instructions after
+// one are unreachable up to the next jump target.
+bool remove_dead_code(Instruction *code, int count) {
+  bool changed = false;
+
+  for (int i = 0; i < count; ++i) {
+    Instruction *inst = &code[i];
+    if (inst->removed ||
+        (inst->op != OP_RETURN && inst->op != OP_JUMP && inst->op != OP_LOOP))
+      continue;
+
+    for (int j = i + 1; j < count && !code[j].is_target; ++j) {
+      if (!code[j].removed) {
+        code[j].removed = true;
+        changed = true;
+      }
+    }
+  }
+
+  return changed;
+}
+
+// Target flags are only recomputed between rounds, so when an instruction
+// that is a jump target goes away its flag moves to whatever now follows it.
+bool rewrite_sequences(Instruction *code, int count) {
+  bool changed = false;
+
+  for (int i = next_live(code, count, 0); i < count;
+       i = next_live(code, count, i + 1)) {
+    Instruction *inst = &code[i];
+    int n = next_live(code, count, i + 1);
+    if (n == count)
+      break;
+
+    Instruction *next = &code[n];
+    if (next->is_target)
+      continue;
+
+    // a value pushed only to be popped again
+    if (is_pure_push(inst->op) && next->op == OP_POP) {
+      inst->removed = true;
+      next->removed = true;
+      int after = next_live(code, count, n + 1);
+      if (inst->is_target && after < count) {
+        code[after].is_target = true;
+      }
+      changed = true;
+      continue;
+    }
+
+    // OP_NOT feeding a branch whose successors both discard the condition
+    if (inst->op == OP_NOT && is_conditional_jump(next->op)) {
+      int fall = next_live(code, count, n + 1);
+      int taken = next_live(code, count, next->target);
+      if (fall < count && taken < count && code[fall].op == OP_POP &&
+          code[taken].op == OP_POP) {
+        inst->removed = true;
+        next->is_target = inst->is_target;
+        next->op = next->op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE
+                                                : OP_JUMP_IF_FALSE;
+        changed = true;
+      }
+      continue;
+    }
+
+    // a branch over a forward jump, which is how 'or' is compiled, becomes
+    // the opposite branch straight to the jump's destination
+    if (is_conditional_jump(inst->op) && next->op == OP_JUMP &&
+        next_live(code, count, inst->target) == next_live(code, count, n + 1)) {
+      int destination = next_live(code, count, next->target);
+      if (destination > n) {
+        inst->op = inst->op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE
+                                                : OP_JUMP_IF_FALSE;
+        inst->target = destination;
+        code[destination].is_target = true;
+        next->removed = true;
+        changed = true;
+      }
+    }
+  }
+
+  return changed;
+}
@@ -0,0 +1,40 @@
+#include "Output.h"
+#include <string.h>
+
+void init_output(Output *output, FILE *stream, char *chars, size_t capacity) {
+  output->stream = stream;
+  output->chars = chars;
+  output->size = 0;
+  output->capacity = capacity;
+}
+
+void flush_output(Output *output) {
+  if (output->size > 0) {
+    fwrite(output->chars, 1, output->size, output->stream);
+    output->size = 0;
+  }
+  fflush(output->stream);
+}
+
+// Anything larger than the buffer goes straight to the stream.
+void write_output(Output *output, const char *chars, size_t length) {
+  if (output->capacity - output->size < length) {
+    fwrite(output->chars, 1, output->size, output->stream);
+    output->size = 0;
+    if (length >= output->capacity) {
+      fwrite(chars, 1, length, output->stream);
+      return;
+    }
+  }
+
+  memcpy(output->chars + output->size, chars, length);
+  output->size += length;
+}
+
+void write_output_char(Output *output, char c) {
+  if (output->size == output->capacity) {
+    fwrite(output->chars, 1, output->size, output->stream);
+    output->size = 0;
+  }
+  output->chars[output->size++] = c;
+}
@@ -1,6 +1,7 @@
 #include "Parser.h"
 #include "Compiler.h"
 #include "Scanner.h"
+#include "VM.h"
 #include <stdio.h>
 
 void init_parser(Parser *parser, Scanner *scanner)
@@ -8,6 +9,7 @@ void init_parser(Parser *parser, Scanner *scanner)
   parser->scanner = scanner;
   parser->had_error = false;
   parser->panic_mode = false;
+  init_arena(&parser->arena);
 }
 
 void advance(Compiler *compiler)
@@ -96,6 +98,8 @@ void error_at(Compiler *compiler, Token *token, const char *message)
   if (compiler->parser->panic_mode)
     return;
   compiler->parser->panic_mode = true;
+  // a lazily compiled function fails in the middle of the program's output
+  flush_output(&compiler->vm->output);
   fprintf(stderr, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF)
@@ -149,6 +153,8 @@ ParseRule rules[] = {
     {NULL, NULL, PREC_NONE},         // TOKEN_RIGHT_PAREN
     {NULL, NULL, PREC_NONE},         // TOKEN_LEFT_BRACE
     {NULL, NULL, PREC_NONE},         // TOKEN_RIGHT_BRACE
+    {list, subscript, PREC_CALL},    // TOKEN_LEFT_BRACKET
+    {NULL, NULL, PREC_NONE},         // TOKEN_RIGHT_BRACKET
     {NULL, NULL, PREC_NONE},         // TOKEN_COMMA
     {NULL, dot, PREC_CALL},          // TOKEN_DOT
     {unary, binary, PREC_TERM},      // TOKEN_MINUS
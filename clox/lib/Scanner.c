@@ -1,13 +1,63 @@
 #include "Scanner.h"
-#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if !defined(LOX_NO_SIMD) && (defined(__SSE2__) || defined(__AVX2__))
+#include <immintrin.h>
+#endif
+
+// Character classes of the source bytes, anything outside ASCII is none of
+// them.
+#define CHAR_ALPHA 1
+#define CHAR_DIGIT 2
+#define CHAR_SPACE 4
+// may continue an identifier
+#define CHAR_IDENT 8
+
+#define S CHAR_SPACE
+#define L (CHAR_ALPHA | CHAR_IDENT)
+#define D (CHAR_DIGIT | CHAR_IDENT)
+#define U CHAR_IDENT
+
+static const uint8_t char_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, S, 0, 0, S, 0, 0, // \t \n \r
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, //
+    S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // space
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0, // 0-9
+    0, L, L, L, L, L, L, L, L, L, L, L, L, L, L, L, // A-O
+    L, L, L, L, L, L, L, L, L, L, L, 0, 0, 0, 0, U, // P-Z _
+    0, L, L, L, L, L, L, L, L, L, L, L, L, L, L, L, // a-o
+    L, L, L, L, L, L, L, L, L, L, L, 0, 0, 0, 0, 0, // p-z
+};
+
+#undef S
+#undef L
+#undef D
+#undef U
+
+// most runs are shorter than this, they never reach the vector loops
+#define SCALAR_RUN_MAX 16
+
+#define NUMBER_DIGITS_MAX 19
+#define EXACT_POWER_MAX 22
+
+static const double powers_of_ten[EXACT_POWER_MAX + 1] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static bool has_class(char c, uint8_t mask);
 static char advance(Scanner *scanner);
 static char peek(Scanner *scanner);
 static char peek_next(Scanner *scanner);
 static void skip_whitespace(Scanner *scanner);
+static const char *skip_spaces(const char *p, const char *end, int *lines);
+static const char *skip_identifier(const char *p, const char *end);
+static const char *find_either(const char *p, const char *end, char a,
+                               char b);
 static bool is_at_end(Scanner *scanner);
 static bool match(Scanner *scanner, char c);
 static Token make_token(Scanner *scanner, TokenType type);
@@ -19,9 +69,10 @@ static TokenType identifier_type(Scanner *scanner);
 static TokenType check_keyword(Scanner *scanner, int start, int length,
                                const char *rest, TokenType type);
 
-void init_scanner(Scanner *scanner, const char *src) {
+void init_scanner(Scanner *scanner, const char *src, const char *end) {
   scanner->start = src;
   scanner->current = src;
+  scanner->end = end;
   scanner->line = 1;
 }
 
@@ -35,9 +86,9 @@ Token scan_token(Scanner *scanner) {
 
   char c = advance(scanner);
 
-  if (isalpha(c))
+  if (has_class(c, CHAR_ALPHA))
     return identifier(scanner);
-  if (isdigit(c))
+  if (has_class(c, CHAR_DIGIT))
     return number(scanner);
 
   switch (c) {
@@ -49,6 +100,10 @@ Token scan_token(Scanner *scanner) {
     return make_token(scanner, TOKEN_LEFT_BRACE);
   case '}':
     return make_token(scanner, TOKEN_RIGHT_BRACE);
+  case '[':
+    return make_token(scanner, TOKEN_LEFT_BRACKET);
+  case ']':
+    return make_token(scanner, TOKEN_RIGHT_BRACKET);
   case ';':
     return make_token(scanner, TOKEN_SEMICOLON);
   case ',':
@@ -84,17 +139,73 @@ Token scan_token(Scanner *scanner) {
   return error_token(scanner, "Unexpected character.");
 }
 
+// Numbers are exact when the digits fit in 53 bits and the power of ten is
+// itself a double, a single correctly rounded division then gives the same
+// result strtod does. Anything longer is left to strtod, on a copy so it
+// stops where the token does.
+double parse_number(const char *start, int length) {
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int scale = 0;
+  bool fraction = false;
+
+  for (int i = 0; i < length; ++i) {
+    if (start[i] == '.') {
+      fraction = true;
+      continue;
+    }
+
+    // counted from the first nonzero digit, a mantissa that wrapped around
+    // to 0 still has too many
+    mantissa = mantissa * 10 + (uint64_t)(start[i] - '0');
+    if (digits > 0 || start[i] != '0') {
+      ++digits;
+    }
+    if (fraction) {
+      ++scale;
+    }
+  }
+
+  if (digits <= NUMBER_DIGITS_MAX && mantissa <= (UINT64_C(1) << 53) &&
+      scale <= EXACT_POWER_MAX) {
+    return (double)mantissa / powers_of_ten[scale];
+  }
+
+  char buffer[64];
+  char *copy = length < (int)sizeof(buffer) ? buffer : malloc(length + 1);
+  if (copy == NULL) {
+    fprintf(stderr, "Out of memory reading a number.\n");
+    exit(74);
+  }
+
+  memcpy(copy, start, length);
+  copy[length] = '\0';
+  double value = strtod(copy, NULL);
+  if (copy != buffer) {
+    free(copy);
+  }
+  return value;
+}
+
+bool has_class(char c, uint8_t mask) {
+  return (char_class[(uint8_t)c] & mask) != 0;
+}
+
 char advance(Scanner *scanner) { return *scanner->current++; }
 
-char peek(Scanner *scanner) { return *scanner->current; }
+char peek(Scanner *scanner) {
+  if (is_at_end(scanner))
+    return '\0';
+  return *scanner->current;
+}
 
 char peek_next(Scanner *scanner) {
-  if (is_at_end(scanner))
+  if (scanner->end - scanner->current < 2)
     return '\0';
   return scanner->current[1];
 }
 
-bool is_at_end(Scanner *scanner) { return *scanner->current == '\0'; }
+bool is_at_end(Scanner *scanner) { return scanner->current >= scanner->end; }
 
 bool match(Scanner *scanner, char c) {
   if (is_at_end(scanner))
@@ -107,57 +218,201 @@ bool match(Scanner *scanner, char c) {
 
 void skip_whitespace(Scanner *scanner) {
   for (;;) {
-    char c = peek(scanner);
-    switch (c) {
-    case ' ':
-    case '\t':
-    case '\r':
-      advance(scanner);
-      break;
-    case '\n':
-      ++scanner->line;
-      advance(scanner);
-      break;
-    case '/':
-      if (peek_next(scanner) == '/') {
-        // A comment goes until the end of the line.
-        while (peek(scanner) != '\n' && !is_at_end(scanner))
-          advance(scanner);
-      } else {
-        return;
-      }
-      break;
-    default:
+    int lines = 0;
+    scanner->current = skip_spaces(scanner->current, scanner->end, &lines);
+    scanner->line += lines;
+
+    if (peek(scanner) == '/' && peek_next(scanner) == '/') {
+      // A comment goes until the end of the line.
+      scanner->current =
+          find_either(scanner->current, scanner->end, '\n', '\n');
+    } else {
       return;
     }
   }
 }
 
+// The skip and find helpers below go a byte at a time for the first
+// SCALAR_RUN_MAX bytes, then 32 or 16 at a time while that many are left
+// before end, and finish a byte at a time.
+
+// Returns the first byte after the whitespace at p, counting the newlines
+// skipped.
+const char *skip_spaces(const char *p, const char *end, int *lines) {
+  const char *scalar_end = end - p > SCALAR_RUN_MAX ? p + SCALAR_RUN_MAX : end;
+  for (; p < scalar_end && has_class(*p, CHAR_SPACE); ++p) {
+    if (*p == '\n')
+      ++*lines;
+  }
+  if (p < scalar_end)
+    return p;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i newline = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'));
+    __m256i space = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+                        newline));
+    uint32_t other = ~(uint32_t)_mm256_movemask_epi8(space);
+    uint32_t newlines = (uint32_t)_mm256_movemask_epi8(newline);
+    if (other != 0) {
+      int skipped = __builtin_ctz(other);
+      *lines += __builtin_popcount(newlines & ((1u << skipped) - 1));
+      return p + skipped;
+    }
+
+    *lines += __builtin_popcount(newlines);
+    p += 32;
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i newline = _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'));
+    __m128i space = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), newline));
+    uint32_t other = ~(uint32_t)_mm_movemask_epi8(space) & 0xffff;
+    uint32_t newlines = (uint32_t)_mm_movemask_epi8(newline);
+    if (other != 0) {
+      int skipped = __builtin_ctz(other);
+      *lines += __builtin_popcount(newlines & ((1u << skipped) - 1));
+      return p + skipped;
+    }
+
+    *lines += __builtin_popcount(newlines);
+    p += 16;
+  }
+#endif
+
+  for (; p < end && has_class(*p, CHAR_SPACE); ++p) {
+    if (*p == '\n')
+      ++*lines;
+  }
+  return p;
+}
+
+// Returns the first byte at p that cannot continue an identifier.
+const char *skip_identifier(const char *p, const char *end) {
+  const char *scalar_end = end - p > SCALAR_RUN_MAX ? p + SCALAR_RUN_MAX : end;
+  while (p < scalar_end && has_class(*p, CHAR_IDENT))
+    ++p;
+  if (p < scalar_end)
+    return p;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    // folding the case leaves '_' and everything else outside a-z
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i alpha =
+        _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), lower));
+    __m256i digit =
+        _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    __m256i ident = _mm256_or_si256(
+        _mm256_or_si256(alpha, digit),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    uint32_t other = ~(uint32_t)_mm256_movemask_epi8(ident);
+    if (other != 0)
+      return p + __builtin_ctz(other);
+    p += 32;
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i alpha =
+        _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    __m128i ident = _mm_or_si128(_mm_or_si128(alpha, digit),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    uint32_t other = ~(uint32_t)_mm_movemask_epi8(ident) & 0xffff;
+    if (other != 0)
+      return p + __builtin_ctz(other);
+    p += 16;
+  }
+#endif
+
+  while (p < end && has_class(*p, CHAR_IDENT))
+    ++p;
+  return p;
+}
+
+// Returns the first a or b at p, end if there is none.
+const char *find_either(const char *p, const char *end, char a, char b) {
+  const char *scalar_end = end - p > SCALAR_RUN_MAX ? p + SCALAR_RUN_MAX : end;
+  while (p < scalar_end && *p != a && *p != b)
+    ++p;
+  if (p < scalar_end)
+    return p;
+
+#if defined(__AVX2__) && !defined(LOX_NO_SIMD)
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(a)),
+                                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(b)));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(found);
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+#endif
+
+#if defined(__SSE2__) && !defined(LOX_NO_SIMD)
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i found = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(a)),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8(b)));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(found);
+    if (mask != 0)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+
+  while (p < end && *p != a && *p != b)
+    ++p;
+  return p;
+}
+
 Token string(Scanner *scanner) {
-  while (peek(scanner) != '"' && !is_at_end(scanner)) {
-    if (peek(scanner) == '\n')
-      ++scanner->line;
+  for (;;) {
+    scanner->current = find_either(scanner->current, scanner->end, '"', '\n');
+    if (is_at_end(scanner))
+      return error_token(scanner, "Unterminated string.");
+    if (*scanner->current == '"')
+      break;
+
+    ++scanner->line;
     advance(scanner);
   }
 
-  if (is_at_end(scanner))
-    return error_token(scanner, "Unterminated string.");
-
   // The closing quote.
   advance(scanner);
   return make_token(scanner, TOKEN_STRING);
 }
 
 Token number(Scanner *scanner) {
-  while (isdigit(peek(scanner)))
+  while (has_class(peek(scanner), CHAR_DIGIT))
     advance(scanner);
 
   // Look for a fractional part.
-  if (peek(scanner) == '.' && isdigit(peek_next(scanner))) {
+  if (peek(scanner) == '.' && has_class(peek_next(scanner), CHAR_DIGIT)) {
     // Consume the ".".
     advance(scanner);
 
-    while (isdigit(peek(scanner)))
+    while (has_class(peek(scanner), CHAR_DIGIT))
       advance(scanner);
   }
 
@@ -165,10 +420,7 @@ Token number(Scanner *scanner) {
 }
 
 Token identifier(Scanner *scanner) {
-  while (isalpha(peek(scanner)) || isdigit(peek(scanner)) ||
-         peek(scanner) == '_')
-    advance(scanner);
-
+  scanner->current = skip_identifier(scanner->current, scanner->end);
   return make_token(scanner, identifier_type(scanner));
 }
 
@@ -0,0 +1,207 @@
+#include "Serialize.h"
+#include "Memory.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void init_writer(Writer *writer) {
+  writer->bytes = NULL;
+  writer->size = 0;
+  writer->capacity = 0;
+  writer->ok = true;
+}
+
+void free_writer(Writer *writer) {
+  free(writer->bytes);
+  init_writer(writer);
+}
+
+// The file is written next to its final name and renamed over it, so a
+// process started meanwhile sees either the old file or the new one. The
+// temporary file gets a unique name, two processes writing the same path
+// never write into each other's file.
+bool write_file(Writer *writer, const char *path) {
+  size_t length = strlen(path);
+  char *temporary = malloc(length + 8);
+  if (!writer->ok || temporary == NULL) {
+    free(temporary);
+    return false;
+  }
+
+  memcpy(temporary, path, length);
+  memcpy(temporary + length, ".XXXXXX", 8);
+
+  int fd = mkstemp(temporary);
+  if (fd == -1) {
+    free(temporary);
+    return false;
+  }
+
+  // mkstemp leaves the file to its owner only, a file written directly
+  // would have had the permissions the umask allows
+  mode_t mask = umask(0);
+  umask(mask);
+  bool ok = fchmod(fd, 0666 & ~mask) == 0;
+
+  FILE *file = fdopen(fd, "wb");
+  if (file == NULL) {
+    close(fd);
+    ok = false;
+  }
+
+  ok = ok && fwrite(writer->bytes, 1, writer->size, file) == writer->size;
+  if (file != NULL && fclose(file) != 0) {
+    ok = false;
+  }
+
+  if (ok) {
+    ok = rename(temporary, path) == 0;
+  }
+  if (!ok) {
+    remove(temporary);
+  }
+
+  free(temporary);
+  return ok;
+}
+
+void put_bytes(Writer *writer, const void *bytes, size_t size) {
+  if (writer->size + size > writer->capacity) {
+    size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+    while (capacity < writer->size + size) {
+      capacity *= 2;
+    }
+
+    uint8_t *grown = realloc(writer->bytes, capacity);
+    if (grown == NULL) {
+      writer->ok = false;
+      return;
+    }
+    writer->bytes = grown;
+    writer->capacity = capacity;
+  }
+
+  memcpy(writer->bytes + writer->size, bytes, size);
+  writer->size += size;
+}
+
+void put_u8(Writer *writer, uint8_t value) { put_bytes(writer, &value, 1); }
+
+void put_u32(Writer *writer, uint32_t value) {
+  uint8_t bytes[4];
+  for (int i = 0; i < 4; ++i) {
+    bytes[i] = (value >> (8 * i)) & 0xff;
+  }
+  put_bytes(writer, bytes, 4);
+}
+
+void put_u64(Writer *writer, uint64_t value) {
+  put_u32(writer, (uint32_t)value);
+  put_u32(writer, (uint32_t)(value >> 32));
+}
+
+void put_number(Writer *writer, double number) {
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  put_u64(writer, bits);
+}
+
+// the line runs as they are, offset and line each
+void put_lines(Writer *writer, Chunk *chunk) {
+  put_u32(writer, (uint32_t)chunk->line_count);
+  for (int i = 0; i < chunk->line_count; ++i) {
+    put_u32(writer, (uint32_t)chunk->lines[i].offset);
+    put_u32(writer, (uint32_t)chunk->lines[i].line);
+  }
+}
+
+bool map_file(const char *path, Reader *reader) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  reader->start = data;
+  reader->at = data;
+  reader->end = reader->start + st.st_size;
+  reader->ok = true;
+  return true;
+}
+
+void unmap_file(Reader *reader) {
+  munmap((void *)reader->start, reader->end - reader->start);
+}
+
+const uint8_t *get_bytes(Reader *reader, size_t size) {
+  static const uint8_t zeroes[8];
+  if (!reader->ok || (size_t)(reader->end - reader->at) < size) {
+    reader->ok = false;
+    return zeroes;
+  }
+
+  const uint8_t *bytes = reader->at;
+  reader->at += size;
+  return bytes;
+}
+
+uint8_t get_u8(Reader *reader) { return *get_bytes(reader, 1); }
+
+uint32_t get_u32(Reader *reader) {
+  const uint8_t *bytes = get_bytes(reader, 4);
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+         (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+uint64_t get_u64(Reader *reader) {
+  uint64_t low = get_u32(reader);
+  return low | (uint64_t)get_u32(reader) << 32;
+}
+
+double get_number(Reader *reader) {
+  uint64_t bits = get_u64(reader);
+  double number;
+  memcpy(&number, &bits, sizeof(number));
+  return number;
+}
+
+// Reads the line runs of a chunk whose code is already read. The runs must
+// start at the first byte and move forward through the code.
+void get_lines(VM *vm, Reader *reader, Chunk *chunk) {
+  uint32_t count = get_u32(reader);
+  if (!reader->ok || count == 0 || count > chunk->size ||
+      count > (size_t)(reader->end - reader->at) / 8) {
+    reader->ok = false;
+    return;
+  }
+
+  chunk->lines = allocate(vm, sizeof(LineRun), count);
+  chunk->line_capacity = (int)count;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t offset = get_u32(reader);
+    uint32_t line = get_u32(reader);
+    if (offset >= chunk->size || (i == 0) != (offset == 0) ||
+        (i > 0 && offset <= (uint32_t)chunk->lines[i - 1].offset) ||
+        line > INT32_MAX) {
+      reader->ok = false;
+      return;
+    }
+
+    chunk->lines[i].offset = (int)offset;
+    chunk->lines[i].line = (int)line;
+    chunk->line_count = (int)i + 1;
+  }
+}
@@ -0,0 +1,669 @@
+#include "Snapshot.h"
+#include "Map.h"
+#include "Memory.h"
+#include "Natives.h"
+#include "Object.h"
+#include "Serialize.h"
+#include "VM.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum ValueTag {
+  TAG_NIL,
+  TAG_FALSE,
+  TAG_TRUE,
+  TAG_NUMBER,
+  TAG_OBJECT,
+};
+
+// The order objects are written in. The shape of an object only refers to
+// kinds before its own, so every object can be allocated in one pass: a
+// closure needs its function's upvalue count, an instance its class and a
+// native the name of the global it is defined as.
+static const ObjType image_order[] = {
+    OBJ_STRING,  OBJ_NATIVE,  OBJ_FUNCTION, OBJ_CLASS,
+    OBJ_UPVALUE, OBJ_CLOSURE, OBJ_INSTANCE, OBJ_BOUND_METHOD,
+    OBJ_LIST,    OBJ_MAP,     OBJ_FLOAT64_ARRAY,
+};
+
+#define IMAGE_KINDS (int)(sizeof(image_order) / sizeof(image_order[0]))
+
+// An object and its position in the image, entries of an open addressing
+// map from objects to their positions.
+struct ObjIndex {
+  Obj *obj;
+  uint32_t index;
+};
+
+typedef struct ObjIndex ObjIndex;
+
+struct ImageWriter {
+  VM *vm;
+  Writer writer;
+  Obj **objects;
+  uint32_t count;
+  ObjIndex *indices;
+  uint32_t capacity;
+};
+
+typedef struct ImageWriter ImageWriter;
+
+// Objects rebuilt so far are also kept on the VM stack, above base, so a
+// collection while the heap is half restored finds them.
+struct ImageReader {
+  VM *vm;
+  Reader reader;
+  Obj **objects;
+  uint32_t count;
+  size_t base;
+};
+
+typedef struct ImageReader ImageReader;
+
+static bool collect_objects(ImageWriter *image);
+static ObjIndex *find_index(ImageWriter *image, Obj *obj);
+static void put_ref(ImageWriter *image, Obj *obj);
+static void put_value(ImageWriter *image, Value value);
+static void put_shape(ImageWriter *image, Obj *obj);
+static void put_references(ImageWriter *image, Obj *obj);
+static void put_table(ImageWriter *image, Table *table);
+static Obj *get_ref(ImageReader *image, ObjType type, uint32_t before);
+static Value get_value(ImageReader *image, bool boxed);
+static Obj *get_shape(ImageReader *image, uint32_t index);
+static void get_references(ImageReader *image, Obj *obj);
+static bool get_globals(ImageReader *image);
+
+// Only objects still alive are written, so a collection runs first. The
+// heap must be at rest: no frame running, every upvalue closed and every
+// function compiled.
+bool write_image(VM *vm, const char *path) {
+  if (vm->frame_count != 0 || vm->open_upvalues != NULL)
+    return false;
+
+  collect_garbage(vm);
+
+  ImageWriter image = {vm, {NULL, 0, 0, true}, NULL, 0, NULL, 0};
+  init_writer(&image.writer);
+  bool ok = collect_objects(&image);
+  if (ok) {
+    put_bytes(&image.writer, IMAGE_MAGIC, 4);
+    put_u32(&image.writer, IMAGE_VERSION);
+    put_u32(&image.writer, image.count);
+    for (uint32_t i = 0; i < image.count; ++i) {
+      put_shape(&image, image.objects[i]);
+    }
+    for (uint32_t i = 0; i < image.count; ++i) {
+      put_references(&image, image.objects[i]);
+    }
+    put_table(&image, &vm->globals);
+    ok = write_file(&image.writer, path);
+  }
+
+  free_writer(&image.writer);
+  free(image.objects);
+  free(image.indices);
+  return ok;
+}
+
+// Maps the image and rebuilds its heap in the VM, which must not have run
+// anything yet. The image is trusted to come from this build of clox: its
+// structure is checked, its code is not verified.
+bool read_image(VM *vm, const char *path) {
+  ImageReader image = {vm, {NULL, NULL, NULL, false}, NULL, 0, 0};
+  if (!map_file(path, &image.reader))
+    return false;
+
+  Reader *reader = &image.reader;
+  const uint8_t *magic = get_bytes(reader, 4);
+  uint32_t version = get_u32(reader);
+  image.count = get_u32(reader);
+  bool ok = reader->ok && memcmp(magic, IMAGE_MAGIC, 4) == 0 &&
+            version == IMAGE_VERSION &&
+            image.count <= (size_t)(reader->end - reader->at);
+
+  if (ok) {
+    image.objects = malloc(sizeof(Obj *) * (image.count + 1));
+    image.base = vm->stack_top - vm->stack;
+    ok = image.objects != NULL;
+  }
+
+  for (uint32_t i = 0; ok && i < image.count; ++i) {
+    image.objects[i] = get_shape(&image, i);
+    ok = reader->ok && image.objects[i] != NULL;
+    if (ok) {
+      push(vm, object_val(image.objects[i]));
+    }
+  }
+
+  for (uint32_t i = 0; ok && i < image.count; ++i) {
+    get_references(&image, image.objects[i]);
+    ok = reader->ok;
+  }
+
+  ok = ok && get_globals(&image) && reader->at == reader->end;
+
+  if (image.objects != NULL) {
+    vm->stack_top = vm->stack + image.base;
+  }
+  free(image.objects);
+  unmap_file(reader);
+  return ok;
+}
+
+bool collect_objects(ImageWriter *image) {
+  for (Obj *obj = image->vm->objects; obj != NULL; obj = obj->next) {
+    ++image->count;
+  }
+
+  image->capacity = 16;
+  while (image->capacity < 2 * image->count) {
+    image->capacity *= 2;
+  }
+
+  image->objects = malloc(sizeof(Obj *) * (image->count + 1));
+  image->indices = calloc(image->capacity, sizeof(ObjIndex));
+  if (image->objects == NULL || image->indices == NULL)
+    return false;
+
+  uint32_t index = 0;
+  for (int kind = 0; kind < IMAGE_KINDS; ++kind) {
+    for (Obj *obj = image->vm->objects; obj != NULL; obj = obj->next) {
+      if (obj->type != image_order[kind])
+        continue;
+
+      if (obj->type == OBJ_FUNCTION && ((ObjFunction *)obj)->lazy != NULL)
+        return false;
+
+      ObjIndex *entry = find_index(image, obj);
+      entry->obj = obj;
+      entry->index = index;
+      image->objects[index++] = obj;
+    }
+  }
+
+  // anything left is of a kind images cannot hold
+  return index == image->count;
+}
+
+ObjIndex *find_index(ImageWriter *image, Obj *obj) {
+  uint32_t mask = image->capacity - 1;
+  uint32_t i = (uint32_t)(((uintptr_t)obj >> 3) * 2654435761u) & mask;
+  while (image->indices[i].obj != NULL && image->indices[i].obj != obj) {
+    i = (i + 1) & mask;
+  }
+  return &image->indices[i];
+}
+
+void put_ref(ImageWriter *image, Obj *obj) {
+  put_u32(&image->writer, find_index(image, obj)->index);
+}
+
+void put_value(ImageWriter *image, Value value) {
+  Writer *writer = &image->writer;
+  if (is_nil(value)) {
+    put_u8(writer, TAG_NIL);
+  } else if (is_bool(value)) {
+    put_u8(writer, as_bool(value) ? TAG_TRUE : TAG_FALSE);
+  } else if (is_number(value)) {
+    put_u8(writer, TAG_NUMBER);
+    put_number(writer, as_number(value));
+  } else {
+    put_u8(writer, TAG_OBJECT);
+    put_ref(image, as_object(value));
+  }
+}
+
+void put_shape(ImageWriter *image, Obj *obj) {
+  Writer *writer = &image->writer;
+  put_u8(writer, (uint8_t)obj->type);
+
+  switch (obj->type) {
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)obj;
+    put_u32(writer, (uint32_t)string->length);
+    put_bytes(writer, string->chars, string->length);
+    break;
+  }
+
+  // a native is written as the name it was registered under, whatever
+  // globals hold it
+  case OBJ_NATIVE: {
+    const char *name = ((ObjNative *)obj)->name;
+    put_u32(writer, (uint32_t)strlen(name));
+    put_bytes(writer, name, strlen(name));
+    break;
+  }
+
+  case OBJ_FUNCTION: {
+    ObjFunction *fn = (ObjFunction *)obj;
+    put_u32(writer, (uint32_t)fn->arity);
+    put_u32(writer, (uint32_t)fn->upvalue_count);
+    put_u32(writer, (uint32_t)fn->calls);
+    put_u8(writer, fn->optimized);
+    break;
+  }
+
+  case OBJ_CLASS:
+    put_u32(writer, (uint32_t)((ObjClass *)obj)->field_count);
+    break;
+
+  case OBJ_CLOSURE:
+    put_ref(image, (Obj *)((ObjClosure *)obj)->fn);
+    break;
+
+  case OBJ_INSTANCE:
+    put_ref(image, (Obj *)((ObjInstance *)obj)->klass);
+    break;
+
+  case OBJ_LIST:
+    put_u32(writer, (uint32_t)((ObjList *)obj)->count);
+    break;
+
+  case OBJ_MAP:
+    put_u32(writer, (uint32_t)((ObjMap *)obj)->count);
+    break;
+
+  // the elements refer to nothing, they are all part of the shape
+  case OBJ_FLOAT64_ARRAY: {
+    ObjFloat64Array *array = (ObjFloat64Array *)obj;
+    put_u32(writer, (uint32_t)array->count);
+    for (int i = 0; i < array->count; ++i) {
+      put_number(writer, array->items[i]);
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+// Functions are written with the code they run now, rewritten by the
+// optimizing tier or not.
+void put_references(ImageWriter *image, Obj *obj) {
+  Writer *writer = &image->writer;
+
+  switch (obj->type) {
+  case OBJ_FUNCTION: {
+    ObjFunction *fn = (ObjFunction *)obj;
+    Chunk *chunk = &fn->chunk;
+    put_ref(image, (Obj *)fn->name);
+    put_u32(writer, (uint32_t)chunk->size);
+    put_bytes(writer, chunk->code, chunk->size);
+    put_lines(writer, chunk);
+    put_u32(writer, (uint32_t)chunk->constants.size);
+    for (size_t i = 0; i < chunk->constants.size; ++i) {
+      put_value(image, chunk->constants.values[i]);
+    }
+    break;
+  }
+
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)obj;
+    put_ref(image, (Obj *)klass->name);
+
+    // the loaded class numbers its methods afresh
+    Table *slots = &klass->layout->slots;
+    uint32_t count = 0;
+    for (int i = 0; i < klass->method_count; ++i) {
+      count += klass->methods[i] != NULL;
+    }
+    put_u32(writer, count);
+    for (int i = 0; i < slots->capacity; ++i) {
+      Entry *entry = &slots->entries[i];
+      if (entry->key == NULL) {
+        continue;
+      }
+
+      int slot = (int)as_number(entry->value);
+      if (slot < klass->method_count && klass->methods[slot] != NULL) {
+        put_ref(image, (Obj *)entry->key);
+        put_ref(image, (Obj *)klass->methods[slot]);
+      }
+    }
+    break;
+  }
+
+  case OBJ_UPVALUE:
+    put_value(image, ((ObjUpvalue *)obj)->closed);
+    break;
+
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)obj;
+    for (int i = 0; i < closure->upvalue_count; ++i) {
+      put_value(image, closure->upvalues[i]);
+    }
+    break;
+  }
+
+  case OBJ_INSTANCE:
+    put_table(image, &((ObjInstance *)obj)->fields);
+    break;
+
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound_method = (ObjBoundMethod *)obj;
+    put_value(image, bound_method->receiver);
+    put_ref(image, (Obj *)bound_method->method);
+    break;
+  }
+
+  case OBJ_LIST: {
+    ObjList *list = (ObjList *)obj;
+    for (int i = 0; i < list->count; ++i) {
+      put_value(image, list->items[i]);
+    }
+    break;
+  }
+
+  // live entries in insertion order, the index is rebuilt on reading
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *)obj;
+    for (int i = 0; i < map->entry_count; ++i) {
+      if (!map->entries[i].removed) {
+        put_value(image, map->entries[i].key);
+        put_value(image, map->entries[i].value);
+      }
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+void put_table(ImageWriter *image, Table *table) {
+  uint32_t count = 0;
+  for (int i = 0; i < table->capacity; ++i) {
+    count += table->entries[i].key != NULL;
+  }
+
+  put_u32(&image->writer, count);
+  for (int i = 0; i < table->capacity; ++i) {
+    Entry *entry = &table->entries[i];
+    if (entry->key != NULL) {
+      put_ref(image, (Obj *)entry->key);
+      put_value(image, entry->value);
+    }
+  }
+}
+
+// A reference to an object of the given kind among the first before ones.
+Obj *get_ref(ImageReader *image, ObjType type, uint32_t before) {
+  uint32_t index = get_u32(&image->reader);
+  if (!image->reader.ok || index >= before ||
+      image->objects[index]->type != type) {
+    image->reader.ok = false;
+    return NULL;
+  }
+  return image->objects[index];
+}
+
+// Only a closure's own upvalues may be boxed.
+Value get_value(ImageReader *image, bool boxed) {
+  Reader *reader = &image->reader;
+  switch (get_u8(reader)) {
+  case TAG_NIL:
+    return nil_val();
+  case TAG_FALSE:
+    return bool_val(false);
+  case TAG_TRUE:
+    return bool_val(true);
+  case TAG_NUMBER:
+    return number_val(get_number(reader));
+  case TAG_OBJECT: {
+    uint32_t index = get_u32(reader);
+    if (reader->ok && index < image->count &&
+        (boxed || image->objects[index]->type != OBJ_UPVALUE))
+      return object_val(image->objects[index]);
+    break;
+  }
+  default:
+    break;
+  }
+
+  reader->ok = false;
+  return nil_val();
+}
+
+Obj *get_shape(ImageReader *image, uint32_t index) {
+  VM *vm = image->vm;
+  Reader *reader = &image->reader;
+
+  switch (get_u8(reader)) {
+  case OBJ_STRING: {
+    uint32_t length = get_u32(reader);
+    if (!reader->ok || length > (size_t)(reader->end - reader->at))
+      return NULL;
+    return (Obj *)copy_string(vm, (const char *)get_bytes(reader, length),
+                              length);
+  }
+
+  case OBJ_NATIVE: {
+    uint32_t length = get_u32(reader);
+    if (!reader->ok || length > (size_t)(reader->end - reader->at))
+      return NULL;
+    return (Obj *)find_native(vm, (const char *)get_bytes(reader, length),
+                              length);
+  }
+
+  case OBJ_FUNCTION: {
+    ObjFunction *fn = new_function(vm);
+    fn->arity = (int)get_u32(reader);
+    fn->upvalue_count = (int)get_u32(reader);
+    fn->calls = (int)get_u32(reader);
+    fn->optimized = get_u8(reader) != 0;
+    if (fn->arity > 255 || fn->upvalue_count > 256 || fn->calls < 0) {
+      reader->ok = false;
+    }
+    return (Obj *)fn;
+  }
+
+  case OBJ_CLASS: {
+    ObjClass *klass = new_class(vm, NULL);
+    klass->field_count = (int)get_u32(reader);
+    if (klass->field_count < 0) {
+      reader->ok = false;
+    }
+    return (Obj *)klass;
+  }
+
+  case OBJ_UPVALUE: {
+    ObjUpvalue *upvalue = new_upvalue(vm, NULL);
+    upvalue->location = &upvalue->closed;
+    return (Obj *)upvalue;
+  }
+
+  case OBJ_CLOSURE: {
+    ObjFunction *fn = (ObjFunction *)get_ref(image, OBJ_FUNCTION, index);
+    return fn == NULL ? NULL : (Obj *)new_closure(vm, fn);
+  }
+
+  case OBJ_INSTANCE: {
+    ObjClass *klass = (ObjClass *)get_ref(image, OBJ_CLASS, index);
+    return klass == NULL ? NULL : (Obj *)new_instance(vm, klass);
+  }
+
+  case OBJ_BOUND_METHOD:
+    return (Obj *)new_bound_method(vm, nil_val(), NULL);
+
+  // every element takes at least a byte of the image
+  case OBJ_LIST: {
+    uint32_t count = get_u32(reader);
+    if (!reader->ok || count > (size_t)(reader->end - reader->at))
+      return NULL;
+
+    ObjList *list = new_list(vm, NULL, 0);
+    push(vm, object_val((Obj *)list));
+    for (uint32_t i = 0; i < count; ++i) {
+      list_append(vm, list, nil_val());
+    }
+    pop(vm);
+    return (Obj *)list;
+  }
+
+  // the entries are sized to the count, which the references fill
+  case OBJ_MAP: {
+    uint32_t count = get_u32(reader);
+    if (!reader->ok || count > (size_t)(reader->end - reader->at) / 2)
+      return NULL;
+
+    ObjMap *map = new_map(vm);
+    push(vm, object_val((Obj *)map));
+    map->entries = allocate(vm, sizeof(MapEntry), count);
+    map->entry_capacity = (int)count;
+    pop(vm);
+    return (Obj *)map;
+  }
+
+  case OBJ_FLOAT64_ARRAY: {
+    uint32_t count = get_u32(reader);
+    if (!reader->ok ||
+        count > (size_t)(reader->end - reader->at) / sizeof(double))
+      return NULL;
+
+    ObjFloat64Array *array = new_float64_array(vm, (int)count);
+    if (array == NULL)
+      return NULL;
+
+    for (uint32_t i = 0; i < count; ++i) {
+      array->items[i] = get_number(reader);
+    }
+    return (Obj *)array;
+  }
+
+  default:
+    return NULL;
+  }
+}
+
+void get_references(ImageReader *image, Obj *obj) {
+  VM *vm = image->vm;
+  Reader *reader = &image->reader;
+
+  switch (obj->type) {
+  case OBJ_FUNCTION: {
+    ObjFunction *fn = (ObjFunction *)obj;
+    Chunk *chunk = &fn->chunk;
+    fn->name = (ObjString *)get_ref(image, OBJ_STRING, image->count);
+    uint32_t size = get_u32(reader);
+    if (!reader->ok || size == 0 || size > (size_t)(reader->end - reader->at)) {
+      reader->ok = false;
+      return;
+    }
+
+    chunk->code = allocate(vm, sizeof(uint8_t), size);
+    chunk->capacity = size;
+    chunk->size = size;
+    memcpy(chunk->code, get_bytes(reader, size), size);
+    get_lines(vm, reader, chunk);
+
+    uint32_t count = get_u32(reader);
+    for (uint32_t i = 0; i < count && reader->ok; ++i) {
+      Value value = get_value(image, false);
+      if (reader->ok) {
+        add_constant(vm, chunk, value);
+      }
+    }
+    break;
+  }
+
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)obj;
+    klass->name = (ObjString *)get_ref(image, OBJ_STRING, image->count);
+    uint32_t count = get_u32(reader);
+    for (uint32_t i = 0; i < count && reader->ok; ++i) {
+      ObjString *name = (ObjString *)get_ref(image, OBJ_STRING, image->count);
+      ObjClosure *method =
+          (ObjClosure *)get_ref(image, OBJ_CLOSURE, image->count);
+      if (reader->ok) {
+        set_method(vm, klass, name, method);
+      }
+    }
+    break;
+  }
+
+  case OBJ_UPVALUE:
+    ((ObjUpvalue *)obj)->closed = get_value(image, false);
+    break;
+
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)obj;
+    for (int i = 0; i < closure->upvalue_count; ++i) {
+      closure->upvalues[i] = get_value(image, true);
+    }
+    break;
+  }
+
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)obj;
+    uint32_t count = get_u32(reader);
+    for (uint32_t i = 0; i < count && reader->ok; ++i) {
+      ObjString *key = (ObjString *)get_ref(image, OBJ_STRING, image->count);
+      Value value = get_value(image, false);
+      if (reader->ok) {
+        table_set(vm, &instance->fields, key, value);
+      }
+    }
+    break;
+  }
+
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound_method = (ObjBoundMethod *)obj;
+    bound_method->receiver = get_value(image, false);
+    bound_method->method =
+        (ObjClosure *)get_ref(image, OBJ_CLOSURE, image->count);
+    break;
+  }
+
+  case OBJ_LIST: {
+    ObjList *list = (ObjList *)obj;
+    for (int i = 0; i < list->count; ++i) {
+      list->items[i] = get_value(image, false);
+    }
+    break;
+  }
+
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *)obj;
+    int count = map->entry_capacity;
+    for (int i = 0; i < count && image->reader.ok; ++i) {
+      Value key = get_value(image, false);
+      Value value = get_value(image, false);
+      map_set(image->vm, map, key, value);
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+// The globals are only defined once all of them were read, a damaged image
+// leaves the VM's globals as they were.
+bool get_globals(ImageReader *image) {
+  Reader *reader = &image->reader;
+  uint32_t count = get_u32(reader);
+  if (!reader->ok || count > (size_t)(reader->end - reader->at))
+    return false;
+
+  Entry *entries = malloc(sizeof(Entry) * (count + 1));
+  if (entries == NULL)
+    return false;
+
+  for (uint32_t i = 0; i < count && reader->ok; ++i) {
+    entries[i].key = (ObjString *)get_ref(image, OBJ_STRING, image->count);
+    entries[i].value = get_value(image, false);
+  }
+
+  bool ok = reader->ok;
+  for (uint32_t i = 0; ok && i < count; ++i) {
+    table_set(image->vm, &image->vm->globals, entries[i].key,
+              entries[i].value);
+  }
+
+  free(entries);
+  return ok;
+}
@@ -0,0 +1,1955 @@
+#include "Ssa.h"
+#include "Memory.h"
+#include "Object.h"
+#include "Opcode.h"
+#include "Optimizer.h"
+#include "Table.h"
+#include "VM.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DEBUG_PRINT_CODE
+#include "Debug.h"
+#endif
+
+// Each round lifts the code the previous round wrote back, so a rewrite can
+// expose more work for the next one.
+#define SSA_ROUNDS 3
+
+// Largest function, in bytes of code, that is spliced into its callers.
+#define INLINE_MAX_SIZE 64
+
+static void init_ssa(SsaFunction *f, VM *vm, ObjFunction *fn);
+static void free_ssa(SsaFunction *f);
+static int operand(SsaFunction *f, int index, int byte);
+static bool is_jump(uint8_t op);
+static bool is_pure(uint8_t op);
+static bool is_operation(uint8_t op);
+
+static bool build_blocks(SsaFunction *f);
+static void add_pred(SsaBlock *block, int pred);
+static void compute_order(SsaFunction *f);
+static void compute_dominators(SsaFunction *f);
+static int intersect(SsaFunction *f, int a, int b);
+static void number_dominator_tree(SsaFunction *f);
+static bool dominates_block(SsaFunction *f, int a, int b);
+static bool dominates(SsaFunction *f, int a, int b);
+
+static bool lift(SsaFunction *f);
+static bool lift_block(SsaFunction *f, int b, int *params);
+static bool simulate(SsaFunction *f, int index);
+static bool fill_phis(SsaFunction *f, int *params);
+static int new_value(SsaFunction *f, SsaKind kind, int inst, int block);
+static void push_slot(SsaFunction *f, int value, int producer);
+static bool pop_slots(SsaFunction *f, int count);
+static void push_result(SsaFunction *f, int index, int first);
+static void add_use(SsaFunction *f, int value);
+static int input_count(SsaFunction *f, int phi);
+static int resolve_phi(SsaFunction *f, int value);
+static int resolve(SsaFunction *f, int value);
+
+static void remove_trivial_phis(SsaFunction *f);
+static SsaType type_of(Value value);
+static SsaType join(SsaType a, SsaType b);
+static bool same_constant(Value a, Value b);
+static void evaluate(SsaFunction *f, int value, SsaType *type,
+                     bool *is_constant, Value *constant);
+static void infer_types(SsaFunction *f);
+static void mark_live(SsaFunction *f);
+static void find_proofs(SsaFunction *f);
+static bool is_number_at(SsaFunction *f, int value, int index);
+static bool pure_range(SsaFunction *f, int first, int last);
+static void remove_range(SsaFunction *f, int first, int last);
+static int constant_load(SsaFunction *f, Value value, uint8_t *out);
+
+static void eliminate_checks(SsaFunction *f);
+static void propagate_constants(SsaFunction *f);
+static void fold_branches(SsaFunction *f);
+static void eliminate_dead_code(SsaFunction *f);
+static int loop_body(SsaFunction *f, int header, bool *body, int *work);
+static bool has_preheader(SsaFunction *f, int header, bool *body);
+static bool is_invariant(SsaFunction *f, int first, int last, int header,
+                         bool *body);
+static void hoist_invariants(SsaFunction *f);
+static ObjFunction *global_callee(SsaFunction *f, int value);
+static bool can_inline(SsaFunction *f, ObjFunction *callee, int slot);
+static void inline_calls(SsaFunction *f);
+
+static void write_jump(uint8_t *code, size_t at, size_t length, size_t to);
+static size_t emit_original(SsaFunction *f, int index, uint8_t *code,
+                            int *lines, size_t size);
+static size_t emit_inlined(SsaFunction *f, int index, uint8_t *code,
+                           int *lines, size_t size);
+static void encode(SsaFunction *f, bool retire);
+
+void optimize_function(VM *vm, ObjFunction *fn, bool retire) {
+  fn->optimized = true;
+
+  for (int round = 0; round < SSA_ROUNDS; ++round) {
+    SsaFunction f;
+    init_ssa(&f, vm, fn);
+    // only the caller's own calls, the inlined bodies keep theirs
+    f.inlining = round == 0;
+
+    bool changed = false;
+    if (lift(&f)) {
+      remove_trivial_phis(&f);
+      infer_types(&f);
+      mark_live(&f);
+      find_proofs(&f);
+
+      eliminate_checks(&f);
+      propagate_constants(&f);
+      fold_branches(&f);
+      eliminate_dead_code(&f);
+      hoist_invariants(&f);
+      inline_calls(&f);
+
+      if (f.changed) {
+        encode(&f, retire);
+        retire = false;
+        changed = true;
+      }
+    }
+
+    free_ssa(&f);
+    if (!changed)
+      break;
+
+    peephole_optimize(&fn->chunk, NULL);
+  }
+
+#ifdef DEBUG_PRINT_CODE
+  disassemble_chunk(&fn->chunk, fn->name->chars, stderr);
+#endif
+}
+
+void init_ssa(SsaFunction *f, VM *vm, ObjFunction *fn) {
+  f->vm = vm;
+  f->fn = fn;
+  f->chunk = &fn->chunk;
+  f->count = decode_chunk(f->chunk, &f->code);
+  f->insts = malloc(sizeof(SsaInst) * (f->count + 1));
+  f->max_slot = fn->arity;
+
+  for (int i = 0; i < f->count; ++i) {
+    SsaInst *inst = &f->insts[i];
+    inst->block = -1;
+    inst->op = f->code[i].op;
+    inst->args[0] = inst->args[1] = -1;
+    inst->producers[0] = inst->producers[1] = -1;
+    inst->arg_count = 0;
+    inst->result = -1;
+    inst->first = -1;
+    inst->proof_next[0] = inst->proof_next[1] = -1;
+    inst->edited = false;
+    inst->removed = false;
+    inst->replacement_length = 0;
+    inst->hoist = -1;
+    inst->callee_slot = -1;
+    inst->callee_value = -1;
+    inst->inlined = NULL;
+
+    if ((inst->op == OP_GET_LOCAL || inst->op == OP_SET_LOCAL ||
+         inst->op == OP_INLINE_RETURN) &&
+        operand(f, i, 0) > f->max_slot) {
+      f->max_slot = operand(f, i, 0);
+    }
+  }
+
+  f->blocks = NULL;
+  f->block_count = 0;
+  f->order = NULL;
+  f->order_count = 0;
+  f->values = NULL;
+  f->value_count = 0;
+  f->value_capacity = 0;
+  f->stack = NULL;
+  f->depth = 0;
+  f->stack_capacity = 0;
+  f->uses = NULL;
+  f->use_count = 0;
+  f->use_capacity = 0;
+  f->hoists = NULL;
+  f->hoist_count = 0;
+  f->hoist_capacity = 0;
+  f->hidden = 0;
+  f->inlining = false;
+  f->changed = false;
+}
+
+void free_ssa(SsaFunction *f) {
+  for (int b = 0; b < f->block_count; ++b) {
+    free(f->blocks[b].preds);
+    free(f->blocks[b].entry);
+    free(f->blocks[b].exit);
+  }
+  for (int v = 0; v < f->value_count; ++v) {
+    free(f->values[v].inputs);
+  }
+
+  free(f->code);
+  free(f->insts);
+  free(f->blocks);
+  free(f->order);
+  free(f->values);
+  free(f->stack);
+  free(f->uses);
+  free(f->hoists);
+}
+
+int operand(SsaFunction *f, int index, int byte) {
+  Instruction *inst = &f->code[index];
+  return f->chunk->code[inst->offset + (inst->wide ? 2 : 1) + byte];
+}
+
+bool is_jump(uint8_t op) {
+  return op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_IF_FALSE ||
+         op == OP_JUMP_IF_TRUE || op == OP_JUMP_IF_CALLEE;
+}
+
+// Instructions that can neither fail nor have a side effect.
+bool is_pure(uint8_t op) {
+  switch (op) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_GET_FLAT_UPVALUE:
+    return true;
+  default:
+    return is_operation(op);
+  }
+}
+
+// Pure instructions that compute a value from their operands.
+bool is_operation(uint8_t op) {
+  switch (op) {
+  case OP_NOT:
+  case OP_EQUAL:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_NEGATE_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Splits the code into basic blocks and links them. Fails on code that runs
+// off its end, which the compiler never produces.
+bool build_blocks(SsaFunction *f) {
+  bool *leader = calloc(f->count + 1, sizeof(bool));
+  leader[0] = true;
+  for (int i = 0; i < f->count; ++i) {
+    uint8_t op = f->insts[i].op;
+    if (is_jump(op)) {
+      leader[f->code[i].target] = true;
+      leader[i + 1] = true;
+    } else if (op == OP_RETURN) {
+      leader[i + 1] = true;
+    }
+  }
+
+  bool ok = !leader[f->count] || f->insts[f->count - 1].op == OP_RETURN;
+  for (int i = 0; i < f->count; ++i) {
+    if (is_jump(f->insts[i].op) && f->code[i].target >= f->count) {
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    for (int i = 0; i < f->count; ++i) {
+      if (leader[i]) {
+        ++f->block_count;
+      }
+    }
+
+    f->blocks = calloc(f->block_count, sizeof(SsaBlock));
+    int b = -1;
+    for (int i = 0; i < f->count; ++i) {
+      if (leader[i]) {
+        SsaBlock *block = &f->blocks[++b];
+        block->start = i;
+        block->depth = -1;
+        block->exit_depth = -1;
+        block->rpo = -1;
+        block->idom = -1;
+        block->first_child = -1;
+        block->next_sibling = -1;
+      }
+      f->insts[i].block = b;
+      f->blocks[b].end = i + 1;
+    }
+
+    for (b = 0; b < f->block_count && ok; ++b) {
+      SsaBlock *block = &f->blocks[b];
+      int last = block->end - 1;
+      uint8_t op = f->insts[last].op;
+
+      if (op == OP_JUMP || op == OP_LOOP) {
+        block->succs[block->succ_count++] =
+            f->insts[f->code[last].target].block;
+      } else if (op != OP_RETURN) {
+        if (block->end == f->count) {
+          ok = false;
+          break;
+        }
+        block->succs[block->succ_count++] = f->insts[block->end].block;
+
+        if (op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE ||
+            op == OP_JUMP_IF_CALLEE) {
+          int taken = f->insts[f->code[last].target].block;
+          if (taken != block->succs[0]) {
+            block->succs[block->succ_count++] = taken;
+          }
+        }
+      }
+    }
+  }
+
+  free(leader);
+  return ok;
+}
+
+void add_pred(SsaBlock *block, int pred) {
+  if (block->pred_count == block->pred_capacity) {
+    block->pred_capacity = grow_capacity(block->pred_capacity);
+    block->preds =
+        realloc(block->preds, sizeof(int) * block->pred_capacity);
+  }
+  block->preds[block->pred_count++] = pred;
+}
+
+// Numbers the reachable blocks in reverse postorder and records the
+// predecessors among them.
+void compute_order(SsaFunction *f) {
+  int *stack = malloc(sizeof(int) * f->block_count);
+  int *next = calloc(f->block_count, sizeof(int));
+  int *post = malloc(sizeof(int) * f->block_count);
+  bool *seen = calloc(f->block_count, sizeof(bool));
+  int top = 0;
+  int count = 0;
+
+  stack[top++] = 0;
+  seen[0] = true;
+  while (top > 0) {
+    SsaBlock *block = &f->blocks[stack[top - 1]];
+    if (next[stack[top - 1]] < block->succ_count) {
+      int succ = block->succs[next[stack[top - 1]]++];
+      if (!seen[succ]) {
+        seen[succ] = true;
+        stack[top++] = succ;
+      }
+    } else {
+      post[count++] = stack[--top];
+    }
+  }
+
+  f->order = malloc(sizeof(int) * count);
+  f->order_count = count;
+  for (int k = 0; k < count; ++k) {
+    f->order[k] = post[count - 1 - k];
+    f->blocks[f->order[k]].rpo = k;
+  }
+
+  for (int k = 0; k < count; ++k) {
+    SsaBlock *block = &f->blocks[f->order[k]];
+    for (int s = 0; s < block->succ_count; ++s) {
+      add_pred(&f->blocks[block->succs[s]], f->order[k]);
+    }
+  }
+
+  free(stack);
+  free(next);
+  free(post);
+  free(seen);
+}
+
+// The iterative algorithm of Cooper, Harvey and Kennedy.
+void compute_dominators(SsaFunction *f) {
+  f->blocks[0].idom = 0;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int k = 1; k < f->order_count; ++k) {
+      SsaBlock *block = &f->blocks[f->order[k]];
+      int idom = -1;
+      for (int p = 0; p < block->pred_count; ++p) {
+        int pred = block->preds[p];
+        if (f->blocks[pred].idom == -1)
+          continue;
+
+        idom = idom == -1 ? pred : intersect(f, pred, idom);
+      }
+
+      if (idom != block->idom) {
+        block->idom = idom;
+        changed = true;
+      }
+    }
+  }
+
+  number_dominator_tree(f);
+}
+
+void number_dominator_tree(SsaFunction *f) {
+  for (int k = f->order_count - 1; k > 0; --k) {
+    SsaBlock *block = &f->blocks[f->order[k]];
+    block->next_sibling = f->blocks[block->idom].first_child;
+    f->blocks[block->idom].first_child = f->order[k];
+  }
+
+  int *stack = malloc(sizeof(int) * f->order_count);
+  int top = 0;
+  int clock = 0;
+  stack[top++] = 0;
+  f->blocks[0].enter = clock++;
+  while (top > 0) {
+    SsaBlock *block = &f->blocks[stack[top - 1]];
+    if (block->first_child != -1) {
+      // each child is visited once, so the list can be consumed
+      int child = block->first_child;
+      block->first_child = f->blocks[child].next_sibling;
+      f->blocks[child].enter = clock++;
+      stack[top++] = child;
+    } else {
+      block->leave = clock++;
+      --top;
+    }
+  }
+
+  free(stack);
+}
+
+int intersect(SsaFunction *f, int a, int b) {
+  while (a != b) {
+    while (f->blocks[a].rpo > f->blocks[b].rpo) {
+      a = f->blocks[a].idom;
+    }
+    while (f->blocks[b].rpo > f->blocks[a].rpo) {
+      b = f->blocks[b].idom;
+    }
+  }
+  return a;
+}
+
+bool dominates_block(SsaFunction *f, int a, int b) {
+  return f->blocks[a].enter <= f->blocks[b].enter &&
+         f->blocks[b].leave <= f->blocks[a].leave;
+}
+
+// Whether instruction a always runs before instruction b.
+bool dominates(SsaFunction *f, int a, int b) {
+  int block_a = f->insts[a].block;
+  int block_b = f->insts[b].block;
+  if (block_a == block_b)
+    return a < b;
+
+  return dominates_block(f, block_a, block_b);
+}
+
+// Builds the SSA form by running the code on an abstract stack of values.
+// Functions whose locals are captured are left alone, a closure could change
+// a local behind the analysis' back.
+bool lift(SsaFunction *f) {
+  if (!build_blocks(f))
+    return false;
+
+  compute_order(f);
+  compute_dominators(f);
+
+  int *params = malloc(sizeof(int) * (f->fn->arity + 1));
+  for (int n = 0; n <= f->fn->arity; ++n) {
+    params[n] = new_value(f, SSA_PARAM, -1, 0);
+  }
+
+  bool ok = true;
+  for (int k = 0; k < f->order_count && ok; ++k) {
+    ok = lift_block(f, f->order[k], params);
+  }
+
+  ok = ok && fill_phis(f, params);
+  free(params);
+  return ok;
+}
+
+bool lift_block(SsaFunction *f, int b, int *params) {
+  SsaBlock *block = &f->blocks[b];
+  f->depth = 0;
+
+  if (b == 0 && block->pred_count == 0) {
+    for (int n = 0; n <= f->fn->arity; ++n) {
+      push_slot(f, params[n], -1);
+    }
+  } else if (b != 0 && block->pred_count == 1) {
+    SsaBlock *pred = &f->blocks[block->preds[0]];
+    for (int n = 0; n < pred->exit_depth; ++n) {
+      push_slot(f, pred->exit[n].value, -1);
+    }
+  } else {
+    // a merge, its depth is known from any predecessor already lifted
+    int depth = b == 0 ? f->fn->arity + 1 : -1;
+    for (int p = 0; p < block->pred_count && depth == -1; ++p) {
+      SsaBlock *pred = &f->blocks[block->preds[p]];
+      if (pred->rpo < block->rpo) {
+        depth = pred->exit_depth;
+      }
+    }
+    if (depth == -1)
+      return false;
+
+    block->has_phis = true;
+    for (int n = 0; n < depth; ++n) {
+      int phi = new_value(f, SSA_PHI, -1, b);
+      f->values[phi].inputs = malloc(sizeof(int) * input_count(f, phi));
+      push_slot(f, phi, -1);
+    }
+  }
+
+  block->depth = f->depth;
+  block->entry = malloc(sizeof(SsaSlot) * (f->depth + 1));
+  memcpy(block->entry, f->stack, sizeof(SsaSlot) * f->depth);
+
+  for (int i = block->start; i < block->end; ++i) {
+    if (!simulate(f, i))
+      return false;
+  }
+
+  block->exit_depth = f->depth;
+  block->exit = malloc(sizeof(SsaSlot) * (f->depth + 1));
+  memcpy(block->exit, f->stack, sizeof(SsaSlot) * f->depth);
+  return true;
+}
+
+bool simulate(SsaFunction *f, int index) {
+  SsaInst *inst = &f->insts[index];
+
+  switch (inst->op) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE: {
+    Value constant;
+    if (inst->op == OP_CONSTANT) {
+      Instruction *code = &f->code[index];
+      size_t at = read_index(f->chunk, code->offset + (code->wide ? 2 : 1),
+                             code->wide);
+      constant = f->chunk->constants.values[at];
+    } else if (inst->op == OP_NIL) {
+      constant = nil_val();
+    } else {
+      constant = bool_val(inst->op == OP_TRUE);
+    }
+
+    int value = new_value(f, SSA_CONST, index, inst->block);
+    f->values[value].constant = constant;
+    f->values[value].is_constant = true;
+    f->values[value].type = type_of(constant);
+    inst->result = value;
+    inst->first = index;
+    push_slot(f, value, index);
+    return true;
+  }
+
+  case OP_GET_LOCAL: {
+    int slot = operand(f, index, 0);
+    if (slot >= f->depth)
+      return false;
+
+    inst->result = f->stack[slot].value;
+    inst->first = index;
+    push_slot(f, inst->result, index);
+    return true;
+  }
+
+  case OP_SET_LOCAL: {
+    int slot = operand(f, index, 0);
+    if (slot >= f->depth)
+      return false;
+
+    int copy = new_value(f, SSA_COPY, index, inst->block);
+    f->values[copy].source = f->stack[f->depth - 1].value;
+    f->stack[slot].value = copy;
+    if (slot != f->depth - 1) {
+      f->stack[slot].producer = -1;
+    }
+    inst->result = copy;
+    return true;
+  }
+
+  case OP_GET_UPVALUE:
+  case OP_GET_FLAT_UPVALUE:
+    push_result(f, index, index);
+    return true;
+
+  case OP_GET_GLOBAL:
+  case OP_CLASS:
+    push_result(f, index, -1);
+    return true;
+
+  case OP_SET_GLOBAL:
+  case OP_SET_UPVALUE:
+    if (f->depth < 1)
+      return false;
+    add_use(f, f->stack[f->depth - 1].value);
+    return true;
+
+  case OP_DEFINE_GLOBAL:
+  case OP_PRINT:
+  case OP_RETURN:
+  case OP_METHOD:
+  case OP_INHERIT:
+    return pop_slots(f, 1);
+
+  case OP_POP:
+    if (f->depth < 1)
+      return false;
+    --f->depth;
+    inst->args[0] = f->stack[f->depth].value;
+    inst->producers[0] = f->stack[f->depth].producer;
+    inst->arg_count = 1;
+    return true;
+
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_TRUE:
+    if (f->depth < 1)
+      return false;
+    inst->args[0] = f->stack[f->depth - 1].value;
+    inst->arg_count = 1;
+    add_use(f, inst->args[0]);
+    return true;
+
+  case OP_JUMP:
+  case OP_LOOP:
+    return true;
+
+  case OP_JUMP_IF_CALLEE: {
+    int arg_count = operand(f, index, 3);
+    if (f->depth < arg_count + 1)
+      return false;
+    add_use(f, f->stack[f->depth - arg_count - 1].value);
+    return true;
+  }
+
+  case OP_INLINE_RETURN: {
+    int slot = operand(f, index, 0);
+    if (f->depth < 1 || slot >= f->depth)
+      return false;
+
+    // the returned value itself lands in the callee's slot
+    int value = f->stack[f->depth - 1].value;
+    add_use(f, value);
+    f->depth = slot;
+    push_slot(f, value, -1);
+    return true;
+  }
+
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_ADD_NUM:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_NEGATE_NUM: {
+    int count = inst->op == OP_NOT || inst->op == OP_NEGATE ||
+                        inst->op == OP_NEGATE_NUM
+                    ? 1
+                    : 2;
+    if (f->depth < count)
+      return false;
+
+    int first = -1;
+    for (int k = 0; k < count; ++k) {
+      SsaSlot *slot = &f->stack[f->depth - count + k];
+      inst->args[k] = slot->value;
+      inst->producers[k] = slot->producer;
+      add_use(f, slot->value);
+    }
+    inst->arg_count = count;
+    if (inst->producers[0] != -1 && inst->producers[count - 1] != -1) {
+      first = f->insts[inst->producers[0]].first;
+    }
+
+    f->depth -= count;
+    push_result(f, index, first);
+    return true;
+  }
+
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    if (f->depth < operand(f, index, 0) + 1)
+      return false;
+    inst->callee_slot = f->depth - operand(f, index, 0) - 1;
+    inst->callee_value = f->stack[inst->callee_slot].value;
+    if (!pop_slots(f, operand(f, index, 0) + 1))
+      return false;
+    push_result(f, index, -1);
+    return true;
+
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_TAIL_SUPER_INVOKE: {
+    int arg_count = f->chunk->code[f->code[index].offset +
+                                   f->code[index].length - 1];
+    bool super =
+        inst->op == OP_SUPER_INVOKE || inst->op == OP_TAIL_SUPER_INVOKE;
+    if (!pop_slots(f, arg_count + (super ? 2 : 1)))
+      return false;
+    push_result(f, index, -1);
+    return true;
+  }
+
+  case OP_CLOSURE: {
+    Instruction *code = &f->code[index];
+    size_t at = read_index(f->chunk, code->offset + (code->wide ? 2 : 1),
+                           code->wide);
+    ObjFunction *fn = as_function(f->chunk->constants.values[at]);
+    size_t upvalues = code->offset + code->length - 2 * fn->upvalue_count;
+    for (int k = 0; k < fn->upvalue_count; ++k) {
+      if (f->chunk->code[upvalues + 2 * k] & CAPTURE_LOCAL)
+        return false;
+    }
+
+    push_result(f, index, -1);
+    return true;
+  }
+
+  case OP_GET_PROPERTY:
+    if (!pop_slots(f, 1))
+      return false;
+    push_result(f, index, -1);
+    return true;
+
+  case OP_GET_METHOD:
+  case OP_GET_SUPER_METHOD:
+    if (!pop_slots(f, inst->op == OP_GET_METHOD ? 1 : 2))
+      return false;
+    push_result(f, index, -1);
+    push_result(f, index, -1);
+    return true;
+
+  case OP_CALL_METHOD:
+    if (!pop_slots(f, operand(f, index, 0) + 2))
+      return false;
+    push_result(f, index, -1);
+    return true;
+
+  case OP_CALL_INTRINSIC:
+    if (!pop_slots(f, operand(f, index, 0) + 1))
+      return false;
+    push_result(f, index, -1);
+    return true;
+
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_INDEX_GET:
+    if (!pop_slots(f, 2))
+      return false;
+    push_result(f, index, -1);
+    return true;
+
+  case OP_INDEX_SET:
+    if (!pop_slots(f, 3))
+      return false;
+    push_result(f, index, -1);
+    return true;
+
+  case OP_BUILD_LIST:
+    if (!pop_slots(f, operand(f, index, 0)))
+      return false;
+    push_result(f, index, -1);
+    return true;
+
+  default:
+    // OP_CLOSE_UPVALUE only follows captured locals
+    return false;
+  }
+}
+
+// Every predecessor must leave the stack as deep as the merge expects, the
+// entry block has the caller as an extra predecessor.
+bool fill_phis(SsaFunction *f, int *params) {
+  for (int k = 0; k < f->order_count; ++k) {
+    int b = f->order[k];
+    SsaBlock *block = &f->blocks[b];
+    if (!block->has_phis)
+      continue;
+
+    for (int p = 0; p < block->pred_count; ++p) {
+      SsaBlock *pred = &f->blocks[block->preds[p]];
+      if (pred->exit_depth != block->depth)
+        return false;
+
+      for (int n = 0; n < block->depth; ++n) {
+        f->values[block->entry[n].value].inputs[p] = pred->exit[n].value;
+      }
+    }
+
+    if (b == 0) {
+      for (int n = 0; n < block->depth; ++n) {
+        f->values[block->entry[n].value].inputs[block->pred_count] =
+            params[n];
+      }
+    }
+  }
+
+  return true;
+}
+
+int new_value(SsaFunction *f, SsaKind kind, int inst, int block) {
+  if (f->value_count == f->value_capacity) {
+    f->value_capacity = grow_capacity(f->value_capacity);
+    f->values = realloc(f->values, sizeof(SsaValue) * f->value_capacity);
+  }
+
+  SsaValue *value = &f->values[f->value_count];
+  value->kind = kind;
+  value->type = SSA_UNDEFINED;
+  value->is_constant = false;
+  value->constant = nil_val();
+  value->inst = inst;
+  value->block = block;
+  value->source = -1;
+  value->inputs = NULL;
+  value->replacement = -1;
+  value->live = false;
+  value->proof = -1;
+  return f->value_count++;
+}
+
+void push_slot(SsaFunction *f, int value, int producer) {
+  if (f->depth == f->stack_capacity) {
+    f->stack_capacity = grow_capacity(f->stack_capacity);
+    f->stack = realloc(f->stack, sizeof(SsaSlot) * f->stack_capacity);
+  }
+
+  f->stack[f->depth].value = value;
+  f->stack[f->depth].producer = producer;
+  ++f->depth;
+}
+
+bool pop_slots(SsaFunction *f, int count) {
+  if (f->depth < count)
+    return false;
+
+  for (int k = 0; k < count; ++k) {
+    add_use(f, f->stack[--f->depth].value);
+  }
+  return true;
+}
+
+void push_result(SsaFunction *f, int index, int first) {
+  SsaInst *inst = &f->insts[index];
+  inst->result = new_value(f, SSA_RESULT, index, inst->block);
+  inst->first = first;
+  push_slot(f, inst->result, index);
+}
+
+void add_use(SsaFunction *f, int value) {
+  if (f->use_count == f->use_capacity) {
+    f->use_capacity = grow_capacity(f->use_capacity);
+    f->uses = realloc(f->uses, sizeof(int) * f->use_capacity);
+  }
+  f->uses[f->use_count++] = value;
+}
+
+int input_count(SsaFunction *f, int phi) {
+  int block = f->values[phi].block;
+  return f->blocks[block].pred_count + (block == 0 ? 1 : 0);
+}
+
+int resolve_phi(SsaFunction *f, int value) {
+  while (f->values[value].kind == SSA_PHI &&
+         f->values[value].replacement != -1) {
+    value = f->values[value].replacement;
+  }
+  return value;
+}
+
+// The value a copy or a trivial phi stands for, this is what propagates
+// copies through every analysis below.
+int resolve(SsaFunction *f, int value) {
+  for (;;) {
+    SsaValue *v = &f->values[value];
+    if (v->kind == SSA_PHI && v->replacement != -1) {
+      value = v->replacement;
+    } else if (v->kind == SSA_COPY) {
+      value = v->source;
+    } else {
+      return value;
+    }
+  }
+}
+
+// A phi whose inputs are all the same value or the phi itself is that value.
+void remove_trivial_phis(SsaFunction *f) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int v = 0; v < f->value_count; ++v) {
+      if (f->values[v].kind != SSA_PHI || f->values[v].replacement != -1)
+        continue;
+
+      int same = -1;
+      bool trivial = true;
+      for (int k = 0; k < input_count(f, v) && trivial; ++k) {
+        int input = resolve_phi(f, f->values[v].inputs[k]);
+        if (input == v || input == same)
+          continue;
+
+        trivial = same == -1;
+        same = input;
+      }
+
+      if (trivial && same != -1) {
+        f->values[v].replacement = same;
+        changed = true;
+      }
+    }
+  }
+}
+
+SsaType type_of(Value value) {
+  if (is_nil(value))
+    return SSA_NIL;
+  if (is_bool(value))
+    return SSA_BOOL;
+  if (is_number(value))
+    return SSA_NUMBER;
+  if (is_object_type(value, OBJ_STRING))
+    return SSA_STRING;
+  return SSA_ANY;
+}
+
+SsaType join(SsaType a, SsaType b) {
+  if (a == SSA_UNDEFINED)
+    return b;
+  if (b == SSA_UNDEFINED || a == b)
+    return a;
+  return SSA_ANY;
+}
+
+bool same_constant(Value a, Value b) {
+  if (a.type != b.type)
+    return false;
+  if (is_number(a)) {
+    double x = as_number(a);
+    double y = as_number(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return is_equal(a, b);
+}
+
+// Abstract interpretation of one instruction result. A result is undefined
+// while an operand is, and also when the operation can only fail, so each
+// rule only moves up the lattice as its operands do.
+void evaluate(SsaFunction *f, int value, SsaType *type, bool *is_constant,
+              Value *constant) {
+  SsaInst *inst = &f->insts[f->values[value].inst];
+  SsaValue *a = inst->arg_count > 0 ? &f->values[resolve(f, inst->args[0])]
+                                    : NULL;
+  SsaValue *b = inst->arg_count > 1 ? &f->values[resolve(f, inst->args[1])]
+                                    : NULL;
+
+  bool numbers = a != NULL && a->is_constant && is_number(a->constant) &&
+                 (b == NULL || (b->is_constant && is_number(b->constant)));
+
+  switch (inst->op) {
+  case OP_ADD:
+  case OP_ADD_NUM:
+    if (inst->op == OP_ADD_NUM ||
+        (a->type == SSA_NUMBER && (b->type == SSA_NUMBER || b->type == SSA_ANY)) ||
+        (a->type == SSA_ANY && b->type == SSA_NUMBER)) {
+      *type = SSA_NUMBER;
+    } else if ((a->type == SSA_STRING &&
+                (b->type == SSA_STRING || b->type == SSA_ANY)) ||
+               (a->type == SSA_ANY && b->type == SSA_STRING)) {
+      *type = SSA_STRING;
+    } else if (a->type == SSA_ANY && b->type == SSA_ANY) {
+      *type = SSA_ANY;
+    } else {
+      *type = SSA_UNDEFINED;
+    }
+
+    if (numbers) {
+      *is_constant = true;
+      *constant = add(a->constant, b->constant);
+    }
+    break;
+
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_NEGATE: {
+    bool valid = (a->type == SSA_NUMBER || a->type == SSA_ANY) &&
+                 (b == NULL || b->type == SSA_NUMBER || b->type == SSA_ANY);
+    bool compare = inst->op == OP_GREATER || inst->op == OP_LESS;
+    *type = !valid ? SSA_UNDEFINED : compare ? SSA_BOOL : SSA_NUMBER;
+    break;
+  }
+
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_NEGATE_NUM:
+    *type = SSA_NUMBER;
+    break;
+
+  case OP_GREATER_NUM:
+  case OP_LESS_NUM:
+  case OP_EQUAL:
+  case OP_NOT:
+    *type = SSA_BOOL;
+    break;
+
+  default:
+    *type = SSA_ANY;
+    break;
+  }
+
+  if (numbers) {
+    switch (inst->op) {
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      *constant = subtract(a->constant, b->constant);
+      break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      *constant = multiply(a->constant, b->constant);
+      break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      *constant = divide(a->constant, b->constant);
+      break;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+      *constant = greater(a->constant, b->constant);
+      break;
+    case OP_LESS:
+    case OP_LESS_NUM:
+      *constant = less(a->constant, b->constant);
+      break;
+    case OP_NEGATE:
+    case OP_NEGATE_NUM:
+      *constant = number_val(-as_number(a->constant));
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+      break;
+    default:
+      numbers = false;
+      break;
+    }
+    *is_constant = *is_constant || numbers;
+  }
+
+  if (inst->op == OP_NOT && a->is_constant) {
+    *is_constant = true;
+    *constant = bool_val(is_falsey(a->constant));
+  } else if (inst->op == OP_EQUAL && a->is_constant && b->is_constant) {
+    *is_constant = true;
+    *constant = bool_val(is_equal(a->constant, b->constant));
+  }
+}
+
+// Types start undefined and only ever widen, constants start unknown and are
+// only claimed once every input is known, so the iteration terminates.
+void infer_types(SsaFunction *f) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int v = 0; v < f->value_count; ++v) {
+      SsaValue *value = &f->values[v];
+      SsaType type = value->type;
+      bool is_constant = value->is_constant;
+      Value constant = value->constant;
+
+      switch (value->kind) {
+      case SSA_PARAM:
+        type = SSA_ANY;
+        break;
+
+      case SSA_PHI: {
+        if (value->replacement != -1)
+          continue;
+
+        bool known = true;
+        bool first = true;
+        type = SSA_UNDEFINED;
+        for (int k = 0; k < input_count(f, v); ++k) {
+          SsaValue *input = &f->values[resolve(f, value->inputs[k])];
+          if (input == value)
+            continue;
+
+          type = join(type, input->type);
+          if (!input->is_constant ||
+              (!first && !same_constant(constant, input->constant))) {
+            known = false;
+          }
+          constant = input->constant;
+          first = false;
+        }
+        is_constant = known && !first;
+        break;
+      }
+
+      case SSA_RESULT:
+        evaluate(f, v, &type, &is_constant, &constant);
+        break;
+
+      default:
+        continue;
+      }
+
+      if (type != value->type || is_constant != value->is_constant) {
+        value = &f->values[v];
+        value->type = type;
+        value->is_constant = is_constant;
+        value->constant = constant;
+        changed = true;
+      }
+    }
+  }
+}
+
+// A value is live when an instruction other than OP_POP reads it, directly
+// or through the copies and phis it flows into.
+void mark_live(SsaFunction *f) {
+  int *work = malloc(sizeof(int) * (f->value_count + 1));
+  int count = 0;
+
+  for (int u = 0; u < f->use_count; ++u) {
+    if (!f->values[f->uses[u]].live) {
+      f->values[f->uses[u]].live = true;
+      work[count++] = f->uses[u];
+    }
+  }
+
+  while (count > 0) {
+    SsaValue *value = &f->values[work[--count]];
+    int inputs = 0;
+    int *from = NULL;
+    if (value->kind == SSA_COPY) {
+      inputs = 1;
+      from = &value->source;
+    } else if (value->kind == SSA_PHI) {
+      inputs = input_count(f, work[count]);
+      from = value->inputs;
+    }
+
+    for (int k = 0; k < inputs; ++k) {
+      if (!f->values[from[k]].live) {
+        f->values[from[k]].live = true;
+        work[count++] = from[k];
+      }
+    }
+  }
+
+  free(work);
+}
+
+// Checked arithmetic and comparisons only succeed on numbers, so every
+// instruction they dominate may rely on their operands being numbers. Each
+// value keeps a list of such instructions, linked through proof_next and
+// encoded as instruction * 2 + operand.
+void find_proofs(SsaFunction *f) {
+  for (int i = 0; i < f->count; ++i) {
+    SsaInst *inst = &f->insts[i];
+    if (inst->block == -1 || f->blocks[inst->block].rpo == -1)
+      continue;
+
+    switch (inst->op) {
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NEGATE:
+      for (int k = 0; k < inst->arg_count; ++k) {
+        SsaValue *value = &f->values[resolve(f, inst->args[k])];
+        inst->proof_next[k] = value->proof;
+        value->proof = i * 2 + k;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+bool is_number_at(SsaFunction *f, int value, int index) {
+  SsaValue *v = &f->values[resolve(f, value)];
+  if (v->type == SSA_NUMBER)
+    return true;
+
+  for (int proof = v->proof; proof != -1;
+       proof = f->insts[proof / 2].proof_next[proof % 2]) {
+    if (proof / 2 != index && dominates(f, proof / 2, index))
+      return true;
+  }
+  return false;
+}
+
+// Whether first..last is straight line code of pure instructions no pass
+// has touched yet.
+bool pure_range(SsaFunction *f, int first, int last) {
+  if (first < 0)
+    return false;
+
+  for (int i = first; i <= last; ++i) {
+    SsaInst *inst = &f->insts[i];
+    if (inst->block != f->insts[last].block || inst->edited ||
+        !is_pure(inst->op))
+      return false;
+  }
+  return true;
+}
+
+void remove_range(SsaFunction *f, int first, int last) {
+  for (int i = first; i <= last; ++i) {
+    f->insts[i].edited = true;
+    f->insts[i].removed = true;
+  }
+  f->changed = true;
+}
+
+// Writes the instruction loading value into out and returns its length, or 0
+// when the value has no constant form. Strings are only found in the pool,
+// numbers are added to it when missing.
+int constant_load(SsaFunction *f, Value value, uint8_t *out) {
+  if (is_nil(value) || is_bool(value)) {
+    out[0] = is_nil(value) ? OP_NIL : as_bool(value) ? OP_TRUE : OP_FALSE;
+    return 1;
+  }
+
+  if (!is_number(value) && !is_object_type(value, OBJ_STRING))
+    return 0;
+
+  ValueArray *constants = &f->chunk->constants;
+  size_t index = 0;
+  while (index < constants->size &&
+         !same_constant(constants->values[index], value)) {
+    ++index;
+  }
+
+  if (index == constants->size) {
+    if (!is_number(value))
+      return 0;
+    index = add_constant(f->vm, f->chunk, value);
+  }
+
+  if (index <= UINT8_MAX) {
+    out[0] = OP_CONSTANT;
+    out[1] = index;
+    return 2;
+  }
+
+  if (index > UINT24_MAX)
+    return 0;
+
+  out[0] = OP_WIDE;
+  out[1] = OP_CONSTANT;
+  out[2] = (index >> 16) & 0xff;
+  out[3] = (index >> 8) & 0xff;
+  out[4] = index & 0xff;
+  return 5;
+}
+
+// Checked operations whose operands are proven numbers skip the check.
+void eliminate_checks(SsaFunction *f) {
+  for (int i = 0; i < f->count; ++i) {
+    SsaInst *inst = &f->insts[i];
+    if (inst->result == -1 || inst->edited)
+      continue;
+
+    uint8_t unchecked;
+    switch (inst->op) {
+    case OP_ADD:
+      unchecked = OP_ADD_NUM;
+      break;
+    case OP_SUBTRACT:
+      unchecked = OP_SUBTRACT_NUM;
+      break;
+    case OP_MULTIPLY:
+      unchecked = OP_MULTIPLY_NUM;
+      break;
+    case OP_DIVIDE:
+      unchecked = OP_DIVIDE_NUM;
+      break;
+    case OP_NEGATE:
+      unchecked = OP_NEGATE_NUM;
+      break;
+    case OP_GREATER:
+      unchecked = OP_GREATER_NUM;
+      break;
+    case OP_LESS:
+      unchecked = OP_LESS_NUM;
+      break;
+    default:
+      continue;
+    }
+
+    bool proven = true;
+    for (int k = 0; k < inst->arg_count; ++k) {
+      proven = proven && is_number_at(f, inst->args[k], i);
+    }
+
+    if (proven) {
+      inst->op = unchecked;
+      f->changed = true;
+    }
+  }
+}
+
+// Loads of locals and pure expressions with a known value become a load of
+// that constant.
+void propagate_constants(SsaFunction *f) {
+  for (int i = 0; i < f->count; ++i) {
+    SsaInst *inst = &f->insts[i];
+    if (inst->result == -1 || inst->edited ||
+        (inst->op != OP_GET_LOCAL && !is_operation(inst->op)))
+      continue;
+
+    SsaValue *value = &f->values[resolve(f, inst->result)];
+    if (!value->is_constant || !pure_range(f, inst->first, i))
+      continue;
+
+    uint8_t load[5];
+    int length = constant_load(f, value->constant, load);
+    if (length == 0)
+      continue;
+
+    if (inst->first < i) {
+      remove_range(f, inst->first, i - 1);
+    }
+    inst = &f->insts[i];
+    memcpy(inst->replacement, load, length);
+    inst->replacement_length = length;
+    inst->edited = true;
+    f->changed = true;
+  }
+}
+
+// Branches on a known condition either always jump or never do.
+void fold_branches(SsaFunction *f) {
+  for (int i = 0; i < f->count; ++i) {
+    SsaInst *inst = &f->insts[i];
+    if (inst->edited || inst->arg_count == 0 ||
+        (inst->op != OP_JUMP_IF_FALSE && inst->op != OP_JUMP_IF_TRUE))
+      continue;
+
+    SsaValue *condition = &f->values[resolve(f, inst->args[0])];
+    if (!condition->is_constant)
+      continue;
+
+    bool jumps = is_falsey(condition->constant) == (inst->op == OP_JUMP_IF_FALSE);
+    if (jumps) {
+      inst->op = OP_JUMP;
+      inst->edited = true;
+      f->changed = true;
+    } else {
+      remove_range(f, i, i);
+    }
+  }
+}
+
+// Stores to locals nothing reads again, and pure expressions that are only
+// computed to be popped.
+void eliminate_dead_code(SsaFunction *f) {
+  for (int i = 0; i < f->count; ++i) {
+    SsaInst *inst = &f->insts[i];
+    if (inst->edited)
+      continue;
+
+    if (inst->op == OP_SET_LOCAL && inst->result != -1 &&
+        !f->values[inst->result].live) {
+      remove_range(f, i, i);
+    } else if (inst->op == OP_POP && inst->arg_count == 1 &&
+               inst->producers[0] == i - 1 &&
+               pure_range(f, f->insts[i - 1].first, i - 1)) {
+      remove_range(f, f->insts[i - 1].first, i);
+    }
+  }
+}
+
+// Collects the natural loop of header into body and returns its size.
+int loop_body(SsaFunction *f, int header, bool *body, int *work) {
+  memset(body, 0, sizeof(bool) * f->block_count);
+  body[header] = true;
+
+  int size = 1;
+  int count = 0;
+  SsaBlock *block = &f->blocks[header];
+  for (int p = 0; p < block->pred_count; ++p) {
+    int pred = block->preds[p];
+    if (!body[pred] && dominates_block(f, header, pred)) {
+      body[pred] = true;
+      work[count++] = pred;
+      ++size;
+    }
+  }
+
+  while (count > 0) {
+    SsaBlock *member = &f->blocks[work[--count]];
+    for (int p = 0; p < member->pred_count; ++p) {
+      int pred = member->preds[p];
+      if (!body[pred]) {
+        body[pred] = true;
+        work[count++] = pred;
+        ++size;
+      }
+    }
+  }
+
+  return size;
+}
+
+// Code placed right before the header runs on entry to the loop only if
+// every edge from outside comes from code before the header and every back
+// edge from code after it.
+bool has_preheader(SsaFunction *f, int header, bool *body) {
+  SsaBlock *block = &f->blocks[header];
+  for (int p = 0; p < block->pred_count; ++p) {
+    int source = f->blocks[block->preds[p]].end - 1;
+    if (body[block->preds[p]] ? source < block->start
+                              : source >= block->start)
+      return false;
+  }
+  return true;
+}
+
+// Whether first..last computes the same value on every iteration and can be
+// evaluated ahead of the loop without failing.
+bool is_invariant(SsaFunction *f, int first, int last, int header,
+                  bool *body) {
+  for (int i = first; i <= last; ++i) {
+    SsaInst *inst = &f->insts[i];
+    switch (inst->op) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQUAL:
+      break;
+
+    case OP_GET_LOCAL: {
+      if (operand(f, i, 0) >= f->blocks[header].depth)
+        return false;
+
+      SsaValue *value = &f->values[resolve_phi(f, inst->result)];
+      int block = value->kind == SSA_PARAM ? -1
+                  : value->kind == SSA_PHI ? value->block
+                                           : f->insts[value->inst].block;
+      if (block != -1 && body[block])
+        return false;
+      break;
+    }
+
+    case OP_ADD_NUM:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_NEGATE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+      for (int k = 0; k < inst->arg_count; ++k) {
+        if (f->values[resolve(f, inst->args[k])].type != SSA_NUMBER)
+          return false;
+      }
+      break;
+
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// Loop invariant expressions are computed once before the loop into a hidden
+// local slot, the loop reads the slot instead. Outer loops go first, so an
+// expression moves as far out as it can.
+void hoist_invariants(SsaFunction *f) {
+  int *headers = malloc(sizeof(int) * f->block_count);
+  int *sizes = malloc(sizeof(int) * f->block_count);
+  bool *body = malloc(sizeof(bool) * f->block_count);
+  int *work = malloc(sizeof(int) * f->block_count);
+  int loops = 0;
+
+  for (int k = 0; k < f->order_count; ++k) {
+    int b = f->order[k];
+    SsaBlock *block = &f->blocks[b];
+    for (int p = 0; p < block->pred_count; ++p) {
+      if (dominates_block(f, b, block->preds[p])) {
+        int size = loop_body(f, b, body, work);
+        int at = loops++;
+        while (at > 0 && sizes[at - 1] < size) {
+          headers[at] = headers[at - 1];
+          sizes[at] = sizes[at - 1];
+          --at;
+        }
+        headers[at] = b;
+        sizes[at] = size;
+        break;
+      }
+    }
+  }
+
+  for (int l = 0; l < loops; ++l) {
+    int header = headers[l];
+    loop_body(f, header, body, work);
+    if (!has_preheader(f, header, body))
+      continue;
+
+    for (int b = 0; b < f->block_count; ++b) {
+      if (!body[b])
+        continue;
+
+      SsaBlock *block = &f->blocks[b];
+      for (int i = block->end - 1; i >= block->start; --i) {
+        SsaInst *inst = &f->insts[i];
+        if (inst->edited || inst->result == -1 || !is_operation(inst->op) ||
+            inst->first == -1 || inst->first == i ||
+            f->values[resolve(f, inst->result)].is_constant ||
+            !pure_range(f, inst->first, i) ||
+            !is_invariant(f, inst->first, i, header, body))
+          continue;
+
+        if (f->max_slot + f->hidden + 1 > UINT8_MAX)
+          goto done;
+
+        if (f->hoist_count == f->hoist_capacity) {
+          f->hoist_capacity = grow_capacity(f->hoist_capacity);
+          f->hoists =
+              realloc(f->hoists, sizeof(SsaHoist) * f->hoist_capacity);
+        }
+
+        SsaHoist *hoist = &f->hoists[f->hoist_count];
+        hoist->header = f->blocks[header].start;
+        hoist->first = inst->first;
+        hoist->last = i;
+        hoist->slot = f->fn->arity + 1 + f->hidden++;
+        for (int k = inst->first; k <= i; ++k) {
+          f->insts[k].edited = true;
+          f->insts[k].hoist = f->hoist_count;
+        }
+        ++f->hoist_count;
+        f->changed = true;
+      }
+    }
+  }
+
+done:
+  free(headers);
+  free(sizes);
+  free(body);
+  free(work);
+}
+
+// The function a global holds right now, when value was read from it.
+ObjFunction *global_callee(SsaFunction *f, int value) {
+  SsaValue *v = &f->values[resolve(f, value)];
+  if (v->kind != SSA_RESULT || f->insts[v->inst].op != OP_GET_GLOBAL)
+    return NULL;
+
+  Instruction *code = &f->code[v->inst];
+  size_t at = read_index(f->chunk, code->offset + (code->wide ? 2 : 1),
+                         code->wide);
+  Value callee;
+  if (!table_get(&f->vm->globals, as_string(f->chunk->constants.values[at]),
+                 &callee) ||
+      !is_closure(callee))
+    return NULL;
+
+  return as_closure(callee)->fn;
+}
+
+// Small functions that capture nothing run unchanged in the caller's frame
+// once their slots are moved up to the callee's. A tail call would replace
+// the caller's frame, the other instructions need the callee's own closure.
+bool can_inline(SsaFunction *f, ObjFunction *callee, int slot) {
+  Chunk *chunk = &callee->chunk;
+  if (callee->upvalue_count > 0 || chunk->size > INLINE_MAX_SIZE ||
+      slot + f->hidden > UINT8_MAX)
+    return false;
+
+  Instruction *code = NULL;
+  int count = decode_chunk(chunk, &code);
+  bool ok = count > 0 && code[count - 1].op == OP_RETURN;
+  for (int i = 0; i < count && ok; ++i) {
+    switch (code[i].op) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      ok = slot + f->hidden + chunk->code[code[i].offset + 1] <= UINT8_MAX;
+      break;
+
+    case OP_TAIL_CALL:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+    case OP_CLOSURE:
+    case OP_CLOSE_UPVALUE:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_FLAT_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE:
+    case OP_GET_SUPER_METHOD:
+    case OP_JUMP_IF_CALLEE:
+    case OP_INLINE_RETURN:
+    case OP_BIND_LOCAL:
+      ok = false;
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  free(code);
+  return ok;
+}
+
+// Splices small functions into the calls that reach them through a global.
+// The global can be rebound at any time, so the body sits behind a guard on
+// the callee and the call itself stays as the slow path. Call sites of the
+// same function share the copies of its constants.
+void inline_calls(SsaFunction *f) {
+  if (!f->inlining)
+    return;
+
+  for (int i = 0; i < f->count; ++i) {
+    SsaInst *inst = &f->insts[i];
+    if (inst->op != OP_CALL || inst->removed || inst->callee_value == -1)
+      continue;
+
+    ObjFunction *callee = global_callee(f, inst->callee_value);
+    if (callee == NULL || callee->arity != operand(f, i, 0) ||
+        !can_inline(f, callee, inst->callee_slot))
+      continue;
+
+    for (int k = 0; k < i && inst->inlined == NULL; ++k) {
+      if (f->insts[k].inlined == callee) {
+        inst->inlined = callee;
+        inst->inlined_function = f->insts[k].inlined_function;
+        inst->inlined_constants = f->insts[k].inlined_constants;
+      }
+    }
+
+    if (inst->inlined == NULL) {
+      ValueArray *constants = &f->chunk->constants;
+      size_t count = callee->chunk.constants.size;
+      if (constants->size > UINT8_MAX ||
+          constants->size + count >= UINT24_MAX)
+        continue;
+
+      inst->inlined = callee;
+      inst->inlined_function =
+          add_constant(f->vm, f->chunk, object_val((Obj *)callee));
+      inst->inlined_constants = constants->size;
+      for (size_t k = 0; k < count; ++k) {
+        add_constant(f->vm, f->chunk, callee->chunk.constants.values[k]);
+      }
+    }
+
+    f->changed = true;
+  }
+}
+
+// Points the jump of the given length at offset at to offset to, an
+// unconditional one becomes OP_LOOP when it goes backwards.
+void write_jump(uint8_t *code, size_t at, size_t length, size_t to) {
+  size_t from = at + length;
+  size_t jump;
+  if (to >= from) {
+    jump = to - from;
+    if (code[at] == OP_LOOP) {
+      code[at] = OP_JUMP;
+    }
+  } else {
+    jump = from - to;
+    code[at] = OP_LOOP;
+  }
+
+  code[at + 1] = (jump >> 16) & 0xff;
+  code[at + 2] = (jump >> 8) & 0xff;
+  code[at + 3] = jump & 0xff;
+}
+
+// Copies instruction index as it was decoded, with its opcode as the passes
+// left it and local slots moved past the hidden ones.
+size_t emit_original(SsaFunction *f, int index, uint8_t *code, int *lines,
+                     size_t size) {
+  Instruction *inst = &f->code[index];
+  memcpy(&code[size], &f->chunk->code[inst->offset], inst->length);
+  for (size_t k = 0; k < inst->length; ++k) {
+    lines[size + k] = inst->line;
+  }
+
+  uint8_t op = f->insts[index].op;
+  code[size + (inst->wide ? 1 : 0)] = op;
+  if ((op == OP_GET_LOCAL || op == OP_SET_LOCAL || op == OP_INLINE_RETURN) &&
+      code[size + 1] > f->fn->arity) {
+    code[size + 1] += f->hidden;
+  }
+  return size + inst->length;
+}
+
+// Emits the call at index as
+//
+//   OP_JUMP_IF_CALLEE -> body
+//   OP_CALL
+//   OP_JUMP -> end
+//   body: the callee's code with its slots moved up to the callee's slot,
+//         every constant operand to its copy and every OP_RETURN turned into
+//         an OP_INLINE_RETURN, followed by a jump to end unless it is last
+//
+// can_inline turns down the other instructions with a constant operand.
+//   end:
+size_t emit_inlined(SsaFunction *f, int index, uint8_t *code, int *lines,
+                    size_t size) {
+  SsaInst *inst = &f->insts[index];
+  Chunk *callee = &inst->inlined->chunk;
+  int base = inst->callee_slot + f->hidden;
+  int line = f->code[index].line;
+
+  size_t guard = size;
+  code[size] = OP_JUMP_IF_CALLEE;
+  code[size + 4] = operand(f, index, 0);
+  code[size + 5] = inst->inlined_function;
+  for (int k = 0; k < 6; ++k) {
+    lines[size++] = line;
+  }
+  size = emit_original(f, index, code, lines, size);
+  size_t slow = size;
+  code[size] = OP_JUMP;
+  for (int k = 0; k < 4; ++k) {
+    lines[size++] = line;
+  }
+  write_jump(code, guard, 6, size);
+
+  Instruction *body = NULL;
+  int count = decode_chunk(callee, &body);
+  size_t *start = malloc(sizeof(size_t) * (count + 1));
+  size_t *exits = malloc(sizeof(size_t) * (count + 1));
+  int exit_count = 0;
+
+  for (int i = 0; i < count; ++i) {
+    Instruction *in = &body[i];
+    uint8_t *from = &callee->code[in->offset];
+    start[i] = size;
+
+    switch (in->op) {
+    case OP_RETURN:
+      code[size++] = OP_INLINE_RETURN;
+      code[size++] = base;
+      if (i != count - 1) {
+        exits[exit_count++] = size;
+        code[size] = OP_JUMP;
+        size += 4;
+      }
+      break;
+
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      code[size++] = in->op;
+      code[size++] = from[1] + base;
+      break;
+
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CLASS:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_METHOD:
+    case OP_GET_METHOD:
+    case OP_INVOKE: {
+      size_t constant = read_index(callee, in->offset + (in->wide ? 2 : 1),
+                                   in->wide) +
+                        inst->inlined_constants;
+      if (constant > UINT8_MAX) {
+        code[size++] = OP_WIDE;
+        code[size++] = in->op;
+        code[size++] = (constant >> 16) & 0xff;
+        code[size++] = (constant >> 8) & 0xff;
+        code[size++] = constant & 0xff;
+      } else {
+        code[size++] = in->op;
+        code[size++] = constant;
+      }
+      if (in->op == OP_INVOKE) {
+        code[size++] = from[in->length - 1];
+      }
+      break;
+    }
+
+    default:
+      memcpy(&code[size], from, in->length);
+      size += in->length;
+      break;
+    }
+
+    for (size_t k = start[i]; k < size; ++k) {
+      lines[k] = in->line;
+    }
+  }
+  start[count] = size;
+
+  for (int i = 0; i < count; ++i) {
+    if (is_jump(body[i].op)) {
+      write_jump(code, start[i], body[i].length, start[body[i].target]);
+    }
+  }
+  for (int e = 0; e < exit_count; ++e) {
+    write_jump(code, exits[e], 4, size);
+  }
+  write_jump(code, slow, 4, size);
+
+  free(body);
+  free(start);
+  free(exits);
+  return size;
+}
+
+// Writes the rewritten code into fresh arrays. Frames already running the
+// function keep their instruction pointers into the old code, so when retire
+// is set it is kept as the function's retired chunk. The hidden slots are
+// set up by a prologue of OP_NIL, and the hoisted expressions of a loop sit
+// between the forward edges into its header and the header itself.
+void encode(SsaFunction *f, bool retire) {
+  Chunk *chunk = f->chunk;
+  size_t capacity = chunk->size * 5 + f->hidden + f->hoist_count * 3 + 1;
+  for (int i = 0; i < f->count; ++i) {
+    if (f->insts[i].inlined != NULL) {
+      // a one byte return grows the most, into a return and a jump
+      capacity += 12 + f->insts[i].inlined->chunk.size * 6;
+    }
+  }
+  uint8_t *code = malloc(capacity);
+  int *lines = malloc(sizeof(int) * capacity);
+  size_t *entry = malloc(sizeof(size_t) * (f->count + 1));
+  size_t *at = malloc(sizeof(size_t) * (f->count + 1));
+  size_t size = 0;
+
+  for (int h = 0; h < f->hidden; ++h) {
+    code[size] = OP_NIL;
+    lines[size++] = get_line(chunk, 0);
+  }
+
+  for (int i = 0; i < f->count; ++i) {
+    SsaInst *inst = &f->insts[i];
+    entry[i] = size;
+
+    for (int h = 0; h < f->hoist_count; ++h) {
+      SsaHoist *hoist = &f->hoists[h];
+      if (hoist->header != i)
+        continue;
+
+      for (int k = hoist->first; k <= hoist->last; ++k) {
+        size = emit_original(f, k, code, lines, size);
+      }
+      int line = lines[size - 1];
+      code[size] = OP_SET_LOCAL;
+      code[size + 1] = hoist->slot;
+      code[size + 2] = OP_POP;
+      lines[size] = lines[size + 1] = lines[size + 2] = line;
+      size += 3;
+    }
+
+    at[i] = size;
+    if (inst->removed)
+      continue;
+
+    if (inst->hoist != -1) {
+      if (f->hoists[inst->hoist].last == i) {
+        code[size] = OP_GET_LOCAL;
+        code[size + 1] = f->hoists[inst->hoist].slot;
+        lines[size] = lines[size + 1] = f->code[i].line;
+        size += 2;
+      }
+    } else if (inst->inlined != NULL) {
+      size = emit_inlined(f, i, code, lines, size);
+    } else if (inst->replacement_length > 0) {
+      for (int k = 0; k < inst->replacement_length; ++k) {
+        code[size] = inst->replacement[k];
+        lines[size++] = f->code[i].line;
+      }
+    } else {
+      size = emit_original(f, i, code, lines, size);
+    }
+  }
+  entry[f->count] = at[f->count] = size;
+
+  // jumps were copied with their old operands, forward ones now land in
+  // front of the target's hoisted code and backward ones right on it
+  for (int i = 0; i < f->count; ++i) {
+    SsaInst *inst = &f->insts[i];
+    if (inst->removed || inst->hoist != -1 || inst->replacement_length > 0 ||
+        !is_jump(inst->op))
+      continue;
+
+    int target = f->code[i].target;
+    write_jump(code, at[i], f->code[i].length,
+               i < target ? entry[target] : at[target]);
+  }
+
+  int run_count = 0;
+  for (size_t k = 0; k < size; ++k) {
+    run_count += k == 0 || lines[k] != lines[k - 1];
+  }
+
+  uint8_t *new_code = allocate(f->vm, sizeof(uint8_t), size);
+  LineRun *new_lines = allocate(f->vm, sizeof(LineRun), run_count);
+  memcpy(new_code, code, size);
+  for (size_t k = 0, run = 0; k < size; ++k) {
+    if (k == 0 || lines[k] != lines[k - 1]) {
+      new_lines[run].offset = (int)k;
+      new_lines[run++].line = lines[k];
+    }
+  }
+
+  if (retire) {
+    f->fn->retired.code = chunk->code;
+    f->fn->retired.lines = chunk->lines;
+    f->fn->retired.size = chunk->size;
+    f->fn->retired.capacity = chunk->capacity;
+    f->fn->retired.line_count = chunk->line_count;
+    f->fn->retired.line_capacity = chunk->line_capacity;
+  } else {
+    free_array(f->vm, sizeof(uint8_t), chunk->code, chunk->capacity);
+    free_array(f->vm, sizeof(LineRun), chunk->lines, chunk->line_capacity);
+  }
+
+  chunk->code = new_code;
+  chunk->lines = new_lines;
+  chunk->size = size;
+  chunk->capacity = size;
+  chunk->line_count = run_count;
+  chunk->line_capacity = run_count;
+
+  free(code);
+  free(lines);
+  free(entry);
+  free(at);
+}
@@ -2,44 +2,55 @@
 #include "Memory.h"
 #include <string.h>
 
-static Entry *find_entry(Entry *entries, ObjString *key);
-static void add_element(Entry **front, Entry **rear, Entry *entry);
+static Entry *find_entry(Entry *entries, int capacity, ObjString *key);
+static void adjust_capacity(VM *vm, Table *table, int capacity);
+static void ensure_capacity(VM *vm, Table *table);
 
 void init_table(Table *table) {
   table->size = 0;
   table->capacity = 0;
-  table->front = NULL;
-  table->rear = NULL;
+  table->entries = NULL;
 }
 
 void free_table(VM *vm, Table *table) {
-  for (Entry *cur = table->front; cur != NULL;) {
-    Entry *next = cur->next;
-    free_array(vm, sizeof(Entry), cur, 1);
-    cur = next;
-  }
-
+  free_array(vm, sizeof(Entry), table->entries, table->capacity);
   init_table(table);
 }
 
 bool table_set(VM *vm, Table *table, ObjString *key, Value value) {
-  Entry *entry = find_entry(table->front, key);
+  ensure_capacity(vm, table);
 
-  if (entry == NULL) {
-    return table_set_no_search(vm, table, key, value);
-  } else {
-    entry->value = value;
-    return false;
+  Entry *entry = find_entry(table->entries, table->capacity, key);
+  bool is_new_key = entry->key == NULL;
+
+  // reusing a tombstone does not change the load of the table
+  if (is_new_key && is_nil(entry->value)) {
+    ++table->size;
   }
+
+  entry->key = key;
+  entry->value = value;
+  return is_new_key;
 }
 
 bool table_set_no_search(VM *vm, Table *table, ObjString *key, Value value) {
-  Entry *entry = allocate(vm, sizeof(Entry), 1);
+  ensure_capacity(vm, table);
+
+  // the caller guarantees key is absent, so take the first free bucket
+  uint32_t mask = table->capacity - 1;
+  uint32_t index = key->hash & mask;
+  Entry *entry = &table->entries[index];
+  while (entry->key != NULL) {
+    index = (index + 1) & mask;
+    entry = &table->entries[index];
+  }
+
+  if (is_nil(entry->value)) {
+    ++table->size;
+  }
+
   entry->key = key;
   entry->value = value;
-  add_element(&table->front, &table->rear, entry);
-  ++table->size;
-  ++table->capacity;
   return true;
 }
 
@@ -47,8 +58,8 @@ bool table_get(Table *table, ObjString *key, Value *value) {
   if (table->size == 0)
     return false;
 
-  Entry *entry = find_entry(table->front, key);
-  if (entry == NULL)
+  Entry *entry = find_entry(table->entries, table->capacity, key);
+  if (entry->key == NULL)
     return false;
 
   *value = entry->value;
@@ -57,66 +68,114 @@ bool table_get(Table *table, ObjString *key, Value *value) {
 
 ObjString *table_find_string(Table *table, const char *key, size_t length,
                              uint32_t hash) {
-  for (Entry *cur = table->front; cur != NULL; cur = cur->next) {
-    if (cur->key->hash == hash && cur->key->length == length &&
-        memcmp(cur->key->chars, key, length) == 0) {
-      return cur->key;
+  if (table->size == 0)
+    return NULL;
+
+  uint32_t mask = table->capacity - 1;
+  uint32_t index = hash & mask;
+
+  for (;;) {
+    Entry *entry = &table->entries[index];
+
+    if (entry->key == NULL) {
+      // stop at an empty bucket, keep going past tombstones
+      if (is_nil(entry->value))
+        return NULL;
+    } else if (entry->key->hash == hash && entry->key->length == length &&
+               string_equals(entry->key->chars, key, length)) {
+      return entry->key;
     }
-  }
 
-  return NULL;
+    index = (index + 1) & mask;
+  }
 }
 
-bool table_delete(VM *vm, Table *table, ObjString *key) {
+bool table_delete(Table *table, ObjString *key) {
   if (table->size == 0)
     return false;
 
-  Entry *prev = NULL;
-  Entry *cur = table->front;
+  Entry *entry = find_entry(table->entries, table->capacity, key);
+  if (entry->key == NULL)
+    return false;
+
+  // leave a tombstone so probe sequences through this bucket stay intact
+  entry->key = NULL;
+  entry->value = bool_val(true);
+  return true;
+}
 
-  while (cur != NULL && cur->key != key) {
-    prev = cur;
-    cur = cur->next;
+// Sizes the table so count entries fit without growing it.
+void table_reserve(VM *vm, Table *table, int count) {
+  int capacity = 8;
+  while (count > capacity * TABLE_MAX_LOAD) {
+    capacity *= 2;
   }
 
-  // didn't find the entry
-  if (cur == NULL) {
-    return false;
-  } else if (prev == NULL) // first entry
-  {
-    table->front = table->front->next;
-    free_array(vm, sizeof(Entry), cur, 1);
-    --table->size;
-    return true;
-  } else {
-    prev->next = cur->next;
-    free_array(vm, sizeof(Entry), cur, 1);
-    --table->size;
-    return true;
+  if (capacity > table->capacity) {
+    adjust_capacity(vm, table, capacity);
   }
 }
 
 void table_add_all(VM *vm, Table *from, Table *to) {
-  for (Entry *cur = from->front; cur != NULL; cur = cur->next) {
-    table_set_no_search(vm, to, cur->key, cur->value);
+  for (int i = 0; i < from->capacity; ++i) {
+    Entry *entry = &from->entries[i];
+    if (entry->key != NULL) {
+      table_set(vm, to, entry->key, entry->value);
+    }
   }
 }
 
-Entry *find_entry(Entry *entries, ObjString *key) {
-  for (Entry *cur = entries; cur != NULL; cur = cur->next) {
-    if (cur->key == key) {
-      return cur;
+Entry *find_entry(Entry *entries, int capacity, ObjString *key) {
+  uint32_t mask = capacity - 1;
+  uint32_t index = key->hash & mask;
+  Entry *tombstone = NULL;
+
+  for (;;) {
+    Entry *entry = &entries[index];
+
+    if (entry->key == NULL) {
+      if (is_nil(entry->value)) {
+        // empty bucket, prefer an earlier tombstone for insertion
+        return tombstone != NULL ? tombstone : entry;
+      } else if (tombstone == NULL) {
+        tombstone = entry;
+      }
+    } else if (entry->key == key) {
+      return entry;
     }
+
+    index = (index + 1) & mask;
+  }
+}
+
+void adjust_capacity(VM *vm, Table *table, int capacity) {
+  Entry *entries = allocate(vm, sizeof(Entry), capacity);
+  for (int i = 0; i < capacity; ++i) {
+    entries[i].key = NULL;
+    entries[i].value = nil_val();
+  }
+
+  // tombstones are dropped while rehashing
+  table->size = 0;
+  for (int i = 0; i < table->capacity; ++i) {
+    Entry *entry = &table->entries[i];
+    if (entry->key == NULL)
+      continue;
+
+    Entry *dest = find_entry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+    ++table->size;
   }
 
-  return NULL;
+  free_array(vm, sizeof(Entry), table->entries, table->capacity);
+  table->entries = entries;
+  table->capacity = capacity;
 }
 
-void add_element(Entry **front, Entry **rear, Entry *entry) {
-  if (*front == NULL) {
-    *front = *rear = entry;
-  } else {
-    entry->next = *front;
-    *front = entry;
+void ensure_capacity(VM *vm, Table *table) {
+  if (table->size + 1 > table->capacity * TABLE_MAX_LOAD) {
+    int capacity = table->capacity < 8 ? 8 : table->capacity * 2;
+    adjust_capacity(vm, table, capacity);
   }
 }
@@ -1,38 +1,69 @@
 #include "VM.h"
 #include "Compiler.h"
 #include "Debug.h"
+#include "Map.h"
 #include "Memory.h"
+#include "Natives.h"
 #include "Object.h"
 #include "Opcode.h"
+#include "Ssa.h"
 #include "Value.h"
+#include <math.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 static uint8_t read_byte(CallFrame *);
-static uint16_t read_short(CallFrame *);
-static Value read_constant(CallFrame *);
-static ObjString *read_string(CallFrame *);
+static uint32_t read_long(CallFrame *);
+static Value read_constant(CallFrame *, bool *wide);
+static ObjString *read_string(CallFrame *, bool *wide);
 static InterpretResult run(VM *vm);
 static void reset_stack(VM *vm);
-static void runtime_error(VM *vm, const char *format, ...);
+static void grow_stack(VM *vm);
+static void grow_frames(VM *vm);
 static InterpretResult binary_op(VM *vm, Value (*fn)(Value, Value));
+static bool element_index(VM *vm, Value receiver, Value index, int *slot);
+static bool map_key(VM *vm, Value key);
+static bool call_intrinsic(int intrinsic, int arg_count, Value *args);
 
 void init_VM(VM *vm) {
+  vm->stack_capacity = STACK_INITIAL;
+  vm->stack = malloc(sizeof(Value) * vm->stack_capacity);
+  vm->open_slots = calloc(vm->stack_capacity, sizeof(ObjUpvalue *));
+  vm->open_upvalues = NULL;
+  vm->frame_capacity = FRAMES_INITIAL;
+  vm->frames = malloc(sizeof(CallFrame) * vm->frame_capacity);
   reset_stack(vm);
   init_table(&vm->strings);
   init_table(&vm->globals);
+  for (int i = 0; i < INTRINSIC_COUNT; ++i) {
+    vm->intrinsics[i] = NULL;
+  }
   vm->compiler = NULL;
   vm->init_string = NULL;
+  vm->layout_count = 0;
   vm->gray_size = 0;
   vm->gray_capacity = 0;
   vm->gray_stack = NULL;
   vm->objects = NULL;
+  vm->free_bound_methods = NULL;
+  vm->free_bound_method_count = 0;
   vm->bytes_allocated = 0;
   vm->next_gc = 1024 * 1024;
-  define_native(vm, "clock", clock_native);
+  vm->peephole = true;
+  init_peephole_stats(&vm->peephole_stats);
+  vm->hot_tier = true;
+  vm->optimize_all = false;
+  vm->lazy = false;
+  vm->sources = NULL;
+  vm->source_count = 0;
+  vm->source_capacity = 0;
+  init_output(&vm->output, stdout, malloc(OUTPUT_BUFFER_SIZE),
+              OUTPUT_BUFFER_SIZE);
+  define_natives(vm);
   vm->init_string = copy_string(vm, "init", 4);
 }
 
@@ -49,15 +80,36 @@ void free_VM(VM *vm) {
     object = next;
   }
 
+  while (vm->free_bound_methods != NULL) {
+    Obj *next = vm->free_bound_methods->next;
+    free(vm->free_bound_methods);
+    vm->free_bound_methods = next;
+  }
+
+  for (int i = 0; i < vm->source_count; ++i) {
+    free(vm->sources[i]);
+  }
+  free(vm->sources);
+
+  flush_output(&vm->output);
+  free(vm->output.chars);
+
   free(vm->gray_stack);
+  free(vm->stack);
+  free(vm->open_slots);
+  free(vm->frames);
 }
 
-InterpretResult interpret(VM *vm, const char *src) {
-  ObjFunction *fn = compile(vm, src);
+InterpretResult interpret(VM *vm, const char *src, size_t length) {
+  ObjFunction *fn = compile(vm, src, length);
   if (fn == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
 
+  return interpret_function(vm, fn);
+}
+
+InterpretResult interpret_function(VM *vm, ObjFunction *fn) {
   // for GC
   vm->compiler = NULL;
   push(vm, object_val((Obj *)fn));
@@ -68,24 +120,60 @@ InterpretResult interpret(VM *vm, const char *src) {
   return run(vm);
 }
 
-void push(VM *vm, Value value) { *vm->stack_top++ = value; }
+void push(VM *vm, Value value) {
+  if (vm->stack_top == vm->stack + vm->stack_capacity) {
+    grow_stack(vm);
+  }
+
+  *vm->stack_top++ = value;
+}
 
 Value pop(VM *vm) { return *--vm->stack_top; }
 
 Value peek(VM *vm, size_t index) { return vm->stack_top[-1 - index]; }
 
-static bool call(VM *vm, ObjClosure *closure, int arg_count) {
+static bool check_arity(VM *vm, ObjClosure *closure, int arg_count) {
   if (arg_count != closure->fn->arity) {
     runtime_error(vm, "Expected %d arguments but got %d.", closure->fn->arity,
                   arg_count);
     return false;
   }
 
+  return true;
+}
+
+static void count_call(VM *vm, ObjFunction *fn) {
+  if (vm->hot_tier && !fn->optimized && ++fn->calls >= HOT_CALLS) {
+    optimize_function(vm, fn, true);
+  }
+}
+
+// A function pre-parsed in lazy mode is compiled right before it first runs.
+static bool compile_body(VM *vm, ObjFunction *fn) {
+  if (fn->lazy != NULL && !compile_lazy(vm, fn)) {
+    runtime_error(vm, "Could not compile %s().", fn->name->chars);
+    return false;
+  }
+
+  return true;
+}
+
+static bool call(VM *vm, ObjClosure *closure, int arg_count) {
+  if (!check_arity(vm, closure, arg_count) ||
+      !compile_body(vm, closure->fn)) {
+    return false;
+  }
+
   if (vm->frame_count == FRAMES_MAX) {
     runtime_error(vm, "Stack overflow.");
     return false;
   }
 
+  if (vm->frame_count == vm->frame_capacity) {
+    grow_frames(vm);
+  }
+
+  count_call(vm, closure->fn);
   CallFrame *frame = &vm->frames[vm->frame_count++];
   frame->closure = closure;
   frame->ip = closure->fn->chunk.code;
@@ -98,11 +186,11 @@ bool call_value(VM *vm, Value callee, int arg_count) {
     switch (object_type(callee)) {
     case OBJ_CLASS: {
       ObjClass *klass = as_class(callee);
-      vm->stack_top[-arg_count - 1] =
-          object_val((Obj *)new_instance(vm, klass));
-      Value init;
-      if (table_get(&klass->methods, vm->init_string, &init)) {
-        return call(vm, as_closure(init), arg_count);
+      // new_instance may grow the stack
+      ObjInstance *instance = new_instance(vm, klass);
+      vm->stack_top[-arg_count - 1] = object_val((Obj *)instance);
+      if (klass->initializer != NULL) {
+        return call(vm, klass->initializer, arg_count);
       } else if (arg_count != 0) {
         runtime_error(vm, "Expected 0 arguments but got %d.", arg_count);
         return false;
@@ -120,10 +208,17 @@ bool call_value(VM *vm, Value callee, int arg_count) {
       return call(vm, as_closure(callee), arg_count);
 
     case OBJ_NATIVE: {
-      NativeFn fn = as_native(callee);
-      Value res = fn(arg_count, vm->stack_top - arg_count);
-      vm->stack_top -= arg_count + 1;
-      push(vm, res);
+      ObjNative *native = (ObjNative *)as_object(callee);
+      if (native->arity != NATIVE_VARIADIC && arg_count != native->arity) {
+        runtime_error(vm, "Expected %d arguments but got %d.", native->arity,
+                      arg_count);
+        return false;
+      }
+
+      if (!native->fn(vm, arg_count, vm->stack_top - arg_count)) {
+        return false;
+      }
+      vm->stack_top -= arg_count;
       return true;
     }
 
@@ -136,8 +231,64 @@ bool call_value(VM *vm, Value callee, int arg_count) {
   return false;
 }
 
+// Replaces the current frame with a call to closure. Its upvalues are closed
+// first, then the callee and the arguments slide down onto the frame's window.
+static bool tail_call(VM *vm, ObjClosure *closure, int arg_count) {
+  if (!check_arity(vm, closure, arg_count) ||
+      !compile_body(vm, closure->fn)) {
+    return false;
+  }
+
+  count_call(vm, closure->fn);
+  CallFrame *frame = &vm->frames[vm->frame_count - 1];
+  close_upvalues(vm, frame->slots);
+
+  Value *callee = vm->stack_top - arg_count - 1;
+  memmove(frame->slots, callee, sizeof(Value) * (arg_count + 1));
+  vm->stack_top = frame->slots + arg_count + 1;
+
+  frame->closure = closure;
+  frame->ip = closure->fn->chunk.code;
+  return true;
+}
+
+// Callees that run bytecode take over the caller's frame. Natives and classes
+// without an initializer leave their result on the stack for the OP_RETURN
+// that follows every OP_TAIL_CALL.
+static bool tail_call_value(VM *vm, Value callee, int arg_count) {
+  if (is_object(callee)) {
+    switch (object_type(callee)) {
+    case OBJ_CLOSURE:
+      return tail_call(vm, as_closure(callee), arg_count);
+
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod *bound_method = as_bound_method(callee);
+      vm->stack_top[-1 - arg_count] = bound_method->receiver;
+      return tail_call(vm, bound_method->method, arg_count);
+    }
+
+    case OBJ_CLASS: {
+      ObjClass *klass = as_class(callee);
+      if (klass->initializer != NULL) {
+        ObjInstance *instance = new_instance(vm, klass);
+        vm->stack_top[-arg_count - 1] = object_val((Obj *)instance);
+        return tail_call(vm, klass->initializer, arg_count);
+      }
+      break;
+    }
+
+    default:
+      break;
+    }
+  }
+
+  return call_value(vm, callee, arg_count);
+}
+
 InterpretResult run(VM *vm) {
   CallFrame *frame = &vm->frames[vm->frame_count - 1];
+  // set by OP_WIDE, consumed by the constant operand of the next instruction
+  bool wide = false;
 
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
@@ -157,7 +308,7 @@ InterpretResult run(VM *vm) {
 
     switch (inst) {
     case OP_CLASS:
-      push(vm, object_val((Obj *)new_class(vm, read_string(frame))));
+      push(vm, object_val((Obj *)new_class(vm, read_string(frame, &wide))));
       break;
 
     case OP_GET_PROPERTY: {
@@ -167,7 +318,7 @@ InterpretResult run(VM *vm) {
       }
 
       ObjInstance *instance = as_instance(peek(vm, 0));
-      ObjString *name = read_string(frame);
+      ObjString *name = read_string(frame, &wide);
 
       Value value;
       if (table_get(&instance->fields, name, &value)) {
@@ -187,27 +338,41 @@ InterpretResult run(VM *vm) {
       }
 
       ObjInstance *instance = as_instance(peek(vm, 1));
-      ObjString *name = read_string(frame);
-      table_set(vm, &instance->fields, name, peek(vm, 0));
+      ObjString *name = read_string(frame, &wide);
+      // an instance out of the ordinary only sizes the ones right after it
+      if (table_set(vm, &instance->fields, name, peek(vm, 0))) {
+        instance->klass->field_count = instance->fields.size;
+      }
       Value value = pop(vm); // value
       pop(vm);               // instance
       push(vm, value);
       break;
     }
 
+    // compiled code always has a class and a closure here, a loaded file
+    // might not
     case OP_METHOD:
-      define_method(vm, read_string(frame));
+      if (!is_class(peek(vm, 1)) || !is_closure(peek(vm, 0))) {
+        runtime_error(vm, "Only classes have methods.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      define_method(vm, read_string(frame, &wide));
       break;
 
     case OP_CLOSURE: {
-      ObjFunction *fn = as_function(read_constant(frame));
+      ObjFunction *fn = as_function(read_constant(frame, &wide));
       ObjClosure *closure = new_closure(vm, fn);
       push(vm, object_val((Obj *)closure));
       for (int i = 0; i < closure->upvalue_count; ++i) {
-        uint8_t is_local = read_byte(frame);
+        uint8_t capture = read_byte(frame);
         uint8_t index = read_byte(frame);
-        if (is_local) {
-          closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
+        // the closure is already in its slot, so a local function capturing
+        // itself flat copies the closure
+        if (capture == (CAPTURE_LOCAL | CAPTURE_FLAT)) {
+          closure->upvalues[i] = frame->slots[index];
+        } else if (capture & CAPTURE_LOCAL) {
+          closure->upvalues[i] = object_val(
+              (Obj *)capture_upvalue(vm, frame->slots + index));
         } else {
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
@@ -215,11 +380,12 @@ InterpretResult run(VM *vm) {
       break;
     }
 
-    case OP_INVOKE: {
-      ObjString *method = read_string(frame);
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE: {
+      ObjString *method = read_string(frame, &wide);
       uint8_t arg_count = read_byte(frame);
 
-      if (invoke(vm, method, arg_count)) {
+      if (invoke(vm, method, arg_count, inst == OP_TAIL_INVOKE)) {
         frame = &vm->frames[vm->frame_count - 1];
       } else {
         return INTERPRET_RUNTIME_ERROR;
@@ -227,12 +393,18 @@ InterpretResult run(VM *vm) {
       break;
     }
 
-    case OP_SUPER_INVOKE: {
-      ObjString *method = read_string(frame);
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_SUPER_INVOKE: {
+      ObjString *method = read_string(frame, &wide);
       uint8_t arg_count = read_byte(frame);
-      ObjClass *superclass = as_class(pop(vm));
+      Value superclass = pop(vm);
+      if (!is_class(superclass)) {
+        runtime_error(vm, "Superclass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
 
-      if (invoke_from_class(vm, superclass, method, arg_count)) {
+      if (invoke_from_class(vm, as_class(superclass), method, arg_count,
+                            inst == OP_TAIL_SUPER_INVOKE)) {
         frame = &vm->frames[vm->frame_count - 1];
       } else {
         return INTERPRET_RUNTIME_ERROR;
@@ -243,22 +415,27 @@ InterpretResult run(VM *vm) {
     case OP_INHERIT: {
       Value superclass = peek(vm, 1);
 
-      if (is_class(superclass)) {
-        ObjClass *subclass = as_class(peek(vm, 0));
-        table_add_all(vm, &as_class(superclass)->methods, &subclass->methods);
-        pop(vm); // subclass
-      } else {
+      if (!is_class(superclass)) {
         runtime_error(vm, "Superclass must be a class.");
         return INTERPRET_RUNTIME_ERROR;
+      } else if (!is_class(peek(vm, 0))) {
+        runtime_error(vm, "Only classes can inherit.");
+        return INTERPRET_RUNTIME_ERROR;
       }
+      inherit_methods(vm, as_class(peek(vm, 0)), as_class(superclass));
+      pop(vm); // subclass
 
       break;
     }
 
     case OP_GET_SUPER: {
-      ObjString *name = read_string(frame);
-      ObjClass *superclass = as_class(pop(vm));
-      if (!bind_method(vm, superclass, name)) {
+      ObjString *name = read_string(frame, &wide);
+      Value superclass = pop(vm);
+      if (!is_class(superclass)) {
+        runtime_error(vm, "Superclass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (!bind_method(vm, as_class(superclass), name)) {
         return INTERPRET_RUNTIME_ERROR;
       }
       break;
@@ -266,18 +443,24 @@ InterpretResult run(VM *vm) {
 
     case OP_GET_UPVALUE: {
       uint8_t slot = read_byte(frame);
-      push(vm, *frame->closure->upvalues[slot]->location);
+      push(vm, *as_upvalue(frame->closure->upvalues[slot])->location);
+      break;
+    }
+
+    case OP_GET_FLAT_UPVALUE: {
+      uint8_t slot = read_byte(frame);
+      push(vm, frame->closure->upvalues[slot]);
       break;
     }
 
     case OP_SET_UPVALUE: {
       uint8_t slot = read_byte(frame);
-      *frame->closure->upvalues[slot]->location = peek(vm, 0);
+      *as_upvalue(frame->closure->upvalues[slot])->location = peek(vm, 0);
       break;
     }
 
     case OP_DEFINE_GLOBAL: {
-      ObjString *name = read_string(frame);
+      ObjString *name = read_string(frame, &wide);
       table_set(vm, &vm->globals, name, peek(vm, 0));
       pop(vm);
       break;
@@ -289,7 +472,7 @@ InterpretResult run(VM *vm) {
       break;
 
     case OP_GET_GLOBAL: {
-      ObjString *name = read_string(frame);
+      ObjString *name = read_string(frame, &wide);
       Value value;
       if (!table_get(&vm->globals, name, &value)) {
         runtime_error(vm, "Undefined variable '%s'.", name->chars);
@@ -301,9 +484,9 @@ InterpretResult run(VM *vm) {
     }
 
     case OP_SET_GLOBAL: {
-      ObjString *name = read_string(frame);
+      ObjString *name = read_string(frame, &wide);
       if (table_set(vm, &vm->globals, name, peek(vm, 0))) {
-        table_delete(vm, &vm->globals, name);
+        table_delete(&vm->globals, name);
         runtime_error(vm, "Undefined variable '%s'.", name->chars);
         return INTERPRET_RUNTIME_ERROR;
       }
@@ -322,31 +505,51 @@ InterpretResult run(VM *vm) {
       break;
     }
 
+    case OP_BIND_LOCAL: {
+      uint8_t slot = read_byte(frame);
+      if (is_closure(frame->slots[slot + 1])) {
+        ObjBoundMethod *bound =
+            new_bound_method(vm, frame->slots[slot], as_closure(frame->slots[slot + 1]));
+        frame->slots[slot] = object_val((Obj *)bound);
+        frame->slots[slot + 1] = nil_val();
+      }
+      push(vm, frame->slots[slot]);
+      break;
+    }
+
     case OP_PRINT:
-      print_value(stdout, pop(vm));
-      putchar('\n');
+      write_value(&vm->output, pop(vm));
+      write_output_char(&vm->output, '\n');
       break;
 
     case OP_LOOP: {
-      uint16_t offset = read_short(frame);
+      uint32_t offset = read_long(frame);
       frame->ip -= offset;
       break;
     }
 
     case OP_JUMP: {
-      uint16_t offset = read_short(frame);
+      uint32_t offset = read_long(frame);
       frame->ip += offset;
       break;
     }
 
     case OP_JUMP_IF_FALSE: {
-      uint16_t offset = read_short(frame);
+      uint32_t offset = read_long(frame);
       if (is_falsey(peek(vm, 0))) {
         frame->ip += offset;
       }
       break;
     }
 
+    case OP_JUMP_IF_TRUE: {
+      uint32_t offset = read_long(frame);
+      if (!is_falsey(peek(vm, 0))) {
+        frame->ip += offset;
+      }
+      break;
+    }
+
     case OP_CALL: {
       int arg_count = read_byte(frame);
       if (!call_value(vm, peek(vm, arg_count), arg_count)) {
@@ -356,6 +559,33 @@ InterpretResult run(VM *vm) {
       break;
     }
 
+    case OP_CALL_INTRINSIC: {
+      int arg_count = read_byte(frame);
+      int intrinsic = read_byte(frame);
+      Value *args = vm->stack_top - arg_count;
+      if (is_object(args[-1]) &&
+          as_object(args[-1]) == (Obj *)vm->intrinsics[intrinsic] &&
+          call_intrinsic(intrinsic, arg_count, args)) {
+        vm->stack_top = args;
+        break;
+      }
+
+      if (!call_value(vm, args[-1], arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm->frames[vm->frame_count - 1];
+      break;
+    }
+
+    case OP_TAIL_CALL: {
+      int arg_count = read_byte(frame);
+      if (!tail_call_value(vm, peek(vm, arg_count), arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm->frames[vm->frame_count - 1];
+      break;
+    }
+
     case OP_RETURN: {
       Value res = pop(vm);
       close_upvalues(vm, frame->slots);
@@ -372,7 +602,7 @@ InterpretResult run(VM *vm) {
     }
 
     case OP_CONSTANT: {
-      Value constant = read_constant(frame);
+      Value constant = read_constant(frame, &wide);
       push(vm, constant);
       break;
     }
@@ -460,6 +690,212 @@ InterpretResult run(VM *vm) {
       }
       break;
 
+    case OP_ADD_NUM: {
+      Value b = pop(vm);
+      vm->stack_top[-1] = add(vm->stack_top[-1], b);
+      break;
+    }
+
+    case OP_SUBTRACT_NUM: {
+      Value b = pop(vm);
+      vm->stack_top[-1] = subtract(vm->stack_top[-1], b);
+      break;
+    }
+
+    case OP_MULTIPLY_NUM: {
+      Value b = pop(vm);
+      vm->stack_top[-1] = multiply(vm->stack_top[-1], b);
+      break;
+    }
+
+    case OP_DIVIDE_NUM: {
+      Value b = pop(vm);
+      vm->stack_top[-1] = divide(vm->stack_top[-1], b);
+      break;
+    }
+
+    case OP_NEGATE_NUM:
+      vm->stack_top[-1] = number_val(-as_number(vm->stack_top[-1]));
+      break;
+
+    case OP_GREATER_NUM: {
+      Value b = pop(vm);
+      vm->stack_top[-1] = greater(vm->stack_top[-1], b);
+      break;
+    }
+
+    case OP_LESS_NUM: {
+      Value b = pop(vm);
+      vm->stack_top[-1] = less(vm->stack_top[-1], b);
+      break;
+    }
+
+    case OP_JUMP_IF_CALLEE: {
+      uint32_t offset = read_long(frame);
+      Value callee = peek(vm, read_byte(frame));
+      ObjFunction *fn = as_function(read_constant(frame, &wide));
+      if (is_closure(callee) && as_closure(callee)->fn == fn) {
+        frame->ip += offset;
+      }
+      break;
+    }
+
+    case OP_INLINE_RETURN: {
+      Value res = pop(vm);
+      vm->stack_top = frame->slots + read_byte(frame);
+      push(vm, res);
+      break;
+    }
+
+    // a field leaves its value and nil, a method the receiver and itself
+    case OP_GET_METHOD: {
+      if (!is_instance(peek(vm, 0))) {
+        runtime_error(vm, "Only instances have properties.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      ObjInstance *instance = as_instance(peek(vm, 0));
+      ObjString *name = read_string(frame, &wide);
+
+      Value value;
+      ObjClosure *method;
+      if (table_get(&instance->fields, name, &value)) {
+        vm->stack_top[-1] = value;
+        push(vm, nil_val());
+      } else if ((method = find_method(instance->klass, name)) != NULL) {
+        push(vm, object_val((Obj *)method));
+      } else {
+        runtime_error(vm, "Undefined property '%s'.", name->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      break;
+    }
+
+    case OP_GET_SUPER_METHOD: {
+      ObjString *name = read_string(frame, &wide);
+      Value superclass = pop(vm);
+      if (!is_class(superclass)) {
+        runtime_error(vm, "Superclass must be a class.");
+        return INTERPRET_RUNTIME_ERROR;
+      }
+
+      ObjClosure *method = find_method(as_class(superclass), name);
+      if (method == NULL) {
+        runtime_error(vm, "Undefined property '%s'.", name->chars);
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      push(vm, object_val((Obj *)method));
+      break;
+    }
+
+    // the arguments slide down over the method, which leaves the receiver
+    // in the callee's slot as a bound method would
+    case OP_CALL_METHOD: {
+      int arg_count = read_byte(frame);
+      Value method = peek(vm, arg_count);
+      Value *args = vm->stack_top - arg_count;
+      memmove(args - 1, args, sizeof(Value) * arg_count);
+      --vm->stack_top;
+
+      Value receiver = peek(vm, arg_count);
+      if (!(is_closure(method) ? call(vm, as_closure(method), arg_count)
+                               : call_value(vm, receiver, arg_count))) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm->frames[vm->frame_count - 1];
+      break;
+    }
+
+    case OP_BUILD_LIST: {
+      int count = read_byte(frame);
+      ObjList *list = new_list(vm, vm->stack_top - count, count);
+      vm->stack_top -= count;
+      push(vm, object_val((Obj *)list));
+      break;
+    }
+
+    case OP_INDEX_GET: {
+      Value receiver = peek(vm, 1);
+      Value index = peek(vm, 0);
+      Value value;
+
+      // an unboxed element read in range needs no other checks
+      if (is_float64_array(receiver) && is_number(index)) {
+        ObjFloat64Array *array = as_float64_array(receiver);
+        double number = as_number(index);
+        if (number >= 0 && number < array->count && (int)number == number) {
+          vm->stack_top -= 1;
+          vm->stack_top[-1] = number_val(array->items[(int)number]);
+          break;
+        }
+      }
+
+      if (is_map(receiver)) {
+        // a missing key reads as nil
+        if (!map_get(as_map(receiver), index, &value)) {
+          value = nil_val();
+        }
+      } else {
+        int slot;
+        if (!element_index(vm, receiver, index, &slot)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        value = is_list(receiver)
+                    ? as_list(receiver)->items[slot]
+                    : number_val(as_float64_array(receiver)->items[slot]);
+      }
+
+      vm->stack_top -= 1;
+      vm->stack_top[-1] = value;
+      break;
+    }
+
+    case OP_INDEX_SET: {
+      Value receiver = peek(vm, 2);
+      Value index = peek(vm, 1);
+      Value value = peek(vm, 0);
+
+      if (is_float64_array(receiver) && is_number(index) && is_number(value)) {
+        ObjFloat64Array *array = as_float64_array(receiver);
+        double number = as_number(index);
+        if (number >= 0 && number < array->count && (int)number == number) {
+          array->items[(int)number] = as_number(value);
+          vm->stack_top -= 2;
+          vm->stack_top[-1] = value;
+          break;
+        }
+      }
+
+      if (is_map(receiver)) {
+        if (!map_key(vm, index)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        map_set(vm, as_map(receiver), index, value);
+      } else {
+        int slot;
+        if (!element_index(vm, receiver, index, &slot)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+
+        if (is_list(receiver)) {
+          as_list(receiver)->items[slot] = value;
+        } else if (is_number(value)) {
+          as_float64_array(receiver)->items[slot] = as_number(value);
+        } else {
+          runtime_error(vm, "Float64Array elements must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+      }
+
+      vm->stack_top -= 2;
+      vm->stack_top[-1] = value;
+      break;
+    }
+
+    case OP_WIDE:
+      wide = true;
+      continue;
+
     default:
       break;
     }
@@ -468,27 +904,96 @@ InterpretResult run(VM *vm) {
 
 uint8_t read_byte(CallFrame *frame) { return *frame->ip++; }
 
-uint16_t read_short(CallFrame *frame) {
-  frame->ip += 2;
-  return (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]);
+uint32_t read_long(CallFrame *frame) {
+  frame->ip += 3;
+  return ((uint32_t)frame->ip[-3] << 16) | ((uint32_t)frame->ip[-2] << 8) |
+         frame->ip[-1];
 }
 
-Value read_constant(CallFrame *frame) {
-  uint8_t index = read_byte(frame);
+Value read_constant(CallFrame *frame, bool *wide) {
+  uint32_t index;
+  if (*wide) {
+    index = read_long(frame);
+    *wide = false;
+  } else {
+    index = read_byte(frame);
+  }
+
   return frame->closure->fn->chunk.constants.values[index];
 }
 
-ObjString *read_string(CallFrame *frame) {
-  return as_string(read_constant(frame));
+ObjString *read_string(CallFrame *frame, bool *wide) {
+  return as_string(read_constant(frame, wide));
 }
 
 void reset_stack(VM *vm) {
   vm->stack_top = vm->stack;
   vm->frame_count = 0;
+  for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    vm->open_slots[upvalue->location - vm->stack] = NULL;
+  }
   vm->open_upvalues = NULL;
 }
 
-static void runtime_error(VM *vm, const char *format, ...) {
+// Reallocating the value stack moves every slot, so the frame windows and the
+// open upvalues that point into it are turned into offsets first and rebased
+// onto the new block afterwards.
+void grow_stack(VM *vm) {
+  ptrdiff_t top = vm->stack_top - vm->stack;
+  for (int i = 0; i < vm->frame_count; ++i) {
+    vm->frames[i].slots = (Value *)(vm->frames[i].slots - vm->stack);
+  }
+  for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = (Value *)(upvalue->location - vm->stack);
+  }
+
+  vm->stack_capacity = grow_capacity(vm->stack_capacity);
+  vm->stack = realloc(vm->stack, sizeof(Value) * vm->stack_capacity);
+  if (vm->stack == NULL) {
+    flush_output(&vm->output);
+    fprintf(stderr, "Out of memory growing the stack.\n");
+    exit(74);
+  }
+
+  vm->open_slots =
+      realloc(vm->open_slots, sizeof(ObjUpvalue *) * vm->stack_capacity);
+  if (vm->open_slots == NULL) {
+    flush_output(&vm->output);
+    fprintf(stderr, "Out of memory growing the stack.\n");
+    exit(74);
+  }
+  memset(vm->open_slots + top, 0,
+         sizeof(ObjUpvalue *) * (vm->stack_capacity - top));
+
+  vm->stack_top = vm->stack + top;
+  for (int i = 0; i < vm->frame_count; ++i) {
+    vm->frames[i].slots = vm->stack + (ptrdiff_t)vm->frames[i].slots;
+  }
+  for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = vm->stack + (ptrdiff_t)upvalue->location;
+  }
+}
+
+void grow_frames(VM *vm) {
+  vm->frame_capacity = grow_capacity(vm->frame_capacity);
+  if (vm->frame_capacity > FRAMES_MAX) {
+    vm->frame_capacity = FRAMES_MAX;
+  }
+
+  vm->frames = realloc(vm->frames, sizeof(CallFrame) * vm->frame_capacity);
+  if (vm->frames == NULL) {
+    flush_output(&vm->output);
+    fprintf(stderr, "Out of memory growing the call stack.\n");
+    exit(74);
+  }
+}
+
+void runtime_error(VM *vm, const char *format, ...) {
+  flush_output(&vm->output);
+
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -498,10 +1003,16 @@ static void runtime_error(VM *vm, const char *format, ...) {
   for (int i = vm->frame_count - 1; i >= 0; i--) {
     CallFrame *frame = &vm->frames[i];
     ObjFunction *function = frame->closure->fn;
+    // frames that were running when the function got optimized are still
+    // in its retired code
+    Chunk *chunk = &function->chunk;
+    if (frame->ip <= chunk->code || frame->ip > chunk->code + chunk->size) {
+      chunk = &function->retired;
+    }
     // -1 because the IP is sitting on the next instruction to be
     // executed.
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    size_t instruction = frame->ip - chunk->code - 1;
+    fprintf(stderr, "[line %d] in ", get_line(chunk, instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -524,19 +1035,119 @@ InterpretResult binary_op(VM *vm, Value (*fn)(Value, Value)) {
   return INTERPRET_OK;
 }
 
-void define_native(VM *vm, const char *name, NativeFn fn) {
+// The element of a list or a Float64Array an index refers to, an integer
+// below its count.
+bool element_index(VM *vm, Value receiver, Value index, int *slot) {
+  const char *kind;
+  int count;
+  if (is_list(receiver)) {
+    kind = "List";
+    count = as_list(receiver)->count;
+  } else if (is_float64_array(receiver)) {
+    kind = "Float64Array";
+    count = as_float64_array(receiver)->count;
+  } else {
+    runtime_error(vm, "Only lists, maps and Float64Arrays can be indexed.");
+    return false;
+  }
+
+  if (!is_number(index)) {
+    runtime_error(vm, "%s index must be a number.", kind);
+    return false;
+  }
+
+  double number = as_number(index);
+  if (!(number >= 0 && number < count)) {
+    runtime_error(vm, "%s index out of range.", kind);
+    return false;
+  }
+
+  *slot = (int)number;
+  if (*slot != number) {
+    runtime_error(vm, "%s index must be an integer.", kind);
+    return false;
+  }
+
+  return true;
+}
+
+// The common cases of the intrinsic natives, computed without a call. Any
+// other argument count or type is left to the native, which reports it.
+bool call_intrinsic(int intrinsic, int arg_count, Value *args) {
+  switch (intrinsic) {
+  case INTRINSIC_CLOCK:
+    if (arg_count != 0)
+      return false;
+    args[-1] = number_val((double)clock() / CLOCKS_PER_SEC);
+    return true;
+
+  case INTRINSIC_LEN:
+    if (arg_count != 1 || !is_object(args[0]))
+      return false;
+    switch (object_type(args[0])) {
+    case OBJ_LIST:
+      args[-1] = number_val(as_list(args[0])->count);
+      return true;
+    case OBJ_STRING:
+      args[-1] = number_val((double)as_string(args[0])->length);
+      return true;
+    case OBJ_MAP:
+      args[-1] = number_val(as_map(args[0])->count);
+      return true;
+    case OBJ_FLOAT64_ARRAY:
+      args[-1] = number_val(as_float64_array(args[0])->count);
+      return true;
+    default:
+      return false;
+    }
+
+  case INTRINSIC_SQRT:
+  case INTRINSIC_ABS:
+  case INTRINSIC_FLOOR: {
+    if (arg_count != 1 || !is_number(args[0]))
+      return false;
+    double number = as_number(args[0]);
+    args[-1] = number_val(intrinsic == INTRINSIC_SQRT  ? sqrt(number)
+                          : intrinsic == INTRINSIC_ABS ? fabs(number)
+                                                       : floor(number));
+    return true;
+  }
+
+  default:
+    return false;
+  }
+}
+
+// NaN equals nothing, not even itself, so it could be stored but never
+// found again.
+bool map_key(VM *vm, Value key) {
+  if (is_number(key) && as_number(key) != as_number(key)) {
+    runtime_error(vm, "Map key cannot be NaN.");
+    return false;
+  }
+
+  return true;
+}
+
+ObjNative *define_native(VM *vm, const char *name, NativeFn fn, int arity) {
   push(vm, object_val((Obj *)copy_string(vm, name, strlen(name))));
-  push(vm, object_val((Obj *)new_native(vm, fn)));
+  push(vm, object_val((Obj *)new_native(vm, name, fn, arity)));
   table_set(vm, &vm->globals, as_string(vm->stack[0]), vm->stack[1]);
+  ObjNative *native = (ObjNative *)as_object(vm->stack[1]);
   pop(vm);
   pop(vm);
+  return native;
 }
 
-Value clock_native(int arg_count, Value *args) {
-  return number_val((double)clock() / CLOCKS_PER_SEC);
-}
-
+// Closures capturing the same slot share its upvalue, which is found through
+// the slot. A new one goes into the sorted list, usually near its head as
+// only the slots above it in the current frame come first.
 ObjUpvalue *capture_upvalue(VM *vm, Value *slot) {
+  ObjUpvalue **open = &vm->open_slots[slot - vm->stack];
+  if (*open != NULL) {
+    return *open;
+  }
+
   ObjUpvalue *prev_upvalue = NULL;
   ObjUpvalue *upvalue = vm->open_upvalues;
 
@@ -545,10 +1156,6 @@ ObjUpvalue *capture_upvalue(VM *vm, Value *slot) {
     upvalue = upvalue->next;
   }
 
-  if (upvalue != NULL && upvalue->location == slot) {
-    return upvalue;
-  }
-
   ObjUpvalue *created_upvalue = new_upvalue(vm, slot);
   created_upvalue->next = upvalue;
   if (prev_upvalue == NULL) {
@@ -557,12 +1164,14 @@ ObjUpvalue *capture_upvalue(VM *vm, Value *slot) {
     prev_upvalue->next = created_upvalue;
   }
 
+  vm->open_slots[slot - vm->stack] = created_upvalue;
   return created_upvalue;
 }
 
 void close_upvalues(VM *vm, Value *last) {
   while (vm->open_upvalues != NULL && vm->open_upvalues->location >= last) {
     ObjUpvalue *upvalue = vm->open_upvalues;
+    vm->open_slots[upvalue->location - vm->stack] = NULL;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
     vm->open_upvalues = upvalue->next;
@@ -570,17 +1179,16 @@ void close_upvalues(VM *vm, Value *last) {
 }
 
 void define_method(VM *vm, ObjString *name) {
-  Value method = peek(vm, 0);
+  ObjClosure *method = as_closure(peek(vm, 0));
   ObjClass *klass = as_class(peek(vm, 1));
-  table_set(vm, &klass->methods, name, method);
+  set_method(vm, klass, name, method);
   pop(vm); // method
 }
 
 bool bind_method(VM *vm, ObjClass *klass, ObjString *name) {
-  Value method;
-  if (table_get(&klass->methods, name, &method)) {
-    ObjBoundMethod *bound =
-        new_bound_method(vm, peek(vm, 0), as_closure(method));
+  ObjClosure *method = find_method(klass, name);
+  if (method != NULL) {
+    ObjBoundMethod *bound = new_bound_method(vm, peek(vm, 0), method);
     pop(vm);                            // instance
     push(vm, object_val((Obj *)bound)); // method
     return true;
@@ -590,7 +1198,8 @@ bool bind_method(VM *vm, ObjClass *klass, ObjString *name) {
   }
 }
 
-bool invoke(VM *vm, ObjString *name, uint8_t arg_count) {
+// A tail invoke takes over the caller's frame as OP_TAIL_CALL does.
+bool invoke(VM *vm, ObjString *name, uint8_t arg_count, bool tail) {
   Value receiver = peek(vm, arg_count);
 
   if (is_instance(receiver)) {
@@ -599,10 +1208,11 @@ bool invoke(VM *vm, ObjString *name, uint8_t arg_count) {
     Value value;
     if (table_get(&instance->fields, name, &value)) {
       vm->stack_top[-arg_count - 1] = value;
-      return call_value(vm, value, arg_count);
+      return tail ? tail_call_value(vm, value, arg_count)
+                  : call_value(vm, value, arg_count);
     }
 
-    return invoke_from_class(vm, instance->klass, name, arg_count);
+    return invoke_from_class(vm, instance->klass, name, arg_count, tail);
   } else {
     runtime_error(vm, "Only instances have methods.");
     return false;
@@ -610,11 +1220,11 @@ bool invoke(VM *vm, ObjString *name, uint8_t arg_count) {
 }
 
 bool invoke_from_class(VM *vm, ObjClass *klass, ObjString *name,
-                       uint8_t arg_count) {
-  Value method;
-
-  if (table_get(&klass->methods, name, &method)) {
-    return call(vm, as_closure(method), arg_count);
+                       uint8_t arg_count, bool tail) {
+  ObjClosure *method = find_method(klass, name);
+  if (method != NULL) {
+    return tail ? tail_call(vm, method, arg_count)
+                : call(vm, method, arg_count);
   } else {
     runtime_error(vm, "Undefined property '%s'.", name->chars);
     return false;
@@ -1,7 +1,21 @@
 #include "Value.h"
 #include "Memory.h"
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+// Numbers print the way %g prints them, six significant digits.
+#define NUMBER_DIGITS 6
+#define NUMBER_DIGITS_LIMIT 1000000
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 uint128;
+
+static bool scale_number(double magnitude, int scale, uint64_t *digits);
+static size_t format_digits(double number, char *buffer);
+#endif
+static size_t format_integer(uint64_t integer, char *buffer);
 
 void init_value_array(ValueArray *array)
 {
@@ -30,26 +44,209 @@ void free_value_array(VM *vm, ValueArray *array)
 }
 
 void print_value(FILE *out, Value value)
+{
+  char chars[256];
+  Output output;
+  init_output(&output, out, chars, sizeof(chars));
+  write_value(&output, value);
+  flush_output(&output);
+}
+
+void write_value(Output *out, Value value)
 {
   switch (value.type)
   {
   case VAL_BOOL:
-    fprintf(out, as_bool(value) ? "true" : "false");
+    if (as_bool(value))
+      write_output(out, "true", 4);
+    else
+      write_output(out, "false", 5);
     break;
   case VAL_NIL:
-    fprintf(out, "nil");
+    write_output(out, "nil", 3);
     break;
   case VAL_NUMBER:
-    fprintf(out, "%g", as_number(value));
+  {
+    char buffer[NUMBER_BUFFER_SIZE];
+    write_output(out, buffer, format_number(as_number(value), buffer));
     break;
+  }
   case VAL_OBJ:
-    print_object(out, value);
+    write_object(out, value);
     break;
   default:
     break;
   }
 }
 
+// Writes number as %g would and returns its length. Integers below a million
+// are their own digits, other numbers are rounded exactly where 128 bits are
+// enough, anything else is left to snprintf.
+size_t format_number(double number, char *buffer)
+{
+  double magnitude = fabs(number);
+  if (magnitude < NUMBER_DIGITS_LIMIT && magnitude == (double)(int32_t)magnitude)
+  {
+    size_t sign = signbit(number) ? 1 : 0;
+    buffer[0] = '-';
+    return sign + format_integer((uint64_t)magnitude, buffer + sign);
+  }
+
+#ifdef __SIZEOF_INT128__
+  if (isfinite(number))
+  {
+    size_t length = format_digits(number, buffer);
+    if (length > 0)
+      return length;
+  }
+#endif
+
+  return (size_t)snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+}
+
+size_t format_integer(uint64_t integer, char *buffer)
+{
+  char digits[20];
+  size_t length = 0;
+  do
+  {
+    digits[length++] = (char)('0' + integer % 10);
+    integer /= 10;
+  } while (integer != 0);
+
+  for (size_t i = 0; i < length; ++i)
+  {
+    buffer[i] = digits[length - 1 - i];
+  }
+  return length;
+}
+
+#ifdef __SIZEOF_INT128__
+// Sets digits to magnitude * 10^scale rounded half to even like printf does,
+// working on the exact binary value. False when that takes more than 128
+// bits.
+bool scale_number(double magnitude, int scale, uint64_t *digits)
+{
+  int exponent;
+  double fraction = frexp(magnitude, &exponent);
+  uint128 numerator = (uint64_t)ldexp(fraction, 53);
+  uint128 denominator = 1;
+  exponent -= 53;
+
+  if (exponent > 64 || exponent < -120)
+    return false;
+  if (exponent > 0)
+    numerator <<= exponent;
+  else
+    denominator <<= -exponent;
+
+  uint128 limit = ~(uint128)0 / 10;
+  for (; scale > 0; --scale)
+  {
+    if (numerator > limit)
+      return false;
+    numerator *= 10;
+  }
+  for (; scale < 0; ++scale)
+  {
+    if (denominator > limit)
+      return false;
+    denominator *= 10;
+  }
+
+  uint128 quotient = numerator / denominator;
+  uint128 remainder = numerator % denominator;
+  uint128 rest = denominator - remainder;
+  if (remainder > rest || (remainder == rest && (quotient & 1)))
+    ++quotient;
+
+  if (quotient >= NUMBER_DIGITS_LIMIT)
+  {
+    *digits = NUMBER_DIGITS_LIMIT;
+    return true;
+  }
+  *digits = (uint64_t)quotient;
+  return true;
+}
+
+// The six significant digits with the exponent %e would give them, written
+// out fixed or with an exponent and without trailing zeros as %g does.
+size_t format_digits(double number, char *buffer)
+{
+  double magnitude = fabs(number);
+  int binary_exponent;
+  frexp(magnitude, &binary_exponent);
+  // floor(log10(2) * (binary_exponent - 1)), magnitude is at least 2 to that
+  int exponent = ((binary_exponent - 1) * 78913) >> 18;
+  uint64_t digits;
+
+  // the estimate may be one too low, and rounding may carry into a seventh
+  // digit
+  for (int tries = 0;; ++tries)
+  {
+    if (tries == 3 ||
+        !scale_number(magnitude, NUMBER_DIGITS - 1 - exponent, &digits))
+      return 0;
+    if (digits >= NUMBER_DIGITS_LIMIT)
+      ++exponent;
+    else if (digits < NUMBER_DIGITS_LIMIT / 10)
+      --exponent;
+    else
+      break;
+  }
+
+  char chars[NUMBER_DIGITS];
+  format_integer(digits, chars);
+  int count = NUMBER_DIGITS;
+  while (count > 1 && chars[count - 1] == '0')
+    --count;
+
+  char *p = buffer;
+  if (signbit(number))
+    *p++ = '-';
+
+  if (exponent >= -4 && exponent < NUMBER_DIGITS)
+  {
+    if (exponent >= 0)
+    {
+      memcpy(p, chars, exponent + 1);
+      p += exponent + 1;
+      if (count > exponent + 1)
+      {
+        *p++ = '.';
+        memcpy(p, chars + exponent + 1, count - exponent - 1);
+        p += count - exponent - 1;
+      }
+    }
+    else
+    {
+      *p++ = '0';
+      *p++ = '.';
+      for (int i = -1; i > exponent; --i)
+        *p++ = '0';
+      memcpy(p, chars, count);
+      p += count;
+    }
+    return (size_t)(p - buffer);
+  }
+
+  *p++ = chars[0];
+  if (count > 1)
+  {
+    *p++ = '.';
+    memcpy(p, chars + 1, count - 1);
+    p += count - 1;
+  }
+  *p++ = 'e';
+  *p++ = exponent < 0 ? '-' : '+';
+  int power = exponent < 0 ? -exponent : exponent;
+  if (power < 10)
+    *p++ = '0';
+  p += format_integer((uint64_t)power, p);
+  return (size_t)(p - buffer);
+}
+#endif
+
 Value add(Value a, Value b) { return number_val(as_number(a) + as_number(b)); }
 
 Value subtract(Value a, Value b)
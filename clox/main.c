@@ -1,16 +1,31 @@
+#include "Bytecode.h"
 #include "Chunk.h"
+#include "Compiler.h"
 #include "Debug.h"
 #include "Opcode.h"
+#include "Snapshot.h"
 #include "VM.h"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define USAGE                                                               \
+  "Usage: clox [--no-peephole] [--lazy] [--cache | --compile-only] "        \
+  "[--image path] [--snapshot path] [-O | -O0] [path]\n"                    \
+  "  --lazy  compile function bodies at their first call, a syntax error "  \
+  "in a\n          body that is never called may go unreported\n"
 
 static void repl(VM *vm)
 {
   char line[1024];
   for (;;)
   {
+    flush_output(&vm->output);
     printf("> ");
 
     if (!fgets(line, sizeof(line), stdin))
@@ -19,49 +34,132 @@ static void repl(VM *vm)
       break;
     }
 
-    interpret(vm, line);
+    interpret(vm, line, strlen(line));
   }
 }
 
-static char *read_file(const char *path)
+// A script is mapped read-only where the file allows it and read into memory
+// otherwise, a pipe or an empty file say. Either way the scanner stops at
+// length, the text needs no terminator.
+struct Source
+{
+  char *chars;
+  size_t length;
+  bool mapped;
+};
+
+typedef struct Source Source;
+
+static bool map_source(const char *path, Source *source)
 {
-  FILE *file = fopen(path, "r");
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+  {
+    close(fd);
+    return false;
+  }
 
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  source->chars = data;
+  source->length = (size_t)st.st_size;
+  source->mapped = true;
+  return true;
+}
+
+static Source read_source(const char *path)
+{
+  Source source;
+  if (map_source(path, &source))
+    return source;
+
+  FILE *file = fopen(path, "rb");
   if (file == NULL)
   {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
     exit(74);
   }
 
-  fseek(file, 0L, SEEK_END);
-  size_t file_size = ftell(file);
-  rewind(file);
+  size_t capacity = 4096;
+  source.chars = malloc(capacity);
+  source.length = 0;
+  source.mapped = false;
+  for (;;)
+  {
+    if (source.chars == NULL)
+    {
+      fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+      exit(74);
+    }
+
+    source.length +=
+        fread(source.chars + source.length, 1, capacity - source.length, file);
+    if (source.length < capacity)
+      break;
+
+    capacity *= 2;
+    source.chars = realloc(source.chars, capacity);
+  }
 
-  char *buffer = malloc(file_size + 1);
-  if (buffer == NULL)
+  if (ferror(file))
   {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
     exit(74);
   }
 
-  size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+  fclose(file);
+  return source;
+}
 
-  if (bytes_read < file_size)
+static void free_source(Source *source)
+{
+  if (source->mapped)
   {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    munmap(source->chars, source->length);
+  }
+  else
+  {
+    free(source->chars);
+  }
+}
+
+static bool has_suffix(const char *path, const char *suffix)
+{
+  size_t length = strlen(path);
+  size_t suffix_length = strlen(suffix);
+  return length >= suffix_length &&
+         strcmp(path + length - suffix_length, suffix) == 0;
+}
+
+// script.lox is cached as script.loxc, any other name gets .loxc appended
+static char *bytecode_path(const char *path)
+{
+  size_t length = strlen(path);
+  char *cached = malloc(length + 6);
+  if (cached == NULL)
+  {
+    fprintf(stderr, "Not enough memory to name the bytecode of \"%s\".\n", path);
     exit(74);
   }
 
-  buffer[bytes_read] = '\0';
-  fclose(file);
-  return buffer;
+  memcpy(cached, path, length + 1);
+  strcat(cached, has_suffix(path, ".lox") ? "c" : ".loxc");
+  return cached;
 }
 
-static void run_file(VM *vm, const char *path)
+static void exit_on_error(VM *vm, InterpretResult result)
 {
-  char *src = read_file(path);
-  InterpretResult result = interpret(vm, src);
-  free(src);
+  if (result != INTERPRET_OK)
+  {
+    flush_output(&vm->output);
+  }
 
   if (result == INTERPRET_COMPILE_ERROR)
     exit(65);
@@ -69,22 +167,153 @@ static void run_file(VM *vm, const char *path)
     exit(70);
 }
 
+static void run_bytecode(VM *vm, const char *path)
+{
+  ObjFunction *fn = read_bytecode(vm, path, NULL);
+  if (fn == NULL)
+  {
+    fprintf(stderr, "Could not load bytecode \"%s\".\n", path);
+    exit(65);
+  }
+
+  exit_on_error(vm, interpret_function(vm, fn));
+}
+
+// With a cache, bytecode saved from the same source is loaded instead of
+// compiling it, otherwise the script is compiled and saved for next time.
+// Saved bytecode is always compiled eagerly and unoptimized.
+static void run_file(VM *vm, const char *path, bool cache, bool compile_only)
+{
+  Source src = read_source(path);
+
+  // the compiled script no longer needs its text
+  if (!cache && !compile_only)
+  {
+    ObjFunction *fn = compile(vm, src.chars, src.length);
+    free_source(&src);
+    if (fn == NULL)
+      exit(65);
+
+    exit_on_error(vm, interpret_function(vm, fn));
+    return;
+  }
+
+  SourceStamp stamp;
+  if (!stamp_source(path, src.chars, src.length, &stamp))
+  {
+    fprintf(stderr, "Could not stat file \"%s\".\n", path);
+    exit(74);
+  }
+
+  char *cached = bytecode_path(path);
+  ObjFunction *fn = compile_only ? NULL : read_bytecode(vm, cached, &stamp);
+  if (fn == NULL)
+  {
+    vm->lazy = false;
+    vm->optimize_all = false;
+    fn = compile(vm, src.chars, src.length);
+    if (fn == NULL)
+      exit(65);
+
+    if (!write_bytecode(fn, &stamp, cached) && compile_only)
+    {
+      fprintf(stderr, "Could not write bytecode \"%s\".\n", cached);
+      exit(74);
+    }
+  }
+
+  free(cached);
+  free_source(&src);
+  if (!compile_only)
+  {
+    exit_on_error(vm, interpret_function(vm, fn));
+  }
+}
+
 int main(int argc, const char *argv[])
 {
   VM vm;
   init_VM(&vm);
 
-  if (argc == 1)
+  int arg = 1;
+  bool bad_option = false;
+  bool cache = false;
+  bool compile_only = false;
+  const char *image = NULL;
+  const char *snapshot = NULL;
+  for (; arg < argc && argv[arg][0] == '-'; ++arg)
+  {
+    if (strcmp(argv[arg], "--no-peephole") == 0)
+    {
+      vm.peephole = false;
+    }
+    else if (strcmp(argv[arg], "--lazy") == 0)
+    {
+      vm.lazy = true;
+    }
+    else if (strcmp(argv[arg], "--cache") == 0)
+    {
+      cache = true;
+    }
+    else if (strcmp(argv[arg], "--compile-only") == 0)
+    {
+      compile_only = true;
+    }
+    else if (strcmp(argv[arg], "--image") == 0 && arg + 1 < argc)
+    {
+      image = argv[++arg];
+    }
+    else if (strcmp(argv[arg], "--snapshot") == 0 && arg + 1 < argc)
+    {
+      // functions left uncompiled have no place in an image
+      snapshot = argv[++arg];
+      vm.lazy = false;
+    }
+    else if (strcmp(argv[arg], "-O") == 0)
+    {
+      vm.optimize_all = true;
+    }
+    else if (strcmp(argv[arg], "-O0") == 0)
+    {
+      vm.hot_tier = false;
+      vm.optimize_all = false;
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option \"%s\".\n", argv[arg]);
+      bad_option = true;
+    }
+  }
+
+  if (image != NULL && !read_image(&vm, image))
+  {
+    fprintf(stderr, "Could not load image \"%s\".\n", image);
+    exit(65);
+  }
+
+  if (bad_option || argc > arg + 1 || (snapshot != NULL && argc == arg))
+  {
+    fprintf(stderr, USAGE);
+  }
+  else if (argc == arg)
   {
     repl(&vm);
   }
-  else if (argc == 2)
+  else if (has_suffix(argv[arg], ".loxc"))
   {
-    run_file(&vm, argv[1]);
+    run_bytecode(&vm, argv[arg]);
   }
   else
   {
-    fprintf(stderr, "Usage: clox [path]\n");
+    run_file(&vm, argv[arg], cache, compile_only);
+  }
+
+  // the prelude ran to completion, its heap is what the image keeps
+  if (snapshot != NULL && argc == arg + 1 && !write_image(&vm, snapshot))
+  {
+    flush_output(&vm.output);
+    fprintf(stderr, "Could not write image \"%s\".\n", snapshot);
+    exit(74);
   }
 
   free_VM(&vm);
@@ -2,6 +2,7 @@
 #define SCANNER_HPP
 
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -13,7 +14,8 @@ class ErrorHandler;
 
 class Scanner {
 public:
-  Scanner(const std::string &aSource, ErrorHandler &aErrorHandler);
+  /// @brief the source is not copied, it has to outlive the scanner
+  Scanner(std::string_view aSource, ErrorHandler &aErrorHandler);
   std::vector<Token> scanAndGetTokens();
 
 private:
@@ -49,14 +51,14 @@ private:
   size_t current;
   /// @brief line number of current lexeme
   size_t line;
-  /// @brief string containing the entire lox source code
-  std::string source;
+  /// @brief view of the entire lox source code
+  std::string_view source;
   /// @brief list of all tokens
   std::vector<Token> tokens;
   /// @brief error handler for adding errors when found
   ErrorHandler &errorHandler;
   /// @brief map of reserved keywords e.g. and, or, for, else, nil etc.
-  std::unordered_map<std::string, TokenType> reservedKeywords;
+  std::unordered_map<std::string_view, TokenType> reservedKeywords;
 };
 } // namespace lox
 
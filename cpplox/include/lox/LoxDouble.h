@@ -2,6 +2,9 @@
 #define _LOX_DOUBLE_H_
 
 #include "lox/LoxObject.h"
+#include <cstdio>
+#include <cstring>
+#include <limits>
 #include <string>
 
 namespace lox {
@@ -15,20 +18,27 @@ public:
 
   double getValue() const { return value; }
 
+  // Formatted as %f with the trailing zeros, and the point of an integer,
+  // dropped.
   virtual std::string str() const override {
-    auto res = std::to_string(value);
-    auto dot = res.find('.');
+    char buffer[std::numeric_limits<double>::max_exponent10 + 32];
+    int length = std::snprintf(buffer, sizeof(buffer), "%f", value);
+    const char *dot =
+        static_cast<const char *>(std::memchr(buffer, '.', length));
+    if (dot == nullptr) {
+      return std::string(buffer, length);
+    }
 
-    size_t end = res.size() - 1;
-    while (end > dot and res[end] == '0') {
+    const char *end = buffer + length;
+    while (end[-1] == '0') {
       --end;
     }
 
     // hack for integers
-    if (end == dot) {
+    if (end - 1 == dot) {
       --end;
     }
-    return res.substr(0, end + 1);
+    return std::string(buffer, end - buffer);
   }
 
   virtual bool isEqual(std::shared_ptr<LoxObject> arg0) const override {
@@ -3,7 +3,7 @@
 
 using namespace lox;
 
-Scanner::Scanner(const std::string &aSource, ErrorHandler &aErrorHandler)
+Scanner::Scanner(std::string_view aSource, ErrorHandler &aErrorHandler)
     : start(0), current(0), line(1), source(aSource),
       errorHandler(aErrorHandler) {
   // initialize reserved keywords map
@@ -127,11 +127,10 @@ void Scanner::identifier() {
     (void)advanceAndGetChar();
   // see if the identifier is a reserved keyword
   const size_t identifierLength = current - start;
-  const std::string identifier = source.substr(start, identifierLength);
-  const bool isReservedKeyword =
-      reservedKeywords.find(identifier) != reservedKeywords.end();
-  if (isReservedKeyword) {
-    addToken(reservedKeywords[identifier]);
+  const std::string_view identifier = source.substr(start, identifierLength);
+  const auto reservedKeyword = reservedKeywords.find(identifier);
+  if (reservedKeyword != reservedKeywords.end()) {
+    addToken(reservedKeyword->second);
   } else {
     addToken(TokenType::IDENTIFIER);
   }
@@ -150,7 +149,7 @@ void Scanner::number() {
       (void)advanceAndGetChar();
   }
   const size_t numberLength = current - start;
-  const std::string numberLiteral = source.substr(start, numberLength);
+  const std::string numberLiteral(source.substr(start, numberLength));
   addToken(TokenType::NUMBER, numberLiteral);
 }
 
@@ -169,13 +168,13 @@ void Scanner::string() {
   (void)advanceAndGetChar();
   const size_t stringSize = current - start;
   // trim the surrounding quotes
-  const std::string stringLiteral = source.substr(start + 1, stringSize - 2);
+  const std::string stringLiteral(source.substr(start + 1, stringSize - 2));
   addToken(TokenType::STRING, stringLiteral);
 }
 
 void Scanner::addToken(const TokenType aTokenType, const std::string &value) {
   const size_t lexemeSize = current - start;
-  const auto lexeme = source.substr(start, lexemeSize);
+  const std::string lexeme(source.substr(start, lexemeSize));
   tokens.push_back(Token(aTokenType, lexeme, value, line));
 }
 
@@ -1,7 +1,12 @@
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <iterator>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "ErrorHandler.h"
 #include "Parser.h"
@@ -16,7 +21,56 @@ static std::shared_ptr<Interpreter> interpreter =
     std::make_shared<Interpreter>();
 static bool hadRuntimeError = false;
 
-static int run(const std::string &source, ErrorHandler &errorHandler) {
+/// @brief a source file mapped read-only, or read into memory when it cannot
+/// be mapped (e.g. a pipe or an empty file)
+class SourceFile {
+public:
+  explicit SourceFile(const std::string &path);
+  ~SourceFile();
+  SourceFile(const SourceFile &) = delete;
+  SourceFile &operator=(const SourceFile &) = delete;
+  std::string_view text() const;
+
+private:
+  void *mapped = nullptr;
+  size_t mappedSize = 0;
+  std::string contents;
+};
+
+SourceFile::SourceFile(const std::string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void *data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                        MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        mapped = data;
+        mappedSize = static_cast<size_t>(st.st_size);
+      }
+    }
+    close(fd);
+  }
+
+  if (mapped == nullptr) {
+    std::ifstream file(path, std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(file),
+                    std::istreambuf_iterator<char>());
+  }
+}
+
+SourceFile::~SourceFile() {
+  if (mapped != nullptr)
+    munmap(mapped, mappedSize);
+}
+
+std::string_view SourceFile::text() const {
+  if (mapped != nullptr)
+    return std::string_view(static_cast<const char *>(mapped), mappedSize);
+  return contents;
+}
+
+static int run(std::string_view source, ErrorHandler &errorHandler) {
   /// scanner
   Scanner scanner(source, errorHandler);
   const auto tokens = scanner.scanAndGetTokens();
@@ -56,11 +110,8 @@ static int run(const std::string &source, ErrorHandler &errorHandler) {
 }
 
 static int runFile(const std::string &path, ErrorHandler &errorHandler) {
-  std::ifstream file(path);
-  std::ostringstream stream;
-  stream << file.rdbuf();
-  file.close();
-  return run(stream.str(), errorHandler);
+  const SourceFile file(path);
+  return run(file.text(), errorHandler);
 }
 
 static void runPrompt(ErrorHandler &errorHandler) {
@@ -77,6 +128,9 @@ static void runPrompt(ErrorHandler &errorHandler) {
 } // namespace lox
 
 int main(int argc, char **argv) {
+  // the program's output goes through cout alone, cerr and cin are tied to it
+  // and still flush it first
+  std::ios::sync_with_stdio(false);
   lox::ErrorHandler errorHandler;
   if (argc > 2) {
     std::cout << "Usage: lox [filename]" << std::endl;
@@ -0,0 +1,157 @@
+from __future__ import print_function
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+from run_tests import (gather_files, print_failed_test,
+                       print_succeeded_test)
+
+# Each mode runs every clox test and must print what a plain run prints.
+# --cache runs twice, the second run loads the cache the first one wrote.
+MODES = (
+    ("lazy", [["--lazy"]]),
+    ("cache", [["--cache"], ["--cache"]]),
+    ("lazy+cache", [["--lazy", "--cache"], ["--lazy", "--cache"]]),
+)
+
+# A script saved with --snapshot and a script run with --image on top of it,
+# and what the second one prints.
+IMAGES = (
+    ("native_alias",
+     "var t = clock;\nvar l = len;\n",
+     "print l(\"abc\");\nprint t == clock;\nprint t() >= 0;\n",
+     ["3", "true", "true"]),
+    ("native_shadowed",
+     "var saved = sqrt;\nsqrt = nil;\n",
+     "print saved(16);\nprint sqrt;\n",
+     ["4", "nil"]),
+    ("classes",
+     "class A {\n  init(x) { this.x = x; }\n  get() { return this.x; }\n}\n"
+     "class B < A {\n  get() { return super.get() * 2; }\n"
+     "  other() { return \"other\"; }\n}\n"
+     "var b = B(21);\n",
+     "print b.get();\nprint b.other();\nprint A(1).get();\n",
+     ["42", "other", "1"]),
+    ("closures",
+     "fun counter() {\n  var n = 0;\n"
+     "  fun next() { n = n + 1; return n; }\n  return next;\n}\n"
+     "var c = counter();\nc();\n",
+     "print c();\nprint c();\n",
+     ["2", "3"]),
+    ("collections",
+     "var l = [1, 2, 3];\nvar m = Map();\nm[\"k\"] = l;\n",
+     "push(l, 4);\nprint len(m[\"k\"]);\n",
+     ["4"]),
+)
+
+
+def run(interpreter_path, args):
+    """Output lines and exit code, only the first line after an error as
+    run_tests.py compares."""
+
+    process = subprocess.Popen([interpreter_path] + args,
+                               stdout=subprocess.PIPE,
+                               stderr=subprocess.PIPE)
+    output = [line.decode("utf-8") for line in process.communicate()]
+    lines = [line.strip() for line in "".join(output).split('\n')
+             if line.strip()]
+    if process.returncode != 0:
+        lines = lines[:1]
+    return lines, process.returncode
+
+
+def run_modes(interpreter_path, test_paths, verbose=False):
+    """Run every test in every mode and compare against a plain run."""
+
+    fail_counter = 0
+    test_counter = 0
+
+    directory = os.path.dirname(os.path.abspath(__file__))
+    test_paths = sorted(test_paths, key=lambda p: os.path.relpath(p, directory))
+
+    for test_path in test_paths:
+        expected = run(interpreter_path, [test_path])
+        test_name = os.path.relpath(test_path, directory)
+
+        for mode, runs in MODES:
+            cache_path = test_path + "c"
+            if os.path.exists(cache_path):
+                os.remove(cache_path)
+
+            test_counter += 1
+            failed = None
+            for flags in runs:
+                actual = run(interpreter_path, flags + [test_path])
+                if actual != expected:
+                    failed = actual
+                    break
+
+            name = "{} ({})".format(test_name, mode)
+            if failed is None:
+                print_succeeded_test(name)
+            else:
+                print_failed_test(name, expected, failed, verbose)
+                fail_counter += 1
+
+    return test_counter, fail_counter
+
+
+def run_images(interpreter_path, verbose=False):
+    """Save each image and run a script on top of it."""
+
+    fail_counter = 0
+    directory = tempfile.mkdtemp()
+    try:
+        for name, setup, script, expected_output in IMAGES:
+            setup_path = os.path.join(directory, name + ".lox")
+            script_path = os.path.join(directory, name + "_run.lox")
+            image_path = os.path.join(directory, name + ".img")
+            with open(setup_path, "w") as f:
+                f.write(setup)
+            with open(script_path, "w") as f:
+                f.write(script)
+
+            actual = run(interpreter_path,
+                         ["--snapshot", image_path, setup_path])
+            if actual == ([], 0):
+                actual = run(interpreter_path,
+                             ["--image", image_path, script_path])
+
+            test_name = "image {}".format(name)
+            if actual == (expected_output, 0):
+                print_succeeded_test(test_name)
+            else:
+                print_failed_test(test_name, (expected_output, 0), actual,
+                                  verbose)
+                fail_counter += 1
+    finally:
+        shutil.rmtree(directory)
+
+    return len(IMAGES), fail_counter
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Run the clox tests with --lazy and --cache, and "
+                    "scripts on top of --snapshot images.")
+    parser.add_argument("interpreter", help="Path to clox.")
+    parser.add_argument("test_regex", nargs="?", default="",
+                        help="Regex to filter tests with")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="Display detail in failed tests.")
+    args = parser.parse_args()
+
+    test_counter, fail_counter = run_modes(
+        args.interpreter, gather_files(args.test_regex, False, "clox"),
+        args.verbose)
+    image_counter, image_fail_counter = run_images(args.interpreter,
+                                                   args.verbose)
+
+    print("Ran {} tests, of which {} failed."
+          .format(test_counter + image_counter,
+                  fail_counter + image_fail_counter))
+    sys.exit(fail_counter + image_fail_counter)
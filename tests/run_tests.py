@@ -6,14 +6,23 @@ import re
 import subprocess
 import sys
 
+# Tests of features only one interpreter has live in a directory named after
+# it and are skipped for the others.
+IMPLEMENTATIONS = ("clox", "cpplox")
 
-def gather_files(test_regex, exclude=False):
+
+def gather_files(test_regex, exclude=False, implementation=None):
     """Collect files with name test_*.lox in test directory"""
 
     directory = os.path.dirname(os.path.abspath(__file__))
-    filepaths = [os.path.join(dirpath, fname)
-                 for dirpath, dirnames, fnames in os.walk(directory)
-                 for fname in fnames if fname.endswith(".lox")]
+    filepaths = []
+    for dirpath, dirnames, fnames in os.walk(directory):
+        if dirpath == directory:
+            dirnames[:] = [name for name in dirnames
+                           if name not in IMPLEMENTATIONS
+                           or name == implementation]
+        filepaths += [os.path.join(dirpath, fname)
+                      for fname in fnames if fname.endswith(".lox")]
 
     modifier = lambda r: (not r if exclude else r)
 
@@ -156,9 +165,14 @@ if __name__ == "__main__":
                         help="Ignore interpreter error output.")
     parser.add_argument("-x", "--exclude", action="store_true",
                         help="Exclude tests matching regex.")
+    parser.add_argument("-I", "--implementation", choices=IMPLEMENTATIONS,
+                        help="Also run the tests only this interpreter "
+                             "passes, guessed from the interpreter's name.")
     args = parser.parse_args()
 
+    implementation = args.implementation or os.path.basename(args.interpreter)
     num_failed_tests = run_tests(
-        args.interpreter, gather_files(args.test_regex, args.exclude),
+        args.interpreter,
+        gather_files(args.test_regex, args.exclude, implementation),
         args.verbose, args.ignore_output, args.ignore_retval)
     sys.exit(num_failed_tests)